@@ -0,0 +1,77 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+/*
+ * Expands an AUB file captured with drm_intel_bufmgr_gem_set_aub_compression()
+ * into one the simulator can read.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intel_bufmgr.h"
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage:\n");
+	fprintf(stderr, "  aub_expand <compressed.aub> <out.aub>\n");
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	FILE *in, *out;
+	int ret;
+
+	if (argc != 3)
+		usage();
+
+	in = fopen(argv[1], "r");
+	if (!in) {
+		fprintf(stderr, "couldn't open `%s'\n", argv[1]);
+		return 1;
+	}
+	out = fopen(argv[2], "w");
+	if (!out) {
+		fprintf(stderr, "couldn't create `%s'\n", argv[2]);
+		return 1;
+	}
+
+	ret = drm_intel_aub_expand(in, out);
+	fclose(in);
+	if (fclose(out) != 0 && ret == 0)
+		ret = -EIO;
+	if (ret) {
+		fprintf(stderr, "couldn't expand `%s': %s\n", argv[1],
+			strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
@@ -56,6 +56,12 @@
 #define CMD_AUB_TRACE_HEADER_BLOCK (CMD_AUB | (1 << 23) | (0x41 << 16))
 #define CMD_AUB_DUMP_BMP           (CMD_AUB | (1 << 23) | (0x9e << 16))
 
+/* Files written with drm_intel_bufmgr_gem_set_aub_compression() start with
+ * these two dwords.  Blocks follow, each headed by its length in dwords
+ * once expanded and as stored. */
+#define AUB_COMPRESSED_MAGIC	0x5a425541	/* "AUBZ" */
+#define AUB_COMPRESSED_VERSION	1
+
 /* DW1 */
 #define AUB_TRACE_OPERATION_MASK	0x000000ff
 #define AUB_TRACE_OP_COMMENT		0x00000000
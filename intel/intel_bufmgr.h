@@ -105,6 +105,35 @@ typedef struct _drm_intel_aub_annotation {
 	uint32_t ending_offset;
 } drm_intel_aub_annotation;
 
+typedef struct _drm_intel_bufmgr_gem_cache_stats {
+	/** Allocations served from the reuse cache */
+	uint64_t hits;
+	/** Allocations that had to create a new buffer object */
+	uint64_t misses;
+	/** Cached buffer objects freed without being reused */
+	uint64_t evictions;
+	/** Buffer objects currently held for reuse, and their size */
+	uint64_t bytes_retained;
+	unsigned int bos_retained;
+	/** Number of size buckets, including learned ones */
+	unsigned int buckets;
+	/**
+	 * Busy checks that needed an ioctl, and those answered from earlier
+	 * results and completed submissions instead
+	 */
+	uint64_t busy_queries;
+	uint64_t busy_avoided;
+} drm_intel_bufmgr_gem_cache_stats;
+
+typedef struct _drm_intel_bufmgr_gem_reloc_stats {
+	/** Memory held for relocation entries */
+	uint64_t reloc_bytes;
+	/** Memory held for validate lists built from them */
+	uint64_t validate_bytes;
+	/** Buffer objects holding relocation entries */
+	unsigned int bos;
+} drm_intel_bufmgr_gem_reloc_stats;
+
 #define BO_ALLOC_FOR_RENDER (1<<0)
 
 drm_intel_bo *drm_intel_bo_alloc(drm_intel_bufmgr *bufmgr, const char *name,
@@ -171,7 +200,17 @@ drm_intel_bo *drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 						const char *name,
 						unsigned int handle);
 void drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_thread_cache(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_deferred_release(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_set_cache_size(drm_intel_bufmgr *bufmgr,
+					 uint64_t max_bytes);
+void drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+					  drm_intel_bufmgr_gem_cache_stats *stats);
+void drm_intel_bufmgr_gem_get_reloc_stats(drm_intel_bufmgr *bufmgr,
+					  drm_intel_bufmgr_gem_reloc_stats *stats);
 void drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_incremental_validate(drm_intel_bufmgr *bufmgr);
+void drm_intel_bufmgr_gem_enable_no_reloc(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_gem_set_vma_cache_size(drm_intel_bufmgr *bufmgr,
 					     int limit);
 int drm_intel_gem_bo_map_unsynchronized(drm_intel_bo *bo);
@@ -185,6 +224,9 @@ void drm_intel_gem_bo_start_gtt_access(drm_intel_bo *bo, int write_enable);
 void
 drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
 				      const char *filename);
+void
+drm_intel_bufmgr_gem_set_aub_compression(drm_intel_bufmgr *bufmgr,
+					 int enable);
 void drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable);
 void drm_intel_gem_bo_aub_dump_bmp(drm_intel_bo *bo,
 				   int x1, int y1, int width, int height,
@@ -194,6 +236,7 @@ void
 drm_intel_bufmgr_gem_set_aub_annotations(drm_intel_bo *bo,
 					 drm_intel_aub_annotation *annotations,
 					 unsigned count);
+int drm_intel_aub_expand(FILE *in, FILE *out);
 
 int drm_intel_get_pipe_from_crtc_id(drm_intel_bufmgr *bufmgr, int crtc_id);
 
@@ -243,6 +286,48 @@ void drm_intel_bo_fake_disable_backing_store(drm_intel_bo *bo,
 void drm_intel_bufmgr_fake_contended_lock_take(drm_intel_bufmgr *bufmgr);
 void drm_intel_bufmgr_fake_evict_all(drm_intel_bufmgr *bufmgr);
 
+/**
+ * Bytes past the end of a batch that drm_intel_decode() may read; see
+ * drm_intel_decode_set_batch_padded().
+ */
+#define DRM_INTEL_DECODE_PADDING 4096
+
+/** What drm_intel_decode() counted for one opcode while stats are on. */
+typedef struct _drm_intel_decode_opcode_stats {
+	/** Header bits that identify the packet, the rest masked off */
+	uint32_t opcode;
+	/** Packet name, as the decoder prints it */
+	const char *name;
+	/** Packets decoded */
+	uint64_t packets;
+	/** DWORDs in them, headers included */
+	uint64_t dwords;
+	/** Packets whose dwords differ from the previous one of the opcode */
+	uint64_t changes;
+} drm_intel_decode_opcode_stats;
+
+/** One dword of a decoded packet, as handed to the packet callback. */
+struct drm_intel_decode_field {
+	uint32_t offset;	/**< GPU address of the dword */
+	uint32_t value;
+	const char *text;	/**< its description, not NUL-terminated */
+	unsigned int text_len;
+};
+
+/** A decoded packet, as handed to the packet callback. */
+struct drm_intel_decode_packet {
+	uint32_t offset;	/**< GPU address of the header */
+	uint32_t header;
+	const char *name;	/**< first line of the header's description */
+	const struct drm_intel_decode_field *fields;
+	unsigned int field_count;
+	const char *text;	/**< the full output, not NUL-terminated */
+	unsigned int text_len;
+};
+
+typedef void (*drm_intel_decode_packet_func)(void *closure,
+					     const struct drm_intel_decode_packet *packet);
+
 struct drm_intel_decode *drm_intel_decode_context_alloc(uint32_t devid);
 void drm_intel_decode_context_free(struct drm_intel_decode *ctx);
 void drm_intel_decode_set_batch_pointer(struct drm_intel_decode *ctx,
@@ -253,6 +338,19 @@ void drm_intel_decode_set_dump_past_end(struct drm_intel_decode *ctx,
 void drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 				    uint32_t head, uint32_t tail);
 void drm_intel_decode_set_output_file(struct drm_intel_decode *ctx, FILE *out);
+void drm_intel_decode_set_packet_callback(struct drm_intel_decode *ctx,
+					  drm_intel_decode_packet_func func,
+					  void *closure);
+void drm_intel_decode_set_batch_padded(struct drm_intel_decode *ctx,
+				       int padded);
+void drm_intel_decode_set_threads(struct drm_intel_decode *ctx, int threads);
+void drm_intel_decode_set_stats(struct drm_intel_decode *ctx, int enable);
+void drm_intel_decode_reset_stats(struct drm_intel_decode *ctx);
+int drm_intel_decode_get_stats(struct drm_intel_decode *ctx,
+			       drm_intel_decode_opcode_stats *stats,
+			       int max_stats);
+const char *drm_intel_decode_get_output(struct drm_intel_decode *ctx,
+					size_t *size);
 void drm_intel_decode(struct drm_intel_decode *ctx);
 
 int drm_intel_reg_read(drm_intel_bufmgr *bufmgr,
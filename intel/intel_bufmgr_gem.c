@@ -90,6 +90,55 @@ struct drm_intel_gem_bo_bucket {
 	unsigned long size;
 };
 
+/* Room for the fixed buckets plus some learned exact-size ones */
+#define DRM_INTEL_GEM_FIXED_BUCKETS (14 * 4)
+#define DRM_INTEL_GEM_MAX_BUCKETS (DRM_INTEL_GEM_FIXED_BUCKETS + 8)
+
+/* Number of distinct uncached sizes remembered, and how often a size must
+ * be allocated before it gets a bucket of its own */
+#define DRM_INTEL_GEM_SIZE_HISTORY 16
+#define DRM_INTEL_GEM_LEARN_COUNT 3
+
+struct drm_intel_gem_size_count {
+	unsigned long size;
+	unsigned int count;
+};
+
+/* Largest buffer and number of buffers per bucket kept in a thread's
+ * magazine */
+#define DRM_INTEL_GEM_MAGAZINE_MAX_SIZE (1024 * 1024)
+#define DRM_INTEL_GEM_MAGAZINE_SIZE 8
+
+/* Relocation entries first allocated for a buffer; doubled as needed up to
+ * max_relocs */
+#define DRM_INTEL_GEM_INITIAL_RELOCS 16
+
+/* The release worker wakes up for this many queued buffers, or this long
+ * after the first one */
+#define DRM_INTEL_GEM_RELEASE_BATCH 32
+#define DRM_INTEL_GEM_RELEASE_DELAY_NS (2 * 1000 * 1000)
+
+/* Rings that execbuffer can select, indexed by I915_EXEC_RING_MASK */
+#define DRM_INTEL_GEM_RINGS (I915_EXEC_VEBOX + 1)
+
+/* AUB files start with a GTT at address 0 mapping AUB_APERTURE_SIZE bytes,
+ * followed by one page for the ring and then the buffers */
+#define AUB_GTT_SIZE 0x10000
+#define AUB_APERTURE_SIZE (AUB_GTT_SIZE / 4 * 4096)
+#define AUB_RING_OFFSET AUB_GTT_SIZE
+#define AUB_BO_OFFSET (AUB_RING_OFFSET + 4096)
+
+/* Dwords of AUB output buffered, and compressed as one block */
+#define AUB_BUF_SIZE (64 * 1024)
+
+/* Compressed blocks are sequences of dword codes: a count of literal
+ * dwords that follow, a count and one dword repeated that many times, or
+ * a count, a first dword and the difference between consecutive ones. */
+#define AUB_CODE_LITERAL (0u << 30)
+#define AUB_CODE_RUN (1u << 30)
+#define AUB_CODE_DELTA (2u << 30)
+#define AUB_CODE_MASK (3u << 30)
+
 typedef struct _drm_intel_bufmgr_gem {
 	drm_intel_bufmgr bufmgr;
 
@@ -107,14 +156,71 @@ typedef struct _drm_intel_bufmgr_gem {
 	int exec_size;
 	int exec_count;
 
-	/** Array of lists of cached gem objects of power-of-two sizes */
-	struct drm_intel_gem_bo_bucket cache_bucket[14 * 4];
+	/**
+	 * Array of lists of cached gem objects of power-of-two sizes,
+	 * followed by exact-size buckets learned from size_history
+	 */
+	struct drm_intel_gem_bo_bucket cache_bucket[DRM_INTEL_GEM_MAX_BUCKETS];
 	int num_buckets;
+	int num_fixed_buckets;
 	time_t time;
+	struct drm_intel_gem_size_count size_history[DRM_INTEL_GEM_SIZE_HISTORY];
+
+	/**
+	 * All cached objects, least recently freed first, when the cache is
+	 * limited to cache_max_bytes rather than aged
+	 */
+	drmMMListHead cache_lru;
+	uint64_t cache_max_bytes;
+	uint64_t cache_bytes;
+	unsigned int cache_count;
+	uint64_t cache_hits, cache_misses, cache_evictions;
+
+	/**
+	 * Execbuffer submissions so far and, per ring, the latest one known
+	 * to have completed.  A ring retires the default context's batches
+	 * in the order they were submitted, so a buffer last used by a
+	 * completed submission is idle without asking the kernel.
+	 */
+	unsigned int exec_serial;
+	atomic_t ring_completed[DRM_INTEL_GEM_RINGS];
+
+	/**
+	 * Busy checks answered by ioctl and without one: counted without the
+	 * lock since the last submission, and in total under it
+	 */
+	atomic_t busy_queries, busy_avoided;
+	uint64_t busy_queries_total, busy_avoided_total;
+
+	/**
+	 * Relocation and validate list entries allocated, and buffers holding
+	 * them, updated without the lock as relocations are emitted
+	 */
+	atomic_t reloc_entries;
+	atomic_t validate_entries;
+	atomic_t reloc_bos;
+
+	/** Per-thread caches in front of cache_bucket, if enabled */
+	pthread_key_t magazine_key;
+	drmMMListHead magazines;
+	bool thread_cache;
+
+	/**
+	 * Buffers dropped while deferred release is enabled, waiting for
+	 * release_thread to cache or close them
+	 */
+	drmMMListHead release_list;
+	int release_count;
+	pthread_cond_t release_cond;
+	pthread_t release_thread;
+	bool deferred_release, release_busy, release_stop;
 
 	drmMMListHead managers;
 
 	drmMMListHead named;
+	/** Indices of the named list by flink name and by gem handle */
+	void *name_table;
+	void *handle_table;
 	drmMMListHead vma_cache;
 	int vma_count, vma_open, vma_max;
 
@@ -130,20 +236,70 @@ typedef struct _drm_intel_bufmgr_gem {
 	unsigned int bo_reuse : 1;
 	unsigned int no_exec : 1;
 	unsigned int has_vebox : 1;
+	unsigned int has_exec_no_reloc : 1;
 	bool fenced_relocs;
+	bool incremental_validate;
+	bool no_reloc;
 
 	char *aub_filename;
 	FILE *aub_file;
 	uint32_t aub_offset;
+
+	/**
+	 * AUB output not yet written to aub_file, and room to compress it
+	 * into when aub_compress is set
+	 */
+	uint32_t *aub_buf;
+	uint32_t *aub_zbuf;
+	unsigned int aub_buf_count;
+	bool aub_compress;
+
+	/**
+	 * Bumped whenever AUB addresses are handed out from the start again,
+	 * which invalidates the address and contents recorded for each buffer
+	 */
+	unsigned int aub_generation;
 } drm_intel_bufmgr_gem;
 
+/**
+ * A thread's private cache of freed buffer objects, consulted before the
+ * shared cache buckets so that alloc/free churn within one thread doesn't
+ * need bufmgr_gem->lock.
+ *
+ * Only the owning thread touches a magazine, except for
+ * drm_intel_bufmgr_gem_destroy().  Buffers in it are not marked
+ * MADV_DONTNEED until they move to the shared buckets.
+ */
+struct drm_intel_gem_bo_magazine {
+	drmMMListHead link;
+	drm_intel_bufmgr_gem *bufmgr_gem;
+	drmMMListHead head[DRM_INTEL_GEM_MAX_BUCKETS];
+	int count[DRM_INTEL_GEM_MAX_BUCKETS];
+	time_t time;
+	uint64_t hits;
+};
+
 #define DRM_INTEL_RELOC_FENCE (1<<0)
+#define DRM_INTEL_RELOC_WRITE (1<<1)
 
 typedef struct _drm_intel_reloc_target_info {
 	drm_intel_bo *bo;
 	int flags;
 } drm_intel_reloc_target;
 
+typedef struct _drm_intel_validate_entry {
+	drm_intel_bo *bo;
+	/** Index of the relocation that first pulled bo into the list */
+	int first_reloc;
+	/**
+	 * DRM_INTEL_RELOC_FENCE if any relocation to bo needs a fence,
+	 * DRM_INTEL_RELOC_WRITE if any writes to it
+	 */
+	int flags;
+	/** Offset of bo presumed by the relocations to it */
+	uint64_t offset;
+} drm_intel_validate_entry;
+
 struct _drm_intel_bo_gem {
 	drm_intel_bo bo;
 
@@ -182,6 +338,28 @@ struct _drm_intel_bo_gem {
 	drm_intel_reloc_target *reloc_target_info;
 	/** Number of entries in relocs */
 	int reloc_count;
+	/** Number of entries allocated for relocs and reloc_target_info */
+	int reloc_size;
+	/**
+	 * Every buffer in this buffer's relocation tree, in the order
+	 * drm_intel_gem_bo_process_reloc2() would validate them.  Built with
+	 * incremental validation enabled, by the first relocation or
+	 * drm_intel_bo_references() query, and kept up to date as
+	 * relocations are emitted from then on.  Each entry holds a
+	 * reference.
+	 *
+	 * validate_table maps an entry's gem handle to its index.  It is NULL
+	 * if the list is not being maintained, in which case exec walks the
+	 * relocation tree instead.
+	 */
+	drm_intel_validate_entry *validate_list;
+	int validate_count, validate_size;
+	void *validate_table;
+	/**
+	 * Whether relocations in this tree disagree about where some buffer
+	 * is, which rules out I915_EXEC_NO_RELOC.
+	 */
+	bool presumed_stale;
 	/** Mapped address for the buffer, saved across map/unmap cycles */
 	void *mem_virtual;
 	/** GTT virtual address for the buffer, saved across map/unmap cycles */
@@ -196,6 +374,8 @@ struct _drm_intel_bo_gem {
 
 	/** BO cache list */
 	drmMMListHead head;
+	/** Link in bufmgr_gem->cache_lru while in a cache bucket */
+	drmMMListHead lru;
 
 	/**
 	 * Boolean of whether this BO and its children have been included in
@@ -229,6 +409,14 @@ struct _drm_intel_bo_gem {
 	 */
 	bool idle;
 
+	/**
+	 * Submission that last used this buffer and the ring it went to, or
+	 * -1 if it has been queued on several rings since it was last known
+	 * to be idle.
+	 */
+	unsigned int exec_serial;
+	int exec_ring;
+
 	/**
 	 * Boolean of whether this buffer was allocated with userptr
 	 */
@@ -252,6 +440,14 @@ struct _drm_intel_bo_gem {
 	bool mapped_cpu_write;
 
 	uint32_t aub_offset;
+	unsigned int aub_generation;
+
+	/**
+	 * Contents last written to the AUB file at aub_offset, with
+	 * relocations applied, so that only the pages that changed since
+	 * need to be written on the next exec
+	 */
+	uint32_t *aub_shadow;
 
 	drm_intel_aub_annotation *aub_annotations;
 	unsigned aub_annotation_count;
@@ -279,6 +475,9 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo);
 
 static void drm_intel_gem_bo_free(drm_intel_bo *bo);
 
+static void
+add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size);
+
 static unsigned long
 drm_intel_gem_bo_tile_size(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size,
 			   uint32_t *tiling_mode)
@@ -367,7 +566,7 @@ drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 {
 	int i;
 
-	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+	for (i = 0; i < bufmgr_gem->num_fixed_buckets; i++) {
 		struct drm_intel_gem_bo_bucket *bucket =
 		    &bufmgr_gem->cache_bucket[i];
 		if (bucket->size >= size) {
@@ -378,6 +577,100 @@ drm_intel_gem_bo_bucket_for_size(drm_intel_bufmgr_gem *bufmgr_gem,
 	return NULL;
 }
 
+/**
+ * Returns the learned bucket for a size too large for the fixed buckets.
+ *
+ * With learn set, counts the allocation in size_history and creates a
+ * bucket for the page-aligned size once it has been seen often enough,
+ * until all bucket slots are used.  Call with bufmgr_gem->lock held.
+ */
+static struct drm_intel_gem_bo_bucket *
+drm_intel_gem_bo_exact_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
+			      unsigned long size, bool learn)
+{
+	struct drm_intel_gem_size_count *entry, *victim;
+	int i;
+
+	size = ALIGN(size, getpagesize());
+	for (i = bufmgr_gem->num_fixed_buckets; i < bufmgr_gem->num_buckets; i++) {
+		if (bufmgr_gem->cache_bucket[i].size == size)
+			return &bufmgr_gem->cache_bucket[i];
+	}
+
+	if (!learn || bufmgr_gem->num_buckets == DRM_INTEL_GEM_MAX_BUCKETS)
+		return NULL;
+
+	victim = &bufmgr_gem->size_history[0];
+	for (i = 0; i < DRM_INTEL_GEM_SIZE_HISTORY; i++) {
+		entry = &bufmgr_gem->size_history[i];
+		if (entry->size == size)
+			break;
+		if (entry->count < victim->count)
+			victim = entry;
+	}
+
+	if (i == DRM_INTEL_GEM_SIZE_HISTORY) {
+		/* Forget the rarest size */
+		victim->size = size;
+		victim->count = 1;
+		return NULL;
+	}
+
+	if (++entry->count < DRM_INTEL_GEM_LEARN_COUNT)
+		return NULL;
+
+	entry->size = 0;
+	entry->count = 0;
+	add_bucket(bufmgr_gem, size);
+	DBG("bo_cache: learned bucket %d: %lu\n",
+	    bufmgr_gem->num_buckets - 1, size);
+	return &bufmgr_gem->cache_bucket[bufmgr_gem->num_buckets - 1];
+}
+
+/** Puts a bo on a cache bucket.  Call with bufmgr_gem->lock held. */
+static void
+drm_intel_gem_bo_cache_add(drm_intel_bufmgr_gem *bufmgr_gem,
+			   struct drm_intel_gem_bo_bucket *bucket,
+			   drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+	DRMLISTADDTAIL(&bo_gem->lru, &bufmgr_gem->cache_lru);
+	bufmgr_gem->cache_bytes += bo_gem->bo.size;
+	bufmgr_gem->cache_count++;
+}
+
+/** Takes a bo off its cache bucket.  Call with bufmgr_gem->lock held. */
+static void
+drm_intel_gem_bo_cache_remove(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTDEL(&bo_gem->head);
+	DRMLISTDEL(&bo_gem->lru);
+	bufmgr_gem->cache_bytes -= bo_gem->bo.size;
+	bufmgr_gem->cache_count--;
+}
+
+/**
+ * Frees the least recently freed cached objects until the cache fits in
+ * cache_max_bytes, if set.  Call with bufmgr_gem->lock held.
+ */
+static void
+drm_intel_gem_bo_cache_evict(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	if (bufmgr_gem->cache_max_bytes == 0)
+		return;
+
+	while (bufmgr_gem->cache_bytes > bufmgr_gem->cache_max_bytes) {
+		drm_intel_bo_gem *bo_gem;
+
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      bufmgr_gem->cache_lru.next, lru);
+		drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
+		drm_intel_gem_bo_free(&bo_gem->bo);
+		bufmgr_gem->cache_evictions++;
+	}
+}
+
 static void
 drm_intel_gem_dump_validation_list(drm_intel_bufmgr_gem *bufmgr_gem)
 {
@@ -553,35 +846,375 @@ drm_intel_bo_gem_set_in_aperture_size(drm_intel_bufmgr_gem *bufmgr_gem,
 	bo_gem->reloc_tree_size = size;
 }
 
+/**
+ * Makes room for another relocation, starting small and doubling up to
+ * max_relocs, since most buffers with relocations are small state buffers
+ * that only carry a few.
+ *
+ * Returns -ENOSPC once the buffer is at its limit, which clearing its
+ * relocations undoes, and -ENOMEM, leaving the buffer in error, if the
+ * lists can't grow.  On failure the lists are left as they were.
+ */
 static int
 drm_intel_setup_reloc_list(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	struct drm_i915_gem_relocation_entry *relocs;
+	drm_intel_reloc_target *reloc_target_info;
 	unsigned int max_relocs = bufmgr_gem->max_relocs;
+	unsigned int new_size;
 
 	if (bo->size / 4 < max_relocs)
 		max_relocs = bo->size / 4;
 
-	bo_gem->relocs = malloc(max_relocs *
-				sizeof(struct drm_i915_gem_relocation_entry));
-	bo_gem->reloc_target_info = malloc(max_relocs *
-					   sizeof(drm_intel_reloc_target));
-	if (bo_gem->relocs == NULL || bo_gem->reloc_target_info == NULL) {
+	new_size = bo_gem->reloc_size * 2;
+	if (new_size == 0)
+		new_size = DRM_INTEL_GEM_INITIAL_RELOCS;
+	if (new_size > max_relocs)
+		new_size = max_relocs;
+	if (new_size <= (unsigned int) bo_gem->reloc_size)
+		return -ENOSPC;
+
+	relocs = malloc(new_size * sizeof(struct drm_i915_gem_relocation_entry));
+	reloc_target_info = malloc(new_size * sizeof(drm_intel_reloc_target));
+	if (relocs == NULL || reloc_target_info == NULL) {
+		free(relocs);
+		free(reloc_target_info);
 		bo_gem->has_error = true;
+		return -ENOMEM;
+	}
+
+	if (bo_gem->reloc_count) {
+		memcpy(relocs, bo_gem->relocs, bo_gem->reloc_count *
+		       sizeof(struct drm_i915_gem_relocation_entry));
+		memcpy(reloc_target_info, bo_gem->reloc_target_info,
+		       bo_gem->reloc_count * sizeof(drm_intel_reloc_target));
+	}
+	free(bo_gem->relocs);
+	free(bo_gem->reloc_target_info);
+	bo_gem->relocs = relocs;
+	bo_gem->reloc_target_info = reloc_target_info;
+
+	if (bo_gem->reloc_size == 0)
+		atomic_inc(&bufmgr_gem->reloc_bos);
+	atomic_add(&bufmgr_gem->reloc_entries, new_size - bo_gem->reloc_size);
+	bo_gem->reloc_size = new_size;
+
+	return 0;
+}
+
+/** Releases the relocation storage of a buffer with no relocations left. */
+static void
+drm_intel_gem_bo_free_reloc_list(drm_intel_bo_gem *bo_gem)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) bo_gem->bo.bufmgr;
+
+	if (bo_gem->reloc_size) {
+		atomic_dec(&bufmgr_gem->reloc_entries, bo_gem->reloc_size);
+		atomic_dec(&bufmgr_gem->reloc_bos, 1);
+	}
+	bo_gem->reloc_size = 0;
+
+	free(bo_gem->reloc_target_info);
+	bo_gem->reloc_target_info = NULL;
+	free(bo_gem->relocs);
+	bo_gem->relocs = NULL;
+}
+
+/**
+ * Drops the validate list entries pulled in by relocations from start
+ * onwards.  Those form a suffix of the list, since entries are appended in
+ * relocation order.
+ *
+ * Requires bufmgr_gem->lock.
+ */
+static void
+drm_intel_gem_bo_truncate_validate_list(drm_intel_bo_gem *bo_gem, int start,
+					time_t time)
+{
+	while (bo_gem->validate_count > 0) {
+		drm_intel_validate_entry *entry =
+			&bo_gem->validate_list[bo_gem->validate_count - 1];
+
+		if (entry->first_reloc < start)
+			break;
 
-		free (bo_gem->relocs);
-		bo_gem->relocs = NULL;
+		drmHashDelete(bo_gem->validate_table,
+			      ((drm_intel_bo_gem *) entry->bo)->gem_handle);
+		drm_intel_gem_bo_unreference_locked_timed(entry->bo, time);
+		bo_gem->validate_count--;
+	}
+
+	if (bo_gem->validate_count == 0)
+		bo_gem->presumed_stale = false;
+}
 
-		free (bo_gem->reloc_target_info);
-		bo_gem->reloc_target_info = NULL;
+/** Releases the storage of an already emptied validate list. */
+static void
+drm_intel_gem_bo_free_validate_list(drm_intel_bo_gem *bo_gem)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) bo_gem->bo.bufmgr;
+
+	assert(bo_gem->validate_count == 0);
+
+	atomic_dec(&bufmgr_gem->validate_entries, bo_gem->validate_size);
+	if (bo_gem->validate_table)
+		drmHashDestroy(bo_gem->validate_table);
+	bo_gem->validate_table = NULL;
+	free(bo_gem->validate_list);
+	bo_gem->validate_list = NULL;
+	bo_gem->validate_size = 0;
+}
 
-		return 1;
+static void
+drm_intel_gem_bo_merge_validate_entry(drm_intel_bo_gem *bo_gem,
+				      drm_intel_validate_entry *entry,
+				      int flags, uint64_t offset)
+{
+	entry->flags |= flags;
+	if (entry->offset != offset)
+		bo_gem->presumed_stale = true;
+}
+
+static int
+drm_intel_gem_bo_add_validate_entry(drm_intel_bo_gem *bo_gem,
+				    drm_intel_bo *target_bo,
+				    int reloc, int flags, uint64_t offset)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem =
+		(drm_intel_bufmgr_gem *) bo_gem->bo.bufmgr;
+	drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) target_bo;
+	drm_intel_validate_entry *entry;
+	void *value;
+
+	if (drmHashLookup(bo_gem->validate_table, target_bo_gem->gem_handle,
+			  &value) == 0) {
+		entry = &bo_gem->validate_list[(uintptr_t) value];
+		drm_intel_gem_bo_merge_validate_entry(bo_gem, entry,
+						      flags, offset);
+		return 0;
+	}
+
+	if (bo_gem->validate_count == bo_gem->validate_size) {
+		int new_size = bo_gem->validate_size * 2;
+
+		if (new_size == 0)
+			new_size = 16;
+
+		entry = realloc(bo_gem->validate_list,
+				sizeof(*entry) * new_size);
+		if (entry == NULL)
+			return -ENOMEM;
+		bo_gem->validate_list = entry;
+		atomic_add(&bufmgr_gem->validate_entries,
+			   new_size - bo_gem->validate_size);
+		bo_gem->validate_size = new_size;
 	}
 
+	if (drmHashInsert(bo_gem->validate_table, target_bo_gem->gem_handle,
+			  (void *) (uintptr_t) bo_gem->validate_count))
+		return -ENOMEM;
+
+	entry = &bo_gem->validate_list[bo_gem->validate_count++];
+	entry->bo = target_bo;
+	entry->first_reloc = reloc;
+	entry->flags = flags;
+	entry->offset = offset;
+	drm_intel_gem_bo_reference(target_bo);
+
 	return 0;
 }
 
+static int
+drm_intel_gem_bo_build_validate_list(drm_intel_bo *bo);
+
+/**
+ * Adds the target of relocation reloc, presumed to be at offset, and the
+ * tree below it to bo's validate list, building the list from bo's earlier
+ * relocations first if it has none yet.
+ *
+ * Targets can't gain relocations once they are used as one, so a target's
+ * own list is complete by now and is merged in ahead of the target, as
+ * the depth-first walk at exec would have done.  If that fails, bo's list
+ * is dropped and exec falls back to walking the tree.
+ */
+static void
+drm_intel_gem_bo_update_validate_list(drm_intel_bo *bo,
+				      drm_intel_bo *target_bo,
+				      int reloc, int flags, uint64_t offset)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) target_bo;
+	drm_intel_validate_entry *entry;
+	struct timespec time;
+	void *value;
+	int i;
+
+	if (drm_intel_gem_bo_build_validate_list(bo))
+		return;
+
+	/* Runs of relocations to the same buffer are common. */
+	if (bo_gem->validate_count) {
+		entry = &bo_gem->validate_list[bo_gem->validate_count - 1];
+		if (entry->bo == target_bo) {
+			drm_intel_gem_bo_merge_validate_entry(bo_gem, entry,
+							      flags, offset);
+			return;
+		}
+	}
+
+	if (drmHashLookup(bo_gem->validate_table, target_bo_gem->gem_handle,
+			  &value) == 0) {
+		entry = &bo_gem->validate_list[(uintptr_t) value];
+		drm_intel_gem_bo_merge_validate_entry(bo_gem, entry,
+						      flags, offset);
+		return;
+	}
+
+	if (target_bo_gem->reloc_count) {
+		if (drm_intel_gem_bo_build_validate_list(target_bo))
+			goto invalid;
+
+		if (target_bo_gem->presumed_stale)
+			bo_gem->presumed_stale = true;
+		for (i = 0; i < target_bo_gem->validate_count; i++) {
+			entry = &target_bo_gem->validate_list[i];
+			if (entry->bo != bo &&
+			    drm_intel_gem_bo_add_validate_entry(bo_gem, entry->bo,
+								reloc,
+								entry->flags,
+								entry->offset))
+				goto invalid;
+		}
+	}
+
+	if (drm_intel_gem_bo_add_validate_entry(bo_gem, target_bo,
+						reloc, flags, offset) == 0)
+		return;
+
+invalid:
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_bo_truncate_validate_list(bo_gem, 0, time.tv_sec);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	drm_intel_gem_bo_free_validate_list(bo_gem);
+}
+
+/**
+ * Makes sure bo has a validate list, building it from the relocations
+ * emitted so far.  Once built it is kept up to date by do_bo_emit_reloc().
+ */
+static int
+drm_intel_gem_bo_build_validate_list(drm_intel_bo *bo)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	int i;
+
+	if (bo_gem->validate_table)
+		return 0;
+
+	bo_gem->validate_table = drmHashCreate();
+	if (bo_gem->validate_table == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < bo_gem->reloc_count; i++) {
+		drm_intel_reloc_target *info = &bo_gem->reloc_target_info[i];
+		struct drm_i915_gem_relocation_entry *reloc =
+			&bo_gem->relocs[i];
+		int flags = info->flags;
+
+		if (info->bo == bo)
+			continue;
+
+		if (reloc->write_domain)
+			flags |= DRM_INTEL_RELOC_WRITE;
+		drm_intel_gem_bo_update_validate_list(bo, info->bo, i, flags,
+						      reloc->presumed_offset);
+		if (bo_gem->validate_table == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static bool
+drm_intel_gem_bo_exec_completed(drm_intel_bufmgr_gem *bufmgr_gem,
+				drm_intel_bo_gem *bo_gem)
+{
+	int ring = bo_gem->exec_ring;
+
+	if (ring < 0)
+		return false;
+	return (int) (bo_gem->exec_serial -
+		      atomic_read(&bufmgr_gem->ring_completed[ring])) <= 0;
+}
+
+/**
+ * Records that submission serial on ring has completed, and with it every
+ * earlier submission on that ring.
+ */
+static void
+drm_intel_gem_ring_completed(drm_intel_bufmgr_gem *bufmgr_gem, int ring,
+			     unsigned int serial)
+{
+	atomic_t *completed = &bufmgr_gem->ring_completed[ring];
+	int old;
+
+	do {
+		old = atomic_read(completed);
+		if ((int) (serial - old) <= 0)
+			return;
+	} while (atomic_cmpxchg(completed, old, (int) serial) != old);
+}
+
+static unsigned int
+drm_intel_gem_atomic_take(atomic_t *v)
+{
+	int old;
+
+	do {
+		old = atomic_read(v);
+	} while (atomic_cmpxchg(v, old, 0) != old);
+	return (unsigned int) old;
+}
+
+/**
+ * Moves the busy check counts into their 64-bit totals, often enough that
+ * the atomic counts never wrap.  Called with the lock held.
+ */
+static void
+drm_intel_gem_fold_busy_stats(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	bufmgr_gem->busy_queries_total +=
+		drm_intel_gem_atomic_take(&bufmgr_gem->busy_queries);
+	bufmgr_gem->busy_avoided_total +=
+		drm_intel_gem_atomic_take(&bufmgr_gem->busy_avoided);
+}
+
+/**
+ * Notes that bo_gem is part of the submission the kernel has just queued
+ * on ring, or on a ring whose completion order is unknown if ring is -1.
+ * Called with the lock held.
+ */
+static void
+drm_intel_gem_bo_mark_exec(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem, int ring)
+{
+	if (bo_gem->exec_ring != ring && !bo_gem->idle &&
+	    !drm_intel_gem_bo_exec_completed(bufmgr_gem, bo_gem))
+		bo_gem->exec_ring = -1;
+	else
+		bo_gem->exec_ring = ring;
+	bo_gem->exec_serial = bufmgr_gem->exec_serial;
+	bo_gem->idle = false;
+}
+
 static int
 drm_intel_gem_bo_busy(drm_intel_bo *bo)
 {
@@ -590,15 +1223,28 @@ drm_intel_gem_bo_busy(drm_intel_bo *bo)
 	struct drm_i915_gem_busy busy;
 	int ret;
 
-	if (bo_gem->reusable && bo_gem->idle)
+	if (bo_gem->reusable &&
+	    (bo_gem->idle ||
+	     drm_intel_gem_bo_exec_completed(bufmgr_gem, bo_gem))) {
+		bo_gem->idle = true;
+		atomic_inc(&bufmgr_gem->busy_avoided);
 		return false;
+	}
 
 	VG_CLEAR(busy);
 	busy.handle = bo_gem->gem_handle;
 
+	atomic_inc(&bufmgr_gem->busy_queries);
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GEM_BUSY, &busy);
 	if (ret == 0) {
 		bo_gem->idle = !busy.busy;
+		/* Our last use of the buffer is done, and so is everything
+		 * queued on its ring before it.
+		 */
+		if (!busy.busy && bo_gem->exec_ring >= 0)
+			drm_intel_gem_ring_completed(bufmgr_gem,
+						     bo_gem->exec_ring,
+						     bo_gem->exec_serial);
 		return busy.busy;
 	} else {
 		return false;
@@ -644,9 +1290,55 @@ drm_intel_gem_bo_cache_purge_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
 		    (bufmgr_gem, bo_gem, I915_MADV_DONTNEED))
 			break;
 
-		DRMLISTDEL(&bo_gem->head);
+		drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
+		drm_intel_gem_bo_free(&bo_gem->bo);
+		bufmgr_gem->cache_evictions++;
+	}
+}
+
+/**
+ * Takes a buffer for the given bucket from the calling thread's magazine,
+ * following the same MRU/idle policy as the shared cache.  Does not need
+ * bufmgr_gem->lock unless the cached buffer has to be retiled and that
+ * fails.
+ */
+static drm_intel_bo_gem *
+drm_intel_gem_bo_magazine_alloc(drm_intel_bufmgr_gem *bufmgr_gem,
+				struct drm_intel_gem_bo_bucket *bucket,
+				bool for_render,
+				uint32_t tiling_mode,
+				unsigned long stride)
+{
+	struct drm_intel_gem_bo_magazine *mag;
+	drm_intel_bo_gem *bo_gem;
+	int i = bucket - bufmgr_gem->cache_bucket;
+
+	mag = pthread_getspecific(bufmgr_gem->magazine_key);
+	if (mag == NULL || DRMLISTEMPTY(&mag->head[i]))
+		return NULL;
+
+	if (for_render) {
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      mag->head[i].prev, head);
+	} else {
+		bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+				      mag->head[i].next, head);
+		if (drm_intel_gem_bo_busy(&bo_gem->bo))
+			return NULL;
+	}
+	DRMLISTDEL(&bo_gem->head);
+	mag->count[i]--;
+
+	if (drm_intel_gem_bo_set_tiling_internal(&bo_gem->bo,
+						 tiling_mode, stride)) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
 		drm_intel_gem_bo_free(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return NULL;
 	}
+
+	mag->hits++;
+	return bo_gem;
 }
 
 static drm_intel_bo *
@@ -683,7 +1375,25 @@ drm_intel_gem_bo_alloc_internal(drm_intel_bufmgr *bufmgr,
 		bo_size = bucket->size;
 	}
 
+	/* Try this thread's own cache before the shared one */
+	if (bucket != NULL && bufmgr_gem->thread_cache) {
+		bo_gem = drm_intel_gem_bo_magazine_alloc(bufmgr_gem, bucket,
+							 for_render,
+							 tiling_mode, stride);
+		if (bo_gem != NULL) {
+			alloc_from_cache = true;
+			goto cached;
+		}
+	}
+
 	pthread_mutex_lock(&bufmgr_gem->lock);
+	/* Sizes above the fixed buckets may have a learned bucket */
+	if (bucket == NULL && bufmgr_gem->bo_reuse) {
+		bucket = drm_intel_gem_bo_exact_bucket(bufmgr_gem, size, true);
+		if (bucket != NULL)
+			bo_size = bucket->size;
+	}
+
 	/* Get a buffer out of the cache if available */
 retry:
 	alloc_from_cache = false;
@@ -695,7 +1405,7 @@ retry:
 			 */
 			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
 					      bucket->head.prev, head);
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
 			alloc_from_cache = true;
 		} else {
 			/* For non-render-target BOs (where we're probably
@@ -709,7 +1419,8 @@ retry:
 					      bucket->head.next, head);
 			if (!drm_intel_gem_bo_busy(&bo_gem->bo)) {
 				alloc_from_cache = true;
-				DRMLISTDEL(&bo_gem->head);
+				drm_intel_gem_bo_cache_remove(bufmgr_gem,
+							      bo_gem);
 			}
 		}
 
@@ -717,6 +1428,7 @@ retry:
 			if (!drm_intel_gem_bo_madvise_internal
 			    (bufmgr_gem, bo_gem, I915_MADV_WILLNEED)) {
 				drm_intel_gem_bo_free(&bo_gem->bo);
+				bufmgr_gem->cache_evictions++;
 				drm_intel_gem_bo_cache_purge_bucket(bufmgr_gem,
 								    bucket);
 				goto retry;
@@ -730,8 +1442,13 @@ retry:
 			}
 		}
 	}
+	if (alloc_from_cache)
+		bufmgr_gem->cache_hits++;
+	else
+		bufmgr_gem->cache_misses++;
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
+cached:
 	if (!alloc_from_cache) {
 		struct drm_i915_gem_create create;
 
@@ -935,6 +1652,39 @@ drm_intel_gem_bo_alloc_userptr(drm_intel_bufmgr *bufmgr,
 	return &bo_gem->bo;
 }
 
+/**
+ * Puts bo_gem on the named list, which holds every flinked, imported and
+ * exported bo, and indexes it by handle and flink name so that imports can
+ * find an existing bo for the same kernel object.  Call with
+ * bufmgr_gem->lock held.
+ */
+static void
+drm_intel_gem_bo_add_named(drm_intel_bufmgr_gem *bufmgr_gem,
+			   drm_intel_bo_gem *bo_gem)
+{
+	if (DRMLISTEMPTY(&bo_gem->name_list)) {
+		DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+		drmHashInsert(bufmgr_gem->handle_table,
+			      bo_gem->gem_handle, bo_gem);
+	}
+	if (bo_gem->global_name)
+		drmHashInsert(bufmgr_gem->name_table,
+			      bo_gem->global_name, bo_gem);
+}
+
+static void
+drm_intel_gem_bo_remove_named(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	if (!DRMLISTEMPTY(&bo_gem->name_list)) {
+		drmHashDelete(bufmgr_gem->handle_table, bo_gem->gem_handle);
+		if (bo_gem->global_name)
+			drmHashDelete(bufmgr_gem->name_table,
+				      bo_gem->global_name);
+	}
+	DRMLISTDEL(&bo_gem->name_list);
+}
+
 /**
  * Returns a drm_intel_bo wrapping the given buffer object handle.
  *
@@ -951,24 +1701,17 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	int ret;
 	struct drm_gem_open open_arg;
 	struct drm_i915_gem_get_tiling get_tiling;
-	drmMMListHead *list;
+	void *value;
 
-	/* At the moment most applications only have a few named bo.
-	 * For instance, in a DRI client only the render buffers passed
-	 * between X and the client are named. And since X returns the
-	 * alternating names for the front/back buffer a linear search
-	 * provides a sufficiently fast match.
+	/* Compositors import client buffers by name every frame, so the
+	 * named list is indexed rather than searched.
 	 */
 	pthread_mutex_lock(&bufmgr_gem->lock);
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->global_name == handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	if (drmHashLookup(bufmgr_gem->name_table, handle, &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	VG_CLEAR(open_arg);
@@ -983,18 +1726,15 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 		return NULL;
 	}
         /* Now see if someone has used a prime handle to get this
-         * object from the kernel before by looking through the list
-         * again for a matching gem_handle
+         * object from the kernel before by looking for a matching
+         * gem_handle
          */
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->gem_handle == open_arg.handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	if (drmHashLookup(bufmgr_gem->handle_table, open_arg.handle,
+			  &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	bo_gem = calloc(1, sizeof(*bo_gem));
@@ -1032,31 +1772,44 @@ drm_intel_bo_gem_create_from_name(drm_intel_bufmgr *bufmgr,
 	drm_intel_bo_gem_set_in_aperture_size(bufmgr_gem, bo_gem);
 
 	DRMINITLISTHEAD(&bo_gem->vma_list);
-	DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	DRMINITLISTHEAD(&bo_gem->name_list);
+	drm_intel_gem_bo_add_named(bufmgr_gem, bo_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 	DBG("bo_create_from_handle: %d (%s)\n", handle, bo_gem->name);
 
 	return &bo_gem->bo;
 }
 
+/** Drops bo's mappings from the vma cache.  Requires bufmgr_gem->lock. */
 static void
-drm_intel_gem_bo_free(drm_intel_bo *bo)
+drm_intel_gem_bo_forget_vma(drm_intel_bufmgr_gem *bufmgr_gem,
+			    drm_intel_bo_gem *bo_gem)
+{
+	DRMLISTDELINIT(&bo_gem->vma_list);
+	if (bo_gem->mem_virtual)
+		bufmgr_gem->vma_count--;
+	if (bo_gem->gtt_virtual)
+		bufmgr_gem->vma_count--;
+}
+
+/**
+ * Unmaps and closes a buffer already taken off every list, which doesn't
+ * need bufmgr_gem->lock.
+ */
+static void
+drm_intel_gem_bo_close(drm_intel_bo *bo)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	struct drm_gem_close close;
 	int ret;
 
-	DRMLISTDEL(&bo_gem->vma_list);
 	if (bo_gem->mem_virtual) {
 		VG(VALGRIND_FREELIKE_BLOCK(bo_gem->mem_virtual, 0));
 		drm_munmap(bo_gem->mem_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
 	}
-	if (bo_gem->gtt_virtual) {
+	if (bo_gem->gtt_virtual)
 		drm_munmap(bo_gem->gtt_virtual, bo_gem->bo.size);
-		bufmgr_gem->vma_count--;
-	}
 
 	/* Close this object */
 	VG_CLEAR(close);
@@ -1067,9 +1820,41 @@ drm_intel_gem_bo_free(drm_intel_bo *bo)
 		    bo_gem->gem_handle, bo_gem->name, strerror(errno));
 	}
 	free(bo_gem->aub_annotations);
+	free(bo_gem->aub_shadow);
 	free(bo);
 }
 
+/**
+ * The cache bucket a released buffer can go back to, or NULL if it has to
+ * be closed.  Requires bufmgr_gem->lock.
+ */
+static struct drm_intel_gem_bo_bucket *
+drm_intel_gem_bo_reuse_bucket(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem)
+{
+	struct drm_intel_gem_bo_bucket *bucket;
+
+	if (!bufmgr_gem->bo_reuse || !bo_gem->reusable)
+		return NULL;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	if (bucket == NULL)
+		bucket = drm_intel_gem_bo_exact_bucket(bufmgr_gem,
+						       bo_gem->bo.size, false);
+	if (bucket == NULL || bo_gem->bo.size != bucket->size)
+		return NULL;
+
+	return bucket;
+}
+
+static void
+drm_intel_gem_bo_free(drm_intel_bo *bo)
+{
+	drm_intel_gem_bo_forget_vma((drm_intel_bufmgr_gem *) bo->bufmgr,
+				    (drm_intel_bo_gem *) bo);
+	drm_intel_gem_bo_close(bo);
+}
+
 static void
 drm_intel_gem_bo_mark_mmaps_incoherent(drm_intel_bo *bo)
 {
@@ -1090,7 +1875,8 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 {
 	int i;
 
-	if (bufmgr_gem->time == time)
+	/* A size-limited cache is trimmed as it fills instead */
+	if (bufmgr_gem->time == time || bufmgr_gem->cache_max_bytes)
 		return;
 
 	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
@@ -1105,15 +1891,158 @@ drm_intel_gem_cleanup_bo_cache(drm_intel_bufmgr_gem *bufmgr_gem, time_t time)
 			if (time - bo_gem->free_time <= 1)
 				break;
 
-			DRMLISTDEL(&bo_gem->head);
+			drm_intel_gem_bo_cache_remove(bufmgr_gem, bo_gem);
 
 			drm_intel_gem_bo_free(&bo_gem->bo);
+			bufmgr_gem->cache_evictions++;
 		}
 	}
 
 	bufmgr_gem->time = time;
 }
 
+/**
+ * Frees the buffers in a magazine that have sat unused for as long as the
+ * shared cache would keep them, and moves the oldest buffers of any
+ * overfull bucket to the shared cache.  With flush set, all the remaining
+ * buffers move to the shared cache.  Call with bufmgr_gem->lock held.
+ */
+static void
+drm_intel_gem_bo_magazine_trim(drm_intel_bufmgr_gem *bufmgr_gem,
+			       struct drm_intel_gem_bo_magazine *mag,
+			       time_t time, bool flush)
+{
+	int i;
+
+	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+		struct drm_intel_gem_bo_bucket *bucket =
+		    &bufmgr_gem->cache_bucket[i];
+		int keep = DRM_INTEL_GEM_MAGAZINE_SIZE;
+
+		if (mag->count[i] > DRM_INTEL_GEM_MAGAZINE_SIZE)
+			keep /= 2;
+		if (flush)
+			keep = 0;
+
+		while (!DRMLISTEMPTY(&mag->head[i])) {
+			drm_intel_bo_gem *bo_gem;
+
+			bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+					      mag->head[i].next, head);
+			if (mag->count[i] <= keep &&
+			    time - bo_gem->free_time <= 1)
+				break;
+
+			DRMLISTDEL(&bo_gem->head);
+			mag->count[i]--;
+
+			if (time - bo_gem->free_time <= 1 &&
+			    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+							      I915_MADV_DONTNEED)) {
+				drm_intel_gem_bo_cache_add(bufmgr_gem, bucket,
+							   bo_gem);
+			} else {
+				drm_intel_gem_bo_free(&bo_gem->bo);
+				bufmgr_gem->cache_evictions++;
+			}
+		}
+	}
+	drm_intel_gem_bo_cache_evict(bufmgr_gem);
+
+	mag->time = time;
+}
+
+/**
+ * Puts a buffer that nothing else references any more into the calling
+ * thread's magazine, creating the magazine on first use.  Returns false if
+ * the buffer has to go through drm_intel_gem_bo_unreference_final()
+ * instead: because it's named, mapped or has relocations, because it is
+ * too large, or because thread caches are off.
+ */
+static bool
+drm_intel_gem_bo_magazine_put(drm_intel_bufmgr_gem *bufmgr_gem,
+			      drm_intel_bo_gem *bo_gem, time_t time)
+{
+	struct drm_intel_gem_bo_magazine *mag;
+	struct drm_intel_gem_bo_bucket *bucket;
+	int i;
+
+	if (!bufmgr_gem->thread_cache || !bufmgr_gem->bo_reuse ||
+	    !bo_gem->reusable || bo_gem->reloc_count || bo_gem->map_count ||
+	    !DRMLISTEMPTY(&bo_gem->name_list) ||
+	    bo_gem->bo.size > DRM_INTEL_GEM_MAGAZINE_MAX_SIZE)
+		return false;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo_gem->bo.size);
+	if (bucket == NULL)
+		return false;
+
+	mag = pthread_getspecific(bufmgr_gem->magazine_key);
+	if (mag == NULL) {
+		mag = calloc(1, sizeof(*mag));
+		if (mag == NULL)
+			return false;
+		mag->bufmgr_gem = bufmgr_gem;
+		mag->time = time;
+		for (i = 0; i < DRM_INTEL_GEM_MAX_BUCKETS; i++)
+			DRMINITLISTHEAD(&mag->head[i]);
+
+		if (pthread_setspecific(bufmgr_gem->magazine_key, mag)) {
+			free(mag);
+			return false;
+		}
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTADD(&mag->link, &bufmgr_gem->magazines);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	/* Unnamed, so nobody else can look it up and take a reference */
+	atomic_set(&bo_gem->refcount, 0);
+
+	DBG("bo_unreference final: %d (%s) to thread cache\n",
+	    bo_gem->gem_handle, bo_gem->name);
+
+	drm_intel_gem_bo_free_reloc_list(bo_gem);
+	drm_intel_gem_bo_free_validate_list(bo_gem);
+	bo_gem->used_as_reloc_target = false;
+
+	bo_gem->free_time = time;
+	bo_gem->name = NULL;
+	bo_gem->validate_index = -1;
+
+	i = bucket - bufmgr_gem->cache_bucket;
+	DRMLISTADDTAIL(&bo_gem->head, &mag->head[i]);
+	mag->count[i]++;
+
+	if (mag->count[i] > DRM_INTEL_GEM_MAGAZINE_SIZE || mag->time != time) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_bo_magazine_trim(bufmgr_gem, mag, time, false);
+		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	return true;
+}
+
+/** Hands a thread's cached buffers to the shared cache when it exits. */
+static void
+drm_intel_gem_bo_magazine_destroy(void *data)
+{
+	struct drm_intel_gem_bo_magazine *mag = data;
+	drm_intel_bufmgr_gem *bufmgr_gem = mag->bufmgr_gem;
+	struct timespec time;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_bo_magazine_trim(bufmgr_gem, mag, time.tv_sec, true);
+	DRMLISTDEL(&mag->link);
+	bufmgr_gem->cache_hits += mag->hits;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	free(mag);
+}
+
 static void drm_intel_gem_bo_purge_vma_cache(drm_intel_bufmgr_gem *bufmgr_gem)
 {
 	int limit;
@@ -1194,18 +2123,14 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 	bo_gem->reloc_count = 0;
 	bo_gem->used_as_reloc_target = false;
 
+	drm_intel_gem_bo_truncate_validate_list(bo_gem, 0, time);
+	drm_intel_gem_bo_free_validate_list(bo_gem);
+
 	DBG("bo_unreference final: %d (%s)\n",
 	    bo_gem->gem_handle, bo_gem->name);
 
 	/* release memory associated with this object */
-	if (bo_gem->reloc_target_info) {
-		free(bo_gem->reloc_target_info);
-		bo_gem->reloc_target_info = NULL;
-	}
-	if (bo_gem->relocs) {
-		free(bo_gem->relocs);
-		bo_gem->relocs = NULL;
-	}
+	drm_intel_gem_bo_free_reloc_list(bo_gem);
 
 	/* Clear any left-over mappings */
 	if (bo_gem->map_count) {
@@ -1215,11 +2140,30 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 	}
 
-	DRMLISTDEL(&bo_gem->name_list);
+	drm_intel_gem_bo_remove_named(bufmgr_gem, bo_gem);
+
+	bucket = drm_intel_gem_bo_reuse_bucket(bufmgr_gem, bo_gem);
+
+	/* The release worker caches it, or closes it if it can't.  Anything
+	 * that can't be cached, such as a named or prime buffer, is closed
+	 * here as before: it is already gone from handle_table, and leaving
+	 * its handle open would let an import of the same object find the
+	 * handle and build a second bo on it for the worker to close.
+	 */
+	if (bucket != NULL && bufmgr_gem->deferred_release) {
+		bo_gem->free_time = time;
+		bo_gem->name = NULL;
+		bo_gem->validate_index = -1;
+
+		DRMLISTADDTAIL(&bo_gem->head, &bufmgr_gem->release_list);
+		if (++bufmgr_gem->release_count == 1 ||
+		    bufmgr_gem->release_count == DRM_INTEL_GEM_RELEASE_BATCH)
+			pthread_cond_broadcast(&bufmgr_gem->release_cond);
+		return;
+	}
 
-	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, bo->size);
 	/* Put the buffer into our internal cache for reuse if we can. */
-	if (bufmgr_gem->bo_reuse && bo_gem->reusable && bucket != NULL &&
+	if (bucket != NULL &&
 	    drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
 					      I915_MADV_DONTNEED)) {
 		bo_gem->free_time = time;
@@ -1227,12 +2171,120 @@ drm_intel_gem_bo_unreference_final(drm_intel_bo *bo, time_t time)
 		bo_gem->name = NULL;
 		bo_gem->validate_index = -1;
 
-		DRMLISTADDTAIL(&bo_gem->head, &bucket->head);
+		drm_intel_gem_bo_cache_add(bufmgr_gem, bucket, bo_gem);
+		drm_intel_gem_bo_cache_evict(bufmgr_gem);
 	} else {
 		drm_intel_gem_bo_free(bo);
 	}
 }
 
+/**
+ * Finishes releasing the buffers dropped while deferred release is
+ * enabled, away from the threads that dropped them: marks them purgeable
+ * and caches them, or unmaps and closes them.  Takes everything queued at
+ * each wakeup and makes the ioctls without bufmgr_gem->lock.
+ */
+static void *
+drm_intel_gem_release_worker(void *arg)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = arg;
+	drm_intel_bo_gem *bo_gem, *next;
+	drmMMListHead keep, drop;
+	struct timespec time;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	for (;;) {
+		if (DRMLISTEMPTY(&bufmgr_gem->release_list)) {
+			if (bufmgr_gem->release_stop)
+				break;
+			pthread_cond_wait(&bufmgr_gem->release_cond,
+					  &bufmgr_gem->lock);
+			continue;
+		}
+
+		/* Give the queue a chance to fill up first */
+		if (bufmgr_gem->release_count < DRM_INTEL_GEM_RELEASE_BATCH &&
+		    !bufmgr_gem->release_stop) {
+			clock_gettime(CLOCK_REALTIME, &time);
+			time.tv_nsec += DRM_INTEL_GEM_RELEASE_DELAY_NS;
+			if (time.tv_nsec >= 1000000000) {
+				time.tv_sec++;
+				time.tv_nsec -= 1000000000;
+			}
+			if (pthread_cond_timedwait(&bufmgr_gem->release_cond,
+						   &bufmgr_gem->lock,
+						   &time) != ETIMEDOUT)
+				continue;
+		}
+
+		DRMINITLISTHEAD(&keep);
+		DRMINITLISTHEAD(&drop);
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next,
+					&bufmgr_gem->release_list, head) {
+			DRMLISTDEL(&bo_gem->head);
+			if (drm_intel_gem_bo_reuse_bucket(bufmgr_gem, bo_gem))
+				DRMLISTADDTAIL(&bo_gem->head, &keep);
+			else
+				DRMLISTADDTAIL(&bo_gem->head, &drop);
+		}
+		bufmgr_gem->release_count = 0;
+		bufmgr_gem->release_busy = true;
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &keep, head) {
+			if (!drm_intel_gem_bo_madvise_internal(bufmgr_gem, bo_gem,
+							       I915_MADV_DONTNEED)) {
+				DRMLISTDEL(&bo_gem->head);
+				DRMLISTADDTAIL(&bo_gem->head, &drop);
+			}
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &keep, head) {
+			struct drm_intel_gem_bo_bucket *bucket;
+
+			DRMLISTDEL(&bo_gem->head);
+			bucket = drm_intel_gem_bo_reuse_bucket(bufmgr_gem,
+							       bo_gem);
+			if (bucket)
+				drm_intel_gem_bo_cache_add(bufmgr_gem, bucket,
+							   bo_gem);
+			else
+				DRMLISTADDTAIL(&bo_gem->head, &drop);
+		}
+		DRMLISTFOREACHENTRY(bo_gem, &drop, head)
+			drm_intel_gem_bo_forget_vma(bufmgr_gem, bo_gem);
+		drm_intel_gem_bo_cache_evict(bufmgr_gem);
+		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time.tv_sec);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+
+		DRMLISTFOREACHENTRYSAFE(bo_gem, next, &drop, head)
+			drm_intel_gem_bo_close(&bo_gem->bo);
+
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		bufmgr_gem->release_busy = false;
+		pthread_cond_broadcast(&bufmgr_gem->release_cond);
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+
+	return NULL;
+}
+
+/**
+ * Waits for the release worker to finish with everything released so
+ * far.  Called with bufmgr_gem->lock held.
+ */
+static void
+drm_intel_gem_release_drain(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	while (bufmgr_gem->deferred_release &&
+	       (!DRMLISTEMPTY(&bufmgr_gem->release_list) ||
+		bufmgr_gem->release_busy))
+		pthread_cond_wait(&bufmgr_gem->release_cond,
+				  &bufmgr_gem->lock);
+}
+
 static void drm_intel_gem_bo_unreference_locked_timed(drm_intel_bo *bo,
 						      time_t time)
 {
@@ -1256,6 +2308,10 @@ static void drm_intel_gem_bo_unreference(drm_intel_bo *bo)
 
 		clock_gettime(CLOCK_MONOTONIC, &time);
 
+		if (drm_intel_gem_bo_magazine_put(bufmgr_gem, bo_gem,
+						  time.tv_sec))
+			return;
+
 		pthread_mutex_lock(&bufmgr_gem->lock);
 
 		if (atomic_dec_and_test(&bo_gem->refcount)) {
@@ -1739,12 +2795,50 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
 	int i;
 
+	/* Let the release worker finish what has been queued */
+	if (bufmgr_gem->deferred_release) {
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		bufmgr_gem->release_stop = true;
+		pthread_cond_broadcast(&bufmgr_gem->release_cond);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+
+		pthread_join(bufmgr_gem->release_thread, NULL);
+		pthread_cond_destroy(&bufmgr_gem->release_cond);
+	}
+
 	free(bufmgr_gem->exec2_objects);
 	free(bufmgr_gem->exec_objects);
 	free(bufmgr_gem->exec_bos);
+	drm_intel_bufmgr_gem_set_aub_dump(bufmgr, 0);
 	free(bufmgr_gem->aub_filename);
+	drmHashDestroy(bufmgr_gem->name_table);
+	drmHashDestroy(bufmgr_gem->handle_table);
 
-	pthread_mutex_destroy(&bufmgr_gem->lock);
+	/* Free the buffers still cached by threads, including any that have
+	 * not exited yet */
+	if (bufmgr_gem->thread_cache) {
+		pthread_key_delete(bufmgr_gem->magazine_key);
+
+		while (!DRMLISTEMPTY(&bufmgr_gem->magazines)) {
+			struct drm_intel_gem_bo_magazine *mag;
+			drm_intel_bo_gem *bo_gem;
+
+			mag = DRMLISTENTRY(struct drm_intel_gem_bo_magazine,
+					   bufmgr_gem->magazines.next, link);
+			for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+				while (!DRMLISTEMPTY(&mag->head[i])) {
+					bo_gem = DRMLISTENTRY(drm_intel_bo_gem,
+							      mag->head[i].next,
+							      head);
+					DRMLISTDEL(&bo_gem->head);
+
+					drm_intel_gem_bo_free(&bo_gem->bo);
+				}
+			}
+			DRMLISTDEL(&mag->link);
+			free(mag);
+		}
+	}
 
 	/* Free any cached buffer objects we were going to reuse */
 	for (i = 0; i < bufmgr_gem->num_buckets; i++) {
@@ -1761,6 +2855,7 @@ drm_intel_bufmgr_gem_destroy(drm_intel_bufmgr *bufmgr)
 		}
 	}
 
+	pthread_mutex_destroy(&bufmgr_gem->lock);
 	free(bufmgr);
 }
 
@@ -1783,6 +2878,7 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) target_bo;
 	bool fenced_command;
+	int ret;
 
 	if (bo_gem->has_error)
 		return -ENOMEM;
@@ -1800,9 +2896,12 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 	if (target_bo_gem->tiling_mode == I915_TILING_NONE)
 		need_fence = false;
 
-	/* Create a new relocation list if needed */
-	if (bo_gem->relocs == NULL && drm_intel_setup_reloc_list(bo))
-		return -ENOMEM;
+	/* Create or grow the relocation list if needed */
+	if (bo_gem->reloc_count == bo_gem->reloc_size) {
+		ret = drm_intel_setup_reloc_list(bo);
+		if (ret)
+			return ret;
+	}
 
 	/* Check overflow */
 	assert(bo_gem->reloc_count < bufmgr_gem->max_relocs);
@@ -1843,6 +2942,17 @@ do_bo_emit_reloc(drm_intel_bo *bo, uint32_t offset,
 	else
 		bo_gem->reloc_target_info[bo_gem->reloc_count].flags = 0;
 
+	if ((bufmgr_gem->incremental_validate || bo_gem->validate_table) &&
+	    target_bo != bo) {
+		int flags = bo_gem->reloc_target_info[bo_gem->reloc_count].flags;
+
+		if (write_domain)
+			flags |= DRM_INTEL_RELOC_WRITE;
+		drm_intel_gem_bo_update_validate_list(bo, target_bo,
+						      bo_gem->reloc_count,
+						      flags, target_bo->offset64);
+	}
+
 	bo_gem->reloc_count++;
 
 	return 0;
@@ -1916,6 +3026,18 @@ drm_intel_gem_bo_clear_relocs(drm_intel_bo *bo, int start)
 	}
 	bo_gem->reloc_count = start;
 
+	/* Fence flags of the surviving entries may have come from cleared
+	 * relocations, so pre-965 rebuilds the list from scratch instead.
+	 */
+	if (bufmgr_gem->gen >= 4 || start == 0) {
+		drm_intel_gem_bo_truncate_validate_list(bo_gem, start,
+							time.tv_sec);
+	} else if (bo_gem->validate_table) {
+		drm_intel_gem_bo_truncate_validate_list(bo_gem, 0,
+							time.tv_sec);
+		drm_intel_gem_bo_free_validate_list(bo_gem);
+	}
+
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 }
@@ -1956,27 +3078,129 @@ drm_intel_gem_bo_process_reloc2(drm_intel_bo *bo)
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 	int i;
 
-	if (bo_gem->relocs == NULL)
-		return;
-
-	for (i = 0; i < bo_gem->reloc_count; i++) {
-		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
-		int need_fence;
+	if (bo_gem->relocs == NULL)
+		return;
+
+	for (i = 0; i < bo_gem->reloc_count; i++) {
+		drm_intel_bo *target_bo = bo_gem->reloc_target_info[i].bo;
+		int need_fence;
+
+		if (target_bo == bo)
+			continue;
+
+		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
+
+		/* Continue walking the tree depth-first. */
+		drm_intel_gem_bo_process_reloc2(target_bo);
+
+		need_fence = (bo_gem->reloc_target_info[i].flags &
+			      DRM_INTEL_RELOC_FENCE);
+
+		/* Add the target to the validate list */
+		drm_intel_add_validate_buffer2(target_bo, need_fence);
+	}
+}
+
+/**
+ * After an exec the kernel has patched every relocation in the tree to
+ * where the buffers ended up, so the validate lists of the buffers that
+ * went in, such as long-lived state buffers, can presume the same.
+ */
+static void
+drm_intel_gem_refresh_validate_lists(drm_intel_bufmgr_gem *bufmgr_gem)
+{
+	int i, j;
+
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo_gem *bo_gem =
+			(drm_intel_bo_gem *)bufmgr_gem->exec_bos[i];
+
+		for (j = 0; j < bo_gem->validate_count; j++) {
+			drm_intel_validate_entry *entry =
+				&bo_gem->validate_list[j];
+
+			entry->offset = entry->bo->offset64;
+		}
+		bo_gem->presumed_stale = false;
+	}
+}
+
+/**
+ * Fills the execbuffer2 validation list from bo's incrementally maintained
+ * one, which saves walking and deduplicating the whole relocation tree on
+ * every exec.  Returns false if bo has no such list.
+ *
+ * With I915_EXEC_NO_RELOC enabled, *presumed_valid is set if every
+ * buffer is still where the relocations to it presumed, so the kernel may
+ * skip relocation processing.
+ */
+static bool
+drm_intel_gem_bo_copy_validate_list(drm_intel_bo *bo, bool *presumed_valid)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
+	bool valid = bufmgr_gem->no_reloc && !bo_gem->presumed_stale;
+	int i;
+
+	if (!bufmgr_gem->incremental_validate || bo_gem->validate_table == NULL)
+		return false;
 
-		if (target_bo == bo)
-			continue;
+	/* Leave room for the batch buffer itself. */
+	if (bo_gem->validate_count >= bufmgr_gem->exec_size) {
+		int new_size = bo_gem->validate_count + 1;
+		struct drm_i915_gem_exec_object2 *objects;
+		drm_intel_bo **bos;
+
+		objects = realloc(bufmgr_gem->exec2_objects,
+				  sizeof(*objects) * new_size);
+		if (objects == NULL)
+			return false;
+		bufmgr_gem->exec2_objects = objects;
+
+		bos = realloc(bufmgr_gem->exec_bos, sizeof(*bos) * new_size);
+		if (bos == NULL)
+			return false;
+		bufmgr_gem->exec_bos = bos;
+		bufmgr_gem->exec_size = new_size;
+	}
 
+	if (bo_gem->validate_count)
 		drm_intel_gem_bo_mark_mmaps_incoherent(bo);
 
-		/* Continue walking the tree depth-first. */
-		drm_intel_gem_bo_process_reloc2(target_bo);
-
-		need_fence = (bo_gem->reloc_target_info[i].flags &
-			      DRM_INTEL_RELOC_FENCE);
-
-		/* Add the target to the validate list */
-		drm_intel_add_validate_buffer2(target_bo, need_fence);
+	for (i = 0; i < bo_gem->validate_count; i++) {
+		drm_intel_validate_entry *entry = &bo_gem->validate_list[i];
+		drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *)entry->bo;
+		struct drm_i915_gem_exec_object2 *object =
+			&bufmgr_gem->exec2_objects[i];
+
+		target_bo_gem->validate_index = i;
+		if (target_bo_gem->reloc_count)
+			drm_intel_gem_bo_mark_mmaps_incoherent(entry->bo);
+
+		object->handle = target_bo_gem->gem_handle;
+		object->relocation_count = target_bo_gem->reloc_count;
+		object->relocs_ptr = (uintptr_t)target_bo_gem->relocs;
+		object->alignment = 0;
+		object->offset = entry->offset;
+		object->flags = 0;
+		if (entry->flags & DRM_INTEL_RELOC_FENCE)
+			object->flags |= EXEC_OBJECT_NEEDS_FENCE;
+		/* Skipped relocations don't tell the kernel about writes. */
+		if (bufmgr_gem->no_reloc &&
+		    (entry->flags & DRM_INTEL_RELOC_WRITE))
+			object->flags |= EXEC_OBJECT_WRITE;
+		object->rsvd1 = 0;
+		object->rsvd2 = 0;
+		bufmgr_gem->exec_bos[i] = entry->bo;
+
+		/* Moved by another batch since the relocations were written */
+		if (entry->offset != entry->bo->offset64)
+			valid = false;
 	}
+	bufmgr_gem->exec_count = bo_gem->validate_count;
+	*presumed_valid = valid;
+
+	return true;
 }
 
 
@@ -2021,67 +3245,185 @@ drm_intel_update_buffer_offsets2 (drm_intel_bufmgr_gem *bufmgr_gem)
 	}
 }
 
-static void
-aub_out(drm_intel_bufmgr_gem *bufmgr_gem, uint32_t data)
+/**
+ * Compresses count dwords from src into dst, which needs room for
+ * count + 1 dwords, and returns the number of dwords written.
+ *
+ * Runs and arithmetic progressions are only coded once they are at least
+ * as long as the literal code they interrupt, so the output never grows
+ * by more than the one literal code.
+ */
+static unsigned int
+aub_compress(const uint32_t *src, unsigned int count, uint32_t *dst)
 {
-	fwrite(&data, 1, 4, bufmgr_gem->aub_file);
+	unsigned int i = 0, n, out = 0;
+	int literal = -1;
+	uint32_t delta;
+
+	while (i < count) {
+		for (n = 1; i + n < count && src[i + n] == src[i]; n++)
+			;
+		if (n >= 4) {
+			dst[out++] = AUB_CODE_RUN | n;
+			dst[out++] = src[i];
+			i += n;
+			literal = -1;
+			continue;
+		}
+
+		if (i + 1 < count) {
+			delta = src[i + 1] - src[i];
+			for (n = 2; i + n < count &&
+			     src[i + n] - src[i + n - 1] == delta; n++)
+				;
+			if (n >= 5) {
+				dst[out++] = AUB_CODE_DELTA | n;
+				dst[out++] = src[i];
+				dst[out++] = delta;
+				i += n;
+				literal = -1;
+				continue;
+			}
+		}
+
+		if (literal < 0) {
+			literal = out++;
+			dst[literal] = AUB_CODE_LITERAL;
+		}
+		dst[literal]++;
+		dst[out++] = src[i++];
+	}
+
+	return out;
 }
 
-static void
-aub_out_data(drm_intel_bufmgr_gem *bufmgr_gem, void *data, size_t size)
+/**
+ * Expands a block written by aub_compress() into count dwords at dst.
+ * Returns false if the block is corrupt.
+ */
+static bool
+aub_expand_block(const uint32_t *src, unsigned int size,
+		 uint32_t *dst, unsigned int count)
 {
-	fwrite(data, 1, size, bufmgr_gem->aub_file);
+	unsigned int i = 0, out = 0, n, j;
+	uint32_t value, delta;
+
+	while (i < size) {
+		n = src[i] & ~AUB_CODE_MASK;
+		if (n > count - out)
+			return false;
+
+		switch (src[i++] & AUB_CODE_MASK) {
+		case AUB_CODE_LITERAL:
+			if (n > size - i)
+				return false;
+			memcpy(dst + out, src + i, n * 4);
+			i += n;
+			break;
+		case AUB_CODE_RUN:
+			if (i + 1 > size)
+				return false;
+			value = src[i++];
+			for (j = 0; j < n; j++)
+				dst[out + j] = value;
+			break;
+		case AUB_CODE_DELTA:
+			if (i + 2 > size)
+				return false;
+			value = src[i++];
+			delta = src[i++];
+			for (j = 0; j < n; j++, value += delta)
+				dst[out + j] = value;
+			break;
+		default:
+			return false;
+		}
+		out += n;
+	}
+
+	return out == count;
 }
 
 static void
-aub_write_bo_data(drm_intel_bo *bo, uint32_t offset, uint32_t size)
+aub_flush(drm_intel_bufmgr_gem *bufmgr_gem)
 {
-	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
-	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
-	uint32_t *data;
-	unsigned int i;
+	uint32_t header[2];
 
-	data = malloc(bo->size);
-	drm_intel_bo_get_subdata(bo, offset, size, data);
-
-	/* Easy mode: write out bo with no relocations */
-	if (!bo_gem->reloc_count) {
-		aub_out_data(bufmgr_gem, data, size);
-		free(data);
+	if (bufmgr_gem->aub_buf_count == 0)
 		return;
+
+	if (bufmgr_gem->aub_compress) {
+		header[0] = bufmgr_gem->aub_buf_count;
+		header[1] = aub_compress(bufmgr_gem->aub_buf,
+					 bufmgr_gem->aub_buf_count,
+					 bufmgr_gem->aub_zbuf);
+		fwrite(header, 4, 2, bufmgr_gem->aub_file);
+		fwrite(bufmgr_gem->aub_zbuf, 4, header[1],
+		       bufmgr_gem->aub_file);
+	} else {
+		fwrite(bufmgr_gem->aub_buf, 4, bufmgr_gem->aub_buf_count,
+		       bufmgr_gem->aub_file);
 	}
+	bufmgr_gem->aub_buf_count = 0;
+}
 
-	/* Otherwise, handle the relocations while writing. */
-	for (i = 0; i < size / 4; i++) {
-		int r;
-		for (r = 0; r < bo_gem->reloc_count; r++) {
-			struct drm_i915_gem_relocation_entry *reloc;
-			drm_intel_reloc_target *info;
+static void
+aub_out(drm_intel_bufmgr_gem *bufmgr_gem, uint32_t data)
+{
+	if (bufmgr_gem->aub_buf_count == AUB_BUF_SIZE)
+		aub_flush(bufmgr_gem);
+	bufmgr_gem->aub_buf[bufmgr_gem->aub_buf_count++] = data;
+}
 
-			reloc = &bo_gem->relocs[r];
-			info = &bo_gem->reloc_target_info[r];
+static void
+aub_out_data(drm_intel_bufmgr_gem *bufmgr_gem, void *data, size_t size)
+{
+	const uint32_t *src = data;
+	size_t count = size / 4, n;
+
+	while (count) {
+		if (bufmgr_gem->aub_buf_count == AUB_BUF_SIZE)
+			aub_flush(bufmgr_gem);
+
+		n = AUB_BUF_SIZE - bufmgr_gem->aub_buf_count;
+		if (n > count)
+			n = count;
+		memcpy(bufmgr_gem->aub_buf + bufmgr_gem->aub_buf_count,
+		       src, n * 4);
+		bufmgr_gem->aub_buf_count += n;
+		src += n;
+		count -= n;
+	}
+}
 
-			if (reloc->offset == offset + i * 4) {
-				drm_intel_bo_gem *target_gem;
-				uint32_t val;
+/**
+ * Returns a copy of the buffer's contents as they are to appear in the AUB
+ * file, with relocations pointing at the targets' AUB addresses.
+ */
+static uint32_t *
+aub_bo_get_data(drm_intel_bo *bo)
+{
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	uint32_t *data;
+	int r;
 
-				target_gem = (drm_intel_bo_gem *)info->bo;
+	data = malloc(bo->size);
+	if (data == NULL)
+		return NULL;
+	drm_intel_bo_get_subdata(bo, 0, bo->size, data);
 
-				val = reloc->delta;
-				val += target_gem->aub_offset;
+	/* Walk backwards so that the first relocation at an offset wins */
+	for (r = bo_gem->reloc_count - 1; r >= 0; r--) {
+		struct drm_i915_gem_relocation_entry *reloc = &bo_gem->relocs[r];
+		drm_intel_bo_gem *target_gem =
+			(drm_intel_bo_gem *) bo_gem->reloc_target_info[r].bo;
 
-				aub_out(bufmgr_gem, val);
-				data[i] = val;
-				break;
-			}
-		}
-		if (r == bo_gem->reloc_count) {
-			/* no relocation, just the data */
-			aub_out(bufmgr_gem, data[i]);
-		}
+		if (reloc->offset + 4 <= bo->size)
+			data[reloc->offset / 4] =
+				reloc->delta + target_gem->aub_offset;
 	}
 
-	free(data);
+	return data;
 }
 
 static void
@@ -2090,6 +3432,12 @@ aub_bo_get_address(drm_intel_bo *bo)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
+	/* Keep the address from an earlier exec, so that pages the file
+	 * already holds don't have to be written again.
+	 */
+	if (bo_gem->aub_generation == bufmgr_gem->aub_generation)
+		return;
+
 	/* Give the object a graphics address in the AUB file.  We
 	 * don't just use the GEM object address because we do AUB
 	 * dumping before execution -- we want to successfully log
@@ -2099,13 +3447,17 @@ aub_bo_get_address(drm_intel_bo *bo)
 	 * call.
 	 */
 	bo_gem->aub_offset = bufmgr_gem->aub_offset;
+	bo_gem->aub_generation = bufmgr_gem->aub_generation;
+	free(bo_gem->aub_shadow);
+	bo_gem->aub_shadow = NULL;
 	bufmgr_gem->aub_offset += bo->size;
 	/* XXX: Handle aperture overflow. */
 	assert(bufmgr_gem->aub_offset < 256 * 1024 * 1024);
 }
 
 static void
-aub_write_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
+aub_write_trace_block(drm_intel_bo *bo, const uint32_t *data,
+		      uint32_t type, uint32_t subtype,
 		      uint32_t offset, uint32_t size)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
@@ -2121,29 +3473,56 @@ aub_write_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
 	aub_out(bufmgr_gem, size);
 	if (bufmgr_gem->gen >= 8)
 		aub_out(bufmgr_gem, 0);
-	aub_write_bo_data(bo, offset, size);
+	aub_out_data(bufmgr_gem, (void *) (data + offset / 4), size);
+}
+
+static bool
+aub_range_changed(drm_intel_bo_gem *bo_gem, const uint32_t *data,
+		  uint32_t offset, uint32_t end)
+{
+	return bo_gem->aub_shadow == NULL ||
+		memcmp(data + offset / 4, bo_gem->aub_shadow + offset / 4,
+		       end - offset) != 0;
 }
 
 /**
+ * Writes the pages of a section that changed since the last exec.
+ *
  * Break up large objects into multiple writes.  Otherwise a 128kb VBO
  * would overflow the 16 bits of size field in the packet header and
  * everything goes badly after that.
  */
 static void
-aub_write_large_trace_block(drm_intel_bo *bo, uint32_t type, uint32_t subtype,
+aub_write_large_trace_block(drm_intel_bo *bo, const uint32_t *data,
+			    uint32_t type, uint32_t subtype,
 			    uint32_t offset, uint32_t size)
 {
-	uint32_t block_size;
-	uint32_t sub_offset;
-
-	for (sub_offset = 0; sub_offset < size; sub_offset += block_size) {
-		block_size = size - sub_offset;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	uint32_t end = offset + size;
+	uint32_t block_end, next;
+
+	while (offset < end) {
+		block_end = ALIGN(offset + 1, 4096);
+		if (block_end > end)
+			block_end = end;
+		if (!aub_range_changed(bo_gem, data, offset, block_end)) {
+			offset = block_end;
+			continue;
+		}
 
-		if (block_size > 8 * 4096)
-			block_size = 8 * 4096;
+		while (block_end < end) {
+			next = block_end + 4096;
+			if (next > end)
+				next = end;
+			if (next - offset > 8 * 4096 ||
+			    !aub_range_changed(bo_gem, data, block_end, next))
+				break;
+			block_end = next;
+		}
 
-		aub_write_trace_block(bo, type, subtype, offset + sub_offset,
-				      block_size);
+		aub_write_trace_block(bo, data, type, subtype, offset,
+				      block_end - offset);
+		offset = block_end;
 	}
 }
 
@@ -2152,19 +3531,22 @@ aub_write_bo(drm_intel_bo *bo)
 {
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	uint32_t offset = 0;
+	uint32_t *data;
 	unsigned i;
 
-	aub_bo_get_address(bo);
+	data = aub_bo_get_data(bo);
+	if (data == NULL)
+		return;
 
 	/* Write out each annotated section separately. */
 	for (i = 0; i < bo_gem->aub_annotation_count; ++i) {
 		drm_intel_aub_annotation *annotation =
 			&bo_gem->aub_annotations[i];
-		uint32_t ending_offset = annotation->ending_offset;
+		uint32_t ending_offset = ALIGN(annotation->ending_offset, 4);
 		if (ending_offset > bo->size)
 			ending_offset = bo->size;
 		if (ending_offset > offset) {
-			aub_write_large_trace_block(bo, annotation->type,
+			aub_write_large_trace_block(bo, data, annotation->type,
 						    annotation->subtype,
 						    offset,
 						    ending_offset - offset);
@@ -2174,9 +3556,12 @@ aub_write_bo(drm_intel_bo *bo)
 
 	/* Write out any remaining unannotated data */
 	if (offset < bo->size) {
-		aub_write_large_trace_block(bo, AUB_TRACE_TYPE_NOTYPE, 0,
+		aub_write_large_trace_block(bo, data, AUB_TRACE_TYPE_NOTYPE, 0,
 					    offset, bo->size - offset);
 	}
+
+	free(bo_gem->aub_shadow);
+	bo_gem->aub_shadow = data;
 }
 
 /*
@@ -2215,16 +3600,13 @@ aub_build_dump_ringbuffer(drm_intel_bufmgr_gem *bufmgr_gem,
 	aub_out(bufmgr_gem,
 		AUB_TRACE_MEMTYPE_GTT | ring | AUB_TRACE_OP_COMMAND_WRITE);
 	aub_out(bufmgr_gem, 0); /* general/surface subtype */
-	aub_out(bufmgr_gem, bufmgr_gem->aub_offset);
+	aub_out(bufmgr_gem, AUB_RING_OFFSET);
 	aub_out(bufmgr_gem, ring_count * 4);
 	if (bufmgr_gem->gen >= 8)
 		aub_out(bufmgr_gem, 0);
 
 	/* FIXME: Need some flush operations here? */
 	aub_out_data(bufmgr_gem, ringbuffer, ring_count * 4);
-
-	/* Update offset pointer */
-	bufmgr_gem->aub_offset += 4096;
 }
 
 drm_public void
@@ -2274,12 +3656,30 @@ aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
+	uint32_t needed = 0;
 	int i;
 	bool batch_buffer_needs_annotations;
 
 	if (!bufmgr_gem->aub_file)
 		return;
 
+	/* Buffers keep their AUB addresses from one exec to the next.  Start
+	 * over once the GTT runs out, writing everything afresh.
+	 */
+	for (i = 0; i < bufmgr_gem->exec_count; i++) {
+		drm_intel_bo *exec_bo = bufmgr_gem->exec_bos[i];
+
+		if (((drm_intel_bo_gem *) exec_bo)->aub_generation !=
+		    bufmgr_gem->aub_generation)
+			needed += exec_bo->size;
+	}
+	if (bufmgr_gem->aub_offset + needed > AUB_APERTURE_SIZE) {
+		bufmgr_gem->aub_generation++;
+		bufmgr_gem->aub_offset = AUB_BO_OFFSET;
+	}
+	for (i = 0; i < bufmgr_gem->exec_count; i++)
+		aub_bo_get_address(bufmgr_gem->exec_bos[i]);
+
 	/* If batch buffer is not annotated, annotate it the best we
 	 * can.
 	 */
@@ -2304,14 +3704,8 @@ aub_exec(drm_intel_bo *bo, int ring_flag, int used)
 	/* Dump ring buffer */
 	aub_build_dump_ringbuffer(bufmgr_gem, bo_gem->aub_offset, ring_flag);
 
+	aub_flush(bufmgr_gem);
 	fflush(bufmgr_gem->aub_file);
-
-	/*
-	 * One frame has been dumped. So reset the aub_offset for the next frame.
-	 *
-	 * FIXME: Can we do this?
-	 */
-	bufmgr_gem->aub_offset = 0x10000;
 }
 
 static int
@@ -2367,11 +3761,16 @@ drm_intel_gem_bo_exec(drm_intel_bo *bo, int used,
 	if (bufmgr_gem->bufmgr.debug)
 		drm_intel_gem_dump_validation_list(bufmgr_gem);
 
+	if (ret == 0)
+		bufmgr_gem->exec_serial++;
+	drm_intel_gem_fold_busy_stats(bufmgr_gem);
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
 		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
-		bo_gem->idle = false;
+		if (ret == 0)
+			drm_intel_gem_bo_mark_exec(bufmgr_gem, bo_gem,
+						   I915_EXEC_RENDER);
 
 		/* Disconnect the buffer from the validate list */
 		bo_gem->validate_index = -1;
@@ -2390,8 +3789,11 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 {
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bo->bufmgr;
 	struct drm_i915_gem_execbuffer2 execbuf;
+	bool presumed_valid = false;
+	int ring = flags & I915_EXEC_RING_MASK;
 	int ret = 0;
 	int i;
+	bool queued;
 
 	switch (flags & 0x7) {
 	default:
@@ -2408,19 +3810,25 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		if (!bufmgr_gem->has_vebox)
 			return -EINVAL;
 		break;
-	case I915_EXEC_RENDER:
 	case I915_EXEC_DEFAULT:
+		ring = I915_EXEC_RENDER;
+		break;
+	case I915_EXEC_RENDER:
 		break;
 	}
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
 	/* Update indices and set up the validate list. */
-	drm_intel_gem_bo_process_reloc2(bo);
+	if (!drm_intel_gem_bo_copy_validate_list(bo, &presumed_valid))
+		drm_intel_gem_bo_process_reloc2(bo);
 
 	/* Add the batch buffer to the validation list.  There are no relocations
 	 * pointing to it.
 	 */
 	drm_intel_add_validate_buffer2(bo, 0);
+	if (presumed_valid)
+		bufmgr_gem->exec2_objects[bufmgr_gem->exec_count - 1].offset =
+			bo->offset64;
 
 	VG_CLEAR(execbuf);
 	execbuf.buffers_ptr = (uintptr_t)bufmgr_gem->exec2_objects;
@@ -2432,6 +3840,8 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 	execbuf.DR1 = 0;
 	execbuf.DR4 = DR4;
 	execbuf.flags = flags;
+	if (presumed_valid)
+		execbuf.flags |= I915_EXEC_NO_RELOC;
 	if (ctx == NULL)
 		i915_execbuffer2_set_context_id(execbuf, 0);
 	else
@@ -2459,16 +3869,29 @@ do_exec2(drm_intel_bo *bo, int used, drm_intel_context *ctx,
 		}
 	}
 	drm_intel_update_buffer_offsets2(bufmgr_gem);
+	if (ret == 0 && bufmgr_gem->no_reloc)
+		drm_intel_gem_refresh_validate_lists(bufmgr_gem);
 
 skip_execution:
 	if (bufmgr_gem->bufmgr.debug)
 		drm_intel_gem_dump_validation_list(bufmgr_gem);
 
+	/* Batches complete in submission order only within one context on
+	 * one ring, and I915_EXEC_BSD may go to either of two video rings.
+	 * Buffers submitted any other way are left to the busy ioctl.
+	 */
+	queued = ret == 0 && !bufmgr_gem->no_exec;
+	if (ctx != NULL || ring == I915_EXEC_BSD)
+		ring = -1;
+	if (queued)
+		bufmgr_gem->exec_serial++;
+	drm_intel_gem_fold_busy_stats(bufmgr_gem);
 	for (i = 0; i < bufmgr_gem->exec_count; i++) {
 		drm_intel_bo *bo = bufmgr_gem->exec_bos[i];
 		drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *)bo;
 
-		bo_gem->idle = false;
+		if (queued)
+			drm_intel_gem_bo_mark_exec(bufmgr_gem, bo_gem, ring);
 
 		/* Disconnect the buffer from the validate list */
 		bo_gem->validate_index = -1;
@@ -2631,7 +4054,7 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	uint32_t handle;
 	drm_intel_bo_gem *bo_gem;
 	struct drm_i915_gem_get_tiling get_tiling;
-	drmMMListHead *list;
+	void *value;
 
 	ret = drmPrimeFDToHandle(bufmgr_gem->fd, prime_fd, &handle);
 
@@ -2641,15 +4064,12 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	 * kernel object
 	 */
 	pthread_mutex_lock(&bufmgr_gem->lock);
-	for (list = bufmgr_gem->named.next;
-	     list != &bufmgr_gem->named;
-	     list = list->next) {
-		bo_gem = DRMLISTENTRY(drm_intel_bo_gem, list, name_list);
-		if (bo_gem->gem_handle == handle) {
-			drm_intel_gem_bo_reference(&bo_gem->bo);
-			pthread_mutex_unlock(&bufmgr_gem->lock);
-			return &bo_gem->bo;
-		}
+	if (ret == 0 &&
+	    drmHashLookup(bufmgr_gem->handle_table, handle, &value) == 0) {
+		bo_gem = value;
+		drm_intel_gem_bo_reference(&bo_gem->bo);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+		return &bo_gem->bo;
 	}
 
 	if (ret) {
@@ -2689,7 +4109,8 @@ drm_intel_bo_gem_create_from_prime(drm_intel_bufmgr *bufmgr, int prime_fd, int s
 	bo_gem->reusable = false;
 
 	DRMINITLISTHEAD(&bo_gem->vma_list);
-	DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	DRMINITLISTHEAD(&bo_gem->name_list);
+	drm_intel_gem_bo_add_named(bufmgr_gem, bo_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	VG_CLEAR(get_tiling);
@@ -2716,8 +4137,7 @@ drm_intel_bo_gem_export_to_prime(drm_intel_bo *bo, int *prime_fd)
 	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 
 	pthread_mutex_lock(&bufmgr_gem->lock);
-        if (DRMLISTEMPTY(&bo_gem->name_list))
-                DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+	drm_intel_gem_bo_add_named(bufmgr_gem, bo_gem);
 	pthread_mutex_unlock(&bufmgr_gem->lock);
 
 	if (drmPrimeHandleToFD(bufmgr_gem->fd, bo_gem->gem_handle,
@@ -2753,8 +4173,7 @@ drm_intel_gem_bo_flink(drm_intel_bo *bo, uint32_t * name)
 		bo_gem->global_name = flink.name;
 		bo_gem->reusable = false;
 
-                if (DRMLISTEMPTY(&bo_gem->name_list))
-                        DRMLISTADDTAIL(&bo_gem->name_list, &bufmgr_gem->named);
+		drm_intel_gem_bo_add_named(bufmgr_gem, bo_gem);
 		pthread_mutex_unlock(&bufmgr_gem->lock);
 	}
 
@@ -2777,6 +4196,151 @@ drm_intel_bufmgr_gem_enable_reuse(drm_intel_bufmgr *bufmgr)
 	bufmgr_gem->bo_reuse = true;
 }
 
+/**
+ * Enables per-thread caches of freed buffer objects in front of the shared
+ * reuse cache.
+ *
+ * Small unnamed buffers that a thread frees are kept for that thread's
+ * next allocations of the same size, without taking the buffer manager
+ * lock, which helps when several threads allocate from one bufmgr.  A
+ * thread keeps a few buffers per size and hands the rest to the shared
+ * cache, along with everything it holds when it exits.  Buffers a thread
+ * no longer uses are freed on its next free after a second or two.
+ *
+ * Only takes effect once reuse is enabled with
+ * drm_intel_bufmgr_gem_enable_reuse(), and should be called before other
+ * threads use the bufmgr.
+ */
+drm_public void
+drm_intel_bufmgr_gem_enable_thread_cache(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	if (!bufmgr_gem->thread_cache &&
+	    pthread_key_create(&bufmgr_gem->magazine_key,
+			       drm_intel_gem_bo_magazine_destroy) == 0)
+		bufmgr_gem->thread_cache = true;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Limits the reuse cache to a number of bytes.
+ *
+ * By default cached buffer objects are freed once they have been unused
+ * for a second or two.  With a limit, they are instead kept until the
+ * cache grows beyond it, and then freed least recently used first, which
+ * suits bursty workloads.  A limit of 0 restores the default.  Buffers
+ * held by per-thread caches are not counted.  With deferred release,
+ * buffers already released are cached first so that the limit covers
+ * them when this returns.
+ */
+drm_public void
+drm_intel_bufmgr_gem_set_cache_size(drm_intel_bufmgr *bufmgr,
+				    uint64_t max_bytes)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_release_drain(bufmgr_gem);
+	bufmgr_gem->cache_max_bytes = max_bytes;
+	bufmgr_gem->time = 0;
+	drm_intel_gem_bo_cache_evict(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Enables a background thread that finishes releasing buffers once their
+ * last reference is dropped, so that the madvise, munmap and close calls
+ * stay off the thread doing it, typically the render thread at the end of
+ * a frame.  Released buffers go back to the cache shortly afterwards
+ * rather than immediately.  Buffers that can't be reused, such as shared
+ * ones, are still closed right away, and so are cached buffers that have
+ * aged out, at most once a second.
+ *
+ * Should be called before any buffers are released.  Nothing changes if
+ * the thread can't be created.
+ */
+drm_public void
+drm_intel_bufmgr_gem_enable_deferred_release(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	if (bufmgr_gem->deferred_release)
+		return;
+
+	if (pthread_cond_init(&bufmgr_gem->release_cond, NULL))
+		return;
+
+	if (pthread_create(&bufmgr_gem->release_thread, NULL,
+			   drm_intel_gem_release_worker, bufmgr_gem)) {
+		pthread_cond_destroy(&bufmgr_gem->release_cond);
+		return;
+	}
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	bufmgr_gem->deferred_release = true;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Reports how well the reuse cache is doing.
+ *
+ * Sizes above the largest fixed bucket that are allocated repeatedly get
+ * a bucket of their own, which are counted in stats->buckets.  Checking
+ * whether a cached buffer is still busy needs an ioctl only while the
+ * submissions that used it are not known to have completed.
+ */
+drm_public void
+drm_intel_bufmgr_gem_get_cache_stats(drm_intel_bufmgr *bufmgr,
+				     drm_intel_bufmgr_gem_cache_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_gem_bo_magazine *mag;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	stats->hits = bufmgr_gem->cache_hits;
+	stats->misses = bufmgr_gem->cache_misses;
+	stats->evictions = bufmgr_gem->cache_evictions;
+	stats->bytes_retained = bufmgr_gem->cache_bytes;
+	stats->bos_retained = bufmgr_gem->cache_count;
+	stats->buckets = bufmgr_gem->num_buckets;
+	drm_intel_gem_fold_busy_stats(bufmgr_gem);
+	stats->busy_queries = bufmgr_gem->busy_queries_total;
+	stats->busy_avoided = bufmgr_gem->busy_avoided_total;
+
+	DRMLISTFOREACHENTRY(mag, &bufmgr_gem->magazines, link) {
+		int i;
+
+		stats->hits += mag->hits;
+		for (i = 0; i < bufmgr_gem->num_buckets; i++) {
+			stats->bytes_retained += (uint64_t) mag->count[i] *
+				bufmgr_gem->cache_bucket[i].size;
+			stats->bos_retained += mag->count[i];
+		}
+	}
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/**
+ * Reports the memory held for relocations: the entries passed to the
+ * kernel and their bookkeeping, and the validate lists built from them.
+ */
+drm_public void
+drm_intel_bufmgr_gem_get_reloc_stats(drm_intel_bufmgr *bufmgr,
+				     drm_intel_bufmgr_gem_reloc_stats *stats)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	stats->reloc_bytes = (uint64_t) atomic_read(&bufmgr_gem->reloc_entries) *
+		(sizeof(struct drm_i915_gem_relocation_entry) +
+		 sizeof(drm_intel_reloc_target));
+	stats->validate_bytes =
+		(uint64_t) atomic_read(&bufmgr_gem->validate_entries) *
+		sizeof(drm_intel_validate_entry);
+	stats->bos = atomic_read(&bufmgr_gem->reloc_bos);
+}
+
 /**
  * Enable use of fenced reloc type.
  *
@@ -2793,6 +4357,46 @@ drm_intel_bufmgr_gem_enable_fenced_relocs(drm_intel_bufmgr *bufmgr)
 		bufmgr_gem->fenced_relocs = true;
 }
 
+/**
+ * Keep each buffer's validation list up to date as relocations are emitted,
+ * so that exec copies it rather than walking and deduplicating the whole
+ * relocation tree.  Repeated submissions of large batches then cost in
+ * proportion to the relocations added since, not the whole tree, and
+ * drm_intel_bo_references() answers from the same lists.
+ *
+ * Only takes effect with execbuffer2.
+ */
+drm_public void
+drm_intel_bufmgr_gem_enable_incremental_validate(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	if (bufmgr_gem->bufmgr.bo_exec == drm_intel_gem_bo_exec2)
+		bufmgr_gem->incremental_validate = true;
+}
+
+/**
+ * Let the kernel skip relocation processing for batches whose buffers are
+ * all still where their relocations presumed, which is most of them once
+ * the working set has settled.
+ *
+ * The caller must write target_bo->offset64 + target_offset at each
+ * relocated location when emitting the relocation, as the kernel won't
+ * patch it unless something moved.  Implies incremental validation, and
+ * does nothing unless the kernel supports I915_EXEC_NO_RELOC.
+ */
+drm_public void
+drm_intel_bufmgr_gem_enable_no_reloc(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	if (bufmgr_gem->bufmgr.bo_exec == drm_intel_gem_bo_exec2 &&
+	    bufmgr_gem->has_exec_no_reloc) {
+		bufmgr_gem->incremental_validate = true;
+		bufmgr_gem->no_reloc = true;
+	}
+}
+
 /**
  * Return the additional aperture space required by the tree of buffer objects
  * rooted at bo.
@@ -3004,21 +4608,36 @@ _drm_intel_gem_bo_references(drm_intel_bo *bo, drm_intel_bo *target_bo)
 	return 0;
 }
 
-/** Return true if target_bo is referenced by bo's relocation tree. */
+/**
+ * Return true if target_bo is referenced by bo's relocation tree.
+ *
+ * With incremental validation enabled the answer comes from bo's validate
+ * list, so that drivers checking every buffer they map against a large
+ * batch don't walk the whole tree each time.  Otherwise the tree is
+ * walked, as maintaining the list would cost every later relocation.
+ */
 static int
 drm_intel_gem_bo_references(drm_intel_bo *bo, drm_intel_bo *target_bo)
 {
+	drm_intel_bufmgr_gem *bufmgr_gem;
+	drm_intel_bo_gem *bo_gem = (drm_intel_bo_gem *) bo;
 	drm_intel_bo_gem *target_bo_gem = (drm_intel_bo_gem *) target_bo;
+	void *value;
 
 	if (bo == NULL || target_bo == NULL)
 		return 0;
-	if (target_bo_gem->used_as_reloc_target)
-		return _drm_intel_gem_bo_references(bo, target_bo);
-	return 0;
+	if (!target_bo_gem->used_as_reloc_target || bo_gem->reloc_count == 0)
+		return 0;
+	bufmgr_gem = (drm_intel_bufmgr_gem *) bo->bufmgr;
+	if (bo != target_bo && bufmgr_gem->incremental_validate &&
+	    drm_intel_gem_bo_build_validate_list(bo) == 0)
+		return drmHashLookup(bo_gem->validate_table,
+				     target_bo_gem->gem_handle, &value) == 0;
+	return _drm_intel_gem_bo_references(bo, target_bo);
 }
 
 static void
-add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, int size)
+add_bucket(drm_intel_bufmgr_gem *bufmgr_gem, unsigned long size)
 {
 	unsigned int i = bufmgr_gem->num_buckets;
 
@@ -3054,6 +4673,9 @@ init_cache_buckets(drm_intel_bufmgr_gem *bufmgr_gem)
 		add_bucket(bufmgr_gem, size + size * 2 / 4);
 		add_bucket(bufmgr_gem, size + size * 3 / 4);
 	}
+
+	assert(bufmgr_gem->num_buckets <= DRM_INTEL_GEM_FIXED_BUCKETS);
+	bufmgr_gem->num_fixed_buckets = bufmgr_gem->num_buckets;
 }
 
 drm_public void
@@ -3123,6 +4745,25 @@ drm_intel_bufmgr_gem_set_aub_filename(drm_intel_bufmgr *bufmgr,
 		bufmgr_gem->aub_filename = strdup(filename);
 }
 
+/**
+ * Compresses the AUB file.
+ *
+ * Mostly empty pages, GTT entries and repeated state compress well, which
+ * keeps captures small enough to take outside the lab.  The result has to
+ * be expanded with drm_intel_aub_expand() before use.
+ *
+ * This function has to be called before drm_intel_bufmgr_gem_set_aub_dump()
+ * for it to have any effect.
+ */
+drm_public void
+drm_intel_bufmgr_gem_set_aub_compression(drm_intel_bufmgr *bufmgr,
+					 int enable)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
+
+	bufmgr_gem->aub_compress = enable;
+}
+
 /**
  * Sets up AUB dumping.
  *
@@ -3137,30 +4778,58 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *)bufmgr;
 	int entry = 0x200003;
 	int i;
-	int gtt_size = 0x10000;
+	int gtt_size = AUB_GTT_SIZE;
 	const char *filename;
 
 	if (!enable) {
 		if (bufmgr_gem->aub_file) {
+			aub_flush(bufmgr_gem);
 			fclose(bufmgr_gem->aub_file);
 			bufmgr_gem->aub_file = NULL;
 		}
+		free(bufmgr_gem->aub_buf);
+		free(bufmgr_gem->aub_zbuf);
+		bufmgr_gem->aub_buf = NULL;
+		bufmgr_gem->aub_zbuf = NULL;
 		return;
 	}
 
 	if (geteuid() != getuid())
 		return;
 
+	bufmgr_gem->aub_buf = malloc(AUB_BUF_SIZE * 4);
+	if (bufmgr_gem->aub_compress)
+		bufmgr_gem->aub_zbuf = malloc((AUB_BUF_SIZE + 1) * 4);
+	if (!bufmgr_gem->aub_buf ||
+	    (bufmgr_gem->aub_compress && !bufmgr_gem->aub_zbuf)) {
+		drm_intel_bufmgr_gem_set_aub_dump(bufmgr, 0);
+		return;
+	}
+
 	if (bufmgr_gem->aub_filename)
 		filename = bufmgr_gem->aub_filename;
 	else
 		filename = "intel.aub";
 	bufmgr_gem->aub_file = fopen(filename, "w+");
-	if (!bufmgr_gem->aub_file)
+	if (!bufmgr_gem->aub_file) {
+		drm_intel_bufmgr_gem_set_aub_dump(bufmgr, 0);
 		return;
+	}
+
+	if (bufmgr_gem->aub_compress) {
+		uint32_t header[2] = {
+			AUB_COMPRESSED_MAGIC, AUB_COMPRESSED_VERSION
+		};
 
-	/* Start allocating objects from just after the GTT. */
-	bufmgr_gem->aub_offset = gtt_size;
+		fwrite(header, 4, 2, bufmgr_gem->aub_file);
+	}
+
+	/* Start allocating objects from just after the GTT and the ring,
+	 * with no buffer's earlier address or contents carried over.
+	 */
+	bufmgr_gem->aub_offset = AUB_BO_OFFSET;
+	bufmgr_gem->aub_generation++;
+	bufmgr_gem->aub_buf_count = 0;
 
 	/* Start with a (required) version packet. */
 	aub_out(bufmgr_gem, CMD_AUB_HEADER | (13 - 2));
@@ -3187,6 +4856,61 @@ drm_intel_bufmgr_gem_set_aub_dump(drm_intel_bufmgr *bufmgr, int enable)
 	}
 }
 
+/**
+ * Expands an AUB file written with drm_intel_bufmgr_gem_set_aub_compression()
+ * from in to out.  Uncompressed files are copied as they are.
+ *
+ * Returns 0 on success, -EINVAL if the input is corrupt, or another
+ * negative errno.
+ */
+drm_public int
+drm_intel_aub_expand(FILE *in, FILE *out)
+{
+	uint32_t header[2], *src, *dst;
+	char copy[4096];
+	size_t n;
+	int ret = 0;
+
+	n = fread(header, 1, sizeof(header), in);
+	if (n < sizeof(header) || header[0] != AUB_COMPRESSED_MAGIC) {
+		if (fwrite(header, 1, n, out) != n)
+			return -EIO;
+		while ((n = fread(copy, 1, sizeof(copy), in)) > 0)
+			if (fwrite(copy, 1, n, out) != n)
+				return -EIO;
+		return ferror(in) ? -EIO : 0;
+	}
+	if (header[1] != AUB_COMPRESSED_VERSION)
+		return -EINVAL;
+
+	src = malloc((AUB_BUF_SIZE + 1) * 4);
+	dst = malloc(AUB_BUF_SIZE * 4);
+	if (!src || !dst) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while ((n = fread(header, 4, 2, in)) == 2) {
+		if (header[0] > AUB_BUF_SIZE || header[1] > header[0] + 1 ||
+		    fread(src, 4, header[1], in) != header[1] ||
+		    !aub_expand_block(src, header[1], dst, header[0])) {
+			ret = -EINVAL;
+			goto out;
+		}
+		if (fwrite(dst, 4, header[0], out) != header[0]) {
+			ret = -EIO;
+			goto out;
+		}
+	}
+	if (n != 0 || ferror(in))
+		ret = -EINVAL;
+
+out:
+	free(src);
+	free(dst);
+	return ret;
+}
+
 drm_public drm_intel_context *
 drm_intel_gem_context_create(drm_intel_bufmgr *bufmgr)
 {
@@ -3536,6 +5260,10 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
 	bufmgr_gem->has_vebox = (ret == 0) & (*gp.value > 0);
 
+	gp.param = I915_PARAM_HAS_EXEC_NO_RELOC;
+	ret = drmIoctl(bufmgr_gem->fd, DRM_IOCTL_I915_GETPARAM, &gp);
+	bufmgr_gem->has_exec_no_reloc = (ret == 0) & (*gp.value > 0);
+
 	if (bufmgr_gem->gen < 4) {
 		gp.param = I915_PARAM_NUM_FENCES_AVAIL;
 		gp.value = &bufmgr_gem->available_fences;
@@ -3607,6 +5335,20 @@ drm_intel_bufmgr_gem_init(int fd, int batch_size)
 	bufmgr_gem->bufmgr.bo_references = drm_intel_gem_bo_references;
 
 	DRMINITLISTHEAD(&bufmgr_gem->named);
+	DRMINITLISTHEAD(&bufmgr_gem->magazines);
+	DRMINITLISTHEAD(&bufmgr_gem->release_list);
+	DRMINITLISTHEAD(&bufmgr_gem->cache_lru);
+	bufmgr_gem->name_table = drmHashCreate();
+	bufmgr_gem->handle_table = drmHashCreate();
+	if (!bufmgr_gem->name_table || !bufmgr_gem->handle_table) {
+		if (bufmgr_gem->name_table)
+			drmHashDestroy(bufmgr_gem->name_table);
+		if (bufmgr_gem->handle_table)
+			drmHashDestroy(bufmgr_gem->handle_table);
+		free(bufmgr_gem);
+		bufmgr_gem = NULL;
+		goto exit;
+	}
 	init_cache_buckets(bufmgr_gem);
 
 	DRMINITLISTHEAD(&bufmgr_gem->vma_cache);
@@ -32,6 +32,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "libdrm.h"
 #include "xf86drm.h"
@@ -81,24 +82,153 @@ struct drm_intel_decode {
 	bool dump_past_end;
 
 	bool overflowed;
+
+	/** @{
+	 * i915 state dwords from 3DSTATE_LOAD_STATE_IMMEDIATE_1, which
+	 * tell how later primitives lay out their vertices.
+	 */
+	uint32_t saved_s2, saved_s4;
+	bool saved_s2_set, saved_s4_set;
+	/** @} */
+
+	/**
+	 * Output not yet handed to out or the packet callback.  With
+	 * neither, it collects the whole decode for
+	 * drm_intel_decode_get_output().
+	 */
+	char *buf;
+	size_t buf_len, buf_size;
+
+	drm_intel_decode_packet_func packet_func;
+	void *packet_closure;
+
+	/**
+	 * Dwords described so far in the current packet, with where their
+	 * line and its description start in buf, and the records handed to
+	 * the packet callback.
+	 */
+	struct decode_field_pos {
+		uint32_t offset, value;
+		size_t line, start;
+	} *field_pos;
+	struct drm_intel_decode_field *fields;
+	unsigned int field_count, field_size;
+	char name[64];
+
+	/** @{
+	 * The opcode tables for this gen, indexed by the opcode bits of a
+	 * header: each slot holds one plus the position of the first entry
+	 * that matches, or 0 for an unknown opcode.  index_3d covers the
+	 * 5-bit i830/i915 opcodes or the low 13 bits of the 965 ones.
+	 */
+	uint8_t index_mi[64];
+	uint8_t index_2d[128];
+	uint8_t index_3d_1d[256];
+	uint8_t index_3d[0x2000];
+	/** @} */
+
+	/** Threads to decode on; see drm_intel_decode_set_threads(). */
+	unsigned int threads;
+	/** Whether the batch is followed by DRM_INTEL_DECODE_PADDING bytes */
+	bool padded;
+	/** Decode without producing any output. */
+	bool quiet;
+
+	/** @{
+	 * Counts per opcode while stats are on, in a hash table keyed by
+	 * decode_stat_key().
+	 */
+	bool stats;
+	struct decode_stat *stat_table;
+	unsigned int stat_count, stat_size;
+	/**
+	 * Entry taking its name from the header line of the packet being
+	 * decoded, and where in buf that line's description starts.
+	 */
+	struct decode_stat *stat_naming;
+	size_t stat_name_pos;
+	/** @} */
 };
 
-static FILE *out;
-static uint32_t saved_s2 = 0, saved_s4 = 0;
-static char saved_s2_set = 0, saved_s4_set = 0;
-static uint32_t head_offset = 0xffffffff;	/* undefined */
-static uint32_t tail_offset = 0xffffffff;	/* undefined */
+struct decode_stat {
+	uint32_t opcode;
+	/** Hash of the last packet's dwords, to notice changes */
+	uint32_t last_hash;
+	uint64_t packets, dwords, changes;
+	char name[48];
+};
+
+/** A stretch of packets decoded by one thread of a parallel decode. */
+struct decode_chunk {
+	/** DWORDs in the chunk. */
+	uint32_t count;
+	/** Context positioned at the chunk, collecting its output. */
+	struct drm_intel_decode *ctx;
+};
+
+struct decode_worker {
+	struct decode_chunk *chunks;
+	unsigned int count, first, stride;
+	pthread_t thread;
+};
+
+/* Parallel decodes split the batch into up to this many chunks per
+ * thread, of no fewer DWORDs than DECODE_CHUNK_MIN.
+ */
+#define DECODE_CHUNKS_PER_THREAD 4
+#define DECODE_CHUNK_MIN 1024
+
+/** An entry in one of the opcode tables. */
+struct decode_opcode {
+	uint32_t opcode;
+	/** Bits of the header holding the length, less 2. */
+	uint32_t len_mask;
+	unsigned int min_len;
+	unsigned int max_len;
+	const char *name;
+	/** The only gen that decodes this entry, or 0 for any. */
+	int gen;
+	int (*func)(struct drm_intel_decode *ctx);
+};
+
+/* Output is written to the file once this much has collected */
+#define DECODE_FLUSH_SIZE (64 * 1024)
 
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(A) (sizeof(A)/sizeof(A[0]))
 #endif
 
 #define BUFFER_FAIL(_count, _len, _name) do {			\
-    fprintf(out, "Buffer size too small in %s (%d < %d)\n",	\
+    decode_out(ctx, "Buffer size too small in %s (%d < %d)\n",	\
 	    (_name), (_count), (_len));				\
     return _count;						\
 } while (0)
 
+static void
+decode_index_opcodes(uint8_t *index, unsigned int index_size,
+		     const struct decode_opcode *opcodes, unsigned int count,
+		     int gen)
+{
+	unsigned int i;
+
+	assert(count < 256);
+	for (i = 0; i < count; i++) {
+		uint32_t key = opcodes[i].opcode & (index_size - 1);
+
+		if (opcodes[i].gen && opcodes[i].gen != gen)
+			continue;
+		if (!index[key])
+			index[key] = i + 1;
+	}
+}
+
+static const struct decode_opcode *
+decode_lookup_opcode(const uint8_t *index,
+		     const struct decode_opcode *opcodes, uint32_t key)
+{
+	return index[key] ? &opcodes[index[key] - 1] : NULL;
+}
+
 static float int_as_float(uint32_t intval)
 {
 	union intfloat {
@@ -110,6 +240,133 @@ static float int_as_float(uint32_t intval)
 	return uval.f;
 }
 
+static bool
+decode_grow(struct drm_intel_decode *ctx, size_t size)
+{
+	size_t new_size = ctx->buf_size ? ctx->buf_size : 4096;
+	char *buf;
+
+	while (new_size < size)
+		new_size *= 2;
+	buf = realloc(ctx->buf, new_size);
+	if (!buf)
+		return false;
+	ctx->buf = buf;
+	ctx->buf_size = new_size;
+	return true;
+}
+
+static void DRM_PRINTFLIKE(2, 0)
+decode_vout(struct drm_intel_decode *ctx, const char *fmt, va_list va)
+{
+	va_list copy;
+	int len;
+
+	if (ctx->quiet)
+		return;
+
+	for (;;) {
+		va_copy(copy, va);
+		len = vsnprintf(ctx->buf + ctx->buf_len,
+				ctx->buf_size - ctx->buf_len, fmt, copy);
+		va_end(copy);
+		if (len < 0)
+			return;
+		if (ctx->buf_len + len < ctx->buf_size) {
+			ctx->buf_len += len;
+			return;
+		}
+		if (!decode_grow(ctx, ctx->buf_len + len + 1))
+			return;
+	}
+}
+
+static void DRM_PRINTFLIKE(2, 3)
+decode_out(struct drm_intel_decode *ctx, const char *fmt, ...)
+{
+	va_list va;
+
+	va_start(va, fmt);
+	decode_vout(ctx, fmt, va);
+	va_end(va);
+}
+
+/** Notes which dword is described from here on, for the packet callback */
+static void
+decode_add_field(struct drm_intel_decode *ctx, unsigned int index,
+		 size_t line)
+{
+	struct decode_field_pos *pos;
+
+	if (ctx->field_count == ctx->field_size) {
+		unsigned int size = ctx->field_size ? ctx->field_size * 2 : 64;
+		struct drm_intel_decode_field *fields;
+
+		pos = realloc(ctx->field_pos, size * sizeof(*pos));
+		if (!pos)
+			return;
+		ctx->field_pos = pos;
+		fields = realloc(ctx->fields, size * sizeof(*fields));
+		if (!fields)
+			return;
+		ctx->fields = fields;
+		ctx->field_size = size;
+	}
+
+	pos = &ctx->field_pos[ctx->field_count++];
+	pos->offset = ctx->hw_offset + index * 4;
+	pos->value = ctx->data[index];
+	pos->line = line;
+	pos->start = ctx->buf_len;
+}
+
+/**
+ * Hands the output for the packet at hw_offset, which starts at
+ * packet_start in buf, to the packet callback, or writes it out once
+ * enough has collected.
+ */
+static void
+decode_end_packet(struct drm_intel_decode *ctx, uint32_t hw_offset,
+		  uint32_t header, size_t packet_start)
+{
+	struct drm_intel_decode_packet packet;
+	unsigned int i, n = ctx->field_count;
+
+	if (ctx->packet_func) {
+		for (i = 0; i < n; i++) {
+			struct drm_intel_decode_field *field = &ctx->fields[i];
+			size_t end = i + 1 < n ?
+				ctx->field_pos[i + 1].line : ctx->buf_len;
+
+			field->offset = ctx->field_pos[i].offset;
+			field->value = ctx->field_pos[i].value;
+			field->text = ctx->buf + ctx->field_pos[i].start;
+			field->text_len = end - ctx->field_pos[i].start;
+		}
+
+		for (i = 0; n > 0 && i < sizeof(ctx->name) - 1 &&
+		     i < ctx->fields[0].text_len &&
+		     ctx->fields[0].text[i] != '\n'; i++)
+			ctx->name[i] = ctx->fields[0].text[i];
+		ctx->name[i] = '\0';
+
+		packet.offset = hw_offset;
+		packet.header = header;
+		packet.name = ctx->name;
+		packet.fields = ctx->fields;
+		packet.field_count = n;
+		packet.text = ctx->buf + packet_start;
+		packet.text_len = ctx->buf_len - packet_start;
+		ctx->packet_func(ctx->packet_closure, &packet);
+
+		ctx->field_count = 0;
+		ctx->buf_len = 0;
+	} else if (ctx->out && ctx->buf_len >= DECODE_FLUSH_SIZE) {
+		fwrite(ctx->buf, 1, ctx->buf_len, ctx->out);
+		ctx->buf_len = 0;
+	}
+}
+
 static void DRM_PRINTFLIKE(3, 4)
 instr_out(struct drm_intel_decode *ctx, unsigned int index,
 	  const char *fmt, ...)
@@ -117,26 +374,34 @@ instr_out(struct drm_intel_decode *ctx, unsigned int index,
 	va_list va;
 	const char *parseinfo;
 	uint32_t offset = ctx->hw_offset + index * 4;
+	size_t line = ctx->buf_len;
 
 	if (index > ctx->count) {
 		if (!ctx->overflowed) {
-			fprintf(out, "ERROR: Decode attempted to continue beyond end of batchbuffer\n");
+			decode_out(ctx, "ERROR: Decode attempted to continue beyond end of batchbuffer\n");
 			ctx->overflowed = true;
 		}
 		return;
 	}
+	if (ctx->quiet)
+		return;
 
-	if (offset == head_offset)
+	if (offset == ctx->head)
 		parseinfo = "HEAD";
-	else if (offset == tail_offset)
+	else if (offset == ctx->tail)
 		parseinfo = "TAIL";
 	else
 		parseinfo = "    ";
 
-	fprintf(out, "0x%08x: %s 0x%08x: %s", offset, parseinfo,
+	decode_out(ctx, "0x%08x: %s 0x%08x: %s", offset, parseinfo,
 		ctx->data[index], index == 0 ? "" : "   ");
+	if (index == 0 && ctx->stat_naming &&
+	    ctx->stat_name_pos == (size_t)-1)
+		ctx->stat_name_pos = ctx->buf_len;
+	if (ctx->packet_func)
+		decode_add_field(ctx, index, line);
 	va_start(va, fmt);
-	vfprintf(out, fmt, va);
+	decode_vout(ctx, fmt, va);
 	va_end(va);
 }
 
@@ -224,72 +489,63 @@ decode_MI_WAIT_FOR_EVENT(struct drm_intel_decode *ctx)
 	return 1;
 }
 
+static const struct decode_opcode opcodes_mi[] = {
+	{ 0x08, 0, 1, 1, "MI_ARB_ON_OFF" },
+	{ 0x0a, 0, 1, 1, "MI_BATCH_BUFFER_END" },
+	{ 0x30, 0x3f, 3, 3, "MI_BATCH_BUFFER" },
+	{ 0x31, 0x3f, 2, 2, "MI_BATCH_BUFFER_START" },
+	{ 0x14, 0x3f, 3, 3, "MI_DISPLAY_BUFFER_INFO" },
+	{ 0x04, 0, 1, 1, "MI_FLUSH" },
+	{ 0x22, 0x1f, 3, 3, "MI_LOAD_REGISTER_IMM" },
+	{ 0x13, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_EXCL" },
+	{ 0x12, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_INCL" },
+	{ 0x00, 0, 1, 1, "MI_NOOP" },
+	{ 0x11, 0x3f, 2, 2, "MI_OVERLAY_FLIP" },
+	{ 0x07, 0, 1, 1, "MI_REPORT_HEAD" },
+	{ 0x18, 0x3f, 2, 2, "MI_SET_CONTEXT", 0, decode_MI_SET_CONTEXT },
+	{ 0x20, 0x3f, 3, 4, "MI_STORE_DATA_IMM" },
+	{ 0x21, 0x3f, 3, 4, "MI_STORE_DATA_INDEX" },
+	{ 0x24, 0x3f, 3, 3, "MI_STORE_REGISTER_MEM" },
+	{ 0x02, 0, 1, 1, "MI_USER_INTERRUPT" },
+	{ 0x03, 0, 1, 1, "MI_WAIT_FOR_EVENT", 0, decode_MI_WAIT_FOR_EVENT },
+	{ 0x16, 0x7f, 3, 3, "MI_SEMAPHORE_MBOX" },
+	{ 0x26, 0x1f, 3, 4, "MI_FLUSH_DW" },
+	{ 0x28, 0x3f, 3, 3, "MI_REPORT_PERF_COUNT" },
+	{ 0x29, 0xff, 3, 3, "MI_LOAD_REGISTER_MEM" },
+	{ 0x0b, 0, 1, 1, "MI_SUSPEND_FLUSH" },
+};
+
 static int
 decode_mi(struct drm_intel_decode *ctx)
 {
 	unsigned int opcode, len = -1;
 	const char *post_sync_op = "";
 	uint32_t *data = ctx->data;
+	const struct decode_opcode *opcode_mi;
 
-	struct {
-		uint32_t opcode;
-		int len_mask;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-		int (*func)(struct drm_intel_decode *ctx);
-	} opcodes_mi[] = {
-		{ 0x08, 0, 1, 1, "MI_ARB_ON_OFF" },
-		{ 0x0a, 0, 1, 1, "MI_BATCH_BUFFER_END" },
-		{ 0x30, 0x3f, 3, 3, "MI_BATCH_BUFFER" },
-		{ 0x31, 0x3f, 2, 2, "MI_BATCH_BUFFER_START" },
-		{ 0x14, 0x3f, 3, 3, "MI_DISPLAY_BUFFER_INFO" },
-		{ 0x04, 0, 1, 1, "MI_FLUSH" },
-		{ 0x22, 0x1f, 3, 3, "MI_LOAD_REGISTER_IMM" },
-		{ 0x13, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_EXCL" },
-		{ 0x12, 0x3f, 2, 2, "MI_LOAD_SCAN_LINES_INCL" },
-		{ 0x00, 0, 1, 1, "MI_NOOP" },
-		{ 0x11, 0x3f, 2, 2, "MI_OVERLAY_FLIP" },
-		{ 0x07, 0, 1, 1, "MI_REPORT_HEAD" },
-		{ 0x18, 0x3f, 2, 2, "MI_SET_CONTEXT", decode_MI_SET_CONTEXT },
-		{ 0x20, 0x3f, 3, 4, "MI_STORE_DATA_IMM" },
-		{ 0x21, 0x3f, 3, 4, "MI_STORE_DATA_INDEX" },
-		{ 0x24, 0x3f, 3, 3, "MI_STORE_REGISTER_MEM" },
-		{ 0x02, 0, 1, 1, "MI_USER_INTERRUPT" },
-		{ 0x03, 0, 1, 1, "MI_WAIT_FOR_EVENT", decode_MI_WAIT_FOR_EVENT },
-		{ 0x16, 0x7f, 3, 3, "MI_SEMAPHORE_MBOX" },
-		{ 0x26, 0x1f, 3, 4, "MI_FLUSH_DW" },
-		{ 0x28, 0x3f, 3, 3, "MI_REPORT_PERF_COUNT" },
-		{ 0x29, 0xff, 3, 3, "MI_LOAD_REGISTER_MEM" },
-		{ 0x0b, 0, 1, 1, "MI_SUSPEND_FLUSH"},
-	}, *opcode_mi = NULL;
+	opcode = (data[0] & 0x1f800000) >> 23;
+	opcode_mi = decode_lookup_opcode(ctx->index_mi, opcodes_mi, opcode);
 
 	/* check instruction length */
-	for (opcode = 0; opcode < sizeof(opcodes_mi) / sizeof(opcodes_mi[0]);
-	     opcode++) {
-		if ((data[0] & 0x1f800000) >> 23 == opcodes_mi[opcode].opcode) {
-			len = 1;
-			if (opcodes_mi[opcode].max_len > 1) {
-				len =
-				    (data[0] & opcodes_mi[opcode].len_mask) + 2;
-				if (len < opcodes_mi[opcode].min_len
-				    || len > opcodes_mi[opcode].max_len) {
-					fprintf(out,
-						"Bad length (%d) in %s, [%d, %d]\n",
-						len, opcodes_mi[opcode].name,
-						opcodes_mi[opcode].min_len,
-						opcodes_mi[opcode].max_len);
-				}
+	if (opcode_mi) {
+		len = 1;
+		if (opcode_mi->max_len > 1) {
+			len = (data[0] & opcode_mi->len_mask) + 2;
+			if (len < opcode_mi->min_len ||
+			    len > opcode_mi->max_len) {
+				decode_out(ctx,
+					"Bad length (%d) in %s, [%d, %d]\n",
+					len, opcode_mi->name,
+					opcode_mi->min_len,
+					opcode_mi->max_len);
 			}
-			opcode_mi = &opcodes_mi[opcode];
-			break;
 		}
 	}
 
 	if (opcode_mi && opcode_mi->func)
 		return opcode_mi->func(ctx);
 
-	switch ((data[0] & 0x1f800000) >> 23) {
+	switch (opcode) {
 	case 0x0a:
 		instr_out(ctx, 0, "MI_BATCH_BUFFER_END\n");
 		return -1;
@@ -355,19 +611,15 @@ decode_mi(struct drm_intel_decode *ctx)
 		return len;
 	}
 
-	for (opcode = 0; opcode < sizeof(opcodes_mi) / sizeof(opcodes_mi[0]);
-	     opcode++) {
-		if ((data[0] & 0x1f800000) >> 23 == opcodes_mi[opcode].opcode) {
-			unsigned int i;
+	if (opcode_mi) {
+		unsigned int i;
 
-			instr_out(ctx, 0, "%s\n",
-				  opcodes_mi[opcode].name);
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
-			}
-
-			return len;
+		instr_out(ctx, 0, "%s\n", opcode_mi->name);
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+
+		return len;
 	}
 
 	instr_out(ctx, 0, "MI UNKNOWN\n");
@@ -418,44 +670,40 @@ decode_2d_br01(struct drm_intel_decode *ctx)
 
 }
 
+static const struct decode_opcode opcodes_2d[] = {
+	{ 0x40, 0xff, 5, 5, "COLOR_BLT" },
+	{ 0x43, 0xff, 6, 6, "SRC_COPY_BLT" },
+	{ 0x01, 0xff, 8, 8, "XY_SETUP_BLT" },
+	{ 0x11, 0xff, 9, 9, "XY_SETUP_MONO_PATTERN_SL_BLT" },
+	{ 0x03, 0xff, 3, 3, "XY_SETUP_CLIP_BLT" },
+	{ 0x24, 0xff, 2, 2, "XY_PIXEL_BLT" },
+	{ 0x25, 0xff, 3, 3, "XY_SCANLINES_BLT" },
+	{ 0x26, 0xff, 4, 4, "Y_TEXT_BLT" },
+	{ 0x31, 0xff, 5, 134, "XY_TEXT_IMMEDIATE_BLT" },
+	{ 0x50, 0xff, 6, 6, "XY_COLOR_BLT" },
+	{ 0x51, 0xff, 6, 6, "XY_PAT_BLT" },
+	{ 0x76, 0xff, 8, 8, "XY_PAT_CHROMA_BLT" },
+	{ 0x72, 0xff, 7, 135, "XY_PAT_BLT_IMMEDIATE" },
+	{ 0x77, 0xff, 9, 137, "XY_PAT_CHROMA_BLT_IMMEDIATE" },
+	{ 0x52, 0xff, 9, 9, "XY_MONO_PAT_BLT" },
+	{ 0x59, 0xff, 7, 7, "XY_MONO_PAT_FIXED_BLT" },
+	{ 0x53, 0xff, 8, 8, "XY_SRC_COPY_BLT" },
+	{ 0x54, 0xff, 8, 8, "XY_MONO_SRC_COPY_BLT" },
+	{ 0x71, 0xff, 9, 137, "XY_MONO_SRC_COPY_IMMEDIATE_BLT" },
+	{ 0x55, 0xff, 9, 9, "XY_FULL_BLT" },
+	{ 0x55, 0xff, 9, 137, "XY_FULL_IMMEDIATE_PATTERN_BLT" },
+	{ 0x56, 0xff, 9, 9, "XY_FULL_MONO_SRC_BLT" },
+	{ 0x75, 0xff, 10, 138, "XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT" },
+	{ 0x57, 0xff, 12, 12, "XY_FULL_MONO_PATTERN_BLT" },
+	{ 0x58, 0xff, 12, 12, "XY_FULL_MONO_PATTERN_MONO_SRC_BLT" },
+};
+
 static int
 decode_2d(struct drm_intel_decode *ctx)
 {
 	unsigned int opcode, len;
 	uint32_t *data = ctx->data;
-
-	struct {
-		uint32_t opcode;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-	} opcodes_2d[] = {
-		{ 0x40, 5, 5, "COLOR_BLT" },
-		{ 0x43, 6, 6, "SRC_COPY_BLT" },
-		{ 0x01, 8, 8, "XY_SETUP_BLT" },
-		{ 0x11, 9, 9, "XY_SETUP_MONO_PATTERN_SL_BLT" },
-		{ 0x03, 3, 3, "XY_SETUP_CLIP_BLT" },
-		{ 0x24, 2, 2, "XY_PIXEL_BLT" },
-		{ 0x25, 3, 3, "XY_SCANLINES_BLT" },
-		{ 0x26, 4, 4, "Y_TEXT_BLT" },
-		{ 0x31, 5, 134, "XY_TEXT_IMMEDIATE_BLT" },
-		{ 0x50, 6, 6, "XY_COLOR_BLT" },
-		{ 0x51, 6, 6, "XY_PAT_BLT" },
-		{ 0x76, 8, 8, "XY_PAT_CHROMA_BLT" },
-		{ 0x72, 7, 135, "XY_PAT_BLT_IMMEDIATE" },
-		{ 0x77, 9, 137, "XY_PAT_CHROMA_BLT_IMMEDIATE" },
-		{ 0x52, 9, 9, "XY_MONO_PAT_BLT" },
-		{ 0x59, 7, 7, "XY_MONO_PAT_FIXED_BLT" },
-		{ 0x53, 8, 8, "XY_SRC_COPY_BLT" },
-		{ 0x54, 8, 8, "XY_MONO_SRC_COPY_BLT" },
-		{ 0x71, 9, 137, "XY_MONO_SRC_COPY_IMMEDIATE_BLT" },
-		{ 0x55, 9, 9, "XY_FULL_BLT" },
-		{ 0x55, 9, 137, "XY_FULL_IMMEDIATE_PATTERN_BLT" },
-		{ 0x56, 9, 9, "XY_FULL_MONO_SRC_BLT" },
-		{ 0x75, 10, 138, "XY_FULL_MONO_SRC_IMMEDIATE_PATTERN_BLT" },
-		{ 0x57, 12, 12, "XY_FULL_MONO_PATTERN_BLT" },
-		{ 0x58, 12, 12, "XY_FULL_MONO_PATTERN_MONO_SRC_BLT"},
-	};
+	const struct decode_opcode *opcode_2d;
 
 	switch ((data[0] & 0x1fc00000) >> 22) {
 	case 0x25:
@@ -466,7 +714,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 3)
-			fprintf(out, "Bad count in XY_SCANLINES_BLT\n");
+			decode_out(ctx, "Bad count in XY_SCANLINES_BLT\n");
 
 		instr_out(ctx, 1, "dest (%d,%d)\n",
 			  data[1] & 0xffff, data[1] >> 16);
@@ -478,7 +726,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 8)
-			fprintf(out, "Bad count in XY_SETUP_BLT\n");
+			decode_out(ctx, "Bad count in XY_SETUP_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "cliprect (%d,%d)\n",
@@ -496,7 +744,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 3)
-			fprintf(out, "Bad count in XY_SETUP_CLIP_BLT\n");
+			decode_out(ctx, "Bad count in XY_SETUP_CLIP_BLT\n");
 
 		instr_out(ctx, 1, "cliprect (%d,%d)\n",
 			  data[1] & 0xffff, data[2] >> 16);
@@ -508,7 +756,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 9)
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in XY_SETUP_MONO_PATTERN_SL_BLT\n");
 
 		decode_2d_br01(ctx);
@@ -528,7 +776,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 6)
-			fprintf(out, "Bad count in XY_COLOR_BLT\n");
+			decode_out(ctx, "Bad count in XY_COLOR_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "(%d,%d)\n",
@@ -543,7 +791,7 @@ decode_2d(struct drm_intel_decode *ctx)
 
 		len = (data[0] & 0x000000ff) + 2;
 		if (len != 8)
-			fprintf(out, "Bad count in XY_SRC_COPY_BLT\n");
+			decode_out(ctx, "Bad count in XY_SRC_COPY_BLT\n");
 
 		decode_2d_br01(ctx);
 		instr_out(ctx, 2, "dst (%d,%d)\n",
@@ -559,29 +807,27 @@ decode_2d(struct drm_intel_decode *ctx)
 		return len;
 	}
 
-	for (opcode = 0; opcode < sizeof(opcodes_2d) / sizeof(opcodes_2d[0]);
-	     opcode++) {
-		if ((data[0] & 0x1fc00000) >> 22 == opcodes_2d[opcode].opcode) {
-			unsigned int i;
-
-			len = 1;
-			instr_out(ctx, 0, "%s\n",
-				  opcodes_2d[opcode].name);
-			if (opcodes_2d[opcode].max_len > 1) {
-				len = (data[0] & 0x000000ff) + 2;
-				if (len < opcodes_2d[opcode].min_len ||
-				    len > opcodes_2d[opcode].max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcodes_2d[opcode].name);
-				}
-			}
-
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
+	opcode = (data[0] & 0x1fc00000) >> 22;
+	opcode_2d = decode_lookup_opcode(ctx->index_2d, opcodes_2d, opcode);
+	if (opcode_2d) {
+		unsigned int i;
+
+		len = 1;
+		instr_out(ctx, 0, "%s\n", opcode_2d->name);
+		if (opcode_2d->max_len > 1) {
+			len = (data[0] & opcode_2d->len_mask) + 2;
+			if (len < opcode_2d->min_len ||
+			    len > opcode_2d->max_len) {
+				decode_out(ctx, "Bad count in %s\n",
+					opcode_2d->name);
 			}
+		}
 
-			return len;
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+
+		return len;
 	}
 
 	instr_out(ctx, 0, "2D UNKNOWN\n");
@@ -623,9 +869,10 @@ decode_3d_1c(struct drm_intel_decode *ctx)
 
 /** Sets the string dstname to describe the destination of the PS instruction */
 static void
-i915_get_instruction_dst(uint32_t *data, int i, char *dstname, int do_mask)
+i915_get_instruction_dst(struct drm_intel_decode *ctx, int i, char *dstname,
+			 int do_mask)
 {
-	uint32_t a0 = data[i];
+	uint32_t a0 = ctx->data[i];
 	int dst_nr = (a0 >> 14) & 0xf;
 	char dstmask[8];
 	const char *sat;
@@ -660,22 +907,22 @@ i915_get_instruction_dst(uint32_t *data, int i, char *dstname, int do_mask)
 	switch ((a0 >> 19) & 0x7) {
 	case 0:
 		if (dst_nr > 15)
-			fprintf(out, "bad destination reg R%d\n", dst_nr);
+			decode_out(ctx, "bad destination reg R%d\n", dst_nr);
 		sprintf(dstname, "R%d%s%s", dst_nr, dstmask, sat);
 		break;
 	case 4:
 		if (dst_nr > 0)
-			fprintf(out, "bad destination reg oC%d\n", dst_nr);
+			decode_out(ctx, "bad destination reg oC%d\n", dst_nr);
 		sprintf(dstname, "oC%s%s", dstmask, sat);
 		break;
 	case 5:
 		if (dst_nr > 0)
-			fprintf(out, "bad destination reg oD%d\n", dst_nr);
+			decode_out(ctx, "bad destination reg oD%d\n", dst_nr);
 		sprintf(dstname, "oD%s%s", dstmask, sat);
 		break;
 	case 6:
 		if (dst_nr > 3)
-			fprintf(out, "bad destination reg U%d\n", dst_nr);
+			decode_out(ctx, "bad destination reg U%d\n", dst_nr);
 		sprintf(dstname, "U%d%s%s", dst_nr, dstmask, sat);
 		break;
 	default:
@@ -706,13 +953,14 @@ i915_get_channel_swizzle(uint32_t select)
 }
 
 static void
-i915_get_instruction_src_name(uint32_t src_type, uint32_t src_nr, char *name)
+i915_get_instruction_src_name(struct drm_intel_decode *ctx,
+			      uint32_t src_type, uint32_t src_nr, char *name)
 {
 	switch (src_type) {
 	case 0:
 		sprintf(name, "R%d", src_nr);
 		if (src_nr > 15)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_out(ctx, "bad src reg %s\n", name);
 		break;
 	case 1:
 		if (src_nr < 8)
@@ -724,41 +972,42 @@ i915_get_instruction_src_name(uint32_t src_type, uint32_t src_nr, char *name)
 		else if (src_nr == 10)
 			sprintf(name, "FOG");
 		else {
-			fprintf(out, "bad src reg T%d\n", src_nr);
+			decode_out(ctx, "bad src reg T%d\n", src_nr);
 			sprintf(name, "RESERVED");
 		}
 		break;
 	case 2:
 		sprintf(name, "C%d", src_nr);
 		if (src_nr > 31)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_out(ctx, "bad src reg %s\n", name);
 		break;
 	case 4:
 		sprintf(name, "oC");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oC%d\n", src_nr);
+			decode_out(ctx, "bad src reg oC%d\n", src_nr);
 		break;
 	case 5:
 		sprintf(name, "oD");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oD%d\n", src_nr);
+			decode_out(ctx, "bad src reg oD%d\n", src_nr);
 		break;
 	case 6:
 		sprintf(name, "U%d", src_nr);
 		if (src_nr > 3)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_out(ctx, "bad src reg %s\n", name);
 		break;
 	default:
-		fprintf(out, "bad src reg type %d\n", src_type);
+		decode_out(ctx, "bad src reg type %d\n", src_type);
 		sprintf(name, "RESERVED");
 		break;
 	}
 }
 
-static void i915_get_instruction_src0(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src0(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a0 = data[i];
-	uint32_t a1 = data[i + 1];
+	uint32_t a0 = ctx->data[i];
+	uint32_t a1 = ctx->data[i + 1];
 	int src_nr = (a0 >> 2) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a1 >> 28) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a1 >> 24) & 0xf);
@@ -766,17 +1015,18 @@ static void i915_get_instruction_src0(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a1 >> 16) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a0 >> 7) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a0 >> 7) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
 		strcat(srcname, swizzle);
 }
 
-static void i915_get_instruction_src1(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src1(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a1 = data[i + 1];
-	uint32_t a2 = data[i + 2];
+	uint32_t a1 = ctx->data[i + 1];
+	uint32_t a2 = ctx->data[i + 2];
 	int src_nr = (a1 >> 8) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a1 >> 4) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a1 >> 0) & 0xf);
@@ -784,16 +1034,17 @@ static void i915_get_instruction_src1(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a2 >> 24) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a1 >> 13) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a1 >> 13) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
 		strcat(srcname, swizzle);
 }
 
-static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
+static void i915_get_instruction_src2(struct drm_intel_decode *ctx, int i,
+				      char *srcname)
 {
-	uint32_t a2 = data[i + 2];
+	uint32_t a2 = ctx->data[i + 2];
 	int src_nr = (a2 >> 16) & 0x1f;
 	const char *swizzle_x = i915_get_channel_swizzle((a2 >> 12) & 0xf);
 	const char *swizzle_y = i915_get_channel_swizzle((a2 >> 8) & 0xf);
@@ -801,7 +1052,7 @@ static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
 	const char *swizzle_w = i915_get_channel_swizzle((a2 >> 0) & 0xf);
 	char swizzle[100];
 
-	i915_get_instruction_src_name((a2 >> 21) & 0x7, src_nr, srcname);
+	i915_get_instruction_src_name(ctx, (a2 >> 21) & 0x7, src_nr, srcname);
 	sprintf(swizzle, ".%s%s%s%s", swizzle_x, swizzle_y, swizzle_z,
 		swizzle_w);
 	if (strcmp(swizzle, ".xyzw") != 0)
@@ -809,13 +1060,14 @@ static void i915_get_instruction_src2(uint32_t *data, int i, char *srcname)
 }
 
 static void
-i915_get_instruction_addr(uint32_t src_type, uint32_t src_nr, char *name)
+i915_get_instruction_addr(struct drm_intel_decode *ctx,
+			  uint32_t src_type, uint32_t src_nr, char *name)
 {
 	switch (src_type) {
 	case 0:
 		sprintf(name, "R%d", src_nr);
 		if (src_nr > 15)
-			fprintf(out, "bad src reg %s\n", name);
+			decode_out(ctx, "bad src reg %s\n", name);
 		break;
 	case 1:
 		if (src_nr < 8)
@@ -827,22 +1079,22 @@ i915_get_instruction_addr(uint32_t src_type, uint32_t src_nr, char *name)
 		else if (src_nr == 10)
 			sprintf(name, "FOG");
 		else {
-			fprintf(out, "bad src reg T%d\n", src_nr);
+			decode_out(ctx, "bad src reg T%d\n", src_nr);
 			sprintf(name, "RESERVED");
 		}
 		break;
 	case 4:
 		sprintf(name, "oC");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oC%d\n", src_nr);
+			decode_out(ctx, "bad src reg oC%d\n", src_nr);
 		break;
 	case 5:
 		sprintf(name, "oD");
 		if (src_nr > 0)
-			fprintf(out, "bad src reg oD%d\n", src_nr);
+			decode_out(ctx, "bad src reg oD%d\n", src_nr);
 		break;
 	default:
-		fprintf(out, "bad src reg type %d\n", src_type);
+		decode_out(ctx, "bad src reg type %d\n", src_type);
 		sprintf(name, "RESERVED");
 		break;
 	}
@@ -854,8 +1106,8 @@ i915_decode_alu1(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
 
 	instr_out(ctx, i++, "%s: %s %s, %s\n", instr_prefix,
 		  op_name, dst, src0);
@@ -869,9 +1121,9 @@ i915_decode_alu2(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100], src1[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
-	i915_get_instruction_src1(ctx->data, i, src1);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
+	i915_get_instruction_src1(ctx, i, src1);
 
 	instr_out(ctx, i++, "%s: %s %s, %s, %s\n", instr_prefix,
 		  op_name, dst, src0, src1);
@@ -885,10 +1137,10 @@ i915_decode_alu3(struct drm_intel_decode *ctx,
 {
 	char dst[100], src0[100], src1[100], src2[100];
 
-	i915_get_instruction_dst(ctx->data, i, dst, 1);
-	i915_get_instruction_src0(ctx->data, i, src0);
-	i915_get_instruction_src1(ctx->data, i, src1);
-	i915_get_instruction_src2(ctx->data, i, src2);
+	i915_get_instruction_dst(ctx, i, dst, 1);
+	i915_get_instruction_src0(ctx, i, src0);
+	i915_get_instruction_src1(ctx, i, src1);
+	i915_get_instruction_src2(ctx, i, src2);
 
 	instr_out(ctx, i++, "%s: %s %s, %s, %s, %s\n", instr_prefix,
 		  op_name, dst, src0, src1, src2);
@@ -906,8 +1158,8 @@ i915_decode_tex(struct drm_intel_decode *ctx, int i,
 	char addr_name[100];
 	int sampler_nr;
 
-	i915_get_instruction_dst(ctx->data, i, dst_name, 0);
-	i915_get_instruction_addr((t1 >> 24) & 0x7,
+	i915_get_instruction_dst(ctx, i, dst_name, 0);
+	i915_get_instruction_addr(ctx, (t1 >> 24) & 0x7,
 				  (t1 >> 17) & 0xf, addr_name);
 	sampler_nr = t0 & 0xf;
 
@@ -933,30 +1185,30 @@ i915_decode_dcl(struct drm_intel_decode *ctx, int i, char *instr_prefix)
 	case 1:
 		sprintf(dcl_mask, ".%s%s%s%s", dcl_x, dcl_y, dcl_z, dcl_w);
 		if (strcmp(dcl_mask, ".") == 0)
-			fprintf(out, "bad (empty) dcl mask\n");
+			decode_out(ctx, "bad (empty) dcl mask\n");
 
 		if (dcl_nr > 10)
-			fprintf(out, "bad T%d dcl register number\n", dcl_nr);
+			decode_out(ctx, "bad T%d dcl register number\n", dcl_nr);
 		if (dcl_nr < 8) {
 			if (strcmp(dcl_mask, ".x") != 0 &&
 			    strcmp(dcl_mask, ".xy") != 0 &&
 			    strcmp(dcl_mask, ".xz") != 0 &&
 			    strcmp(dcl_mask, ".w") != 0 &&
 			    strcmp(dcl_mask, ".xyzw") != 0) {
-				fprintf(out, "bad T%d.%s dcl mask\n", dcl_nr,
+				decode_out(ctx, "bad T%d.%s dcl mask\n", dcl_nr,
 					dcl_mask);
 			}
 			instr_out(ctx, i++, "%s: DCL T%d%s\n",
 				  instr_prefix, dcl_nr, dcl_mask);
 		} else {
 			if (strcmp(dcl_mask, ".xz") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
+				decode_out(ctx, "errataed bad dcl mask %s\n",
 					dcl_mask);
 			else if (strcmp(dcl_mask, ".xw") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
+				decode_out(ctx, "errataed bad dcl mask %s\n",
 					dcl_mask);
 			else if (strcmp(dcl_mask, ".xzw") == 0)
-				fprintf(out, "errataed bad dcl mask %s\n",
+				decode_out(ctx, "errataed bad dcl mask %s\n",
 					dcl_mask);
 
 			if (dcl_nr == 8) {
@@ -992,7 +1244,7 @@ i915_decode_dcl(struct drm_intel_decode *ctx, int i, char *instr_prefix)
 			break;
 		}
 		if (dcl_nr > 15)
-			fprintf(out, "bad S%d dcl register number\n", dcl_nr);
+			decode_out(ctx, "bad S%d dcl register number\n", dcl_nr);
 		instr_out(ctx, i++, "%s: DCL S%d %s\n",
 			  instr_prefix, dcl_nr, sampletype);
 		instr_out(ctx, i++, "%s\n", instr_prefix);
@@ -1266,39 +1518,34 @@ decode_sample_filter(uint32_t mode)
 	return "";
 }
 
+static const struct decode_opcode opcodes_3d_1d[] = {
+	{ 0x86, 0xffff, 4, 4, "3DSTATE_CHROMA_KEY" },
+	{ 0x88, 0xffff, 2, 2, "3DSTATE_CONSTANT_BLEND_COLOR" },
+	{ 0x99, 0xffff, 2, 2, "3DSTATE_DEFAULT_DIFFUSE" },
+	{ 0x9a, 0xffff, 2, 2, "3DSTATE_DEFAULT_SPECULAR" },
+	{ 0x98, 0xffff, 2, 2, "3DSTATE_DEFAULT_Z" },
+	{ 0x97, 0xffff, 2, 2, "3DSTATE_DEPTH_OFFSET_SCALE" },
+	{ 0x9d, 0xffff, 65, 65, "3DSTATE_FILTER_COEFFICIENTS_4X4" },
+	{ 0x9e, 0xffff, 4, 4, "3DSTATE_MONO_FILTER" },
+	{ 0x89, 0xffff, 4, 4, "3DSTATE_FOG_MODE" },
+	{ 0x8f, 0xffff, 2, 16, "3DSTATE_MAP_PALLETE_LOAD_32" },
+	{ 0x83, 0xffff, 2, 2, "3DSTATE_SPAN_STIPPLE" },
+	{ 0x8c, 0xffff, 2, 2, "3DSTATE_MAP_COORD_TRANSFORM_I830", 2 },
+	{ 0x8b, 0xffff, 2, 2, "3DSTATE_MAP_VERTEX_TRANSFORM_I830", 2 },
+	{ 0x8d, 0xffff, 3, 3, "3DSTATE_W_STATE_I830", 2 },
+	{ 0x01, 0xffff, 2, 2, "3DSTATE_COLOR_FACTOR_I830", 2 },
+	{ 0x02, 0xffff, 2, 2, "3DSTATE_MAP_COORD_SETBIND_I830", 2 },
+};
+
 static int
 decode_3d_1d(struct drm_intel_decode *ctx)
 {
-	unsigned int len, i, c, idx, word, map, sampler, instr;
+	unsigned int len, i, c, word, map, sampler, instr;
 	const char *format, *zformat, *type;
 	uint32_t opcode;
 	uint32_t *data = ctx->data;
 	uint32_t devid = ctx->devid;
-
-	struct {
-		uint32_t opcode;
-		int i830_only;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-	} opcodes_3d_1d[] = {
-		{ 0x86, 0, 4, 4, "3DSTATE_CHROMA_KEY" },
-		{ 0x88, 0, 2, 2, "3DSTATE_CONSTANT_BLEND_COLOR" },
-		{ 0x99, 0, 2, 2, "3DSTATE_DEFAULT_DIFFUSE" },
-		{ 0x9a, 0, 2, 2, "3DSTATE_DEFAULT_SPECULAR" },
-		{ 0x98, 0, 2, 2, "3DSTATE_DEFAULT_Z" },
-		{ 0x97, 0, 2, 2, "3DSTATE_DEPTH_OFFSET_SCALE" },
-		{ 0x9d, 0, 65, 65, "3DSTATE_FILTER_COEFFICIENTS_4X4" },
-		{ 0x9e, 0, 4, 4, "3DSTATE_MONO_FILTER" },
-		{ 0x89, 0, 4, 4, "3DSTATE_FOG_MODE" },
-		{ 0x8f, 0, 2, 16, "3DSTATE_MAP_PALLETE_LOAD_32" },
-		{ 0x83, 0, 2, 2, "3DSTATE_SPAN_STIPPLE" },
-		{ 0x8c, 1, 2, 2, "3DSTATE_MAP_COORD_TRANSFORM_I830" },
-		{ 0x8b, 1, 2, 2, "3DSTATE_MAP_VERTEX_TRANSFORM_I830" },
-		{ 0x8d, 1, 3, 3, "3DSTATE_W_STATE_I830" },
-		{ 0x01, 1, 2, 2, "3DSTATE_COLOR_FACTOR_I830" },
-		{ 0x02, 1, 2, 2, "3DSTATE_MAP_COORD_SETBIND_I830"},
-	}, *opcode_3d_1d;
+	const struct decode_opcode *opcode_3d_1d;
 
 	opcode = (data[0] & 0x00ff0000) >> 16;
 
@@ -1337,7 +1584,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			instr_out(ctx, i++, "PSC.1\n");
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_LOAD_INDIRECT\n");
+			decode_out(ctx, "Bad count in 3DSTATE_LOAD_INDIRECT\n");
 			return len;
 		}
 		return len;
@@ -1353,12 +1600,12 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 					int tex_num;
 
 					if (word == 2) {
-						saved_s2_set = 1;
-						saved_s2 = data[i];
+						ctx->saved_s2_set = 1;
+						ctx->saved_s2 = data[i];
 					}
 					if (word == 4) {
-						saved_s4_set = 1;
-						saved_s4 = data[i];
+						ctx->saved_s4_set = 1;
+						ctx->saved_s4 = data[i];
 					}
 
 					switch (word) {
@@ -1387,43 +1634,43 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 								 tex_num *
 								 4) & 0xf) {
 							case 0:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=2D ",
 									tex_num);
 								break;
 							case 1:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=3D ",
 									tex_num);
 								break;
 							case 2:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=4D ",
 									tex_num);
 								break;
 							case 3:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=1D ",
 									tex_num);
 								break;
 							case 4:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=2D_16 ",
 									tex_num);
 								break;
 							case 5:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=4D_16 ",
 									tex_num);
 								break;
 							case 0xf:
-								fprintf(out,
+								decode_out(ctx,
 									"%i=NP ",
 									tex_num);
 								break;
 							}
 						}
-						fprintf(out, "\n");
+						decode_out(ctx, "\n");
 
 						break;
 					case 3:
@@ -1724,7 +1971,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_1\n");
 		}
 		return len;
@@ -1774,7 +2021,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_LOAD_STATE_IMMEDIATE_2\n");
 		}
 		return len;
@@ -1976,7 +2223,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_MAP_STATE\n");
+			decode_out(ctx, "Bad count in 3DSTATE_MAP_STATE\n");
 			return len;
 		}
 		return len;
@@ -2003,7 +2250,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_PIXEL_SHADER_CONSTANTS\n");
 		}
 		return len;
@@ -2011,7 +2258,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		instr_out(ctx, 0, "3DSTATE_PIXEL_SHADER_PROGRAM\n");
 		len = (data[0] & 0x000000ff) + 2;
 		if ((len - 1) % 3 != 0 || len > 370) {
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_PIXEL_SHADER_PROGRAM\n");
 		}
 		i = 1;
@@ -2089,14 +2336,14 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 			}
 		}
 		if (len != i) {
-			fprintf(out, "Bad count in 3DSTATE_SAMPLER_STATE\n");
+			decode_out(ctx, "Bad count in 3DSTATE_SAMPLER_STATE\n");
 		}
 		return len;
 	case 0x85:
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 2)
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_DEST_BUFFER_VARIABLES\n");
 
 		instr_out(ctx, 0,
@@ -2166,7 +2413,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 
 			len = (data[0] & 0x0000000f) + 2;
 			if (len != 3)
-				fprintf(out,
+				decode_out(ctx,
 					"Bad count in 3DSTATE_BUFFER_INFO\n");
 
 			switch ((data[1] >> 24) & 0x7) {
@@ -2199,7 +2446,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 3)
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_SCISSOR_RECTANGLE\n");
 
 		instr_out(ctx, 0, "3DSTATE_SCISSOR_RECTANGLE\n");
@@ -2213,7 +2460,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 5)
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_DRAWING_RECTANGLE\n");
 
 		instr_out(ctx, 0, "3DSTATE_DRAWING_RECTANGLE\n");
@@ -2231,7 +2478,7 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		len = (data[0] & 0x0000000f) + 2;
 
 		if (len != 7)
-			fprintf(out, "Bad count in 3DSTATE_CLEAR_PARAMETERS\n");
+			decode_out(ctx, "Bad count in 3DSTATE_CLEAR_PARAMETERS\n");
 
 		instr_out(ctx, 0, "3DSTATE_CLEAR_PARAMETERS\n");
 		instr_out(ctx, 1, "prim_type=%s, clear=%s%s%s\n",
@@ -2248,31 +2495,26 @@ decode_3d_1d(struct drm_intel_decode *ctx)
 		return len;
 	}
 
-	for (idx = 0; idx < ARRAY_SIZE(opcodes_3d_1d); idx++) {
-		opcode_3d_1d = &opcodes_3d_1d[idx];
-		if (opcode_3d_1d->i830_only && !IS_GEN2(devid))
-			continue;
-
-		if (((data[0] & 0x00ff0000) >> 16) == opcode_3d_1d->opcode) {
-			len = 1;
-
-			instr_out(ctx, 0, "%s\n",
-				  opcode_3d_1d->name);
-			if (opcode_3d_1d->max_len > 1) {
-				len = (data[0] & 0x0000ffff) + 2;
-				if (len < opcode_3d_1d->min_len ||
-				    len > opcode_3d_1d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d_1d->name);
-				}
-			}
-
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
+	opcode_3d_1d = decode_lookup_opcode(ctx->index_3d_1d, opcodes_3d_1d,
+					    opcode);
+	if (opcode_3d_1d) {
+		len = 1;
+
+		instr_out(ctx, 0, "%s\n", opcode_3d_1d->name);
+		if (opcode_3d_1d->max_len > 1) {
+			len = (data[0] & opcode_3d_1d->len_mask) + 2;
+			if (len < opcode_3d_1d->min_len ||
+			    len > opcode_3d_1d->max_len) {
+				decode_out(ctx, "Bad count in %s\n",
+					opcode_3d_1d->name);
 			}
+		}
 
-			return len;
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+
+		return len;
 	}
 
 	instr_out(ctx, 0, "3D UNKNOWN: 3d_1d opcode = 0x%x\n",
@@ -2288,8 +2530,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 	char immediate = (data[0] & (1 << 23)) == 0;
 	unsigned int len, i, j, ret;
 	const char *primtype;
-	int original_s2 = saved_s2;
-	int original_s4 = saved_s4;
+	int original_s2 = ctx->saved_s2;
+	int original_s4 = ctx->saved_s4;
 
 	switch ((data[0] >> 18) & 0xf) {
 	case 0x0:
@@ -2324,8 +2566,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 		break;
 	case 0xa:
 		primtype = "CLEAR_RECT";
-		saved_s4 = 3 << 6;
-		saved_s2 = ~0;
+		ctx->saved_s4 = 3 << 6;
+		ctx->saved_s2 = ~0;
 		break;
 	default:
 		primtype = "unknown";
@@ -2339,8 +2581,8 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 			  primtype);
 		if (count < len)
 			BUFFER_FAIL(count, len, "3DPRIMITIVE inline");
-		if (!saved_s2_set || !saved_s4_set) {
-			fprintf(out, "unknown vertex format\n");
+		if (!ctx->saved_s2_set || !ctx->saved_s4_set) {
+			decode_out(ctx, "unknown vertex format\n");
 			for (i = 1; i < len; i++) {
 				instr_out(ctx, i,
 					  "           vertex data (%f float)\n",
@@ -2355,13 +2597,13 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
     if (i < len)							\
 	instr_out(ctx, i, " V%d."fmt"\n", vertex, __VA_ARGS__); \
     else								\
-	fprintf(out, " missing data in V%d\n", vertex);			\
+	decode_out(ctx, " missing data in V%d\n", vertex);			\
     i++;								\
 } while (0)
 
 				VERTEX_OUT("X = %f", int_as_float(data[i]));
 				VERTEX_OUT("Y = %f", int_as_float(data[i]));
-				switch (saved_s4 >> 6 & 0x7) {
+				switch (ctx->saved_s4 >> 6 & 0x7) {
 				case 0x1:
 					VERTEX_OUT("Z = %f",
 						   int_as_float(data[i]));
@@ -2379,10 +2621,10 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 						   int_as_float(data[i]));
 					break;
 				default:
-					fprintf(out, "bad S4 position mask\n");
+					decode_out(ctx, "bad S4 position mask\n");
 				}
 
-				if (saved_s4 & (1 << 10)) {
+				if (ctx->saved_s4 & (1 << 10)) {
 					VERTEX_OUT
 					    ("color = (A=0x%02x, R=0x%02x, G=0x%02x, "
 					     "B=0x%02x)", data[i] >> 24,
@@ -2390,7 +2632,7 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					     (data[i] >> 8) & 0xff,
 					     data[i] & 0xff);
 				}
-				if (saved_s4 & (1 << 11)) {
+				if (ctx->saved_s4 & (1 << 11)) {
 					VERTEX_OUT
 					    ("spec = (A=0x%02x, R=0x%02x, G=0x%02x, "
 					     "B=0x%02x)", data[i] >> 24,
@@ -2398,11 +2640,11 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					     (data[i] >> 8) & 0xff,
 					     data[i] & 0xff);
 				}
-				if (saved_s4 & (1 << 12))
+				if (ctx->saved_s4 & (1 << 12))
 					VERTEX_OUT("width = 0x%08x)", data[i]);
 
 				for (tc = 0; tc <= 7; tc++) {
-					switch ((saved_s2 >> (tc * 4)) & 0xf) {
+					switch ((ctx->saved_s2 >> (tc * 4)) & 0xf) {
 					case 0x0:
 						VERTEX_OUT("T%d.X = %f", tc,
 							   int_as_float(data
@@ -2457,7 +2699,7 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 					case 0xf:
 						break;
 					default:
-						fprintf(out,
+						decode_out(ctx,
 							"bad S2.T%d format\n",
 							tc);
 					}
@@ -2502,7 +2744,7 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 							  data[i] >> 16);
 					}
 				}
-				fprintf(out,
+				decode_out(ctx,
 					"3DPRIMITIVE: no terminator found in index buffer\n");
 				ret = count;
 				goto out;
@@ -2535,34 +2777,29 @@ decode_3d_primitive(struct drm_intel_decode *ctx)
 	}
 
 out:
-	saved_s2 = original_s2;
-	saved_s4 = original_s4;
+	ctx->saved_s2 = original_s2;
+	ctx->saved_s4 = original_s4;
 	return ret;
 }
 
+static const struct decode_opcode opcodes_3d_i915[] = {
+	{ 0x06, 0xff, 1, 1, "3DSTATE_ANTI_ALIASING" },
+	{ 0x08, 0xff, 1, 1, "3DSTATE_BACKFACE_STENCIL_OPS" },
+	{ 0x09, 0xff, 1, 1, "3DSTATE_BACKFACE_STENCIL_MASKS" },
+	{ 0x16, 0xff, 1, 1, "3DSTATE_COORD_SET_BINDINGS" },
+	{ 0x15, 0xff, 1, 1, "3DSTATE_FOG_COLOR" },
+	{ 0x0b, 0xff, 1, 1, "3DSTATE_INDEPENDENT_ALPHA_BLEND" },
+	{ 0x0d, 0xff, 1, 1, "3DSTATE_MODES_4" },
+	{ 0x0c, 0xff, 1, 1, "3DSTATE_MODES_5" },
+	{ 0x07, 0xff, 1, 1, "3DSTATE_RASTERIZATION_RULES" },
+};
+
 static int
 decode_3d(struct drm_intel_decode *ctx)
 {
 	uint32_t opcode;
-	unsigned int idx;
 	uint32_t *data = ctx->data;
-
-	struct {
-		uint32_t opcode;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-	} opcodes_3d[] = {
-		{ 0x06, 1, 1, "3DSTATE_ANTI_ALIASING" },
-		{ 0x08, 1, 1, "3DSTATE_BACKFACE_STENCIL_OPS" },
-		{ 0x09, 1, 1, "3DSTATE_BACKFACE_STENCIL_MASKS" },
-		{ 0x16, 1, 1, "3DSTATE_COORD_SET_BINDINGS" },
-		{ 0x15, 1, 1, "3DSTATE_FOG_COLOR" },
-		{ 0x0b, 1, 1, "3DSTATE_INDEPENDENT_ALPHA_BLEND" },
-		{ 0x0d, 1, 1, "3DSTATE_MODES_4" },
-		{ 0x0c, 1, 1, "3DSTATE_MODES_5" },
-		{ 0x07, 1, 1, "3DSTATE_RASTERIZATION_RULES"},
-	}, *opcode_3d;
+	const struct decode_opcode *opcode_3d;
 
 	opcode = (data[0] & 0x1f000000) >> 24;
 
@@ -2575,26 +2812,25 @@ decode_3d(struct drm_intel_decode *ctx)
 		return decode_3d_1c(ctx);
 	}
 
-	for (idx = 0; idx < ARRAY_SIZE(opcodes_3d); idx++) {
-		opcode_3d = &opcodes_3d[idx];
-		if (opcode == opcode_3d->opcode) {
-			unsigned int len = 1, i;
+	opcode_3d = decode_lookup_opcode(ctx->index_3d, opcodes_3d_i915,
+					 opcode);
+	if (opcode_3d) {
+		unsigned int len = 1, i;
 
-			instr_out(ctx, 0, "%s\n", opcode_3d->name);
-			if (opcode_3d->max_len > 1) {
-				len = (data[0] & 0xff) + 2;
-				if (len < opcode_3d->min_len ||
-				    len > opcode_3d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d->name);
-				}
+		instr_out(ctx, 0, "%s\n", opcode_3d->name);
+		if (opcode_3d->max_len > 1) {
+			len = (data[0] & opcode_3d->len_mask) + 2;
+			if (len < opcode_3d->min_len ||
+			    len > opcode_3d->max_len) {
+				decode_out(ctx, "Bad count in %s\n",
+					opcode_3d->name);
 			}
+		}
 
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
-			}
-			return len;
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+		return len;
 	}
 
 	instr_out(ctx, 0, "3D UNKNOWN: 3d opcode = 0x%x\n", opcode);
@@ -2727,7 +2963,7 @@ i965_decode_urb_fence(struct drm_intel_decode *ctx, int len)
 	uint32_t *data = ctx->data;
 
 	if (len != 3)
-		fprintf(out, "Bad count in URB_FENCE\n");
+		decode_out(ctx, "Bad count in URB_FENCE\n");
 
 	vs_fence = data[1] & 0x3ff;
 	gs_fence = (data[1] >> 10) & 0x3ff;
@@ -2750,13 +2986,13 @@ i965_decode_urb_fence(struct drm_intel_decode *ctx, int len)
 		  "sf fence: %d, vfe_fence: %d, cs_fence: %d\n",
 		  sf_fence, vfe_fence, cs_fence);
 	if (gs_fence < vs_fence)
-		fprintf(out, "gs fence < vs fence!\n");
+		decode_out(ctx, "gs fence < vs fence!\n");
 	if (clip_fence < gs_fence)
-		fprintf(out, "clip fence < gs fence!\n");
+		decode_out(ctx, "clip fence < gs fence!\n");
 	if (sf_fence < clip_fence)
-		fprintf(out, "sf fence < clip fence!\n");
+		decode_out(ctx, "sf fence < clip fence!\n");
 	if (cs_fence < sf_fence)
-		fprintf(out, "cs fence < sf fence!\n");
+		decode_out(ctx, "cs fence < sf fence!\n");
 
 	return len;
 }
@@ -3132,6 +3368,97 @@ gen7_3DPRIMITIVE(struct drm_intel_decode *ctx)
 	return 7;
 }
 
+static const struct decode_opcode opcodes_3d_965[] = {
+	{ 0x6000, 0x00ff, 3, 3, "URB_FENCE" },
+	{ 0x6001, 0xffff, 2, 2, "CS_URB_STATE" },
+	{ 0x6002, 0x00ff, 2, 2, "CONSTANT_BUFFER" },
+	{ 0x6101, 0xffff, 6, 10, "STATE_BASE_ADDRESS" },
+	{ 0x6102, 0xffff, 2, 2, "STATE_SIP" },
+	{ 0x6104, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
+	{ 0x680b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
+	{ 0x6904, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
+	{ 0x7800, 0xffff, 7, 7, "3DSTATE_PIPELINED_POINTERS" },
+	{ 0x7801, 0x00ff, 4, 6, "3DSTATE_BINDING_TABLE_POINTERS" },
+	{ 0x7802, 0x00ff, 4, 4, "3DSTATE_SAMPLER_STATE_POINTERS" },
+	{ 0x7805, 0x00ff, 7, 7, "3DSTATE_DEPTH_BUFFER", 7 },
+	{ 0x7805, 0x00ff, 3, 3, "3DSTATE_URB" },
+	{ 0x7804, 0x00ff, 3, 3, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x7806, 0x00ff, 3, 3, "3DSTATE_STENCIL_BUFFER" },
+	{ 0x790f, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 6 },
+	{ 0x7807, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 7, gen7_3DSTATE_HIER_DEPTH_BUFFER },
+	{ 0x7808, 0x00ff, 5, 257, "3DSTATE_VERTEX_BUFFERS" },
+	{ 0x7809, 0x00ff, 3, 256, "3DSTATE_VERTEX_ELEMENTS" },
+	{ 0x780a, 0x00ff, 3, 3, "3DSTATE_INDEX_BUFFER" },
+	{ 0x780b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
+	{ 0x780d, 0x00ff, 4, 4, "3DSTATE_VIEWPORT_STATE_POINTERS" },
+	{ 0x780e, 0xffff, 4, 4, NULL, 6, gen6_3DSTATE_CC_STATE_POINTERS },
+	{ 0x780e, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_CC_STATE_POINTERS },
+	{ 0x780f, 0x00ff, 2, 2, "3DSTATE_SCISSOR_POINTERS" },
+	{ 0x7810, 0x00ff, 6, 6, "3DSTATE_VS" },
+	{ 0x7811, 0x00ff, 7, 7, "3DSTATE_GS" },
+	{ 0x7812, 0x00ff, 4, 4, "3DSTATE_CLIP" },
+	{ 0x7813, 0x00ff, 20, 20, "3DSTATE_SF", 6 },
+	{ 0x7813, 0x00ff, 7, 7, "3DSTATE_SF", 7 },
+	{ 0x7814, 0x00ff, 3, 3, "3DSTATE_WM", 7, gen7_3DSTATE_WM },
+	{ 0x7814, 0x00ff, 9, 9, "3DSTATE_WM", 6, gen6_3DSTATE_WM },
+	{ 0x7815, 0x00ff, 5, 5, "3DSTATE_CONSTANT_VS_STATE", 6 },
+	{ 0x7815, 0x00ff, 7, 7, "3DSTATE_CONSTANT_VS", 7, gen7_3DSTATE_CONSTANT_VS },
+	{ 0x7816, 0x00ff, 5, 5, "3DSTATE_CONSTANT_GS_STATE", 6 },
+	{ 0x7816, 0x00ff, 7, 7, "3DSTATE_CONSTANT_GS", 7, gen7_3DSTATE_CONSTANT_GS },
+	{ 0x7817, 0x00ff, 5, 5, "3DSTATE_CONSTANT_PS_STATE", 6 },
+	{ 0x7817, 0x00ff, 7, 7, "3DSTATE_CONSTANT_PS", 7, gen7_3DSTATE_CONSTANT_PS },
+	{ 0x7818, 0xffff, 2, 2, "3DSTATE_SAMPLE_MASK" },
+	{ 0x7819, 0x00ff, 7, 7, "3DSTATE_CONSTANT_HS", 7, gen7_3DSTATE_CONSTANT_HS },
+	{ 0x781a, 0x00ff, 7, 7, "3DSTATE_CONSTANT_DS", 7, gen7_3DSTATE_CONSTANT_DS },
+	{ 0x781b, 0x00ff, 7, 7, "3DSTATE_HS" },
+	{ 0x781c, 0x00ff, 4, 4, "3DSTATE_TE" },
+	{ 0x781d, 0x00ff, 6, 6, "3DSTATE_DS" },
+	{ 0x781e, 0x00ff, 3, 3, "3DSTATE_STREAMOUT" },
+	{ 0x781f, 0x00ff, 14, 14, "3DSTATE_SBE" },
+	{ 0x7820, 0x00ff, 8, 8, "3DSTATE_PS" },
+	{ 0x7821, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP },
+	{ 0x7823, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_CC },
+	{ 0x7824, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_BLEND_STATE_POINTERS },
+	{ 0x7825, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_DEPTH_STENCIL_STATE_POINTERS },
+	{ 0x7826, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_VS" },
+	{ 0x7827, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_HS" },
+	{ 0x7828, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_DS" },
+	{ 0x7829, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_GS" },
+	{ 0x782a, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
+	{ 0x782b, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_VS" },
+	{ 0x782c, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_HS" },
+	{ 0x782d, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_DS" },
+	{ 0x782e, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_GS" },
+	{ 0x782f, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
+	{ 0x7830, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_VS },
+	{ 0x7831, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_HS },
+	{ 0x7832, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_DS },
+	{ 0x7833, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_GS },
+	{ 0x7900, 0xffff, 4, 4, "3DSTATE_DRAWING_RECTANGLE" },
+	{ 0x7901, 0xffff, 5, 5, "3DSTATE_CONSTANT_COLOR" },
+	{ 0x7905, 0xffff, 5, 7, "3DSTATE_DEPTH_BUFFER" },
+	{ 0x7906, 0xffff, 2, 2, "3DSTATE_POLY_STIPPLE_OFFSET" },
+	{ 0x7907, 0xffff, 33, 33, "3DSTATE_POLY_STIPPLE_PATTERN" },
+	{ 0x7908, 0xffff, 3, 3, "3DSTATE_LINE_STIPPLE" },
+	{ 0x7909, 0xffff, 2, 2, "3DSTATE_GLOBAL_DEPTH_OFFSET_CLAMP" },
+	{ 0x7909, 0xffff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x790a, 0xffff, 3, 3, "3DSTATE_AA_LINE_PARAMETERS" },
+	{ 0x790b, 0xffff, 4, 4, "3DSTATE_GS_SVB_INDEX" },
+	{ 0x790d, 0xffff, 3, 3, "3DSTATE_MULTISAMPLE", 6 },
+	{ 0x790d, 0xffff, 4, 4, "3DSTATE_MULTISAMPLE", 7 },
+	{ 0x7910, 0x00ff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
+	{ 0x7912, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_VS" },
+	{ 0x7913, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_HS" },
+	{ 0x7914, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_DS" },
+	{ 0x7915, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_GS" },
+	{ 0x7916, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_PS" },
+	{ 0x7917, 0x00ff, 2, 2+128*2, "3DSTATE_SO_DECL_LIST" },
+	{ 0x7918, 0x00ff, 4, 4, "3DSTATE_SO_BUFFER" },
+	{ 0x7a00, 0x00ff, 4, 6, "PIPE_CONTROL" },
+	{ 0x7b00, 0x00ff, 7, 7, NULL, 7, gen7_3DPRIMITIVE },
+	{ 0x7b00, 0x00ff, 6, 6, NULL, 0, gen4_3DPRIMITIVE },
+};
+
 static int
 decode_3d_965(struct drm_intel_decode *ctx)
 {
@@ -3141,120 +3468,12 @@ decode_3d_965(struct drm_intel_decode *ctx)
 	const char *desc1 = NULL;
 	uint32_t *data = ctx->data;
 	uint32_t devid = ctx->devid;
-
-	struct {
-		uint32_t opcode;
-		uint32_t len_mask;
-		int unsigned min_len;
-		int unsigned max_len;
-		const char *name;
-		int gen;
-		int (*func)(struct drm_intel_decode *ctx);
-	} opcodes_3d[] = {
-		{ 0x6000, 0x00ff, 3, 3, "URB_FENCE" },
-		{ 0x6001, 0xffff, 2, 2, "CS_URB_STATE" },
-		{ 0x6002, 0x00ff, 2, 2, "CONSTANT_BUFFER" },
-		{ 0x6101, 0xffff, 6, 10, "STATE_BASE_ADDRESS" },
-		{ 0x6102, 0xffff, 2, 2, "STATE_SIP" },
-		{ 0x6104, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
-		{ 0x680b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
-		{ 0x6904, 0xffff, 1, 1, "3DSTATE_PIPELINE_SELECT" },
-		{ 0x7800, 0xffff, 7, 7, "3DSTATE_PIPELINED_POINTERS" },
-		{ 0x7801, 0x00ff, 4, 6, "3DSTATE_BINDING_TABLE_POINTERS" },
-		{ 0x7802, 0x00ff, 4, 4, "3DSTATE_SAMPLER_STATE_POINTERS" },
-		{ 0x7805, 0x00ff, 7, 7, "3DSTATE_DEPTH_BUFFER", 7 },
-		{ 0x7805, 0x00ff, 3, 3, "3DSTATE_URB" },
-		{ 0x7804, 0x00ff, 3, 3, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x7806, 0x00ff, 3, 3, "3DSTATE_STENCIL_BUFFER" },
-		{ 0x790f, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 6 },
-		{ 0x7807, 0x00ff, 3, 3, "3DSTATE_HIER_DEPTH_BUFFER", 7, gen7_3DSTATE_HIER_DEPTH_BUFFER },
-		{ 0x7808, 0x00ff, 5, 257, "3DSTATE_VERTEX_BUFFERS" },
-		{ 0x7809, 0x00ff, 3, 256, "3DSTATE_VERTEX_ELEMENTS" },
-		{ 0x780a, 0x00ff, 3, 3, "3DSTATE_INDEX_BUFFER" },
-		{ 0x780b, 0xffff, 1, 1, "3DSTATE_VF_STATISTICS" },
-		{ 0x780d, 0x00ff, 4, 4, "3DSTATE_VIEWPORT_STATE_POINTERS" },
-		{ 0x780e, 0xffff, 4, 4, NULL, 6, gen6_3DSTATE_CC_STATE_POINTERS },
-		{ 0x780e, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_CC_STATE_POINTERS },
-		{ 0x780f, 0x00ff, 2, 2, "3DSTATE_SCISSOR_POINTERS" },
-		{ 0x7810, 0x00ff, 6, 6, "3DSTATE_VS" },
-		{ 0x7811, 0x00ff, 7, 7, "3DSTATE_GS" },
-		{ 0x7812, 0x00ff, 4, 4, "3DSTATE_CLIP" },
-		{ 0x7813, 0x00ff, 20, 20, "3DSTATE_SF", 6 },
-		{ 0x7813, 0x00ff, 7, 7, "3DSTATE_SF", 7 },
-		{ 0x7814, 0x00ff, 3, 3, "3DSTATE_WM", 7, gen7_3DSTATE_WM },
-		{ 0x7814, 0x00ff, 9, 9, "3DSTATE_WM", 6, gen6_3DSTATE_WM },
-		{ 0x7815, 0x00ff, 5, 5, "3DSTATE_CONSTANT_VS_STATE", 6 },
-		{ 0x7815, 0x00ff, 7, 7, "3DSTATE_CONSTANT_VS", 7, gen7_3DSTATE_CONSTANT_VS },
-		{ 0x7816, 0x00ff, 5, 5, "3DSTATE_CONSTANT_GS_STATE", 6 },
-		{ 0x7816, 0x00ff, 7, 7, "3DSTATE_CONSTANT_GS", 7, gen7_3DSTATE_CONSTANT_GS },
-		{ 0x7817, 0x00ff, 5, 5, "3DSTATE_CONSTANT_PS_STATE", 6 },
-		{ 0x7817, 0x00ff, 7, 7, "3DSTATE_CONSTANT_PS", 7, gen7_3DSTATE_CONSTANT_PS },
-		{ 0x7818, 0xffff, 2, 2, "3DSTATE_SAMPLE_MASK" },
-		{ 0x7819, 0x00ff, 7, 7, "3DSTATE_CONSTANT_HS", 7, gen7_3DSTATE_CONSTANT_HS },
-		{ 0x781a, 0x00ff, 7, 7, "3DSTATE_CONSTANT_DS", 7, gen7_3DSTATE_CONSTANT_DS },
-		{ 0x781b, 0x00ff, 7, 7, "3DSTATE_HS" },
-		{ 0x781c, 0x00ff, 4, 4, "3DSTATE_TE" },
-		{ 0x781d, 0x00ff, 6, 6, "3DSTATE_DS" },
-		{ 0x781e, 0x00ff, 3, 3, "3DSTATE_STREAMOUT" },
-		{ 0x781f, 0x00ff, 14, 14, "3DSTATE_SBE" },
-		{ 0x7820, 0x00ff, 8, 8, "3DSTATE_PS" },
-		{ 0x7821, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_SF_CLIP },
-		{ 0x7823, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_VIEWPORT_STATE_POINTERS_CC },
-		{ 0x7824, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_BLEND_STATE_POINTERS },
-		{ 0x7825, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_DEPTH_STENCIL_STATE_POINTERS },
-		{ 0x7826, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_VS" },
-		{ 0x7827, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_HS" },
-		{ 0x7828, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_DS" },
-		{ 0x7829, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_GS" },
-		{ 0x782a, 0x00ff, 2, 2, "3DSTATE_BINDING_TABLE_POINTERS_PS" },
-		{ 0x782b, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_VS" },
-		{ 0x782c, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_HS" },
-		{ 0x782d, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_DS" },
-		{ 0x782e, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_GS" },
-		{ 0x782f, 0x00ff, 2, 2, "3DSTATE_SAMPLER_STATE_POINTERS_PS" },
-		{ 0x7830, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_VS },
-		{ 0x7831, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_HS },
-		{ 0x7832, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_DS },
-		{ 0x7833, 0x00ff, 2, 2, NULL, 7, gen7_3DSTATE_URB_GS },
-		{ 0x7900, 0xffff, 4, 4, "3DSTATE_DRAWING_RECTANGLE" },
-		{ 0x7901, 0xffff, 5, 5, "3DSTATE_CONSTANT_COLOR" },
-		{ 0x7905, 0xffff, 5, 7, "3DSTATE_DEPTH_BUFFER" },
-		{ 0x7906, 0xffff, 2, 2, "3DSTATE_POLY_STIPPLE_OFFSET" },
-		{ 0x7907, 0xffff, 33, 33, "3DSTATE_POLY_STIPPLE_PATTERN" },
-		{ 0x7908, 0xffff, 3, 3, "3DSTATE_LINE_STIPPLE" },
-		{ 0x7909, 0xffff, 2, 2, "3DSTATE_GLOBAL_DEPTH_OFFSET_CLAMP" },
-		{ 0x7909, 0xffff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x790a, 0xffff, 3, 3, "3DSTATE_AA_LINE_PARAMETERS" },
-		{ 0x790b, 0xffff, 4, 4, "3DSTATE_GS_SVB_INDEX" },
-		{ 0x790d, 0xffff, 3, 3, "3DSTATE_MULTISAMPLE", 6 },
-		{ 0x790d, 0xffff, 4, 4, "3DSTATE_MULTISAMPLE", 7 },
-		{ 0x7910, 0x00ff, 2, 2, "3DSTATE_CLEAR_PARAMS" },
-		{ 0x7912, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_VS" },
-		{ 0x7913, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_HS" },
-		{ 0x7914, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_DS" },
-		{ 0x7915, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_GS" },
-		{ 0x7916, 0x00ff, 2, 2, "3DSTATE_PUSH_CONSTANT_ALLOC_PS" },
-		{ 0x7917, 0x00ff, 2, 2+128*2, "3DSTATE_SO_DECL_LIST" },
-		{ 0x7918, 0x00ff, 4, 4, "3DSTATE_SO_BUFFER" },
-		{ 0x7a00, 0x00ff, 4, 6, "PIPE_CONTROL" },
-		{ 0x7b00, 0x00ff, 7, 7, NULL, 7, gen7_3DPRIMITIVE },
-		{ 0x7b00, 0x00ff, 6, 6, NULL, 0, gen4_3DPRIMITIVE },
-	}, *opcode_3d = NULL;
+	const struct decode_opcode *opcode_3d;
 
 	opcode = (data[0] & 0xffff0000) >> 16;
 
-	for (i = 0; i < ARRAY_SIZE(opcodes_3d); i++) {
-		if (opcode != opcodes_3d[i].opcode)
-			continue;
-
-		/* If it's marked as not our gen, skip. */
-		if (opcodes_3d[i].gen && opcodes_3d[i].gen != ctx->gen)
-			continue;
-
-		opcode_3d = &opcodes_3d[i];
-		break;
-	}
-
+	opcode_3d = decode_lookup_opcode(ctx->index_3d, opcodes_3d_965,
+					 opcode & 0x1fff);
 	if (opcode_3d) {
 		if (opcode_3d->max_len == 1)
 			len = 1;
@@ -3263,7 +3482,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 		if (len < opcode_3d->min_len ||
 		    len > opcode_3d->max_len) {
-			fprintf(out, "Bad length %d in %s, expected %d-%d\n",
+			decode_out(ctx, "Bad length %d in %s, expected %d-%d\n",
 				len, opcode_3d->name,
 				opcode_3d->min_len, opcode_3d->max_len);
 		}
@@ -3300,7 +3519,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		else
 			sba_len = 6;
 		if (len != sba_len)
-			fprintf(out, "Bad count in STATE_BASE_ADDRESS\n");
+			decode_out(ctx, "Bad count in STATE_BASE_ADDRESS\n");
 
 		state_base_out(ctx, i++, "general");
 		state_base_out(ctx, i++, "surface");
@@ -3329,7 +3548,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		return len;
 	case 0x7801:
 		if (len != 6 && len != 4)
-			fprintf(out,
+			decode_out(ctx,
 				"Bad count in 3DSTATE_BINDING_TABLE_POINTERS\n");
 		if (len == 6) {
 			instr_out(ctx, 0,
@@ -3378,7 +3597,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x7808:
 		if ((len - 1) % 4 != 0)
-			fprintf(out, "Bad count in 3DSTATE_VERTEX_BUFFERS\n");
+			decode_out(ctx, "Bad count in 3DSTATE_VERTEX_BUFFERS\n");
 		instr_out(ctx, 0, "3DSTATE_VERTEX_BUFFERS\n");
 
 		for (i = 1; i < len;) {
@@ -3403,7 +3622,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 
 	case 0x7809:
 		if ((len + 1) % 2 != 0)
-			fprintf(out, "Bad count in 3DSTATE_VERTEX_ELEMENTS\n");
+			decode_out(ctx, "Bad count in 3DSTATE_VERTEX_ELEMENTS\n");
 		instr_out(ctx, 0, "3DSTATE_VERTEX_ELEMENTS\n");
 
 		for (i = 1; i < len;) {
@@ -3632,7 +3851,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 		if (IS_GEN6(devid) || IS_GEN7(devid)) {
 			unsigned int i;
 			if (len != 4 && len != 5)
-				fprintf(out, "Bad count in PIPE_CONTROL\n");
+				decode_out(ctx, "Bad count in PIPE_CONTROL\n");
 
 			switch ((data[1] >> 14) & 0x3) {
 			case 0:
@@ -3698,7 +3917,7 @@ decode_3d_965(struct drm_intel_decode *ctx)
 			return len;
 		} else {
 			if (len != 4)
-				fprintf(out, "Bad count in PIPE_CONTROL\n");
+				decode_out(ctx, "Bad count in PIPE_CONTROL\n");
 
 			switch ((data[0] >> 14) & 0x3) {
 			case 0:
@@ -3748,36 +3967,31 @@ decode_3d_965(struct drm_intel_decode *ctx)
 	return 1;
 }
 
+static const struct decode_opcode opcodes_3d_i830[] = {
+	{ 0x02, 0xff, 1, 1, "3DSTATE_MODES_3" },
+	{ 0x03, 0xff, 1, 1, "3DSTATE_ENABLES_1" },
+	{ 0x04, 0xff, 1, 1, "3DSTATE_ENABLES_2" },
+	{ 0x05, 0xff, 1, 1, "3DSTATE_VFT0" },
+	{ 0x06, 0xff, 1, 1, "3DSTATE_AA" },
+	{ 0x07, 0xff, 1, 1, "3DSTATE_RASTERIZATION_RULES" },
+	{ 0x08, 0xff, 1, 1, "3DSTATE_MODES_1" },
+	{ 0x09, 0xff, 1, 1, "3DSTATE_STENCIL_TEST" },
+	{ 0x0a, 0xff, 1, 1, "3DSTATE_VFT1" },
+	{ 0x0b, 0xff, 1, 1, "3DSTATE_INDPT_ALPHA_BLEND" },
+	{ 0x0c, 0xff, 1, 1, "3DSTATE_MODES_5" },
+	{ 0x0d, 0xff, 1, 1, "3DSTATE_MAP_BLEND_OP" },
+	{ 0x0e, 0xff, 1, 1, "3DSTATE_MAP_BLEND_ARG" },
+	{ 0x0f, 0xff, 1, 1, "3DSTATE_MODES_2" },
+	{ 0x15, 0xff, 1, 1, "3DSTATE_FOG_COLOR" },
+	{ 0x16, 0xff, 1, 1, "3DSTATE_MODES_4" },
+};
+
 static int
 decode_3d_i830(struct drm_intel_decode *ctx)
 {
-	unsigned int idx;
 	uint32_t opcode;
 	uint32_t *data = ctx->data;
-
-	struct {
-		uint32_t opcode;
-		unsigned int min_len;
-		unsigned int max_len;
-		const char *name;
-	} opcodes_3d[] = {
-		{ 0x02, 1, 1, "3DSTATE_MODES_3" },
-		{ 0x03, 1, 1, "3DSTATE_ENABLES_1" },
-		{ 0x04, 1, 1, "3DSTATE_ENABLES_2" },
-		{ 0x05, 1, 1, "3DSTATE_VFT0" },
-		{ 0x06, 1, 1, "3DSTATE_AA" },
-		{ 0x07, 1, 1, "3DSTATE_RASTERIZATION_RULES" },
-		{ 0x08, 1, 1, "3DSTATE_MODES_1" },
-		{ 0x09, 1, 1, "3DSTATE_STENCIL_TEST" },
-		{ 0x0a, 1, 1, "3DSTATE_VFT1" },
-		{ 0x0b, 1, 1, "3DSTATE_INDPT_ALPHA_BLEND" },
-		{ 0x0c, 1, 1, "3DSTATE_MODES_5" },
-		{ 0x0d, 1, 1, "3DSTATE_MAP_BLEND_OP" },
-		{ 0x0e, 1, 1, "3DSTATE_MAP_BLEND_ARG" },
-		{ 0x0f, 1, 1, "3DSTATE_MODES_2" },
-		{ 0x15, 1, 1, "3DSTATE_FOG_COLOR" },
-		{ 0x16, 1, 1, "3DSTATE_MODES_4"},
-	}, *opcode_3d;
+	const struct decode_opcode *opcode_3d;
 
 	opcode = (data[0] & 0x1f000000) >> 24;
 
@@ -3790,26 +4004,25 @@ decode_3d_i830(struct drm_intel_decode *ctx)
 		return decode_3d_1c(ctx);
 	}
 
-	for (idx = 0; idx < ARRAY_SIZE(opcodes_3d); idx++) {
-		opcode_3d = &opcodes_3d[idx];
-		if ((data[0] & 0x1f000000) >> 24 == opcode_3d->opcode) {
-			unsigned int len = 1, i;
+	opcode_3d = decode_lookup_opcode(ctx->index_3d, opcodes_3d_i830,
+					 opcode);
+	if (opcode_3d) {
+		unsigned int len = 1, i;
 
-			instr_out(ctx, 0, "%s\n", opcode_3d->name);
-			if (opcode_3d->max_len > 1) {
-				len = (data[0] & 0xff) + 2;
-				if (len < opcode_3d->min_len ||
-				    len > opcode_3d->max_len) {
-					fprintf(out, "Bad count in %s\n",
-						opcode_3d->name);
-				}
+		instr_out(ctx, 0, "%s\n", opcode_3d->name);
+		if (opcode_3d->max_len > 1) {
+			len = (data[0] & opcode_3d->len_mask) + 2;
+			if (len < opcode_3d->min_len ||
+			    len > opcode_3d->max_len) {
+				decode_out(ctx, "Bad count in %s\n",
+					opcode_3d->name);
 			}
+		}
 
-			for (i = 1; i < len; i++) {
-				instr_out(ctx, i, "dword %d\n", i);
-			}
-			return len;
+		for (i = 1; i < len; i++) {
+			instr_out(ctx, i, "dword %d\n", i);
 		}
+		return len;
 	}
 
 	instr_out(ctx, 0, "3D UNKNOWN: 3d_i830 opcode = 0x%x\n",
@@ -3846,12 +4059,34 @@ drm_intel_decode_context_alloc(uint32_t devid)
 		ctx->gen = 2;
 	}
 
+	decode_index_opcodes(ctx->index_mi, ARRAY_SIZE(ctx->index_mi),
+			     opcodes_mi, ARRAY_SIZE(opcodes_mi), ctx->gen);
+	decode_index_opcodes(ctx->index_2d, ARRAY_SIZE(ctx->index_2d),
+			     opcodes_2d, ARRAY_SIZE(opcodes_2d), ctx->gen);
+	decode_index_opcodes(ctx->index_3d_1d, ARRAY_SIZE(ctx->index_3d_1d),
+			     opcodes_3d_1d, ARRAY_SIZE(opcodes_3d_1d),
+			     ctx->gen);
+	if (ctx->gen >= 4)
+		decode_index_opcodes(ctx->index_3d, ARRAY_SIZE(ctx->index_3d),
+				     opcodes_3d_965,
+				     ARRAY_SIZE(opcodes_3d_965), ctx->gen);
+	else if (ctx->gen == 3)
+		decode_index_opcodes(ctx->index_3d, 32, opcodes_3d_i915,
+				     ARRAY_SIZE(opcodes_3d_i915), ctx->gen);
+	else
+		decode_index_opcodes(ctx->index_3d, 32, opcodes_3d_i830,
+				     ARRAY_SIZE(opcodes_3d_i830), ctx->gen);
+
 	return ctx;
 }
 
 drm_public void
 drm_intel_decode_context_free(struct drm_intel_decode *ctx)
 {
+	free(ctx->buf);
+	free(ctx->field_pos);
+	free(ctx->fields);
+	free(ctx->stat_table);
 	free(ctx);
 }
 
@@ -3879,6 +4114,10 @@ drm_intel_decode_set_head_tail(struct drm_intel_decode *ctx,
 	ctx->tail = tail;
 }
 
+/**
+ * Sets where drm_intel_decode() writes its output.  With NULL, the output
+ * is kept for drm_intel_decode_get_output() instead.
+ */
 drm_public void
 drm_intel_decode_set_output_file(struct drm_intel_decode *ctx,
 				 FILE *out)
@@ -3887,46 +4126,288 @@ drm_intel_decode_set_output_file(struct drm_intel_decode *ctx,
 }
 
 /**
- * Decodes an i830-i915 batch buffer, writing the output to stdout.
- *
- * \param data batch buffer contents
- * \param count number of DWORDs to decode in the batch buffer
- * \param hw_offset hardware address for the buffer
+ * Has drm_intel_decode() pass each packet to func as it is decoded, with
+ * its text and a record for each dword, instead of writing it out.  The
+ * record is only valid during the call.  Pass NULL to write output again.
  */
 drm_public void
-drm_intel_decode(struct drm_intel_decode *ctx)
+drm_intel_decode_set_packet_callback(struct drm_intel_decode *ctx,
+				     drm_intel_decode_packet_func func,
+				     void *closure)
 {
-	int ret;
-	unsigned int index = 0;
-	uint32_t devid;
-	int size = ctx->base_count * 4;
-	void *temp;
+	ctx->packet_func = func;
+	ctx->packet_closure = closure;
+}
 
-	if (!ctx)
-		return;
+/**
+ * Tells drm_intel_decode() that the batch is followed by at least
+ * DRM_INTEL_DECODE_PADDING readable bytes, so that it can decode the batch
+ * in place instead of first copying it to pad it with 0xd0d0d0d0.
+ * Packets running off the end then show whatever the padding holds.
+ */
+drm_public void
+drm_intel_decode_set_batch_padded(struct drm_intel_decode *ctx, int padded)
+{
+	ctx->padded = !!padded;
+}
 
-	/* Put a scratch page full of obviously undefined data after
-	 * the batchbuffer.  This lets us avoid a bunch of length
-	 * checking in statically sized packets.
-	 */
-	temp = malloc(size + 4096);
-	memcpy(temp, ctx->base_data, size);
-	memset((char *)temp + size, 0xd0, 4096);
-	ctx->data = temp;
+/**
+ * Has drm_intel_decode() split batches of more than a few thousand dwords
+ * across this many threads.  The output is the same as decoding on one
+ * thread.  It is ignored while a packet callback is set.
+ */
+drm_public void
+drm_intel_decode_set_threads(struct drm_intel_decode *ctx, int threads)
+{
+	ctx->threads = threads > 0 ? threads : 1;
+}
 
-	ctx->hw_offset = ctx->base_hw_offset;
-	ctx->count = ctx->base_count;
+/**
+ * Has drm_intel_decode() count the packets, dwords and changes of state
+ * for each opcode in the batch instead of producing any output.  The
+ * counts add up over decodes until drm_intel_decode_reset_stats().
+ */
+drm_public void
+drm_intel_decode_set_stats(struct drm_intel_decode *ctx, int enable)
+{
+	ctx->stats = !!enable;
+}
+
+drm_public void
+drm_intel_decode_reset_stats(struct drm_intel_decode *ctx)
+{
+	free(ctx->stat_table);
+	ctx->stat_table = NULL;
+	ctx->stat_count = 0;
+	ctx->stat_size = 0;
+}
+
+static int
+decode_stat_compare(const void *a, const void *b)
+{
+	const drm_intel_decode_opcode_stats *sa = a, *sb = b;
+
+	if (sa->dwords != sb->dwords)
+		return sa->dwords < sb->dwords ? 1 : -1;
+	if (sa->packets != sb->packets)
+		return sa->packets < sb->packets ? 1 : -1;
+	return sa->opcode < sb->opcode ? -1 : sa->opcode > sb->opcode;
+}
+
+/**
+ * Copies the counts for up to max_stats opcodes into stats, those with
+ * the most dwords first, and returns how many opcodes have been seen.
+ * The names stay valid until the next decode or reset.
+ */
+drm_public int
+drm_intel_decode_get_stats(struct drm_intel_decode *ctx,
+			   drm_intel_decode_opcode_stats *stats,
+			   int max_stats)
+{
+	drm_intel_decode_opcode_stats *all;
+	unsigned int i, n = 0;
+
+	if (!stats || max_stats <= 0 || !ctx->stat_count)
+		return ctx->stat_count;
+
+	all = calloc(ctx->stat_count, sizeof(*all));
+	if (!all)
+		return -1;
+	for (i = 0; i < ctx->stat_size; i++) {
+		struct decode_stat *stat = &ctx->stat_table[i];
+
+		if (!stat->packets)
+			continue;
+		all[n].opcode = stat->opcode;
+		all[n].name = stat->name;
+		all[n].packets = stat->packets;
+		all[n].dwords = stat->dwords;
+		all[n].changes = stat->changes;
+		n++;
+	}
+	qsort(all, n, sizeof(*all), decode_stat_compare);
 
-	devid = ctx->devid;
-	head_offset = ctx->head;
-	tail_offset = ctx->tail;
-	out = ctx->out;
+	if ((unsigned int)max_stats > n)
+		max_stats = n;
+	memcpy(stats, all, max_stats * sizeof(*stats));
+	free(all);
+	return n;
+}
 
-	saved_s2_set = 0;
-	saved_s4_set = 1;
+/**
+ * Returns the text of the last drm_intel_decode() with no output file set,
+ * NUL-terminated, and its length in *size.  It stays valid until the next
+ * decode or the context is freed.
+ */
+drm_public const char *
+drm_intel_decode_get_output(struct drm_intel_decode *ctx, size_t *size)
+{
+	if (size)
+		*size = ctx->buf_len;
+	return ctx->buf_len ? ctx->buf : "";
+}
+
+/**
+ * Returns the bits of a packet header that tell packets apart for stats:
+ * the type and opcode, and for 3D packets the sub-opcode where the
+ * decoders switch on one.
+ */
+static uint32_t
+decode_stat_key(struct drm_intel_decode *ctx, uint32_t header)
+{
+	switch (header >> 29) {
+	case 0x0:
+		return header & 0xff800000;
+	case 0x2:
+		return header & 0xffc00000;
+	case 0x3:
+		if (ctx->gen >= 4)
+			return header & 0xffff0000;
+		switch ((header >> 24) & 0x1f) {
+		case 0x1c:
+			return header & 0xfff80000;
+		case 0x1d:
+			return header & 0xffff0000;
+		default:
+			return header & 0xff000000;
+		}
+	default:
+		return header & 0xe0000000;
+	}
+}
+
+static bool
+decode_stat_grow(struct drm_intel_decode *ctx)
+{
+	unsigned int size = ctx->stat_size ? ctx->stat_size * 2 : 64;
+	struct decode_stat *table, *old = ctx->stat_table;
+	unsigned int i, j;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return false;
+
+	for (i = 0; i < ctx->stat_size; i++) {
+		if (!old[i].packets)
+			continue;
+		j = (old[i].opcode * 0x9e3779b1u) >> 16;
+		while (table[j & (size - 1)].packets)
+			j++;
+		table[j & (size - 1)] = old[i];
+	}
+
+	free(old);
+	ctx->stat_table = table;
+	ctx->stat_size = size;
+	return true;
+}
+
+/**
+ * Finds the stats entry for the packet at ctx->data, adding it if it is
+ * the first with its opcode.  A new entry has no packets counted yet.
+ */
+static struct decode_stat *
+decode_stat_lookup(struct drm_intel_decode *ctx)
+{
+	uint32_t opcode = decode_stat_key(ctx, ctx->data[0]);
+	struct decode_stat *stat;
+	unsigned int i;
+
+	if (ctx->stat_count * 2 >= ctx->stat_size && !decode_stat_grow(ctx))
+		return NULL;
+
+	for (i = (opcode * 0x9e3779b1u) >> 16; ; i++) {
+		stat = &ctx->stat_table[i & (ctx->stat_size - 1)];
+		if (!stat->packets) {
+			stat->opcode = opcode;
+			ctx->stat_count++;
+			return stat;
+		}
+		if (stat->opcode == opcode)
+			return stat;
+	}
+}
+
+/**
+ * Names a new stats entry after its packet's header line: the first
+ * word, or the whole description up to any details for unknown packets.
+ */
+static void
+decode_stat_name(struct drm_intel_decode *ctx, struct decode_stat *stat)
+{
+	const char *line = "UNKNOWN";
+	size_t len;
+
+	if (ctx->stat_name_pos != (size_t)-1)
+		line = ctx->buf + ctx->stat_name_pos;
+	len = strcspn(line, ":(,\n");
+	if (len >= sizeof(stat->name))
+		len = sizeof(stat->name) - 1;
+	memcpy(stat->name, line, len);
+	stat->name[len] = '\0';
+
+	if (!strstr(stat->name, "UNKNOWN"))
+		len = strcspn(stat->name, " ");
+	while (len > 0 && stat->name[len - 1] == ' ')
+		len--;
+	stat->name[len] = '\0';
+}
+
+/** Counts the packet at ctx->data, len dwords long, against its opcode. */
+static void
+decode_stat_packet(struct drm_intel_decode *ctx, struct decode_stat *stat,
+		   uint32_t len)
+{
+	uint32_t hash = 2166136261u, i;
+
+	if (ctx->stat_naming) {
+		decode_stat_name(ctx, stat);
+		ctx->stat_naming = NULL;
+		ctx->buf_len = 0;
+		ctx->field_count = 0;
+		ctx->quiet = true;
+	}
+
+	if (len > ctx->count)
+		len = ctx->count;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ ctx->data[i]) * 16777619u;
+
+	if (!stat->packets || hash != stat->last_hash)
+		stat->changes++;
+	stat->last_hash = hash;
+	stat->packets++;
+	stat->dwords += len;
+}
+
+/**
+ * Decodes packets from ctx->data until at least count dwords have been
+ * consumed or the batch runs out, and returns how many were consumed.
+ */
+static uint32_t
+decode_packets(struct drm_intel_decode *ctx, uint32_t count)
+{
+	int ret;
+	unsigned int index = 0;
+	uint32_t devid = ctx->devid;
+	uint32_t done = 0;
+
+	while (ctx->count > 0 && done < count) {
+		size_t packet_start = ctx->buf_len;
+		struct decode_stat *stat = NULL;
 
-	while (ctx->count > 0) {
 		index = 0;
+		ret = 0;
+
+		/* The first packet with an opcode is formatted, to name it. */
+		if (ctx->stats) {
+			stat = decode_stat_lookup(ctx);
+			if (stat && !stat->packets) {
+				ctx->stat_naming = stat;
+				ctx->stat_name_pos = (size_t)-1;
+				ctx->quiet = false;
+			}
+		}
 
 		switch ((ctx->data[index] & 0xe0000000) >> 29) {
 		case 0x0:
@@ -3941,6 +4422,8 @@ drm_intel_decode(struct drm_intel_decode *ctx)
 			if (ret == -1) {
 				if (ctx->dump_past_end) {
 					index++;
+				} else if (ctx->quiet) {
+					index = ctx->count;
 				} else {
 					for (index = index + 1; index < ctx->count;
 					     index++) {
@@ -3969,15 +4452,207 @@ drm_intel_decode(struct drm_intel_decode *ctx)
 			index++;
 			break;
 		}
-		fflush(out);
+		if (stat)
+			decode_stat_packet(ctx, stat, ret == -1 ? 1 : index);
+		else
+			decode_end_packet(ctx, ctx->hw_offset, ctx->data[0],
+					  packet_start);
 
-		if (ctx->count < index)
+		if (ctx->count < index) {
+			done += ctx->count;
+			ctx->count = 0;
 			break;
+		}
 
 		ctx->count -= index;
 		ctx->data += index;
 		ctx->hw_offset += 4 * index;
+		done += index;
 	}
 
+	return done;
+}
+
+static void
+decode_chunks(struct decode_chunk *chunks, unsigned int count,
+	      unsigned int first, unsigned int stride)
+{
+	unsigned int i;
+
+	for (i = first; i < count; i += stride) {
+		struct decode_chunk *chunk = &chunks[i];
+
+		if (decode_grow(chunk->ctx, DECODE_FLUSH_SIZE))
+			decode_packets(chunk->ctx, chunk->count);
+	}
+}
+
+static void *
+decode_worker(void *arg)
+{
+	struct decode_worker *worker = arg;
+
+	decode_chunks(worker->chunks, worker->count, worker->first,
+		      worker->stride);
+	return NULL;
+}
+
+/**
+ * Decodes the batch at ctx->data on ctx->threads threads.
+ *
+ * A first pass runs the decoders with output off to find where packets
+ * start, splitting the batch into a few chunks per thread and noting the
+ * state the i915 decoders carry from packet to packet at each split.
+ * The threads then decode alternate chunks into copies of the context,
+ * and their output is put back together in order.  Returns false, with
+ * nothing decoded, if the chunks can't be set up.
+ */
+static bool
+decode_parallel(struct drm_intel_decode *ctx)
+{
+	unsigned int threads = ctx->threads, size, n = 0, i, started;
+	struct decode_worker *workers;
+	struct decode_chunk *chunks;
+	uint32_t chunk_size;
+	bool ret = false;
+
+	size = threads * DECODE_CHUNKS_PER_THREAD;
+	if (size > ctx->count / DECODE_CHUNK_MIN)
+		size = ctx->count / DECODE_CHUNK_MIN;
+	chunk_size = ctx->count / size;
+
+	chunks = calloc(size, sizeof(*chunks));
+	workers = calloc(threads, sizeof(*workers));
+	if (!chunks || !workers)
+		goto out;
+	for (i = 0; i < size; i++) {
+		chunks[i].ctx = malloc(sizeof(*ctx));
+		if (!chunks[i].ctx)
+			goto out;
+	}
+
+	/* Each chunk's copy of the context starts out as the first pass
+	 * left it, with its own output.
+	 */
+	ctx->quiet = true;
+	for (n = 0; n < size && ctx->count > 0; n++) {
+		struct decode_chunk *chunk = &chunks[n];
+
+		*chunk->ctx = *ctx;
+		chunk->ctx->quiet = false;
+		chunk->ctx->out = NULL;
+		chunk->ctx->buf = NULL;
+		chunk->ctx->buf_len = 0;
+		chunk->ctx->buf_size = 0;
+		chunk->count = decode_packets(ctx, n == size - 1 ?
+					      UINT32_MAX : chunk_size);
+	}
+	ctx->quiet = false;
+
+	started = 1;
+	for (i = 1; i < threads && i < n; i++) {
+		workers[i].chunks = chunks;
+		workers[i].count = n;
+		workers[i].first = i;
+		workers[i].stride = threads;
+		if (pthread_create(&workers[i].thread, NULL,
+				   decode_worker, &workers[i]))
+			break;
+		started++;
+	}
+	/* Chunks left without a thread are decoded here. */
+	for (i = 0; i < threads; i++) {
+		if (i == 0 || i >= started)
+			decode_chunks(chunks, n, i, threads);
+	}
+	for (i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (i = 0; i < n; i++) {
+		struct drm_intel_decode *chunk_ctx = chunks[i].ctx;
+
+		if (!chunk_ctx->buf_len)
+			continue;
+		if (ctx->out) {
+			fwrite(chunk_ctx->buf, 1, chunk_ctx->buf_len,
+			       ctx->out);
+		} else if (decode_grow(ctx, ctx->buf_len +
+				       chunk_ctx->buf_len + 1)) {
+			memcpy(ctx->buf + ctx->buf_len, chunk_ctx->buf,
+			       chunk_ctx->buf_len);
+			ctx->buf_len += chunk_ctx->buf_len;
+			ctx->buf[ctx->buf_len] = '\0';
+		}
+	}
+	ret = true;
+
+out:
+	for (i = 0; ret && i < n; i++)
+		free(chunks[i].ctx->buf);
+	for (i = 0; chunks && i < size; i++)
+		free(chunks[i].ctx);
+	free(chunks);
+	free(workers);
+	return ret;
+}
+
+/**
+ * Decodes an i830-i915 batch buffer, writing the output to stdout.
+ *
+ * \param data batch buffer contents
+ * \param count number of DWORDs to decode in the batch buffer
+ * \param hw_offset hardware address for the buffer
+ */
+drm_public void
+drm_intel_decode(struct drm_intel_decode *ctx)
+{
+	int size = ctx->base_count * 4;
+	void *temp = NULL;
+
+	if (!ctx)
+		return;
+
+	ctx->buf_len = 0;
+	ctx->field_count = 0;
+	if (!ctx->buf && !decode_grow(ctx, DECODE_FLUSH_SIZE))
+		return;
+
+	/* Put a scratch page full of obviously undefined data after
+	 * the batchbuffer.  This lets us avoid a bunch of length
+	 * checking in statically sized packets.  If the caller has
+	 * already padded the batch, decode it where it is.
+	 */
+	if (ctx->padded) {
+		ctx->data = ctx->base_data;
+	} else {
+		temp = malloc(size + DRM_INTEL_DECODE_PADDING);
+		if (!temp)
+			return;
+		memcpy(temp, ctx->base_data, size);
+		memset((char *)temp + size, 0xd0, DRM_INTEL_DECODE_PADDING);
+		ctx->data = temp;
+	}
+
+	ctx->hw_offset = ctx->base_hw_offset;
+	ctx->count = ctx->base_count;
+
+	ctx->saved_s2_set = 0;
+	ctx->saved_s4_set = 1;
+	ctx->overflowed = false;
+
+	if (ctx->stats) {
+		ctx->quiet = true;
+		decode_packets(ctx, UINT32_MAX);
+		ctx->quiet = false;
+	} else if (ctx->threads < 2 || ctx->packet_func ||
+		   ctx->count < 2 * DECODE_CHUNK_MIN || !decode_parallel(ctx)) {
+		decode_packets(ctx, UINT32_MAX);
+	}
+
+	if (ctx->out && !ctx->packet_func) {
+		fwrite(ctx->buf, 1, ctx->buf_len, ctx->out);
+		fflush(ctx->out);
+		ctx->buf_len = 0;
+	}
 	free(temp);
 }
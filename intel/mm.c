@@ -23,11 +23,156 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
 #include <assert.h>
 
 #include "xf86drm.h"
 #include "mm.h"
 
+/*
+ * Free blocks are kept in segregated lists, four size classes per power of
+ * two, so that an allocation only looks at blocks that are about the right
+ * size.  Every block, free or not, is also in a treap ordered by offset for
+ * mmFindBlock.  The heap returned by mmInit is the head of a struct
+ * mem_heap that holds both indexes.
+ */
+#define MM_BIN_SHIFT	2
+#define MM_BINS		(32 << MM_BIN_SHIFT)
+
+struct mem_heap {
+	struct mem_block head;
+	struct mem_block *root;
+	struct mem_block *bins[MM_BINS];
+	uint32_t bin_map[MM_BINS / 32];
+};
+
+static struct mem_heap *Heap(const struct mem_block *heap)
+{
+	return (struct mem_heap *)heap;
+}
+
+static int FreeBin(int size)
+{
+	int bits = 0;
+
+	while ((size >> bits) >= (2 << MM_BIN_SHIFT))
+		bits++;
+	if (bits == 0)
+		return size;
+	return ((bits + MM_BIN_SHIFT) << MM_BIN_SHIFT) +
+		((size >> bits) & ((1 << MM_BIN_SHIFT) - 1));
+}
+
+static void AddFree(struct mem_heap *heap, struct mem_block *p)
+{
+	int bin = FreeBin(p->size);
+
+	p->prev_free = NULL;
+	p->next_free = heap->bins[bin];
+	if (p->next_free)
+		p->next_free->prev_free = p;
+	heap->bins[bin] = p;
+	heap->bin_map[bin / 32] |= 1u << (bin % 32);
+}
+
+static void RemoveFree(struct mem_heap *heap, struct mem_block *p)
+{
+	int bin = FreeBin(p->size);
+
+	if (p->prev_free)
+		p->prev_free->next_free = p->next_free;
+	else
+		heap->bins[bin] = p->next_free;
+	if (p->next_free)
+		p->next_free->prev_free = p->prev_free;
+	else if (!heap->bins[bin])
+		heap->bin_map[bin / 32] &= ~(1u << (bin % 32));
+
+	p->next_free = NULL;
+	p->prev_free = NULL;
+}
+
+/* The first non-empty bin at or above bin, or -1 */
+static int NextBin(const struct mem_heap *heap, int bin)
+{
+	uint32_t bits;
+	int word;
+
+	for (word = bin / 32; word < MM_BINS / 32; word++) {
+		bits = heap->bin_map[word];
+		if (word == bin / 32)
+			bits &= ~0u << (bin % 32);
+		if (bits)
+			return word * 32 + ffs(bits) - 1;
+	}
+	return -1;
+}
+
+/* Treap priorities are a hash of the offset, which keeps the tree balanced
+ * for the aligned offsets allocations tend to have. */
+static uint32_t Priority(const struct mem_block *p)
+{
+	uint32_t h = p->ofs;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static void InsertBlock(struct mem_heap *heap, struct mem_block *b)
+{
+	struct mem_block **link = &heap->root, *t, **l, **r;
+	uint32_t prio = Priority(b);
+
+	while (*link && Priority(*link) >= prio)
+		link = b->ofs < (*link)->ofs ? &(*link)->left : &(*link)->right;
+
+	/* Split the subtree below b by offset into its children */
+	t = *link;
+	l = &b->left;
+	r = &b->right;
+	while (t) {
+		if (t->ofs < b->ofs) {
+			*l = t;
+			l = &t->right;
+			t = t->right;
+		} else {
+			*r = t;
+			r = &t->left;
+			t = t->left;
+		}
+	}
+	*l = NULL;
+	*r = NULL;
+	*link = b;
+}
+
+static void RemoveBlock(struct mem_heap *heap, struct mem_block *b)
+{
+	struct mem_block **link = &heap->root, *l = b->left, *r = b->right;
+
+	while (*link != b)
+		link = b->ofs < (*link)->ofs ? &(*link)->left : &(*link)->right;
+
+	/* Merge b's children in its place */
+	while (l && r) {
+		if (Priority(l) > Priority(r)) {
+			*link = l;
+			link = &l->right;
+			l = l->right;
+		} else {
+			*link = r;
+			link = &r->left;
+			r = r->left;
+		}
+	}
+	*link = l ? l : r;
+}
+
 void mmDumpMemInfo(const struct mem_block *heap)
 {
 	drmMsg("Memory heap %p:\n", (void *)heap);
@@ -35,6 +180,7 @@ void mmDumpMemInfo(const struct mem_block *heap)
 		drmMsg("  heap == 0\n");
 	} else {
 		const struct mem_block *p;
+		int bin;
 
 		for (p = heap->next; p != heap; p = p->next) {
 			drmMsg("  Offset:%08x, Size:%08x, %c%c\n", p->ofs,
@@ -44,10 +190,12 @@ void mmDumpMemInfo(const struct mem_block *heap)
 
 		drmMsg("\nFree list:\n");
 
-		for (p = heap->next_free; p != heap; p = p->next_free) {
-			drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n", p->ofs,
-			       p->size, p->free ? 'F' : '.',
-			       p->reserved ? 'R' : '.');
+		for (bin = 0; bin < MM_BINS; bin++) {
+			for (p = Heap(heap)->bins[bin]; p; p = p->next_free) {
+				drmMsg(" FREE Offset:%08x, Size:%08x, %c%c\n",
+				       p->ofs, p->size, p->free ? 'F' : '.',
+				       p->reserved ? 'R' : '.');
+			}
 		}
 
 	}
@@ -56,12 +204,13 @@ void mmDumpMemInfo(const struct mem_block *heap)
 
 struct mem_block *mmInit(int ofs, int size)
 {
-	struct mem_block *heap, *block;
+	struct mem_heap *heap;
+	struct mem_block *block;
 
 	if (size <= 0)
 		return NULL;
 
-	heap = (struct mem_block *)calloc(1, sizeof(struct mem_block));
+	heap = (struct mem_heap *)calloc(1, sizeof(struct mem_heap));
 	if (!heap)
 		return NULL;
 
@@ -71,36 +220,40 @@ struct mem_block *mmInit(int ofs, int size)
 		return NULL;
 	}
 
-	heap->next = block;
-	heap->prev = block;
-	heap->next_free = block;
-	heap->prev_free = block;
+	heap->head.next = block;
+	heap->head.prev = block;
 
-	block->heap = heap;
-	block->next = heap;
-	block->prev = heap;
-	block->next_free = heap;
-	block->prev_free = heap;
+	block->heap = &heap->head;
+	block->next = &heap->head;
+	block->prev = &heap->head;
 
 	block->ofs = ofs;
 	block->size = size;
 	block->free = 1;
 
-	return heap;
+	InsertBlock(heap, block);
+	AddFree(heap, block);
+
+	return &heap->head;
 }
 
 static struct mem_block *SliceBlock(struct mem_block *p,
 				    int startofs, int size,
 				    int reserved, int alignment)
 {
+	struct mem_heap *heap = Heap(p->heap);
 	struct mem_block *newblock;
 
+	RemoveFree(heap, p);
+
 	/* break left  [p, newblock, p->next], then p = newblock */
 	if (startofs > p->ofs) {
 		newblock =
 		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		if (!newblock) {
+			AddFree(heap, p);
 			return NULL;
+		}
 		newblock->ofs = startofs;
 		newblock->size = p->size - (startofs - p->ofs);
 		newblock->free = 1;
@@ -111,12 +264,10 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 		p->next->prev = newblock;
 		p->next = newblock;
 
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+		InsertBlock(heap, newblock);
 
 		p->size -= newblock->size;
+		AddFree(heap, p);
 		p = newblock;
 	}
 
@@ -124,8 +275,10 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 	if (size < p->size) {
 		newblock =
 		    (struct mem_block *)calloc(1, sizeof(struct mem_block));
-		if (!newblock)
+		if (!newblock) {
+			AddFree(heap, p);
 			return NULL;
+		}
 		newblock->ofs = startofs + size;
 		newblock->size = p->size - size;
 		newblock->free = 1;
@@ -136,10 +289,8 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 		p->next->prev = newblock;
 		p->next = newblock;
 
-		newblock->next_free = p->next_free;
-		newblock->prev_free = p;
-		p->next_free->prev_free = newblock;
-		p->next_free = newblock;
+		InsertBlock(heap, newblock);
+		AddFree(heap, newblock);
 
 		p->size = size;
 	}
@@ -147,14 +298,6 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 	/* p = middle block */
 	p->free = 0;
 
-	/* Remove p from the free list: 
-	 */
-	p->next_free->prev_free = p->prev_free;
-	p->prev_free->next_free = p->next_free;
-
-	p->next_free = 0;
-	p->prev_free = 0;
-
 	p->reserved = reserved;
 	return p;
 }
@@ -162,52 +305,57 @@ static struct mem_block *SliceBlock(struct mem_block *p,
 struct mem_block *mmAllocMem(struct mem_block *heap, int size, int align2,
 			     int startSearch)
 {
-	struct mem_block *p;
+	struct mem_block *p, *best = NULL;
 	const int mask = (1 << align2) - 1;
-	int startofs = 0;
-	int endofs;
+	int startofs, beststart = 0;
+	int bin;
 
 	if (!heap || align2 < 0 || size <= 0)
 		return NULL;
 
-	for (p = heap->next_free; p != heap; p = p->next_free) {
-		assert(p->free);
-
-		startofs = (p->ofs + mask) & ~mask;
-		if (startofs < startSearch) {
-			startofs = startSearch;
+	/* Every block in a later bin is bigger than any in an earlier one,
+	 * so the first bin with a block that fits holds the best fit.
+	 */
+	for (bin = NextBin(Heap(heap), FreeBin(size)); bin >= 0;
+	     bin = NextBin(Heap(heap), bin + 1)) {
+		for (p = Heap(heap)->bins[bin]; p; p = p->next_free) {
+			assert(p->free);
+
+			startofs = (p->ofs + mask) & ~mask;
+			if (startofs < startSearch) {
+				startofs = startSearch;
+			}
+			if (startofs + size > p->ofs + p->size)
+				continue;
+			if (!best || p->size < best->size ||
+			    (p->size == best->size && p->ofs < best->ofs)) {
+				best = p;
+				beststart = startofs;
+			}
 		}
-		endofs = startofs + size;
-		if (endofs <= (p->ofs + p->size))
+		if (best)
 			break;
 	}
 
-	if (p == heap)
+	if (!best)
 		return NULL;
 
-	assert(p->free);
-	p = SliceBlock(p, startofs, size, 0, mask + 1);
-
-	return p;
+	return SliceBlock(best, beststart, size, 0, mask + 1);
 }
 
 struct mem_block *mmFindBlock(struct mem_block *heap, int start)
 {
-	struct mem_block *p;
+	struct mem_block *p = Heap(heap)->root;
 
-	for (p = heap->next; p != heap; p = p->next) {
-		if (p->ofs == start)
-			return p;
-	}
+	while (p && p->ofs != start)
+		p = start < p->ofs ? p->left : p->right;
 
-	return NULL;
+	return p;
 }
 
 static int Join2Blocks(struct mem_block *p)
 {
-	/* XXX there should be some assertions here */
-
-	/* NOTE: heap->free == 0 */
+	/* NOTE: heap->free == 0, and neither block is on a free list */
 
 	if (p->free && p->next->free) {
 		struct mem_block *q = p->next;
@@ -218,8 +366,7 @@ static int Join2Blocks(struct mem_block *p)
 		p->next = q->next;
 		q->next->prev = p;
 
-		q->next_free->prev_free = q->prev_free;
-		q->prev_free->next_free = q->next_free;
+		RemoveBlock(Heap(p->heap), q);
 
 		free(q);
 		return 1;
@@ -229,6 +376,8 @@ static int Join2Blocks(struct mem_block *p)
 
 int mmFreeMem(struct mem_block *b)
 {
+	struct mem_heap *heap;
+
 	if (!b)
 		return 0;
 
@@ -241,15 +390,20 @@ int mmFreeMem(struct mem_block *b)
 		return -1;
 	}
 
+	heap = Heap(b->heap);
 	b->free = 1;
-	b->next_free = b->heap->next_free;
-	b->prev_free = b->heap;
-	b->next_free->prev_free = b;
-	b->prev_free->next_free = b;
 
-	Join2Blocks(b);
-	if (b->prev != b->heap)
-		Join2Blocks(b->prev);
+	if (b->next->free) {
+		RemoveFree(heap, b->next);
+		Join2Blocks(b);
+	}
+	if (b->prev->free) {
+		b = b->prev;
+		RemoveFree(heap, b);
+		Join2Blocks(b);
+	}
+
+	AddFree(heap, b);
 
 	return 0;
 }
@@ -267,5 +421,5 @@ void mmDestroy(struct mem_block *heap)
 		p = next;
 	}
 
-	free(heap);
+	free(Heap(heap));
 }
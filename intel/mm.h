@@ -31,7 +31,10 @@
 
 struct mem_block {
 	struct mem_block *next, *prev;
+	/* Other free blocks of the same size class */
 	struct mem_block *next_free, *prev_free;
+	/* Children in the heap's tree of blocks by offset */
+	struct mem_block *left, *right;
 	struct mem_block *heap;
 	int ofs, size;
 	unsigned int free:1;
@@ -55,7 +58,8 @@ struct mem_block {
 extern struct mem_block *mmInit(int ofs, int size);
 
 /**
- * Allocate 'size' bytes with 2^align2 bytes alignment,
+ * Allocate 'size' bytes with 2^align2 bytes alignment from the smallest
+ * free block that can hold them,
  * restrict the search to free memory after 'startSearch'
  * depth and back buffers should be in different 4mb banks
  * to get better page hits if possible
@@ -75,7 +79,7 @@ extern struct mem_block *mmAllocMem(struct mem_block *heap, int size,
 extern int mmFreeMem(struct mem_block *b);
 
 /**
- * Free block starts at offset
+ * Find the block starting at offset, in O(log n)
  * input: pointer to a heap, start offset
  * return: pointer to a block
  */
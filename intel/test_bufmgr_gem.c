@@ -0,0 +1,1729 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Runs the GEM buffer manager against a small emulation of the i915 GEM
+ * ioctls, checking its bookkeeping without needing the hardware.  With
+ * -bench it also measures the paths that matter to heavy users.
+ */
+
+#include "intel_bufmgr_gem.c"
+
+#include <time.h>
+#include <pthread.h>
+
+#define MOCK_FD		0x7fff
+#define MOCK_PRIME_FD	0x10000
+#define MOCK_OBJECTS	(1 << 16)
+#define MOCK_EXEC_OBJECTS 4096
+
+#define NAMED_BOS	10000
+
+#define THREADS		4
+#define THREAD_LOOPS	50000
+
+#define EXEC_TARGETS	512
+#define EXEC_RELOCS	8192
+#define EXEC_LOOPS	200
+
+#define QUERY_RELOCS	10000
+
+#define STATE_BOS	1000
+
+#define RELEASE_BOS	2000
+#define RELEASE_SIZE	(64 * 1024)
+
+#define BUSY_BOS	64
+#define BUSY_FRAMES	200
+
+#define AUB_TARGETS	8
+#define AUB_TARGET_SIZE	(64 * 1024)
+#define AUB_EXECS	200
+#define AUB_IMAGE_SIZE	(16 * 1024 * 1024)
+
+struct mock_object {
+	uint64_t size;
+	uint32_t name;
+	uint32_t handle;	/* Handle open on MOCK_FD, 0 if none */
+	uint32_t seqno;		/* Last execbuffer that used the object */
+	char *data;		/* Contents for pread/pwrite, once used */
+};
+
+struct mock_handle {
+	uint32_t object;	/* Index into objects, 0 if the handle is free */
+};
+
+/* Object 0 and handle 0 are never used, as with the kernel. */
+static struct mock_object objects[MOCK_OBJECTS];
+static struct mock_handle handles[MOCK_OBJECTS];
+static uint32_t num_objects = 1, next_name = 1;
+static unsigned int gem_opens, gem_creates, gem_closes, madvises;
+/* Handles and flags of the last execbuffer's validation list */
+static uint32_t exec_handles[MOCK_EXEC_OBJECTS];
+static uint64_t exec_flags[MOCK_EXEC_OBJECTS];
+static uint64_t exec_offsets[MOCK_EXEC_OBJECTS];
+static uint32_t exec_count;
+static uint64_t exec_batch_flags;
+/* Execbuffers submitted, and retired: all of them unless a test holds
+ * some back */
+static uint32_t mock_seqno, mock_retired = UINT32_MAX;
+/* Error for the next execbuffers to fail with, if any */
+static int mock_exec_error;
+static uint32_t next_ctx_id = 1;
+static unsigned int busy_ioctls;
+static pthread_mutex_t mock_lock = PTHREAD_MUTEX_INITIALIZER;
+static int errors;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		errors++;						\
+	}								\
+} while (0)
+
+/* Returns the lowest free handle, which is what the kernel's idr does and
+ * what makes a stale handle index dangerous. */
+static uint32_t mock_new_handle(uint32_t object)
+{
+	uint32_t handle;
+
+	for (handle = 1; handle < MOCK_OBJECTS; handle++) {
+		if (!handles[handle].object) {
+			handles[handle].object = object;
+			objects[object].handle = handle;
+			return handle;
+		}
+	}
+	abort();
+}
+
+/* Creates an object somewhere else, e.g. in another process, and returns
+ * its flink name. */
+static uint32_t mock_foreign_object(uint64_t size)
+{
+	uint32_t object = num_objects++;
+
+	objects[object].size = size;
+	objects[object].name = next_name++;
+	return objects[object].name;
+}
+
+static uint32_t mock_object_by_name(uint32_t name)
+{
+	uint32_t object;
+
+	for (object = 1; object < num_objects; object++)
+		if (objects[object].name == name)
+			return object;
+	return 0;
+}
+
+static char *mock_object_data(uint32_t handle)
+{
+	struct mock_object *object = &objects[handles[handle].object];
+
+	if (!object->data)
+		object->data = calloc(1, object->size);
+	return object->data;
+}
+
+static int mock_ioctl(unsigned long request, void *arg)
+{
+	switch (request) {
+	case DRM_IOCTL_I915_GEM_GET_APERTURE: {
+		struct drm_i915_gem_get_aperture *aperture = arg;
+
+		aperture->aper_size = 1ull << 32;
+		aperture->aper_available_size = 1ull << 32;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GETPARAM: {
+		drm_i915_getparam_t *gp = arg;
+
+		switch (gp->param) {
+		case I915_PARAM_CHIPSET_ID:
+			*gp->value = 0x0166;	/* Ivybridge GT2 */
+			return 0;
+		case I915_PARAM_HAS_EXECBUF2:
+		case I915_PARAM_HAS_BSD:
+		case I915_PARAM_HAS_BLT:
+		case I915_PARAM_HAS_RELAXED_FENCING:
+		case I915_PARAM_HAS_LLC:
+		case I915_PARAM_HAS_EXEC_NO_RELOC:
+			*gp->value = 1;
+			return 0;
+		}
+		return -EINVAL;
+	}
+	case DRM_IOCTL_I915_GEM_CREATE: {
+		struct drm_i915_gem_create *create = arg;
+		uint32_t object = num_objects++;
+
+		objects[object].size = create->size;
+		create->handle = mock_new_handle(object);
+		gem_creates++;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_CLOSE: {
+		struct drm_gem_close *close_bo = arg;
+		uint32_t object = handles[close_bo->handle].object;
+
+		if (!object)
+			return -EINVAL;
+		handles[close_bo->handle].object = 0;
+		objects[object].handle = 0;
+		gem_closes++;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_OPEN: {
+		struct drm_gem_open *open_arg = arg;
+		uint32_t object = mock_object_by_name(open_arg->name);
+
+		if (!object)
+			return -ENOENT;
+		gem_opens++;
+		open_arg->handle = mock_new_handle(object);
+		open_arg->size = objects[object].size;
+		return 0;
+	}
+	case DRM_IOCTL_GEM_FLINK: {
+		struct drm_gem_flink *flink = arg;
+		uint32_t object = handles[flink->handle].object;
+
+		if (!object)
+			return -ENOENT;
+		if (!objects[object].name)
+			objects[object].name = next_name++;
+		flink->name = objects[object].name;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_HANDLE_TO_FD: {
+		struct drm_prime_handle *prime = arg;
+		uint32_t object = handles[prime->handle].object;
+
+		if (!object)
+			return -ENOENT;
+		prime->fd = MOCK_PRIME_FD + object;
+		return 0;
+	}
+	case DRM_IOCTL_PRIME_FD_TO_HANDLE: {
+		struct drm_prime_handle *prime = arg;
+		uint32_t object = prime->fd - MOCK_PRIME_FD;
+
+		if (object == 0 || object >= num_objects)
+			return -EBADF;
+		prime->handle = objects[object].handle;
+		if (!prime->handle)
+			prime->handle = mock_new_handle(object);
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_GET_TILING: {
+		struct drm_i915_gem_get_tiling *tiling = arg;
+
+		tiling->tiling_mode = I915_TILING_NONE;
+		tiling->swizzle_mode = I915_BIT_6_SWIZZLE_NONE;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_MMAP: {
+		struct drm_i915_gem_mmap *mmap_arg = arg;
+		void *addr;
+
+		if (!handles[mmap_arg->handle].object)
+			return -ENOENT;
+		addr = mmap(NULL, mmap_arg->size, PROT_READ | PROT_WRITE,
+			    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (addr == MAP_FAILED)
+			return -ENOMEM;
+		mmap_arg->addr_ptr = (uintptr_t) addr;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_MADVISE: {
+		struct drm_i915_gem_madvise *madv = arg;
+
+		madv->retained = 1;
+		madvises++;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_BUSY: {
+		struct drm_i915_gem_busy *busy = arg;
+
+		uint32_t object = handles[busy->handle].object;
+
+		if (!object)
+			return -ENOENT;
+		busy->busy = objects[object].seqno > mock_retired;
+		busy_ioctls++;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_EXECBUFFER2: {
+		struct drm_i915_gem_execbuffer2 *execbuf = arg;
+		struct drm_i915_gem_exec_object2 *exec =
+			(void *)(uintptr_t) execbuf->buffers_ptr;
+		uint32_t i;
+
+		if (execbuf->buffer_count > ARRAY_SIZE(exec_handles))
+			return -EINVAL;
+		if (mock_exec_error)
+			return mock_exec_error;
+		mock_seqno++;
+		for (i = 0; i < execbuf->buffer_count; i++) {
+			objects[handles[exec[i].handle].object].seqno =
+				mock_seqno;
+			exec_handles[i] = exec[i].handle;
+			exec_flags[i] = exec[i].flags;
+			exec_offsets[i] = exec[i].offset;
+			exec[i].offset = (uint64_t) exec[i].handle << 20;
+		}
+		exec_count = execbuf->buffer_count;
+		exec_batch_flags = execbuf->flags;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_CONTEXT_CREATE: {
+		struct drm_i915_gem_context_create *create = arg;
+
+		create->ctx_id = next_ctx_id++;
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_CONTEXT_DESTROY:
+		return 0;
+	case DRM_IOCTL_I915_GEM_PWRITE: {
+		struct drm_i915_gem_pwrite *pwrite = arg;
+
+		if (!handles[pwrite->handle].object)
+			return -ENOENT;
+		memcpy(mock_object_data(pwrite->handle) + pwrite->offset,
+		       (void *)(uintptr_t) pwrite->data_ptr, pwrite->size);
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_PREAD: {
+		struct drm_i915_gem_pread *pread = arg;
+
+		if (!handles[pread->handle].object)
+			return -ENOENT;
+		memcpy((void *)(uintptr_t) pread->data_ptr,
+		       mock_object_data(pread->handle) + pread->offset,
+		       pread->size);
+		return 0;
+	}
+	case DRM_IOCTL_I915_GEM_SET_DOMAIN:
+	case DRM_IOCTL_I915_GEM_SW_FINISH:
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+/* Called through a pointer the compiler can't see through, so that it
+ * judges the library's ioctl arguments as it would against the kernel
+ * rather than warning about what the mock leaves unset. */
+static int (*volatile mock_dispatch)(unsigned long, void *) = mock_ioctl;
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	int ret;
+
+	if (fd != MOCK_FD) {
+		errno = EBADF;
+		return -1;
+	}
+	/* Serialized, much like the kernel's struct_mutex */
+	pthread_mutex_lock(&mock_lock);
+	ret = mock_dispatch(request, arg);
+	pthread_mutex_unlock(&mock_lock);
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+/* libdrm binds its own calls to drmIoctl, so the prime helpers have to be
+ * replaced as well for the emulation to see them. */
+int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd)
+{
+	struct drm_prime_handle args;
+
+	memset(&args, 0, sizeof(args));
+	args.handle = handle;
+	args.flags = flags;
+	if (drmIoctl(fd, DRM_IOCTL_PRIME_HANDLE_TO_FD, &args))
+		return -errno;
+	*prime_fd = args.fd;
+	return 0;
+}
+
+int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle)
+{
+	struct drm_prime_handle args;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	args.fd = prime_fd;
+	ret = drmIoctl(fd, DRM_IOCTL_PRIME_FD_TO_HANDLE, &args);
+	/* Always set, or the compiler can't tell -errno is never 0 here */
+	*handle = args.handle;
+	return ret ? -errno : 0;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The lookup drm_intel_bo_gem_create_from_name used to do. */
+static drm_intel_bo_gem *
+named_list_lookup(drm_intel_bufmgr_gem *bufmgr_gem, uint32_t name)
+{
+	drm_intel_bo_gem *bo_gem;
+
+	DRMLISTFOREACHENTRY(bo_gem, &bufmgr_gem->named, name_list)
+		if (bo_gem->global_name == name)
+			return bo_gem;
+	return NULL;
+}
+
+static void test_named(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	static drm_intel_bo *bos[NAMED_BOS];
+	static uint32_t names[NAMED_BOS];
+	drm_intel_bo *bo, *local;
+	unsigned int i, opens;
+	uint32_t name, handle;
+	int prime_fd;
+
+	for (i = 0; i < NAMED_BOS; i++) {
+		names[i] = mock_foreign_object(4096);
+		bos[i] = drm_intel_bo_gem_create_from_name(bufmgr, "named",
+							   names[i]);
+		check(bos[i] && bos[i]->size == 4096);
+	}
+
+	/* Importing the same name again, or the same object through a prime
+	 * fd, finds the existing bo without a new GEM_OPEN. */
+	opens = gem_opens;
+	for (i = 0; i < NAMED_BOS; i++) {
+		bo = drm_intel_bo_gem_create_from_name(bufmgr, "named",
+						       names[i]);
+		check(bo == bos[i]);
+		drm_intel_bo_unreference(bo);
+	}
+	check(gem_opens == opens);
+	for (i = 0; i < NAMED_BOS; i++)
+		check(named_list_lookup(bufmgr_gem, names[i]) ==
+		      (drm_intel_bo_gem *) bos[i]);
+
+	bo = drm_intel_bo_gem_create_from_prime(bufmgr,
+						MOCK_PRIME_FD +
+						mock_object_by_name(names[7]),
+						4096);
+	check(bo == bos[7]);
+	drm_intel_bo_unreference(bo);
+
+	/* A local bo becomes visible to imports once exported. */
+	local = drm_intel_bo_alloc(bufmgr, "local", 4096, 4096);
+	check(local != NULL);
+	check(drm_intel_bo_gem_export_to_prime(local, &prime_fd) == 0);
+	bo = drm_intel_bo_gem_create_from_prime(bufmgr, prime_fd, 4096);
+	check(bo == local);
+	drm_intel_bo_unreference(bo);
+	check(drm_intel_bo_flink(local, &name) == 0);
+	bo = drm_intel_bo_gem_create_from_name(bufmgr, "local", name);
+	check(bo == local);
+	drm_intel_bo_unreference(bo);
+
+	/* Once the last reference goes, the handle is closed and may be
+	 * reused for a different object, which must not find the old bo. */
+	handle = ((drm_intel_bo_gem *) bos[0])->gem_handle;
+	for (i = 0; i < NAMED_BOS; i++)
+		drm_intel_bo_unreference(bos[i]);
+	name = mock_foreign_object(8192);
+	bo = drm_intel_bo_gem_create_from_name(bufmgr, "reused", name);
+	check(bo && bo->size == 8192);
+	check(((drm_intel_bo_gem *) bo)->gem_handle == handle);
+	drm_intel_bo_unreference(bo);
+
+	bo = drm_intel_bo_gem_create_from_name(bufmgr, "named", names[0]);
+	check(bo && bo != bos[0] && bo->size == 4096);
+	drm_intel_bo_unreference(bo);
+	drm_intel_bo_unreference(local);
+
+	check(DRMLISTEMPTY(&bufmgr_gem->named));
+	check(named_list_lookup(bufmgr_gem, names[0]) == NULL);
+}
+
+/* Times create_from_name finding an already imported name, and puts the
+ * time the linear list search it replaced would take in *linear. */
+static double bench_named(drm_intel_bufmgr *bufmgr, double *linear)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	static drm_intel_bo *bos[NAMED_BOS];
+	static uint32_t names[NAMED_BOS];
+	drm_intel_bo *bo;
+	double start, indexed;
+	unsigned int i;
+
+	for (i = 0; i < NAMED_BOS; i++) {
+		names[i] = mock_foreign_object(4096);
+		bos[i] = drm_intel_bo_gem_create_from_name(bufmgr, "named",
+							   names[i]);
+	}
+
+	start = now();
+	for (i = 0; i < NAMED_BOS; i++) {
+		bo = drm_intel_bo_gem_create_from_name(bufmgr, "named",
+						       names[i]);
+		drm_intel_bo_unreference(bo);
+	}
+	indexed = now() - start;
+
+	start = now();
+	for (i = 0; i < NAMED_BOS; i++)
+		check(named_list_lookup(bufmgr_gem, names[i]) ==
+		      (drm_intel_bo_gem *) bos[i]);
+	*linear = (now() - start) * 1e9 / NAMED_BOS;
+
+	for (i = 0; i < NAMED_BOS; i++)
+		drm_intel_bo_unreference(bos[i]);
+	return indexed * 1e9 / NAMED_BOS;
+}
+
+static struct drm_intel_gem_bo_magazine *
+thread_magazine(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	return pthread_getspecific(bufmgr_gem->magazine_key);
+}
+
+static drm_intel_bo_gem *
+cached_bo(drm_intel_bufmgr *bufmgr, unsigned long size)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	struct drm_intel_gem_bo_bucket *bucket;
+
+	bucket = drm_intel_gem_bo_bucket_for_size(bufmgr_gem, size);
+	if (DRMLISTEMPTY(&bucket->head))
+		return NULL;
+	return DRMLISTENTRY(drm_intel_bo_gem, bucket->head.prev, head);
+}
+
+static void *exiting_thread(void *data)
+{
+	drm_intel_bufmgr *bufmgr = data;
+	drm_intel_bo *bos[3];
+	int i;
+
+	for (i = 0; i < 3; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "exiting", 12288, 4096);
+	for (i = 0; i < 3; i++)
+		drm_intel_bo_unreference(bos[i]);
+	check(thread_magazine(bufmgr) &&
+	      thread_magazine(bufmgr)->count[2] == 3);
+	return NULL;
+}
+
+static void test_thread_cache(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo *bo, *bos[DRM_INTEL_GEM_MAGAZINE_SIZE + 1];
+	struct drm_intel_gem_bo_magazine *mag;
+	unsigned int creates, madvs;
+	uint32_t name;
+	pthread_t thread;
+	int i;
+
+	/* Freeing and reallocating stays within the thread, without even
+	 * madvising the buffer. */
+	bo = drm_intel_bo_alloc(bufmgr, "churn", 4096, 4096);
+	drm_intel_bo_unreference(bo);
+	creates = gem_creates;
+	madvs = madvises;
+	check(drm_intel_bo_alloc(bufmgr, "churn", 4096, 4096) == bo);
+	drm_intel_bo_unreference(bo);
+	check(gem_creates == creates && madvises == madvs);
+	mag = thread_magazine(bufmgr);
+	check(mag && mag->count[0] == 1 && cached_bo(bufmgr, 4096) == NULL);
+
+	/* An overfull magazine hands its oldest buffers to the shared cache */
+	for (i = 0; i < DRM_INTEL_GEM_MAGAZINE_SIZE + 1; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "overflow", 8192, 4096);
+	for (i = 0; i < DRM_INTEL_GEM_MAGAZINE_SIZE + 1; i++)
+		drm_intel_bo_unreference(bos[i]);
+	check(mag->count[1] == DRM_INTEL_GEM_MAGAZINE_SIZE / 2);
+	check(cached_bo(bufmgr, 8192) ==
+	      (drm_intel_bo_gem *) bos[DRM_INTEL_GEM_MAGAZINE_SIZE / 2]);
+
+	/* Large and named buffers take the shared path */
+	bo = drm_intel_bo_alloc(bufmgr, "large", 4 << 20, 4096);
+	drm_intel_bo_unreference(bo);
+	check(cached_bo(bufmgr, 4 << 20) == (drm_intel_bo_gem *) bo);
+
+	bo = drm_intel_bo_alloc(bufmgr, "named", 4096, 4096);
+	drm_intel_bo_flink(bo, &name);
+	drm_intel_bo_unreference(bo);
+	check(mag->count[0] == 0);
+
+	/* A thread hands back what it holds when it exits */
+	pthread_create(&thread, NULL, exiting_thread, bufmgr);
+	pthread_join(thread, NULL);
+	check(cached_bo(bufmgr, 12288) != NULL);
+	check(bufmgr_gem->magazines.next == &mag->link &&
+	      mag->link.next == &bufmgr_gem->magazines);
+}
+
+/* Two bursts of allocations separated by a few idle seconds, returning the
+ * fraction of the second burst served from the cache. */
+static double burst_hit_rate(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bufmgr_gem_cache_stats before, after;
+	drm_intel_bo *bos[32];
+	struct timespec time;
+	int i, burst;
+
+	for (burst = 0; burst < 2; burst++) {
+		drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &before);
+		for (i = 0; i < 32; i++)
+			bos[i] = drm_intel_bo_alloc(bufmgr, "burst", 1 << 20,
+						    4096);
+		for (i = 0; i < 32; i++)
+			drm_intel_bo_unreference(bos[i]);
+		drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &after);
+
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		pthread_mutex_lock(&bufmgr_gem->lock);
+		drm_intel_gem_cleanup_bo_cache(bufmgr_gem, time.tv_sec + 3);
+		pthread_mutex_unlock(&bufmgr_gem->lock);
+	}
+
+	return (double) (after.hits - before.hits) / 32;
+}
+
+static void test_cache_policy(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bufmgr_gem_cache_stats stats;
+	unsigned long size = (200 << 20) + 123;
+	drm_intel_bo *bo, *bos[8];
+	double aged, limited;
+	int i;
+
+	/* A size beyond the fixed buckets gets its own after a few uses */
+	for (i = 0; i < DRM_INTEL_GEM_LEARN_COUNT; i++) {
+		bo = drm_intel_bo_alloc(bufmgr, "video", size, 4096);
+		drm_intel_bo_unreference(bo);
+	}
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.buckets ==
+	      (unsigned int) bufmgr_gem->num_fixed_buckets + 1);
+	check(stats.hits == 0 && stats.misses == DRM_INTEL_GEM_LEARN_COUNT);
+	check(stats.bos_retained == 1 &&
+	      stats.bytes_retained == ALIGN(size, 4096));
+	check(drm_intel_bo_alloc(bufmgr, "video", size, 4096) == bo);
+	check(bo->size == ALIGN(size, 4096));
+	drm_intel_bo_unreference(bo);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.hits == 1);
+
+	/* A limited cache drops the least recently freed buffers first, and
+	 * keeps the rest however long they sit unused */
+	drm_intel_bufmgr_gem_set_cache_size(bufmgr, 1 << 20);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.bos_retained == 0 && stats.evictions == 1);
+	for (i = 0; i < 8; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "limited", 256 << 10, 4096);
+	for (i = 0; i < 8; i++)
+		drm_intel_bo_unreference(bos[i]);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.bytes_retained == 1 << 20 && stats.evictions == 5);
+	check(cached_bo(bufmgr, 256 << 10) == (drm_intel_bo_gem *) bos[7]);
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_cleanup_bo_cache(bufmgr_gem, bufmgr_gem->time + 10);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+	check(bufmgr_gem->cache_bytes == 1 << 20);
+
+	drm_intel_bufmgr_gem_set_cache_size(bufmgr, 0);
+	aged = burst_hit_rate(bufmgr);
+	drm_intel_bufmgr_gem_set_cache_size(bufmgr, 64 << 20);
+	limited = burst_hit_rate(bufmgr);
+	printf("bursts 3s apart: aged cache %3.0f%% hits, "
+	       "64MB LRU cache %3.0f%% hits\n", aged * 100, limited * 100);
+	check(aged == 0 && limited == 1);
+}
+
+/* Records the last execbuffer's list as indices into targets[], with the
+ * batch as -1. */
+static int exec_list(drm_intel_bo *batch, drm_intel_bo **targets,
+		     int count, int *list)
+{
+	unsigned int i;
+	int j;
+
+	check(drm_intel_bo_exec(batch, 4096, NULL, 0, 0) == 0);
+	for (i = 0; i < exec_count; i++) {
+		list[i] = -2;
+		if (exec_handles[i] == ((drm_intel_bo_gem *) batch)->gem_handle)
+			list[i] = -1;
+		for (j = 0; j < count; j++)
+			if (exec_handles[i] ==
+			    ((drm_intel_bo_gem *) targets[j])->gem_handle)
+				list[i] = j;
+	}
+	return exec_count;
+}
+
+static void emit_relocs(drm_intel_bo *batch, drm_intel_bo **targets,
+			int count, int relocs)
+{
+	int i;
+
+	for (i = 0; i < relocs; i++)
+		drm_intel_bo_emit_reloc(batch, i * 4, targets[(i / 3) % count],
+					0, I915_GEM_DOMAIN_RENDER, 0);
+}
+
+/* Batches with and without incremental validation have to be submitted
+ * with the same list, in the same order, as the tree changes. */
+static void test_validate(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	int walked[ARRAY_SIZE(exec_handles)], copied[ARRAY_SIZE(exec_handles)];
+	drm_intel_bo *targets[40], *walk, *copy;
+	int i, count;
+
+	drm_intel_bufmgr_gem_enable_incremental_validate(bufmgr);
+	for (i = 0; i < 40; i++)
+		targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	/* A state buffer with relocations of its own */
+	for (i = 0; i < 5; i++)
+		drm_intel_bo_emit_reloc(targets[7], i * 4, targets[35 + i], 0,
+					I915_GEM_DOMAIN_SAMPLER, 0);
+
+	walk = drm_intel_bo_alloc(bufmgr, "walk", 16384, 4096);
+	copy = drm_intel_bo_alloc(bufmgr, "copy", 16384, 4096);
+	bufmgr_gem->incremental_validate = false;
+	emit_relocs(walk, targets, 32, 200);
+	bufmgr_gem->incremental_validate = true;
+	emit_relocs(copy, targets, 32, 200);
+	check(((drm_intel_bo_gem *) copy)->validate_count == 37);
+	check(((drm_intel_bo_gem *) walk)->validate_table == NULL);
+
+	count = exec_list(walk, targets, 40, walked);
+	check(count == 38);
+	check(exec_list(copy, targets, 40, copied) == count &&
+	      memcmp(walked, copied, sizeof(int) * count) == 0);
+	check(copied[count - 1] == -1);
+	check(targets[7]->offset64 == (uint64_t)
+	      ((drm_intel_bo_gem *) targets[7])->gem_handle << 20);
+
+	/* Rolling back part of the batch drops what only it referenced */
+	drm_intel_gem_bo_clear_relocs(walk, 20);
+	drm_intel_gem_bo_clear_relocs(copy, 20);
+	count = exec_list(walk, targets, 40, walked);
+	check(count == 8);
+	check(exec_list(copy, targets, 40, copied) == count &&
+	      memcmp(walked, copied, sizeof(int) * count) == 0);
+
+	/* Relocations emitted before enabling it are picked up */
+	emit_relocs(walk, targets, 10, 30);
+	check(((drm_intel_bo_gem *) walk)->validate_count == 15);
+	check(exec_list(walk, targets, 40, walked) == 16);
+
+	drm_intel_bo_unreference(walk);
+	drm_intel_bo_unreference(copy);
+	for (i = 0; i < 40; i++)
+		drm_intel_bo_unreference(targets[i]);
+	check(bufmgr_gem->cache_count == 42);
+}
+
+/* Queries match the tree walk before and after the list is built, as the
+ * batch grows and as it is rolled back. */
+static void test_references(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo *targets[40], *batch;
+	int i, j;
+
+	for (i = 0; i < 40; i++)
+		targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	for (i = 0; i < 5; i++)
+		drm_intel_bo_emit_reloc(targets[7], i * 4, targets[35 + i], 0,
+					I915_GEM_DOMAIN_SAMPLER, 0);
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 16384, 4096);
+	drm_intel_bo_emit_reloc(batch, 0, batch, 0,
+				I915_GEM_DOMAIN_INSTRUCTION, 0);
+
+	for (j = 0; j < 4; j++) {
+		if (j == 1)
+			emit_relocs(batch, targets, 10, 30);
+		if (j == 2)
+			emit_relocs(batch, targets, 20, 60);
+		if (j == 3)
+			drm_intel_gem_bo_clear_relocs(batch, 10);
+		for (i = 0; i < 40; i++)
+			check(drm_intel_bo_references(batch, targets[i]) ==
+			      _drm_intel_gem_bo_references(batch, targets[i]));
+		check(drm_intel_bo_references(targets[7], targets[36]));
+		check(!drm_intel_bo_references(targets[7], targets[6]));
+	}
+	/* Queries only keep a list when exec would use it anyway */
+	check((((drm_intel_bo_gem *) batch)->validate_table != NULL) ==
+	      bufmgr_gem->incremental_validate);
+	check(((drm_intel_bo_gem *) targets[7])->validate_table == NULL ||
+	      bufmgr_gem->incremental_validate);
+	check(!drm_intel_bo_references(batch, targets[7]) &&
+	      drm_intel_bo_references(batch, targets[2]));
+	check(drm_intel_bo_exec(batch, 4096, NULL, 0, 0) == 0);
+	check(exec_count == 4);
+
+	drm_intel_bo_unreference(batch);
+	for (i = 0; i < 40; i++)
+		drm_intel_bo_unreference(targets[i]);
+}
+
+/* Builds a batch of QUERY_RELOCS relocations to as many buffers, checking
+ * it references each target after emitting the relocation to it, as a
+ * driver does before mapping a buffer.  Returns the time per query. */
+static double bench_references(drm_intel_bufmgr *bufmgr, bool walk)
+{
+	drm_intel_bo **targets, *batch;
+	double start, total = 0;
+	int i, found = 0;
+
+	targets = calloc(QUERY_RELOCS, sizeof(*targets));
+	for (i = 0; i < QUERY_RELOCS; i++)
+		targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	batch = drm_intel_bo_alloc(bufmgr, "batch", QUERY_RELOCS * 8, 4096);
+
+	for (i = 0; i < QUERY_RELOCS; i++) {
+		drm_intel_bo_emit_reloc(batch, i * 4, targets[i], 0,
+					I915_GEM_DOMAIN_RENDER, 0);
+		start = now();
+		if (walk)
+			found += _drm_intel_gem_bo_references(batch, targets[i]);
+		else
+			found += drm_intel_bo_references(batch, targets[i]);
+		total += now() - start;
+	}
+	check(found == QUERY_RELOCS);
+
+	drm_intel_bo_unreference(batch);
+	for (i = 0; i < QUERY_RELOCS; i++)
+		drm_intel_bo_unreference(targets[i]);
+	free(targets);
+	return total * 1e9 / QUERY_RELOCS;
+}
+
+/* Submits a batch of relocations to targets, the first of them written,
+ * returning whether the kernel was told to skip relocation processing. */
+static bool exec_no_reloc(drm_intel_bufmgr *bufmgr, drm_intel_bo **targets,
+			  int count, drm_intel_bo *moved)
+{
+	drm_intel_bo *batch;
+	uint64_t offset, presumed[16];
+	int i;
+
+	for (i = 0; i < count; i++)
+		presumed[i] = targets[i]->offset64;
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	drm_intel_bo_emit_reloc(batch, 0, targets[0], 0,
+				I915_GEM_DOMAIN_RENDER,
+				I915_GEM_DOMAIN_RENDER);
+	for (i = 1; i < count; i++)
+		drm_intel_bo_emit_reloc(batch, i * 4, targets[i], 0,
+					I915_GEM_DOMAIN_SAMPLER, 0);
+	if (moved) {
+		/* Another relocation after it was moved and put back */
+		offset = moved->offset64;
+		moved->offset64 = offset + 4096;
+		drm_intel_bo_emit_reloc(batch, count * 4, moved, 0,
+					I915_GEM_DOMAIN_SAMPLER, 0);
+		moved->offset64 = offset;
+	}
+
+	check(drm_intel_bo_exec(batch, 4096, NULL, 0, 0) == 0);
+	check(exec_count == (uint32_t) count + 1);
+	for (i = 0; i < count; i++) {
+		check(!!(exec_flags[i] & EXEC_OBJECT_WRITE) == (i == 0));
+		if (exec_batch_flags & I915_EXEC_NO_RELOC)
+			check(exec_offsets[i] == presumed[i]);
+	}
+	drm_intel_bo_unreference(batch);
+
+	return exec_batch_flags & I915_EXEC_NO_RELOC;
+}
+
+static void test_no_reloc(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo *targets[8];
+	int i;
+
+	drm_intel_bufmgr_gem_enable_no_reloc(bufmgr);
+	check(bufmgr_gem->no_reloc && bufmgr_gem->incremental_validate);
+	for (i = 0; i < 8; i++)
+		targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	/* The last one is a state buffer with relocations of its own */
+	drm_intel_bo_emit_reloc(targets[7], 0, targets[6], 0,
+				I915_GEM_DOMAIN_SAMPLER, 0);
+
+	/* Nothing has been placed yet, so offset 0 is what's presumed */
+	check(exec_no_reloc(bufmgr, targets, 8, NULL));
+	check(targets[3]->offset64 ==
+	      (uint64_t) ((drm_intel_bo_gem *) targets[3])->gem_handle << 20);
+	check(exec_no_reloc(bufmgr, targets, 8, NULL));
+
+	/* Relocations disagreeing about where a buffer is */
+	check(!exec_no_reloc(bufmgr, targets, 8, targets[5]));
+
+	/* The state buffer's relocations presuming an old offset */
+	targets[6]->offset64 += 4096;
+	check(!exec_no_reloc(bufmgr, targets, 8, NULL));
+	check(exec_no_reloc(bufmgr, targets, 6, NULL));
+
+	for (i = 0; i < 8; i++)
+		drm_intel_bo_unreference(targets[i]);
+}
+
+/* Many small state buffers with a few relocations each, and one batch
+ * with many, only hold storage for what they use. */
+static void test_reloc_storage(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	size_t entry = sizeof(struct drm_i915_gem_relocation_entry) +
+		sizeof(drm_intel_reloc_target);
+	drm_intel_bufmgr_gem_reloc_stats stats;
+	drm_intel_bo **state, *target, *batch;
+	int i, upfront;
+
+	state = calloc(STATE_BOS, sizeof(*state));
+	target = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+	for (i = 0; i < STATE_BOS; i++) {
+		state[i] = drm_intel_bo_alloc(bufmgr, "state", 4096, 4096);
+		emit_relocs(state[i], &target, 1, 3);
+	}
+	drm_intel_bufmgr_gem_get_reloc_stats(bufmgr, &stats);
+	check(stats.bos == STATE_BOS && stats.validate_bytes == 0);
+	check(stats.reloc_bytes ==
+	      STATE_BOS * DRM_INTEL_GEM_INITIAL_RELOCS * entry);
+	/* Previously each got max_relocs entries, capped at one per word */
+	upfront = bufmgr_gem->max_relocs < 4096 / 4 ?
+		bufmgr_gem->max_relocs : 4096 / 4;
+	printf("%d state buffers with 3 relocations: %6lu KB of relocation "
+	       "storage, %6lu KB allocated up front\n", STATE_BOS,
+	       (unsigned long) stats.reloc_bytes / 1024,
+	       (unsigned long) (STATE_BOS * upfront * entry / 1024));
+
+	/* A batch grows as it fills, up to max_relocs */
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 16384, 4096);
+	for (i = 0; i < bufmgr_gem->max_relocs - 1; i++)
+		check(drm_intel_bo_emit_reloc(batch, i * 4,
+					      state[i % STATE_BOS], 0,
+					      I915_GEM_DOMAIN_RENDER, 0) == 0);
+	check(((drm_intel_bo_gem *) batch)->relocs[1000].offset == 4000);
+	check(((drm_intel_bo_gem *) batch)->reloc_target_info[999].bo ==
+	      state[999]);
+	drm_intel_bufmgr_gem_get_reloc_stats(bufmgr, &stats);
+	check(stats.bos == STATE_BOS + 1);
+	check(stats.reloc_bytes == (STATE_BOS * DRM_INTEL_GEM_INITIAL_RELOCS +
+				    bufmgr_gem->max_relocs) * entry);
+	check(drm_intel_bo_exec(batch, 4096, NULL, 0, 0) == 0);
+	check(exec_count == STATE_BOS + 2);
+
+	/* Going past it fails that relocation but leaves the batch usable */
+	check(drm_intel_bo_emit_reloc(batch, 0, target, 0,
+				      I915_GEM_DOMAIN_RENDER, 0) == 0);
+	check(drm_intel_bo_emit_reloc(batch, 4, target, 0,
+				      I915_GEM_DOMAIN_RENDER, 0) == -ENOSPC);
+	check(!((drm_intel_bo_gem *) batch)->has_error);
+	drm_intel_gem_bo_clear_relocs(batch, 0);
+	check(drm_intel_bo_emit_reloc(batch, 4, target, 0,
+				      I915_GEM_DOMAIN_RENDER, 0) == 0);
+	check(drm_intel_bo_exec(batch, 4096, NULL, 0, 0) == 0);
+	check(exec_count == 2);
+
+	drm_intel_bo_unreference(batch);
+	for (i = 0; i < STATE_BOS; i++)
+		drm_intel_bo_unreference(state[i]);
+	drm_intel_bo_unreference(target);
+	free(state);
+
+	drm_intel_bufmgr_gem_get_reloc_stats(bufmgr, &stats);
+	check(stats.bos == 0 && stats.reloc_bytes == 0);
+}
+
+static void release_wait(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	drm_intel_gem_release_drain(bufmgr_gem);
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+/* Released buffers reach the cache, or get closed, on the worker */
+/* Makes every cached buffer look long unused */
+static void age_cache(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo_gem *bo_gem;
+	int i;
+
+	pthread_mutex_lock(&bufmgr_gem->lock);
+	for (i = 0; i < bufmgr_gem->num_buckets; i++)
+		DRMLISTFOREACHENTRY(bo_gem, &bufmgr_gem->cache_bucket[i].head,
+				    head)
+			bo_gem->free_time -= 10;
+	bufmgr_gem->time = 0;
+	pthread_mutex_unlock(&bufmgr_gem->lock);
+}
+
+static void test_deferred_release(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem_cache_stats before, stats;
+	drm_intel_bo *bos[4], *bo;
+	unsigned int closes = gem_closes, advised = madvises;
+	uint32_t name;
+	int i, prime_fd;
+
+	drm_intel_bufmgr_gem_enable_deferred_release(bufmgr);
+	for (i = 0; i < 4; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "released", 4096, 4096);
+	/* Shared, so it can't be reused */
+	check(drm_intel_bo_flink(bos[1], &name) == 0);
+	check(drm_intel_bo_map(bos[2], 1) == 0);
+	memset(bos[2]->virtual, 0xaa, 4096);
+	drm_intel_bo_unmap(bos[2]);
+	/* The batch takes its targets with it */
+	drm_intel_bo_emit_reloc(bos[0], 0, bos[3], 0,
+				I915_GEM_DOMAIN_RENDER, 0);
+	drm_intel_bo_unreference(bos[3]);
+
+	for (i = 0; i < 3; i++)
+		drm_intel_bo_unreference(bos[i]);
+	release_wait(bufmgr);
+
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.bos_retained == 3);
+	check(gem_closes - closes == 1 && madvises - advised == 3);
+
+	/* Kept mapped while cached, as without the worker */
+	bo = drm_intel_bo_alloc(bufmgr, "reused", 4096, 4096);
+	check(bo == bos[0] || bo == bos[2] || bo == bos[3]);
+	drm_intel_bo_unreference(bo);
+	release_wait(bufmgr);
+
+	/* A shared buffer is closed at once, so importing the object again
+	 * gets a handle the worker won't close under it */
+	bo = drm_intel_bo_alloc(bufmgr, "exported", 4096, 4096);
+	check(drm_intel_bo_gem_export_to_prime(bo, &prime_fd) == 0);
+	drm_intel_bo_unreference(bo);
+	bo = drm_intel_bo_gem_create_from_prime(bufmgr, prime_fd, 4096);
+	check(bo != NULL);
+	if (bo) {
+		release_wait(bufmgr);
+		check(handles[((drm_intel_bo_gem *) bo)->gem_handle].object ==
+		      (uint32_t) (prime_fd - MOCK_PRIME_FD));
+		drm_intel_bo_unreference(bo);
+	}
+
+	/* Releasing a buffer still ages out the cache, without waiting for
+	 * the worker to wake up */
+	age_cache(bufmgr);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &before);
+	check(before.bos_retained > 0);
+	bo = drm_intel_bo_alloc(bufmgr, "released", 65536, 4096);
+	drm_intel_bo_unreference(bo);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.bos_retained == 0);
+	check(stats.evictions == before.evictions + before.bos_retained);
+	release_wait(bufmgr);
+
+	/* A new cache limit waits for the worker, so it covers buffers
+	 * released just before */
+	for (i = 0; i < 4; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "limited", 4096, 4096);
+	for (i = 0; i < 4; i++)
+		drm_intel_bo_unreference(bos[i]);
+	drm_intel_bufmgr_gem_set_cache_size(bufmgr, 8192);
+	check(DRMLISTEMPTY(&((drm_intel_bufmgr_gem *) bufmgr)->release_list));
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &stats);
+	check(stats.bytes_retained == 8192);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	const double *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/* Maps, writes and drops buffers, timing the final unreference on this
+ * thread.  Returns the median and puts the 99th percentile in *tail; on a
+ * single CPU the worker's share of the mean lands on the caller anyway. */
+static double bench_release(drm_intel_bufmgr *bufmgr, double *tail)
+{
+	static double times[RELEASE_BOS];
+	drm_intel_bo *bo;
+	double start;
+	int i;
+
+	for (i = 0; i < RELEASE_BOS; i++) {
+		bo = drm_intel_bo_alloc(bufmgr, "released", RELEASE_SIZE, 4096);
+		drm_intel_bo_map(bo, 1);
+		memset(bo->virtual, i, RELEASE_SIZE);
+		drm_intel_bo_unmap(bo);
+
+		start = now();
+		drm_intel_bo_unreference(bo);
+		times[i] = (now() - start) * 1e9;
+	}
+	qsort(times, RELEASE_BOS, sizeof(times[0]), compare_double);
+	*tail = times[RELEASE_BOS * 99 / 100];
+	return times[RELEASE_BOS / 2];
+}
+
+/* Submits bos[] from a fresh batch on ring and drops the batch */
+static void exec_busy(drm_intel_bufmgr *bufmgr, drm_intel_bo **bos,
+		      int count, int ring)
+{
+	drm_intel_bo *batch;
+	int i;
+
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	for (i = 0; i < count; i++)
+		drm_intel_bo_emit_reloc(batch, i * 4, bos[i], 0,
+					I915_GEM_DOMAIN_RENDER, 0);
+	check(drm_intel_bo_mrb_exec(batch, 4096, NULL, 0, 0, ring) == 0);
+	drm_intel_bo_unreference(batch);
+}
+
+/* Once one buffer from a submission is found idle, the others and
+ * everything submitted before them on the same ring are idle too. */
+static void test_busy_tracking(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bufmgr_gem_cache_stats before, after;
+	drm_intel_bo *bos[BUSY_BOS], *bo, *blt;
+	unsigned int creates, ioctls;
+	int i;
+
+	mock_retired = mock_seqno;
+	for (i = 0; i < BUSY_BOS; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "busy", 8192, 4096);
+	exec_busy(bufmgr, bos, BUSY_BOS, I915_EXEC_RENDER);
+	for (i = 0; i < BUSY_BOS; i++)
+		drm_intel_bo_unreference(bos[i]);
+
+	/* Still running: not reused, and each attempt asks the kernel */
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &before);
+	creates = gem_creates;
+	bo = drm_intel_bo_alloc(bufmgr, "busy", 8192, 4096);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &after);
+	check(gem_creates == creates + 1);
+	check(after.busy_queries == before.busy_queries + 1);
+	drm_intel_bo_unreference(bo);
+
+	/* One query finds the submission complete, the rest need none */
+	mock_retired = mock_seqno;
+	before = after;
+	creates = gem_creates;
+	for (i = 0; i < BUSY_BOS; i++)
+		bos[i] = drm_intel_bo_alloc(bufmgr, "busy", 8192, 4096);
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &after);
+	check(gem_creates == creates);
+	check(after.busy_queries == before.busy_queries + 1);
+	check(after.busy_avoided >= before.busy_avoided + BUSY_BOS - 1);
+
+	/* Rings complete independently: a buffer queued on the blitter
+	 * is not idle because the render ring has caught up. */
+	blt = bos[0];
+	exec_busy(bufmgr, &blt, 1, I915_EXEC_BLT);
+	exec_busy(bufmgr, &bos[1], 1, I915_EXEC_RENDER);
+	mock_retired = mock_seqno;
+	check(!drm_intel_bo_busy(bos[1]));
+	mock_retired = mock_seqno - 2;
+	ioctls = busy_ioctls;
+	check(drm_intel_bo_busy(blt));
+	check(busy_ioctls == ioctls + 1);
+
+	/* Queued on two rings at once, it takes the kernel's word for it */
+	exec_busy(bufmgr, &blt, 1, I915_EXEC_RENDER);
+	check(((drm_intel_bo_gem *) blt)->exec_ring == -1);
+	mock_retired = mock_seqno;
+	ioctls = busy_ioctls;
+	check(!drm_intel_bo_busy(blt));
+	check(busy_ioctls == ioctls + 1);
+
+	for (i = 0; i < BUSY_BOS; i++)
+		drm_intel_bo_unreference(bos[i]);
+	mock_retired = UINT32_MAX;
+}
+
+/* Only submissions the kernel queued count towards a ring's progress,
+ * and only those from the default context to a single ring. */
+static void test_busy_unordered(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *running, *idle, *batch;
+	drm_intel_context *ctx;
+	unsigned int ioctls;
+
+	running = drm_intel_bo_alloc(bufmgr, "running", 8192, 4096);
+	idle = drm_intel_bo_alloc(bufmgr, "idle", 8192, 4096);
+	exec_busy(bufmgr, &running, 1, I915_EXEC_RENDER);
+	mock_retired = mock_seqno - 1;
+
+	/* A failed submission leaves idle as it was, so finding it idle
+	 * says nothing about running */
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	drm_intel_bo_emit_reloc(batch, 0, idle, 0, I915_GEM_DOMAIN_RENDER, 0);
+	mock_exec_error = -EIO;
+	check(drm_intel_bo_mrb_exec(batch, 4096, NULL, 0, 0,
+				    I915_EXEC_RENDER) == -EIO);
+	mock_exec_error = 0;
+	drm_intel_bo_unreference(batch);
+	check(!drm_intel_bo_busy(idle));
+	check(drm_intel_bo_busy(running));
+
+	/* Another context's batch may finish before running does */
+	ctx = drm_intel_gem_context_create(bufmgr);
+	check(ctx != NULL);
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	drm_intel_bo_emit_reloc(batch, 0, idle, 0, I915_GEM_DOMAIN_RENDER, 0);
+	check(drm_intel_gem_bo_context_exec(batch, ctx, 4096,
+					    I915_EXEC_RENDER) == 0);
+	drm_intel_bo_unreference(batch);
+	check(((drm_intel_bo_gem *) idle)->exec_ring == -1);
+	/* ... and here it does */
+	objects[handles[((drm_intel_bo_gem *) idle)->gem_handle].object].seqno = 0;
+	ioctls = busy_ioctls;
+	check(!drm_intel_bo_busy(idle));
+	check(drm_intel_bo_busy(running));
+	check(busy_ioctls == ioctls + 2);
+	drm_intel_gem_context_destroy(ctx);
+
+	/* As may a batch sent to whichever video ring is free */
+	exec_busy(bufmgr, &idle, 1, I915_EXEC_BSD);
+	check(((drm_intel_bo_gem *) idle)->exec_ring == -1);
+
+	drm_intel_bo_unreference(idle);
+	drm_intel_bo_unreference(running);
+	mock_retired = UINT32_MAX;
+}
+
+/* Allocates, submits and frees BUSY_BOS buffers a frame, with the GPU a
+ * frame behind, and returns the busy ioctls needed per reuse check. */
+static double bench_busy(drm_intel_bufmgr *bufmgr, unsigned int *checks)
+{
+	drm_intel_bufmgr_gem_cache_stats before, after;
+	drm_intel_bo *bos[BUSY_BOS];
+	uint32_t frame_seqno = mock_seqno;
+	int i, j;
+
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &before);
+	for (i = 0; i < BUSY_FRAMES; i++) {
+		mock_retired = frame_seqno;
+		frame_seqno = mock_seqno;
+		for (j = 0; j < BUSY_BOS; j++)
+			bos[j] = drm_intel_bo_alloc(bufmgr, "frame", 8192,
+						    4096);
+		exec_busy(bufmgr, bos, BUSY_BOS, I915_EXEC_RENDER);
+		for (j = 0; j < BUSY_BOS; j++)
+			drm_intel_bo_unreference(bos[j]);
+	}
+	drm_intel_bufmgr_gem_get_cache_stats(bufmgr, &after);
+	mock_retired = UINT32_MAX;
+
+	*checks = (after.busy_queries - before.busy_queries) +
+		(after.busy_avoided - before.busy_avoided);
+	return (double) (after.busy_queries - before.busy_queries) / *checks;
+}
+
+static drm_intel_bufmgr *create_bufmgr_size(int batch_size)
+{
+	drm_intel_bufmgr *bufmgr;
+
+	bufmgr = drm_intel_bufmgr_gem_init(MOCK_FD, batch_size);
+	if (!bufmgr) {
+		fprintf(stderr, "failed to create the buffer manager\n");
+		exit(1);
+	}
+	return bufmgr;
+}
+
+static drm_intel_bufmgr *create_bufmgr(void)
+{
+	return create_bufmgr_size(16 * 1024);
+}
+
+static void aub_temp_file(char *path)
+{
+	int fd;
+
+	strcpy(path, "/tmp/test_bufmgr_gem.XXXXXX");
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "couldn't create a temporary file\n");
+		exit(1);
+	}
+	close(fd);
+}
+
+/* Replays the memory writes in an uncompressed AUB file into image, and
+ * returns the number of ring writes, or -1 if the file is malformed. */
+static int aub_replay(const char *path, char *image)
+{
+	uint32_t header[16];
+	unsigned int len;
+	int rings = 0;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	while (fread(header, 4, 1, f) == 1) {
+		len = (header[0] & 0xffff) + 2;
+		if (len > 16 || fread(header + 1, 4, len - 1, f) != len - 1)
+			break;
+		if ((header[0] & 0xffff0000) !=
+		    (CMD_AUB_TRACE_HEADER_BLOCK & 0xffff0000))
+			continue;
+
+		if ((header[1] & AUB_TRACE_OPERATION_MASK) ==
+		    AUB_TRACE_OP_COMMAND_WRITE)
+			rings++;
+		if ((header[1] & AUB_TRACE_ADDRESS_SPACE_MASK) ==
+		    AUB_TRACE_MEMTYPE_GTT &&
+		    (header[1] & AUB_TRACE_OPERATION_MASK) ==
+		    AUB_TRACE_OP_DATA_WRITE) {
+			if (header[3] + header[4] > AUB_IMAGE_SIZE ||
+			    fread(image + header[3], 1, header[4], f) !=
+			    header[4])
+				break;
+		} else {
+			fseek(f, header[4], SEEK_CUR);
+		}
+	}
+	if (!feof(f))
+		rings = -1;
+	fclose(f);
+	return rings;
+}
+
+/* Captures a batch pointing at AUB_TARGETS partly filled buffers, executed
+ * execs times with one page of one buffer changed in between.  Returns the
+ * bytes written by the first exec and puts those of the rest in *rest.
+ * If image is set, checks that it holds what was written to the buffers
+ * once the capture is replayed into it. */
+static long aub_capture(drm_intel_bufmgr *bufmgr, const char *path,
+			bool compress, int execs, long *rest, char *image)
+{
+	static uint32_t contents[AUB_TARGET_SIZE / 4];
+	drm_intel_bufmgr_gem *bufmgr_gem = (drm_intel_bufmgr_gem *) bufmgr;
+	drm_intel_bo *batch, *targets[AUB_TARGETS];
+	uint32_t page[1024], end = 0x05000000, reloc;
+	long start, first = 0;
+	int i, j, n;
+
+	drm_intel_bufmgr_gem_set_aub_filename(bufmgr, path);
+	drm_intel_bufmgr_gem_set_aub_compression(bufmgr, compress);
+	drm_intel_bufmgr_gem_set_aub_dump(bufmgr, 1);
+	check(bufmgr_gem->aub_file != NULL);
+
+	batch = drm_intel_bo_alloc(bufmgr, "batch", 4096, 4096);
+	for (i = 0; i < AUB_TARGETS; i++) {
+		targets[i] = drm_intel_bo_alloc(bufmgr, "aub", AUB_TARGET_SIZE,
+						4096);
+		for (n = 0; n < AUB_TARGET_SIZE / 4096; n += 2) {
+			for (j = 0; j < 1024; j++)
+				page[j] = (i << 24) | (n << 16) | (j & 0xff);
+			drm_intel_bo_subdata(targets[i], n * 4096, 4096, page);
+		}
+		drm_intel_bo_emit_reloc(batch, i * 8, targets[i], i * 16,
+					I915_GEM_DOMAIN_RENDER, 0);
+	}
+	drm_intel_bo_subdata(batch, AUB_TARGETS * 8, 4, &end);
+
+	start = ftell(bufmgr_gem->aub_file);
+	for (n = 0; n < execs; n++) {
+		if (n > 0) {
+			for (j = 0; j < 1024; j++)
+				page[j] = j % 16 ? 0 : n * j;
+			drm_intel_bo_subdata(targets[n % AUB_TARGETS],
+					     n % (AUB_TARGET_SIZE / 4096) * 4096,
+					     4096, page);
+		}
+		check(drm_intel_bo_exec(batch, AUB_TARGETS * 8 + 4,
+					NULL, 0, 0) == 0);
+		if (n == 0) {
+			first = ftell(bufmgr_gem->aub_file) - start;
+			start += first;
+		}
+	}
+	*rest = ftell(bufmgr_gem->aub_file) - start;
+
+	drm_intel_bufmgr_gem_set_aub_dump(bufmgr, 0);
+	if (image) {
+		check(aub_replay(path, image) == execs);
+		for (i = 0; i < AUB_TARGETS; i++) {
+			uint32_t offset =
+				((drm_intel_bo_gem *) targets[i])->aub_offset;
+
+			drm_intel_bo_get_subdata(targets[i], 0,
+						 AUB_TARGET_SIZE, contents);
+			check(memcmp(image + offset, contents,
+				     AUB_TARGET_SIZE) == 0);
+			memcpy(&reloc, image + i * 8 +
+			       ((drm_intel_bo_gem *) batch)->aub_offset, 4);
+			check(reloc == offset + i * 16);
+		}
+	}
+	for (i = 0; i < AUB_TARGETS; i++)
+		drm_intel_bo_unreference(targets[i]);
+	drm_intel_bo_unreference(batch);
+	return first;
+}
+
+static bool files_equal(const char *a, const char *b)
+{
+	FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+	bool equal = fa && fb;
+	int ca, cb;
+
+	while (equal) {
+		ca = getc(fa);
+		cb = getc(fb);
+		equal = ca == cb;
+		if (ca == EOF)
+			break;
+	}
+	if (fa)
+		fclose(fa);
+	if (fb)
+		fclose(fb);
+	return equal;
+}
+
+/* The dump has to hold what the buffers held at each exec, while later
+ * execs only write the pages that changed, and compressed dumps have to
+ * expand to the same file. */
+static void test_aub(void)
+{
+	static uint32_t src[4096], packed[4097], unpacked[4096];
+	char plain[64], compressed[64], expanded[64];
+	drm_intel_bufmgr *bufmgr;
+	unsigned int count;
+	long first, rest;
+	char *image;
+	FILE *in, *out;
+	int i;
+
+	/* Runs, progressions and noise survive a round trip */
+	for (i = 0; i < 4096; i++)
+		src[i] = i < 1000 ? 0 : i < 2000 ? 0x200003 + i * 0x1000u :
+			i < 3000 ? i * 2654435761u : i % 3u;
+	count = aub_compress(src, 4096, packed);
+	check(count < 4096 / 3);
+	check(aub_expand_block(packed, count, unpacked, 4096));
+	check(memcmp(src, unpacked, sizeof(src)) == 0);
+	check(!aub_expand_block(packed, count - 1, unpacked, 4096));
+	check(!aub_expand_block(packed, count, unpacked, 4095));
+	for (i = 0; i < 4096; i++)
+		src[i] = i * 2654435761u;
+	check(aub_compress(src, 4096, packed) <= 4097);
+
+	image = calloc(1, AUB_IMAGE_SIZE);
+	aub_temp_file(plain);
+	bufmgr = create_bufmgr();
+	first = aub_capture(bufmgr, plain, false, AUB_EXECS / 10, &rest,
+			    image);
+	drm_intel_bufmgr_destroy(bufmgr);
+	check(first >= AUB_TARGETS * AUB_TARGET_SIZE / 2);
+	check(rest < AUB_EXECS / 10 * 2 * 4096);
+	free(image);
+
+	aub_temp_file(compressed);
+	bufmgr = create_bufmgr();
+	aub_capture(bufmgr, compressed, true, AUB_EXECS / 10, &rest, NULL);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	aub_temp_file(expanded);
+	in = fopen(compressed, "r");
+	out = fopen(expanded, "w");
+	check(drm_intel_aub_expand(in, out) == 0);
+	fclose(in);
+	fclose(out);
+	check(files_equal(plain, expanded));
+
+	/* Plain files go through untouched */
+	in = fopen(plain, "r");
+	out = fopen(expanded, "w");
+	check(drm_intel_aub_expand(in, out) == 0);
+	fclose(in);
+	fclose(out);
+	check(files_equal(plain, expanded));
+
+	unlink(plain);
+	unlink(compressed);
+	unlink(expanded);
+}
+
+/* Returns the time per captured exec, and puts the bytes written per exec
+ * after the first in *size. */
+static double bench_aub(bool compress, long *size)
+{
+	drm_intel_bufmgr *bufmgr;
+	char path[64];
+	double start;
+	long rest;
+
+	aub_temp_file(path);
+	bufmgr = create_bufmgr();
+	start = now();
+	aub_capture(bufmgr, path, compress, AUB_EXECS, &rest, NULL);
+	start = (now() - start) * 1e9 / AUB_EXECS;
+	drm_intel_bufmgr_destroy(bufmgr);
+	unlink(path);
+
+	*size = rest / (AUB_EXECS - 1);
+	return start;
+}
+
+/* Refills and submits a large batch, returning the time per exec */
+static double bench_exec(drm_intel_bufmgr *bufmgr)
+{
+	drm_intel_bo *targets[EXEC_TARGETS], *batch;
+	double start, total = 0;
+	int i;
+
+	for (i = 0; i < EXEC_TARGETS; i++)
+		targets[i] = drm_intel_bo_alloc(bufmgr, "target", 4096, 4096);
+
+	for (i = 0; i < EXEC_LOOPS; i++) {
+		batch = drm_intel_bo_alloc(bufmgr, "batch", EXEC_RELOCS * 8,
+					   4096);
+		emit_relocs(batch, targets, EXEC_TARGETS, EXEC_RELOCS);
+
+		start = now();
+		drm_intel_bo_exec(batch, 4096, NULL, 0, 0);
+		total += now() - start;
+
+		drm_intel_bo_unreference(batch);
+	}
+	check(exec_count == EXEC_TARGETS + 1);
+
+	for (i = 0; i < EXEC_TARGETS; i++)
+		drm_intel_bo_unreference(targets[i]);
+	return total * 1e9 / EXEC_LOOPS;
+}
+
+static void *churn_thread(void *data)
+{
+	static const unsigned long sizes[] = { 4096, 12288, 65536, 4096 };
+	drm_intel_bufmgr *bufmgr = data;
+	drm_intel_bo *bos[ARRAY_SIZE(sizes)];
+	unsigned int i, j;
+
+	for (i = 0; i < THREAD_LOOPS; i++) {
+		for (j = 0; j < ARRAY_SIZE(sizes); j++)
+			bos[j] = drm_intel_bo_alloc(bufmgr, "churn",
+						    sizes[j], 4096);
+		for (j = 0; j < ARRAY_SIZE(sizes); j++)
+			drm_intel_bo_unreference(bos[j]);
+	}
+	return NULL;
+}
+
+/* Several threads allocating and freeing small buffers from one bufmgr */
+static double bench_churn(drm_intel_bufmgr *bufmgr)
+{
+	pthread_t threads[THREADS];
+	double start;
+	int i;
+
+	start = now();
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&threads[i], NULL, churn_thread, bufmgr);
+	for (i = 0; i < THREADS; i++)
+		pthread_join(threads[i], NULL);
+	return (now() - start) * 1e9 / (THREADS * THREAD_LOOPS * 4);
+}
+
+static void run_tests(void)
+{
+	drm_intel_bufmgr *bufmgr;
+
+	bufmgr = create_bufmgr();
+	test_named(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	test_cache_policy(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	test_validate(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	test_references(bufmgr);
+	drm_intel_bufmgr_gem_enable_incremental_validate(bufmgr);
+	test_references(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	test_no_reloc(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	test_reloc_storage(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	test_deferred_release(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	test_busy_tracking(bufmgr);
+	test_busy_unordered(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	test_aub();
+
+	/* Without kernel support batches are submitted as before */
+	bufmgr = create_bufmgr();
+	((drm_intel_bufmgr_gem *) bufmgr)->has_exec_no_reloc = 0;
+	drm_intel_bufmgr_gem_enable_no_reloc(bufmgr);
+	check(!((drm_intel_bufmgr_gem *) bufmgr)->no_reloc);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	drm_intel_bufmgr_gem_enable_thread_cache(bufmgr);
+	test_thread_cache(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+}
+
+static void run_benchmarks(void)
+{
+	drm_intel_bufmgr *bufmgr;
+	double name_hit, name_walk;
+	double exec_walk, exec_list;
+	double release_sync, release_sync_tail;
+	double release_deferred, release_deferred_tail;
+	double busy_ioctls_per_check;
+	double aub_plain_time, aub_packed_time;
+	double query_walk, query_list;
+	double churn_shared, churn_cached;
+	unsigned int busy_checks, creates, closes;
+	long aub_plain_size, aub_packed_size;
+
+	bufmgr = create_bufmgr();
+	name_hit = bench_named(bufmgr, &name_walk);
+	drm_intel_bufmgr_destroy(bufmgr);
+	/* A linear walk per import is what made this worth indexing. */
+	check(name_hit < name_walk);
+	printf("%u named bos: create_from_name hit %8.1f ns, "
+	       "list walk %8.1f ns\n", NAMED_BOS, name_hit, name_walk);
+
+	bufmgr = create_bufmgr_size(EXEC_RELOCS * 8 + 64);
+	exec_walk = bench_exec(bufmgr);
+	drm_intel_bufmgr_gem_enable_incremental_validate(bufmgr);
+	exec_list = bench_exec(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+	printf("exec of %d relocations to %d buffers: tree walk %8.1f us, "
+	       "incremental list %8.1f us\n", EXEC_RELOCS, EXEC_TARGETS,
+	       exec_walk / 1000, exec_list / 1000);
+
+	bufmgr = create_bufmgr();
+	release_sync = bench_release(bufmgr, &release_sync_tail);
+	drm_intel_bufmgr_destroy(bufmgr);
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_deferred_release(bufmgr);
+	closes = gem_closes;
+	release_deferred = bench_release(bufmgr, &release_deferred_tail);
+	drm_intel_bufmgr_destroy(bufmgr);
+	check(gem_closes - closes == RELEASE_BOS);
+	printf("unreference of a written %dKB buffer, median/99th: "
+	       "synchronous %8.1f/%8.1f ns, deferred %8.1f/%8.1f ns\n",
+	       RELEASE_SIZE / 1024, release_sync, release_sync_tail,
+	       release_deferred, release_deferred_tail);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	busy_ioctls_per_check = bench_busy(bufmgr, &busy_checks);
+	drm_intel_bufmgr_destroy(bufmgr);
+	printf("reuse of buffers a frame behind the GPU: %u busy checks, "
+	       "%.3f ioctls per check\n", busy_checks, busy_ioctls_per_check);
+
+	aub_plain_time = bench_aub(false, &aub_plain_size);
+	aub_packed_time = bench_aub(true, &aub_packed_size);
+	printf("aub capture of %d x %dKB buffers, one page changed per exec: "
+	       "%6.1f us and %ld bytes, compressed %6.1f us and %ld bytes "
+	       "per exec\n", AUB_TARGETS, AUB_TARGET_SIZE / 1024,
+	       aub_plain_time / 1000, aub_plain_size,
+	       aub_packed_time / 1000, aub_packed_size);
+
+	bufmgr = create_bufmgr_size(QUERY_RELOCS * 8 + 64);
+	drm_intel_bufmgr_gem_enable_incremental_validate(bufmgr);
+	query_walk = bench_references(bufmgr, true);
+	query_list = bench_references(bufmgr, false);
+	drm_intel_bufmgr_destroy(bufmgr);
+	printf("references query in a %d relocation batch: tree walk "
+	       "%8.1f ns, validate list %8.1f ns\n", QUERY_RELOCS,
+	       query_walk, query_list);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	churn_shared = bench_churn(bufmgr);
+	drm_intel_bufmgr_destroy(bufmgr);
+
+	bufmgr = create_bufmgr();
+	drm_intel_bufmgr_gem_enable_reuse(bufmgr);
+	drm_intel_bufmgr_gem_enable_thread_cache(bufmgr);
+	creates = gem_creates;
+	churn_cached = bench_churn(bufmgr);
+	check(gem_creates - creates <= THREADS * 4);
+	drm_intel_bufmgr_destroy(bufmgr);
+	printf("%d threads alloc+free: shared cache %8.1f ns, "
+	       "thread cache %8.1f ns\n", THREADS, churn_shared, churn_cached);
+}
+
+/* make check runs the tests only; "-bench" adds the timing runs */
+int main(int argc, char **argv)
+{
+	unsetenv("INTEL_DEVID_OVERRIDE");
+
+	run_tests();
+	if (argc > 1 && strcmp(argv[1], "-bench") == 0)
+		run_benchmarks();
+
+	return errors != 0;
+}
@@ -33,6 +33,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <err.h>
+#include <time.h>
 
 #include "libdrm.h"
 #include "intel_bufmgr.h"
@@ -40,12 +41,17 @@
 
 #define HW_OFFSET 0x12300000
 
+/* Batches repeated to at least this size stand in for large dumps. */
+#define LARGE_BATCH_SIZE (256 * 1024)
+
 static void
 usage(void)
 {
 	fprintf(stderr, "usage:\n");
 	fprintf(stderr, "  test_decode <batch>\n");
 	fprintf(stderr, "  test_decode <batch> -dump\n");
+	fprintf(stderr, "  test_decode -bench [-j <threads>] <batch>...\n");
+	fprintf(stderr, "  test_decode -stats <batch>...\n");
 	exit(1);
 }
 
@@ -86,6 +92,154 @@ dump_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	drm_intel_decode(ctx);
 }
 
+static uint16_t
+infer_devid(const char *batch_filename)
+{
+	struct {
+		const char *name;
+		uint16_t devid;
+	} chipsets[] = {
+		{ "830",  0x3577},
+		{ "855",  0x3582},
+		{ "945",  0x2772},
+		{ "gen4", 0x2a02 },
+		{ "gm45", 0x2a42 },
+		{ "gen5", PCI_CHIP_ILD_G },
+		{ "gen6", PCI_CHIP_SANDYBRIDGE_GT2 },
+		{ "gen7", PCI_CHIP_IVYBRIDGE_GT2 },
+		{ "gen8", 0x1616 },
+		{ NULL, 0 },
+	};
+	int i;
+
+	for (i = 0; chipsets[i].name != NULL; i++) {
+		if (strstr(batch_filename, chipsets[i].name))
+			return chipsets[i].devid;
+	}
+
+	fprintf(stderr, "Couldn't guess chipset id from batch filename `%s'.\n",
+		batch_filename);
+	fprintf(stderr, "Must be contain one of:\n");
+	for (i = 0; chipsets[i].name != NULL; i++) {
+		fprintf(stderr, "  %s\n", chipsets[i].name);
+	}
+	exit(1);
+}
+
+struct packet_text {
+	char *text;
+	size_t len, size;
+	int errors;
+	unsigned int packets;
+};
+
+/* Reassembles the decode from its packets, checking that the dword
+ * records line up with the packet text.
+ */
+static void
+collect_packet(void *closure, const struct drm_intel_decode_packet *packet)
+{
+	struct packet_text *t = closure;
+	unsigned int i;
+
+	if (packet->field_count == 0 ||
+	    packet->fields[0].offset != packet->offset ||
+	    packet->fields[0].value != packet->header ||
+	    strncmp(packet->text + packet->text_len -
+		    packet->fields[packet->field_count - 1].text_len,
+		    packet->fields[packet->field_count - 1].text,
+		    packet->fields[packet->field_count - 1].text_len) != 0 ||
+	    strncmp(packet->fields[0].text, packet->name,
+		    strlen(packet->name)) != 0)
+		t->errors++;
+	for (i = 1; i < packet->field_count; i++) {
+		if (packet->fields[i].offset < packet->fields[i - 1].offset)
+			t->errors++;
+	}
+
+	if (t->len + packet->text_len > t->size) {
+		t->size = (t->len + packet->text_len) * 2;
+		t->text = realloc(t->text, t->size);
+		if (!t->text)
+			errx(1, "out of memory");
+	}
+	memcpy(t->text + t->len, packet->text, packet->text_len);
+	t->len += packet->text_len;
+	t->packets++;
+}
+
+static void
+compare_output(const char *mode, const char *output, size_t size,
+	       const char *ref, size_t ref_size, const char *batch_filename)
+{
+	if (size != ref_size || memcmp(output, ref, size) != 0) {
+		fprintf(stderr, "Decode mismatch with reference for `%s' "
+			"using %s.\n", batch_filename, mode);
+		exit(1);
+	}
+}
+
+/* Returns the batch repeated up to at least size bytes and padded for
+ * decoding in place, with its length in *large_size.
+ */
+static uint32_t *
+repeat_batch(const void *batch, size_t batch_size, size_t size,
+	     size_t *large_size)
+{
+	size_t copies = (size + batch_size - 1) / batch_size, i;
+	char *large;
+
+	*large_size = copies * batch_size;
+	large = malloc(*large_size + DRM_INTEL_DECODE_PADDING);
+	if (!large)
+		errx(1, "out of memory");
+	for (i = 0; i < copies; i++)
+		memcpy(large + i * batch_size, batch, batch_size);
+	memset(large + *large_size, 0xd0, DRM_INTEL_DECODE_PADDING);
+	return (uint32_t *)large;
+}
+
+/* Decodes a large batch, in place and on several threads, and compares
+ * it with decoding a copy on one.
+ */
+static void
+compare_parallel(uint16_t devid, const char *batch_filename)
+{
+	struct drm_intel_decode *ctx;
+	void *batch_ptr;
+	uint32_t *large;
+	size_t batch_size, large_size, size, parallel_size;
+	const char *output, *parallel;
+	char *copy;
+
+	read_file(batch_filename, &batch_ptr, &batch_size);
+	large = repeat_batch(batch_ptr, batch_size, LARGE_BATCH_SIZE,
+			     &large_size);
+
+	ctx = drm_intel_decode_context_alloc(devid);
+	drm_intel_decode_set_batch_pointer(ctx, large, HW_OFFSET,
+					   large_size / 4);
+	drm_intel_decode_set_dump_past_end(ctx, 1);
+	drm_intel_decode_set_output_file(ctx, NULL);
+	drm_intel_decode(ctx);
+	output = drm_intel_decode_get_output(ctx, &size);
+	copy = malloc(size + 1);
+	if (!copy)
+		errx(1, "out of memory");
+	memcpy(copy, output, size + 1);
+
+	drm_intel_decode_set_batch_padded(ctx, 1);
+	drm_intel_decode_set_threads(ctx, 4);
+	drm_intel_decode(ctx);
+	parallel = drm_intel_decode_get_output(ctx, &parallel_size);
+	compare_output("4 threads", parallel, parallel_size, copy, size,
+		       batch_filename);
+
+	drm_intel_decode_context_free(ctx);
+	free(copy);
+	free(large);
+}
+
 static void
 compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 {
@@ -128,42 +282,270 @@ compare_batch(struct drm_intel_decode *ctx, const char *batch_filename)
 	}
 
 	fclose(out);
+
+	/* The same again, kept in memory and packet by packet. */
+	{
+		struct packet_text t = { NULL, 0, 0, 0, 0 };
+		drm_intel_decode_opcode_stats stats[256];
+		uint64_t packets = 0, dwords = 0;
+		int i, n;
+		const char *output;
+		size_t output_size;
+
+		drm_intel_decode_set_output_file(ctx, NULL);
+		drm_intel_decode(ctx);
+		output = drm_intel_decode_get_output(ctx, &output_size);
+		compare_output("memory output", output, output_size,
+			       ref_ptr, ref_size, batch_filename);
+
+		drm_intel_decode_set_packet_callback(ctx, collect_packet, &t);
+		drm_intel_decode(ctx);
+		drm_intel_decode_set_packet_callback(ctx, NULL, NULL);
+		compare_output("packet callback", t.text, t.len,
+			       ref_ptr, ref_size, batch_filename);
+		if (t.errors) {
+			fprintf(stderr, "Bad packet records for `%s'.\n",
+				batch_filename);
+			exit(1);
+		}
+
+		/* Stats should see the same packets, each named. */
+		drm_intel_decode_set_stats(ctx, 1);
+		drm_intel_decode(ctx);
+		drm_intel_decode_set_stats(ctx, 0);
+		n = drm_intel_decode_get_stats(ctx, stats, 256);
+		for (i = 0; i < n && i < 256; i++) {
+			if (!stats[i].name[0] || !stats[i].changes ||
+			    stats[i].changes > stats[i].packets ||
+			    (i > 0 && stats[i].dwords > stats[i - 1].dwords))
+				t.errors++;
+			packets += stats[i].packets;
+			dwords += stats[i].dwords;
+		}
+		if (n <= 0 || n > 256 || t.errors || packets != t.packets ||
+		    dwords > batch_size / 4) {
+			fprintf(stderr, "Bad stats for `%s'.\n",
+				batch_filename);
+			exit(1);
+		}
+		free(t.text);
+	}
+
 	free(ref_filename);
 	free(ptr);
 }
 
-static uint16_t
-infer_devid(const char *batch_filename)
+static double
+now(void)
 {
-	struct {
-		const char *name;
-		uint16_t devid;
-	} chipsets[] = {
-		{ "830",  0x3577},
-		{ "855",  0x3582},
-		{ "945",  0x2772},
-		{ "gen4", 0x2a02 },
-		{ "gm45", 0x2a42 },
-		{ "gen5", PCI_CHIP_ILD_G },
-		{ "gen6", PCI_CHIP_SANDYBRIDGE_GT2 },
-		{ "gen7", PCI_CHIP_IVYBRIDGE_GT2 },
-		{ "gen8", 0x1616 },
-		{ NULL, 0 },
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+count_packet(void *closure, const struct drm_intel_decode_packet *packet)
+{
+	*(unsigned int *)closure += packet->field_count;
+}
+
+/* Decodes the batches repeatedly through each output path and reports
+ * the rate in MB of batch data per second.
+ */
+static void
+bench_batches(int count, char **filenames)
+{
+	static const char *const modes[] = {
+		"file (/dev/null)", "memory", "packet callback", "stats"
 	};
-	int i;
+	struct drm_intel_decode **ctxs;
+	void **batches;
+	size_t *sizes, total = 0;
+	unsigned int fields = 0, mode;
+	FILE *null;
+	int i, iter, iters;
+
+	null = fopen("/dev/null", "w");
+	if (!null)
+		errx(1, "couldn't open /dev/null");
+
+	ctxs = calloc(count, sizeof(*ctxs));
+	batches = calloc(count, sizeof(*batches));
+	sizes = calloc(count, sizeof(*sizes));
+	if (!ctxs || !batches || !sizes)
+		errx(1, "out of memory");
+
+	for (i = 0; i < count; i++) {
+		read_file(filenames[i], &batches[i], &sizes[i]);
+		ctxs[i] = drm_intel_decode_context_alloc(infer_devid(filenames[i]));
+		drm_intel_decode_set_batch_pointer(ctxs[i], batches[i],
+						   HW_OFFSET, sizes[i] / 4);
+		total += sizes[i];
+	}
+	if (total == 0)
+		errx(1, "no batch data");
+	iters = (64 << 20) / total + 1;
+
+	for (mode = 0; mode < sizeof(modes) / sizeof(modes[0]); mode++) {
+		double start;
+
+		for (i = 0; i < count; i++) {
+			drm_intel_decode_set_output_file(ctxs[i],
+							 mode == 0 ? null : NULL);
+			drm_intel_decode_set_packet_callback(ctxs[i],
+							     mode == 2 ? count_packet : NULL,
+							     &fields);
+			drm_intel_decode_set_stats(ctxs[i], mode == 3);
+		}
+
+		start = now();
+		for (iter = 0; iter < iters; iter++) {
+			for (i = 0; i < count; i++)
+				drm_intel_decode(ctxs[i]);
+		}
+		printf("%-18s %8.1f MB/s\n", modes[mode],
+		       total * (double)iters / (now() - start) / (1 << 20));
+	}
 
-	for (i = 0; chipsets[i].name != NULL; i++) {
-		if (strstr(batch_filename, chipsets[i].name))
-			return chipsets[i].devid;
+	for (i = 0; i < count; i++)
+		drm_intel_decode_context_free(ctxs[i]);
+	free(ctxs);
+	free(batches);
+	free(sizes);
+	fclose(null);
+}
+
+/* Decodes each batch, repeated to stand in for a large dump, to memory
+ * on one thread and on the given number, copied and in place, and
+ * reports the time taken over all of them.
+ */
+static void
+bench_parallel(int count, char **filenames, int threads)
+{
+	struct drm_intel_decode **ctxs;
+	size_t large_size, total = 0;
+	uint32_t **larges;
+	int i, mode;
+
+	ctxs = calloc(count, sizeof(*ctxs));
+	larges = calloc(count, sizeof(*larges));
+	if (!ctxs || !larges)
+		errx(1, "out of memory");
+
+	for (i = 0; i < count; i++) {
+		void *batch_ptr;
+		size_t batch_size;
+
+		read_file(filenames[i], &batch_ptr, &batch_size);
+		larges[i] = repeat_batch(batch_ptr, batch_size,
+					 4 * LARGE_BATCH_SIZE, &large_size);
+		ctxs[i] = drm_intel_decode_context_alloc(infer_devid(filenames[i]));
+		drm_intel_decode_set_batch_pointer(ctxs[i], larges[i],
+						   HW_OFFSET, large_size / 4);
+		drm_intel_decode_set_dump_past_end(ctxs[i], 1);
+		drm_intel_decode_set_output_file(ctxs[i], NULL);
+		total += large_size;
 	}
 
-	fprintf(stderr, "Couldn't guess chipset id from batch filename `%s'.\n",
-		batch_filename);
-	fprintf(stderr, "Must be contain one of:\n");
-	for (i = 0; chipsets[i].name != NULL; i++) {
-		fprintf(stderr, "  %s\n", chipsets[i].name);
+	printf("%d batches of %zu KB:\n", count, total / count / 1024);
+	for (mode = 0; mode < 4; mode++) {
+		int mode_threads = mode < 2 ? 1 : threads;
+		double start, elapsed;
+
+		for (i = 0; i < count; i++) {
+			drm_intel_decode_set_threads(ctxs[i], mode_threads);
+			drm_intel_decode_set_batch_padded(ctxs[i], mode & 1);
+		}
+
+		start = now();
+		for (i = 0; i < count; i++)
+			drm_intel_decode(ctxs[i]);
+		elapsed = now() - start;
+		printf("threads %-3d %-9s %8.1f ms %8.1f MB/s\n",
+		       mode_threads, mode & 1 ? "in place" : "copied",
+		       elapsed * 1000,
+		       total / elapsed / (1 << 20));
 	}
-	exit(1);
+
+	for (i = 0; i < count; i++) {
+		drm_intel_decode_context_free(ctxs[i]);
+		free(larges[i]);
+	}
+	free(ctxs);
+	free(larges);
+}
+
+/* Prints where the packets of the batches went, by opcode, with one
+ * table for each chipset.
+ */
+static void
+print_stats(int count, char **filenames)
+{
+	drm_intel_decode_opcode_stats *stats;
+	struct drm_intel_decode *ctx;
+	uint16_t devid;
+	uint64_t dwords;
+	size_t total, all = 0;
+	double start, elapsed = 0;
+	int i, j, n, first;
+
+	for (first = 0; first < count; first = i) {
+		devid = infer_devid(filenames[first]);
+		ctx = drm_intel_decode_context_alloc(devid);
+		drm_intel_decode_set_output_file(ctx, NULL);
+		drm_intel_decode_set_stats(ctx, 1);
+
+		total = 0;
+		for (i = first; i < count &&
+		     infer_devid(filenames[i]) == devid; i++) {
+			void *batch_ptr;
+			size_t batch_size;
+
+			read_file(filenames[i], &batch_ptr, &batch_size);
+			drm_intel_decode_set_batch_pointer(ctx, batch_ptr,
+							   HW_OFFSET,
+							   batch_size / 4);
+			start = now();
+			drm_intel_decode(ctx);
+			elapsed += now() - start;
+			total += batch_size;
+		}
+		all += total;
+
+		n = drm_intel_decode_get_stats(ctx, NULL, 0);
+		stats = calloc(n, sizeof(*stats));
+		if (n < 0 || (n && !stats))
+			errx(1, "out of memory");
+		n = drm_intel_decode_get_stats(ctx, stats, n);
+
+		dwords = 0;
+		for (j = 0; j < n; j++)
+			dwords += stats[j].dwords;
+
+		printf("devid 0x%04x, %d batch%s, %zu dwords\n", devid,
+		       i - first, i - first == 1 ? "" : "es", total / 4);
+		printf("%-10s %8s %8s %6s %8s  %-20s %s\n", "opcode",
+		       "packets", "dwords", "%", "changes", "", "name");
+		for (j = 0; j < n; j++) {
+			double share = dwords ?
+				100.0 * stats[j].dwords / dwords : 0;
+			int bar = share / 5 + 0.5;
+
+			printf("0x%08x %8llu %8llu %6.1f %8llu  %-20.*s %s\n",
+			       stats[j].opcode,
+			       (unsigned long long)stats[j].packets,
+			       (unsigned long long)stats[j].dwords, share,
+			       (unsigned long long)stats[j].changes,
+			       bar, "####################", stats[j].name);
+		}
+		printf("\n");
+
+		free(stats);
+		drm_intel_decode_context_free(ctx);
+	}
+
+	printf("%zu KB counted in %.3f ms\n", all / 1024, elapsed * 1000);
 }
 
 int
@@ -175,6 +557,32 @@ main(int argc, char **argv)
 	if (argc < 2)
 		usage();
 
+	if (strcmp(argv[1], "-bench") == 0) {
+		int threads = 0;
+
+		argv += 2;
+		argc -= 2;
+		if (argc >= 2 && strcmp(argv[0], "-j") == 0) {
+			threads = atoi(argv[1]);
+			if (threads < 1)
+				usage();
+			argv += 2;
+			argc -= 2;
+		}
+		if (argc < 1)
+			usage();
+		bench_batches(argc, argv);
+		if (threads)
+			bench_parallel(argc, argv, threads);
+		return 0;
+	}
+
+	if (strcmp(argv[1], "-stats") == 0) {
+		if (argc < 3)
+			usage();
+		print_stats(argc - 2, argv + 2);
+		return 0;
+	}
 
 	devid = infer_devid(argv[1]);
 
@@ -187,6 +595,7 @@ main(int argc, char **argv)
 			usage();
 	} else {
 		compare_batch(ctx, argv[1]);
+		compare_parallel(devid, argv[1]);
 	}
 
 	drm_intel_decode_context_free(ctx);
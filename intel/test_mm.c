@@ -0,0 +1,312 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Replays random allocation and free patterns against the heap the fake
+ * buffer manager allocates from, checking its free lists and offset tree
+ * along the way, and reports allocation latency and how fragmented the
+ * heap gets.
+ */
+
+#include "mm.c"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define HEAP_OFS	(1 << 20)
+#define HEAP_SIZE	(1 << 30)
+
+#define CHECK_OPS	20000
+#define BENCH_OPS	500000
+#define MAX_LIVE	8192
+#define SAMPLE_OPS	1000
+#define FIND_LOOPS	100
+
+static int errors;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+			__FILE__, __LINE__, #cond);			\
+		errors++;						\
+	}								\
+} while (0)
+
+static uint32_t seed;
+
+static uint32_t random32(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+/* Mostly small buffers, a few large ones, in pages or odd sizes */
+static int random_size(void)
+{
+	int size = (1 + random32() % 4) << (12 + random32() % 8);
+
+	if (random32() % 8 == 0)
+		size -= random32() % 4096;
+	return size;
+}
+
+static int random_align(void)
+{
+	switch (random32() % 8) {
+	case 0:
+		return 0;
+	case 1:
+		return 16;
+	default:
+		return 12;
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Checks the offset order and priorities under p, returning its size */
+static int check_tree(const struct mem_block *p, int lo, int hi)
+{
+	if (!p)
+		return 0;
+
+	check(p->ofs >= lo && p->ofs < hi);
+	if (p->left)
+		check(Priority(p->left) <= Priority(p));
+	if (p->right)
+		check(Priority(p->right) <= Priority(p));
+	return 1 + check_tree(p->left, lo, p->ofs) +
+		check_tree(p->right, p->ofs + 1, hi);
+}
+
+static void check_heap(struct mem_block *heap)
+{
+	struct mem_heap *h = Heap(heap);
+	struct mem_block *p;
+	int ofs = HEAP_OFS, blocks = 0, free_blocks = 0, bin;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		check(p->heap == heap);
+		check(p->ofs == ofs && p->size > 0);
+		check(p->prev->next == p && p->next->prev == p);
+		check(!(p->free && p->next->free));
+		check(mmFindBlock(heap, p->ofs) == p);
+		ofs += p->size;
+		blocks++;
+		free_blocks += p->free;
+	}
+	check(ofs == HEAP_OFS + HEAP_SIZE);
+	check(check_tree(h->root, HEAP_OFS, ofs) == blocks);
+	check(mmFindBlock(heap, ofs) == NULL);
+
+	for (bin = 0; bin < MM_BINS; bin++) {
+		check(!h->bins[bin] ==
+		      !(h->bin_map[bin / 32] & (1u << (bin % 32))));
+		for (p = h->bins[bin]; p; p = p->next_free) {
+			check(p->free && FreeBin(p->size) == bin);
+			check(p->next_free == NULL || p->next_free->prev_free == p);
+			free_blocks--;
+		}
+	}
+	check(free_blocks == 0);
+}
+
+/* The lowest start the smallest free block that fits would give */
+static int best_fit(struct mem_block *heap, int size, int align2,
+		    int startSearch)
+{
+	const int mask = (1 << align2) - 1;
+	struct mem_block *p, *best = NULL;
+	int startofs, beststart = -1;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		if (!p->free)
+			continue;
+		startofs = (p->ofs + mask) & ~mask;
+		if (startofs < startSearch)
+			startofs = startSearch;
+		if (startofs + size > p->ofs + p->size)
+			continue;
+		if (!best || p->size < best->size) {
+			best = p;
+			beststart = startofs;
+		}
+	}
+	return beststart;
+}
+
+/* 1 - largest free block / free space: 0 when all free space is in one
+ * piece, close to 1 when it is scattered in small holes */
+static double fragmentation(struct mem_block *heap)
+{
+	struct mem_block *p;
+	double total = 0, largest = 0;
+
+	for (p = heap->next; p != heap; p = p->next) {
+		if (!p->free)
+			continue;
+		total += p->size;
+		if (p->size > largest)
+			largest = p->size;
+	}
+	return total ? 1 - largest / total : 0;
+}
+
+static struct mem_block *live[MAX_LIVE];
+static int live_count;
+
+/* Allocate a bit more often than free, so that the heap fills up */
+static int random_free(void)
+{
+	return live_count == MAX_LIVE ||
+		(live_count && random32() % 8 < 3);
+}
+
+static void free_random(void)
+{
+	int i = random32() % live_count;
+
+	check(mmFreeMem(live[i]) == 0);
+	live[i] = live[--live_count];
+}
+
+static void run_checks(void)
+{
+	struct mem_block *heap, *b;
+	int i, size, align2, start, expect;
+
+	seed = 1;
+	live_count = 0;
+	heap = mmInit(HEAP_OFS, HEAP_SIZE);
+	check(heap != NULL);
+	check_heap(heap);
+
+	check(mmAllocMem(heap, 0, 12, 0) == NULL);
+	check(mmAllocMem(heap, HEAP_SIZE + 1, 0, 0) == NULL);
+	check(mmAllocMem(heap, 4096, 12, HEAP_OFS + HEAP_SIZE) == NULL);
+
+	for (i = 0; i < CHECK_OPS; i++) {
+		if (random_free()) {
+			free_random();
+		} else {
+			size = random_size();
+			align2 = random_align();
+			start = random32() % 16 ? 0 :
+				HEAP_OFS + random32() % HEAP_SIZE;
+			expect = best_fit(heap, size, align2, start);
+			b = mmAllocMem(heap, size, align2, start);
+			if (expect < 0) {
+				check(b == NULL);
+			} else {
+				check(b != NULL);
+				if (!b)
+					continue;
+				check(b->ofs == expect && b->size == size);
+				check(!b->free && !b->reserved);
+				live[live_count++] = b;
+			}
+		}
+		if (i % 64 == 0)
+			check_heap(heap);
+	}
+
+	check(mmFreeMem(NULL) == 0);
+	while (live_count)
+		free_random();
+	check_heap(heap);
+	check(heap->next->next == heap && heap->next->free);
+	mmDestroy(heap);
+}
+
+static void run_bench(void)
+{
+	struct mem_block *heap, *b;
+	double start, alloc_time = 0, free_time = 0, find_time, frag = 0;
+	int i, j, size, align2, allocs = 0, frees = 0, failed = 0, samples = 0;
+
+	seed = 2;
+	live_count = 0;
+	heap = mmInit(HEAP_OFS, HEAP_SIZE);
+	check(heap != NULL);
+	if (!heap)
+		return;
+
+	for (i = 0; i < BENCH_OPS; i++) {
+		if (random_free()) {
+			j = random32() % live_count;
+			start = now();
+			mmFreeMem(live[j]);
+			free_time += now() - start;
+			live[j] = live[--live_count];
+			frees++;
+		} else {
+			size = random_size();
+			align2 = random_align();
+			start = now();
+			b = mmAllocMem(heap, size, align2, 0);
+			alloc_time += now() - start;
+			allocs++;
+			if (b)
+				live[live_count++] = b;
+			else
+				failed++;
+		}
+		if (i % SAMPLE_OPS == 0) {
+			frag += fragmentation(heap);
+			samples++;
+		}
+	}
+
+	start = now();
+	for (j = 0; j < FIND_LOOPS; j++) {
+		for (i = 0; i < live_count; i++)
+			check(mmFindBlock(heap, live[i]->ofs) == live[i]);
+	}
+	find_time = now() - start;
+
+	printf("%d random allocs and frees in a %d MB heap:\n",
+	       BENCH_OPS, HEAP_SIZE >> 20);
+	printf("  mmAllocMem %8.1f ns, mmFreeMem %8.1f ns, "
+	       "mmFindBlock among %d blocks %8.1f ns\n",
+	       alloc_time * 1e9 / allocs, free_time * 1e9 / frees,
+	       live_count, find_time * 1e9 / (FIND_LOOPS * live_count));
+	printf("  %d of %d allocations failed, mean fragmentation %.3f\n",
+	       failed, allocs, frag / samples);
+
+	mmDestroy(heap);
+}
+
+int main(int argc, char **argv)
+{
+	run_checks();
+	run_bench();
+	return errors != 0;
+}
@@ -0,0 +1,417 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Builds a fake /dev/dri and /sys/class/drm tree with one primary, control
+ * and render node per device, checks what drmListDevices finds in it and
+ * compares the device opens and time drmOpen needs with and without the
+ * cached device list.  xf86drm.c is built into the test with its paths
+ * pointed at the fake tree and open() and ioctl() replaced, so the "device"
+ * nodes are plain files holding the driver name and bus ID.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "xf86drm.h"
+
+#define NUM_DEVICES	DRM_MAX_MINOR
+#define FIRST_I915	12	/* Minors below this are nouveau */
+#define ITERATIONS	2000
+
+static char root[] = "/tmp/drmdevice.XXXXXX";
+static char dri_dir[40], sysfs_dir[40], no_sysfs_dir[40];
+static const char *sysfs_path = sysfs_dir;
+
+#undef DRM_DIR_NAME
+#define DRM_DIR_NAME	dri_dir
+#define DRM_SYSFS_DIR	sysfs_path
+
+static unsigned int opens;
+static char claimed[1024];	/* SET_VERSION was called on the fd */
+
+static int mock_open(const char *path, int flags, ...)
+{
+	int fd = open(path, flags);
+
+	if (fd >= 0 && !strncmp(path, dri_dir, strlen(dri_dir))) {
+		opens++;
+		if (fd < (int) sizeof claimed)
+			claimed[fd] = 0;
+	}
+	return fd;
+}
+
+/* Answers from the "driver busid" line the node file holds. */
+static int mock_ioctl(int fd, unsigned long request, ...)
+{
+	char line[128], driver[64], busid[64];
+	struct drm_version *v;
+	struct drm_unique *u;
+	const char *unique;
+	ssize_t len;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	len = pread(fd, line, sizeof line - 1, 0);
+	if (len <= 0)
+		goto inval;
+	line[len] = '\0';
+	if (sscanf(line, "%63s %63s", driver, busid) != 2)
+		goto inval;
+
+	switch (request) {
+	case DRM_IOCTL_VERSION:
+		v = arg;
+		v->version_major = 1;
+		v->version_minor = 0;
+		v->version_patchlevel = 0;
+		if (v->name && v->name_len)
+			memcpy(v->name, driver, strlen(driver));
+		v->name_len = strlen(driver);
+		if (v->date && v->date_len)
+			memcpy(v->date, "20141017", 8);
+		v->date_len = 8;
+		if (v->desc && v->desc_len)
+			memcpy(v->desc, "mock", 4);
+		v->desc_len = 4;
+		return 0;
+	case DRM_IOCTL_SET_VERSION:
+		claimed[fd] = 1;
+		return 0;
+	case DRM_IOCTL_GET_UNIQUE:
+		u = arg;
+		unique = claimed[fd] ? busid : "";
+		if (u->unique && u->unique_len)
+			memcpy(u->unique, unique, strlen(unique));
+		u->unique_len = strlen(unique);
+		return 0;
+	}
+inval:
+	errno = EINVAL;
+	return -1;
+}
+
+#define open mock_open
+#define ioctl mock_ioctl
+/* Never look like root, so drmOpenDevice doesn't mknod into the tree. */
+#define geteuid() 1000
+
+#include "xf86drm.c"
+
+#undef open
+#undef ioctl
+
+static const char *driver_name(int minor)
+{
+	return minor < FIRST_I915 ? "nouveau" : "i915";
+}
+
+static void busid_name(char *buf, size_t size, int minor)
+{
+	snprintf(buf, size, "pci:0000:%02x:00.0", minor + 1);
+}
+
+static int write_file(const char *path, const char *contents)
+{
+	FILE *f = fopen(path, "w");
+
+	if (!f)
+		return -1;
+	fputs(contents, f);
+	return fclose(f);
+}
+
+/* Creates the nodes of device minor, backed by PCI function bus minor + 1. */
+static int add_device(int minor)
+{
+	char path[PATH_MAX], target[PATH_MAX], busid[64], line[128];
+	const char *nodes[] = { "card%d", "controlD%d", "renderD%d" };
+	int i, ret = 0;
+
+	busid_name(busid, sizeof busid, minor);
+	snprintf(path, sizeof path, "%s/devices/%s", root, busid + 4);
+	ret |= mkdir(path, 0755);
+	snprintf(path, sizeof path, "%s/devices/%s/driver", root, busid + 4);
+	snprintf(target, sizeof target, "../../drivers/%s", driver_name(minor));
+	ret |= symlink(target, path);
+	snprintf(path, sizeof path, "%s/devices/%s/uevent", root, busid + 4);
+	snprintf(line, sizeof line, "DRIVER=%s\nPCI_SLOT_NAME=%s\n",
+		 driver_name(minor), busid + 4);
+	ret |= write_file(path, line);
+
+	for (i = 0; i < 3; i++) {
+		snprintf(path, sizeof path, "%s/", sysfs_dir);
+		snprintf(path + strlen(path), sizeof path - strlen(path),
+			 nodes[i], minor + 64 * i);
+		ret |= mkdir(path, 0755);
+		strcat(path, "/device");
+		snprintf(target, sizeof target, "../../devices/%s",
+			 busid + 4);
+		ret |= symlink(target, path);
+	}
+
+	/* Connector directories share the card prefix */
+	snprintf(path, sizeof path, "%s/card%d-HDMI-A-1", sysfs_dir, minor);
+	ret |= mkdir(path, 0755);
+
+	snprintf(path, sizeof path, "%s/card%d", dri_dir, minor);
+	snprintf(line, sizeof line, "%s %s\n", driver_name(minor), busid);
+	ret |= write_file(path, line);
+
+	return ret;
+}
+
+static int make_tree(void)
+{
+	char path[PATH_MAX];
+	int i, ret = 0;
+
+	if (!mkdtemp(root))
+		return -1;
+	snprintf(dri_dir, sizeof dri_dir, "%s/dri", root);
+	snprintf(sysfs_dir, sizeof sysfs_dir, "%s/class", root);
+	snprintf(no_sysfs_dir, sizeof no_sysfs_dir, "%s/none", root);
+	ret |= mkdir(dri_dir, 0755);
+	ret |= mkdir(sysfs_dir, 0755);
+	snprintf(path, sizeof path, "%s/devices", root);
+	ret |= mkdir(path, 0755);
+	for (i = 0; i < NUM_DEVICES; i++)
+		ret |= add_device(i);
+	return ret;
+}
+
+static void remove_tree(void)
+{
+	char cmd[PATH_MAX + 16];
+
+	snprintf(cmd, sizeof cmd, "rm -rf %s", root);
+	if (system(cmd))
+		fprintf(stderr, "failed to remove %s\n", root);
+}
+
+/* Swaps the PCI functions behind two minors, in /dev and in sysfs. */
+static int swap_devices(int a, int b)
+{
+	char pa[PATH_MAX], pb[PATH_MAX], tmp[PATH_MAX];
+	const char *fmt[] = { "%s/card%d", "%s/card%d/device" };
+	const char *dirs[] = { dri_dir, sysfs_dir };
+	int i, ret = 0;
+
+	for (i = 0; i < 2; i++) {
+		snprintf(pa, sizeof pa, fmt[i], dirs[i], a);
+		snprintf(pb, sizeof pb, fmt[i], dirs[i], b);
+		snprintf(tmp, sizeof tmp, "%s/swap", root);
+		ret |= rename(pa, tmp);
+		ret |= rename(pb, pa);
+		ret |= rename(tmp, pb);
+	}
+	return ret;
+}
+
+static int check_devices(void)
+{
+	drmDeviceInfoPtr devices[NUM_DEVICES + 1];
+	char node[PATH_MAX], busid[64];
+	drmDeviceInfoPtr dev;
+	int i, count, errors = 0;
+
+	count = drmListDevices(NULL, 0);
+	if (count != NUM_DEVICES) {
+		fprintf(stderr, "drmListDevices counted %d devices\n", count);
+		return 1;
+	}
+	count = drmListDevices(devices, NUM_DEVICES + 1);
+	for (i = 0; i < count; i++) {
+		dev = devices[i];
+		busid_name(busid, sizeof busid, i);
+		if (dev->minor != i || !dev->busid || strcmp(dev->busid, busid) ||
+		    !dev->driver || strcmp(dev->driver, driver_name(i)))
+			errors++;
+		snprintf(node, sizeof node, "%s/card%d", dri_dir, i);
+		if (strcmp(dev->node, node))
+			errors++;
+		snprintf(node, sizeof node, "%s/controlD%d", dri_dir, i + 64);
+		if (!dev->control || strcmp(dev->control, node))
+			errors++;
+		snprintf(node, sizeof node, "%s/renderD%d", dri_dir, i + 128);
+		if (!dev->render || strcmp(dev->render, node))
+			errors++;
+	}
+	drmFreeDeviceList(devices, count);
+
+	if (errors)
+		fprintf(stderr, "drmListDevices: %d wrong fields\n", errors);
+	return errors != 0;
+}
+
+/* Checks that fd is the node file of the expected minor. */
+static int is_minor(int fd, int minor)
+{
+	char line[128], expect[128], busid[64];
+	ssize_t len;
+
+	if (fd < 0)
+		return 0;
+	len = pread(fd, line, sizeof line - 1, 0);
+	if (len <= 0)
+		return 0;
+	line[len] = '\0';
+	busid_name(busid, sizeof busid, minor);
+	snprintf(expect, sizeof expect, "%s %s\n", driver_name(minor), busid);
+	return !strcmp(line, expect);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *label, const char *name, const char *busid,
+	       int minor, int cached)
+{
+	double start, elapsed;
+	int i, fd, errors = 0;
+
+	sysfs_path = cached ? sysfs_dir : no_sysfs_dir;
+	drmRescanDevices();
+
+	opens = 0;
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		fd = drmOpen(name, busid);
+		if (!is_minor(fd, minor))
+			errors++;
+		if (fd >= 0)
+			close(fd);
+	}
+	elapsed = now() - start;
+
+	printf("%-28s %-6s %8.2f us/open %6.2f device opens/open\n",
+	       label, cached ? "cached" : "scan", elapsed * 1e6 / ITERATIONS,
+	       (double) opens / ITERATIONS);
+	if (errors)
+		fprintf(stderr, "%s: %d opens found the wrong device\n",
+			label, errors);
+	return errors != 0;
+}
+
+static int check_stale(void)
+{
+	char busid[64];
+	int fd, ret = 0;
+
+	sysfs_path = sysfs_dir;
+	drmRescanDevices();
+	if (drmListDevices(NULL, 0) != NUM_DEVICES)
+		return 1;
+
+	/* The cache still places the last device at the last minor */
+	if (swap_devices(NUM_DEVICES - 2, NUM_DEVICES - 1))
+		return 1;
+	busid_name(busid, sizeof busid, NUM_DEVICES - 1);
+
+	opens = 0;
+	fd = drmOpen(NULL, busid);
+	if (!is_minor(fd, NUM_DEVICES - 1) || opens != NUM_DEVICES + 1) {
+		fprintf(stderr, "stale cache: fd %d after %u opens\n",
+			fd, opens);
+		ret = 1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	/* The fallback scan dropped the cache, so the next open is direct */
+	opens = 0;
+	fd = drmOpen(NULL, busid);
+	if (!is_minor(fd, NUM_DEVICES - 1) || opens != 2) {
+		fprintf(stderr, "rescanned cache: fd %d after %u opens\n",
+			fd, opens);
+		ret = 1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	swap_devices(NUM_DEVICES - 2, NUM_DEVICES - 1);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	char busid[64], old_busid[64];
+	double start;
+	int i, ret = 0;
+
+	if (make_tree()) {
+		fprintf(stderr, "failed to build the fake device tree\n");
+		remove_tree();
+		return 1;
+	}
+
+	ret |= check_devices();
+
+	start = now();
+	for (i = 0; i < ITERATIONS; i++) {
+		drmRescanDevices();
+		drmListDevices(NULL, 0);
+	}
+	printf("%-28s %8.2f us/scan\n", "sysfs scan",
+	       (now() - start) * 1e6 / ITERATIONS);
+
+	busid_name(busid, sizeof busid, NUM_DEVICES - 1);
+	snprintf(old_busid, sizeof old_busid, "PCI:%d:0:0", NUM_DEVICES);
+	for (i = 0; i < 2; i++) {
+		ret |= run("drmOpen(busid, last)", NULL, busid,
+			   NUM_DEVICES - 1, i);
+		ret |= run("drmOpen(old busid, last)", NULL, old_busid,
+			   NUM_DEVICES - 1, i);
+		ret |= run("drmOpen(\"i915\")", "i915", NULL, FIRST_I915, i);
+	}
+
+	ret |= check_stale();
+
+	remove_tree();
+	return ret;
+}
@@ -0,0 +1,268 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Feeds synthetic DRM event streams through a pipe to check
+ * drmHandleEventBatch against drmHandleEvent and measure events/second.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include "xf86drm.h"
+
+#define BURST_BYTES	32768	/* Half of a default pipe buffer */
+#define BURSTS		2000
+#define EVENT_UNKNOWN	0x80000000
+
+struct unknown_event {
+	struct drm_event base;
+	uint32_t sequence;
+	uint32_t pad[5];
+};
+
+static unsigned int expected, errors, vblanks, flips, unknowns;
+static unsigned int last_sec, last_usec;
+
+static void check(unsigned int sequence, unsigned int tv_sec,
+		  unsigned int tv_usec)
+{
+	if (sequence != expected || tv_sec != sequence / 1000 ||
+	    tv_usec != sequence % 1000)
+		errors++;
+	expected = sequence + 1;
+}
+
+static void vblank_handler(int fd, unsigned int sequence,
+			   unsigned int tv_sec, unsigned int tv_usec,
+			   void *data)
+{
+	check(sequence, tv_sec, tv_usec);
+	last_sec = tv_sec;
+	last_usec = tv_usec;
+	vblanks++;
+}
+
+static void flip_handler(int fd, unsigned int sequence,
+			 unsigned int tv_sec, unsigned int tv_usec,
+			 void *data)
+{
+	check(sequence, tv_sec, tv_usec);
+	last_sec = tv_sec;
+	last_usec = tv_usec;
+	flips++;
+}
+
+static void unhandled(int fd, const struct drm_event *e, void *data)
+{
+	const struct unknown_event *u = (const struct unknown_event *) e;
+
+	if (e->type != EVENT_UNKNOWN || e->length != sizeof *u ||
+	    u->sequence != expected)
+		errors++;
+	expected = u->sequence + 1;
+	unknowns++;
+}
+
+/* Write one burst of events starting at sequence, returning how many.
+ * With unknown set, every eighth event is of a type libdrm doesn't know.
+ * All events are 32 bytes, so that reads of the pipe end between events
+ * as they do on a DRM fd. */
+static unsigned int write_burst(int fd, unsigned int sequence, int unknown)
+{
+	static char buffer[BURST_BYTES];
+	struct drm_event_vblank *vblank;
+	struct unknown_event *u;
+	unsigned int count = 0, len = 0, done;
+	ssize_t ret;
+
+	while (len + sizeof *vblank <= sizeof buffer) {
+		if (unknown && count % 8 == 7) {
+			u = (struct unknown_event *) &buffer[len];
+			u->base.type = EVENT_UNKNOWN;
+			u->base.length = sizeof *u;
+			u->sequence = sequence + count;
+			len += sizeof *u;
+		} else {
+			vblank = (struct drm_event_vblank *) &buffer[len];
+			vblank->base.type = count & 1 ?
+				DRM_EVENT_FLIP_COMPLETE : DRM_EVENT_VBLANK;
+			vblank->base.length = sizeof *vblank;
+			vblank->user_data = 0;
+			vblank->sequence = sequence + count;
+			vblank->tv_sec = vblank->sequence / 1000;
+			vblank->tv_usec = vblank->sequence % 1000;
+			len += sizeof *vblank;
+		}
+		count++;
+	}
+
+	for (done = 0; done < len; done += ret) {
+		ret = write(fd, buffer + done, len - done);
+		if (ret < 0 && errno != EINTR)
+			return 0;
+		if (ret < 0)
+			ret = 0;
+	}
+	return count;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int run(const char *name, int batched, unsigned int size, int unknown)
+{
+	drmEventContext evctx;
+	drmEventBatch batch;
+	int fds[2];
+	unsigned int i, sequence = 0, count, handled, reads = 0;
+	double start, elapsed;
+	int ret;
+
+	if (pipe(fds))
+		return 1;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.vblank_handler = vblank_handler;
+	evctx.page_flip_handler = flip_handler;
+
+	memset(&batch, 0, sizeof batch);
+	batch.size = size;
+	batch.buffer = size ? malloc(size) : NULL;
+	batch.unhandled = unhandled;
+
+	expected = errors = vblanks = flips = unknowns = 0;
+
+	start = now();
+	for (i = 0; i < BURSTS; i++) {
+		count = write_burst(fds[1], sequence, unknown);
+		if (!count)
+			return 1;
+		sequence += count;
+
+		for (handled = 0; handled < count; ) {
+			if (batched) {
+				ret = drmHandleEventBatch(fds[0], &evctx,
+							  &batch);
+				handled += ret;
+				reads += batch.reads;
+				if (batch.events &&
+				    (batch.tv_sec != last_sec ||
+				     batch.tv_usec != last_usec))
+					errors++;
+			} else {
+				ret = drmHandleEvent(fds[0], &evctx);
+				handled = vblanks + flips - (sequence - count);
+				reads++;
+			}
+			if (ret < 0) {
+				fprintf(stderr, "%s: read failed\n", name);
+				return 1;
+			}
+		}
+	}
+	elapsed = now() - start;
+
+	close(fds[0]);
+	close(fds[1]);
+	free(batch.buffer);
+
+	printf("%-32s %10.0f events/s %6.2f reads/burst\n",
+	       name, sequence / elapsed, (double) reads / BURSTS);
+
+	if (errors || vblanks + flips + unknowns != sequence ||
+	    (!unknown && unknowns)) {
+		fprintf(stderr, "%s: %u errors, %u of %u events seen\n",
+			name, errors, vblanks + flips + unknowns, sequence);
+		return 1;
+	}
+	return 0;
+}
+
+/* Events ahead of a truncated one are still dispatched and counted, and
+ * the end of the stream ends the batch quietly. */
+static int check_truncated(void)
+{
+	drmEventContext evctx;
+	drmEventBatch batch;
+	struct drm_event_vblank events[4];
+	int fds[2], i, ret, failed = 0;
+
+	if (pipe(fds))
+		return 1;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.vblank_handler = vblank_handler;
+	memset(&batch, 0, sizeof batch);
+
+	memset(events, 0, sizeof events);
+	for (i = 0; i < 4; i++) {
+		events[i].base.type = DRM_EVENT_VBLANK;
+		events[i].base.length = sizeof events[i];
+		events[i].sequence = i;
+		events[i].tv_usec = i;
+	}
+	expected = errors = vblanks = 0;
+	if (write(fds[1], events, 3 * sizeof events[0] + 8) < 0)
+		return 1;
+	close(fds[1]);
+
+	ret = drmHandleEventBatch(fds[0], &evctx, &batch);
+	if (ret != 3 || batch.events != 3 || vblanks != 3 || errors)
+		failed = 1;
+	if (drmHandleEventBatch(fds[0], &evctx, &batch) != 0)
+		failed = 1;
+	close(fds[0]);
+
+	if (failed)
+		fprintf(stderr, "truncated stream: %d events\n", ret);
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	int ret = 0;
+
+	ret |= run("drmHandleEvent", 0, 0, 0);
+	ret |= run("drmHandleEventBatch", 1, 0, 0);
+	ret |= run("drmHandleEventBatch 64KB", 1, 65536, 0);
+	ret |= run("drmHandleEventBatch 1KB", 1, 1024, 0);
+	ret |= run("drmHandleEventBatch unknown", 1, 0, 1);
+	ret |= run("drmHandleEventBatch unknown 1KB", 1, 1024, 1);
+	ret |= check_truncated();
+
+	return ret;
+}
@@ -0,0 +1,183 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Issues ioctls on a pipe through drmIoctl with statistics off and on,
+ * checks what drmGetIoctlStats and drmDumpIoctlStats report, including the
+ * dump a LIBDRM_IOCTL_STATS child writes at exit, and measures the cost per
+ * call in both modes.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include "xf86drm.h"
+
+#define CALLS		200000
+#define FAILS		1000
+
+static int fds[2];
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(unsigned int calls)
+{
+	double start = now();
+	unsigned int i;
+	int avail;
+
+	for (i = 0; i < calls; i++)
+		drmIoctl(fds[0], FIONREAD, &avail);
+	return (now() - start) * 1e9 / calls;
+}
+
+static int read_file(const char *path, char *buf, size_t size)
+{
+	FILE *f = fopen(path, "r");
+	size_t len;
+
+	if (!f)
+		return -1;
+	len = fread(buf, 1, size - 1, f);
+	buf[len] = '\0';
+	fclose(f);
+	return 0;
+}
+
+/* A child with LIBDRM_IOCTL_STATS set dumps its totals when it exits.
+ * Runs before this process makes its first drmIoctl so that the child
+ * still reads the environment. */
+static int check_env(void)
+{
+	char path[] = "/tmp/drmioctlstats.XXXXXX", buf[4096];
+	drm_version_t version;
+	int status, fd;
+	pid_t pid;
+
+	if ((fd = mkstemp(path)) < 0)
+		return 1;
+	close(fd);
+
+	pid = fork();
+	if (pid == 0) {
+		setenv("LIBDRM_IOCTL_STATS", path, 1);
+		memset(&version, 0, sizeof(version));
+		drmIoctl(fds[0], DRM_IOCTL_VERSION, &version);
+		run(10);
+		exit(0);
+	}
+	if (pid < 0 || waitpid(pid, &status, 0) != pid || status ||
+	    read_file(path, buf, sizeof(buf))) {
+		unlink(path);
+		return 1;
+	}
+	unlink(path);
+
+	if (!strstr(buf, "libdrm ioctl stats") ||
+	    !strstr(buf, "\n0x1b  0x0000541b        10 ") ||
+	    !strstr(buf, "\n0x00  ")) {
+		fprintf(stderr, "unexpected dump at exit:\n%s", buf);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	drmIoctlStat stats[4];
+	drm_version_t version;
+	double off, on;
+	uint64_t total;
+	int i, j, count, errors = 0;
+
+	unsetenv("LIBDRM_IOCTL_STATS");
+	if (pipe(fds))
+		return 1;
+
+	if (check_env()) {
+		fprintf(stderr, "LIBDRM_IOCTL_STATS dump failed\n");
+		errors++;
+	}
+
+	run(CALLS / 10);
+	off = run(CALLS);
+	if (drmGetIoctlStats(NULL, 0) != 0)
+		errors++;
+
+	drmSetIoctlStats(1);
+	on = run(CALLS);
+	for (i = 0; i < FAILS; i++) {
+		memset(&version, 0, sizeof(version));
+		if (drmIoctl(fds[0], DRM_IOCTL_VERSION, &version) != -1 ||
+		    errno != ENOTTY)
+			errors++;
+	}
+	drmSetIoctlStats(0);
+	run(10);
+
+	printf("drmIoctl, stats off  %8.1f ns/call\n", off);
+	printf("drmIoctl, stats on   %8.1f ns/call\n", on);
+
+	count = drmGetIoctlStats(stats, 4);
+	if (count != 2 || stats[0].request != FIONREAD ||
+	    stats[0].count != CALLS || stats[0].errors ||
+	    stats[1].request != DRM_IOCTL_VERSION ||
+	    stats[1].count != FAILS || stats[1].errors != FAILS ||
+	    stats[0].total_ns < stats[1].total_ns ||
+	    stats[0].max_ns * CALLS < stats[0].total_ns) {
+		fprintf(stderr, "unexpected stats for %d requests\n", count);
+		errors++;
+	}
+	for (i = 0; i < count && i < 4; i++) {
+		total = 0;
+		for (j = 0; j < DRM_IOCTL_STATS_BUCKETS; j++)
+			total += stats[i].histogram[j];
+		if (total != stats[i].count)
+			errors++;
+	}
+
+	fflush(stdout);
+	drmDumpIoctlStats(STDOUT_FILENO);
+
+	drmResetIoctlStats();
+	if (drmGetIoctlStats(NULL, 0) != 0)
+		errors++;
+
+	close(fds[0]);
+	close(fds[1]);
+	return errors != 0;
+}
@@ -0,0 +1,369 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Commits drmModeCommitReq requests to a mock KMS device that either has the
+ * atomic ioctl or only the legacy ones, and checks which ioctls are issued
+ * and that page flip events come back through drmHandleEvent.  The mode code
+ * is built into the test so that drmIoctl can be replaced; the device is a
+ * pipe, so flip events written to it are read back by drmHandleEvent.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "xf86drmMode.c"
+
+#define CRTC_ID(i)	(300 + (i))
+#define CONN_ID(i)	(100 + (i))
+#define PLANE_ID(i)	(400 + (i))	/* Planes 0 and 1 are primary */
+#define FB_ID(i)	(600 + (i))
+#define PROP_FB_ID	500
+#define PROP_CRTC_ID	501
+#define PROP_DPMS	502
+
+#define NUM_CRTCS	2
+#define NUM_PLANES	4
+#define NUM_FBS		4
+
+#define MAX_LOG		32
+
+static int has_atomic;
+static int event_fd = -1;
+static unsigned int log_count;
+static unsigned long log_request[MAX_LOG];
+static uint32_t log_object[MAX_LOG];
+
+/* Last atomic commit, as the kernel saw it */
+static uint32_t atomic_objs[8], atomic_count_props[8], atomic_props[16];
+static uint64_t atomic_values[16];
+static uint32_t atomic_count_objs, atomic_flags;
+
+static int valid(uint32_t id, uint32_t base, int count)
+{
+	return id >= base && id < base + count;
+}
+
+static void send_flip(uint32_t crtc_id, uint64_t user_data)
+{
+	struct drm_event_vblank e;
+
+	memset(&e, 0, sizeof(e));
+	e.base.type = DRM_EVENT_FLIP_COMPLETE;
+	e.base.length = sizeof(e);
+	e.user_data = user_data;
+	e.sequence = crtc_id;
+	if (write(event_fd, &e, sizeof(e)) != sizeof(e))
+		abort();
+}
+
+static int mock_atomic(struct drm_mode_atomic *atomic)
+{
+	uint32_t *objs = U642VOID(atomic->objs_ptr);
+	uint32_t *count_props = U642VOID(atomic->count_props_ptr);
+	uint32_t *props = U642VOID(atomic->props_ptr);
+	uint64_t *values = U642VOID(atomic->prop_values_ptr);
+	uint32_t i, j, count = 0;
+
+	if (!has_atomic || (atomic->flags & ~DRM_MODE_ATOMIC_FLAGS))
+		return -EINVAL;
+
+	for (i = 0; i < atomic->count_objs; i++) {
+		if (!valid(objs[i], PLANE_ID(0), NUM_PLANES) &&
+		    !valid(objs[i], CRTC_ID(0), NUM_CRTCS) &&
+		    !valid(objs[i], CONN_ID(0), 2))
+			return -ENOENT;
+		count += count_props[i];
+	}
+	if (atomic->count_objs > 8 || count > 16)
+		return -ENOSPC;
+
+	atomic_count_objs = atomic->count_objs;
+	atomic_flags = atomic->flags;
+	memcpy(atomic_objs, objs, atomic->count_objs * sizeof(*objs));
+	memcpy(atomic_count_props, count_props,
+	       atomic->count_objs * sizeof(*count_props));
+	memcpy(atomic_props, props, count * sizeof(*props));
+	memcpy(atomic_values, values, count * sizeof(*values));
+
+	if (atomic->flags & DRM_MODE_ATOMIC_TEST_ONLY ||
+	    !(atomic->flags & DRM_MODE_PAGE_FLIP_EVENT))
+		return 0;
+
+	/* Every crtc whose primary plane changed flips. */
+	for (i = 0; i < atomic->count_objs; i++)
+		for (j = 0; j < NUM_CRTCS; j++)
+			if (objs[i] == PLANE_ID(j))
+				send_flip(CRTC_ID(j), atomic->user_data);
+	return 0;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_crtc *crtc = arg;
+	struct drm_mode_set_plane *plane = arg;
+	struct drm_mode_crtc_page_flip *flip = arg;
+	struct drm_mode_obj_set_property *set_prop = arg;
+	uint32_t object = 0;
+	int ret = 0;
+
+	switch (request) {
+	case DRM_IOCTL_MODE_ATOMIC:
+		ret = mock_atomic(arg);
+		break;
+	case DRM_IOCTL_MODE_SETCRTC:
+		object = crtc->crtc_id;
+		if (!valid(crtc->crtc_id, CRTC_ID(0), NUM_CRTCS) ||
+		    (crtc->fb_id && !valid(crtc->fb_id, FB_ID(0), NUM_FBS)))
+			ret = -ENOENT;
+		break;
+	case DRM_IOCTL_MODE_SETPLANE:
+		object = plane->plane_id;
+		if (!valid(plane->plane_id, PLANE_ID(0), NUM_PLANES) ||
+		    (plane->fb_id && !valid(plane->fb_id, FB_ID(0), NUM_FBS)))
+			ret = -ENOENT;
+		break;
+	case DRM_IOCTL_MODE_PAGE_FLIP:
+		object = flip->crtc_id;
+		if (!valid(flip->crtc_id, CRTC_ID(0), NUM_CRTCS) ||
+		    !valid(flip->fb_id, FB_ID(0), NUM_FBS))
+			ret = -ENOENT;
+		else if (flip->flags & DRM_MODE_PAGE_FLIP_EVENT)
+			send_flip(flip->crtc_id, flip->user_data);
+		break;
+	case DRM_IOCTL_MODE_OBJ_SETPROPERTY:
+		object = set_prop->obj_id;
+		if (set_prop->obj_type != DRM_MODE_OBJECT_CONNECTOR ||
+		    !valid(set_prop->obj_id, CONN_ID(0), 2))
+			ret = -ENOENT;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (log_count < MAX_LOG) {
+		log_request[log_count] = request;
+		log_object[log_count] = object;
+	}
+	log_count++;
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+void *drmMalloc(int size)
+{
+	return calloc(1, size);
+}
+
+void drmFree(void *pt)
+{
+	free(pt);
+}
+
+static unsigned int flips;
+static uint32_t flipped_crtcs;
+
+static void flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+			 unsigned int tv_usec, void *data)
+{
+	if (data == &flips) {
+		flips++;
+		flipped_crtcs |= 1 << (sequence - CRTC_ID(0));
+	}
+}
+
+/* Dispatch pending events, returning how many flips completed. */
+static unsigned int handle_flips(int fd)
+{
+	drmEventContext evctx;
+	drmEventBatch batch;
+
+	memset(&evctx, 0, sizeof evctx);
+	evctx.version = DRM_EVENT_CONTEXT_VERSION;
+	evctx.page_flip_handler = flip_handler;
+	memset(&batch, 0, sizeof batch);
+
+	flips = 0;
+	flipped_crtcs = 0;
+	if (drmHandleEventBatch(fd, &evctx, &batch) < 0)
+		return 0;
+	return flips;
+}
+
+static int open_device(int atomic)
+{
+	int fds[2];
+
+	if (pipe(fds))
+		abort();
+	if (event_fd >= 0)
+		close(event_fd);
+	event_fd = fds[1];
+	has_atomic = atomic;
+	return fds[0];
+}
+
+static void close_device(int fd)
+{
+	drmModeInvalidatePropertyCache(fd);
+	close(fd);
+}
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: %s failed\n",			\
+			__FILE__, __LINE__, #cond);			\
+		errors++;						\
+	}								\
+} while (0)
+
+static int test_atomic(void)
+{
+	drmModeCommitReqPtr req = drmModeCommitReqAlloc();
+	int fd = open_device(1), cursor, errors = 0;
+
+	/* Two heads flip in one ioctl; the older FB_ID for plane 0 is
+	 * dropped and the tuples are grouped by object. */
+	drmModeCommitReqAddProperty(req, PLANE_ID(1), PROP_FB_ID, FB_ID(3));
+	drmModeCommitReqAddProperty(req, PLANE_ID(0), PROP_FB_ID, FB_ID(0));
+	cursor = drmModeCommitReqAddProperty(req, PLANE_ID(0), PROP_FB_ID,
+					     FB_ID(2));
+	CHECK(cursor == 3);
+
+	/* Rolled back before the commit */
+	drmModeCommitReqAddProperty(req, CRTC_ID(0), PROP_DPMS, 3);
+	drmModeCommitReqSetCursor(req, cursor);
+	CHECK(drmModeCommitReqGetCursor(req) == cursor);
+
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, DRM_MODE_ATOMIC_NONBLOCK |
+			    DRM_MODE_PAGE_FLIP_EVENT, &flips) == 0);
+	printf("2-head flip, atomic:  %u ioctl(s)\n", log_count);
+	CHECK(log_count == 1);
+	CHECK(atomic_count_objs == 2);
+	CHECK(atomic_objs[0] == PLANE_ID(0) && atomic_objs[1] == PLANE_ID(1));
+	CHECK(atomic_count_props[0] == 1 && atomic_count_props[1] == 1);
+	CHECK(atomic_values[0] == FB_ID(2) && atomic_values[1] == FB_ID(3));
+	CHECK(atomic_flags == (DRM_MODE_ATOMIC_NONBLOCK |
+			       DRM_MODE_PAGE_FLIP_EVENT));
+	CHECK(handle_flips(fd) == 2 && flipped_crtcs == 3);
+
+	/* Refusals of a real request are passed on without a fallback. */
+	drmModeCommitReqAddProperty(req, 999, PROP_DPMS, 0);
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, DRM_MODE_ATOMIC_TEST_ONLY,
+			    NULL) == -ENOENT);
+	CHECK(log_count == 1);
+
+	CHECK(drmModeCommit(fd, req, 0x80000000, NULL) == -EINVAL);
+
+	drmModeCommitReqFree(req);
+	close_device(fd);
+	return errors;
+}
+
+static int test_legacy(void)
+{
+	drmModeCommitReqPtr req = drmModeCommitReqAlloc();
+	drmModeModeInfo mode;
+	uint32_t connectors[] = { CONN_ID(0) };
+	int fd = open_device(0), errors = 0;
+
+	/* Property tuples find out once that there is no atomic ioctl. */
+	drmModeCommitReqAddProperty(req, CONN_ID(0), PROP_DPMS, 0);
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, 0, NULL) == 0);
+	CHECK(log_count == 3);
+	CHECK(log_request[2] == DRM_IOCTL_MODE_OBJ_SETPROPERTY);
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, 0, NULL) == 0);
+	CHECK(log_count == 1);
+	drmModeCommitReqSetCursor(req, 0);
+
+	/* Two heads flip with one ioctl each. */
+	drmModeCommitReqAddPageFlip(req, CRTC_ID(0), FB_ID(0));
+	drmModeCommitReqAddPageFlip(req, CRTC_ID(1), FB_ID(1));
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, DRM_MODE_PAGE_FLIP_EVENT,
+			    &flips) == 0);
+	printf("2-head flip, legacy:  %u ioctl(s)\n", log_count);
+	CHECK(log_count == 2);
+	CHECK(handle_flips(fd) == 2 && flipped_crtcs == 3);
+	drmModeCommitReqSetCursor(req, 0);
+
+	/* Flips go last, everything else in order. */
+	memset(&mode, 0, sizeof(mode));
+	mode.hdisplay = 1920;
+	mode.vdisplay = 1080;
+	drmModeCommitReqAddPageFlip(req, CRTC_ID(1), FB_ID(3));
+	drmModeCommitReqAddCrtc(req, CRTC_ID(0), FB_ID(0), 0, 0, connectors, 1,
+				&mode);
+	drmModeCommitReqAddPlane(req, PLANE_ID(2), CRTC_ID(0), FB_ID(1),
+				 0, 0, 64, 64, 0, 0, 64 << 16, 64 << 16);
+	drmModeCommitReqAddProperty(req, CONN_ID(0), PROP_DPMS, 0);
+
+	CHECK(drmModeCommit(fd, req, 0, NULL) == -EINVAL);
+
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET |
+			    DRM_MODE_PAGE_FLIP_EVENT, &flips) == 0);
+	CHECK(log_count == 4);
+	CHECK(log_request[0] == DRM_IOCTL_MODE_SETCRTC &&
+	      log_object[0] == CRTC_ID(0));
+	CHECK(log_request[1] == DRM_IOCTL_MODE_SETPLANE &&
+	      log_object[1] == PLANE_ID(2));
+	CHECK(log_request[2] == DRM_IOCTL_MODE_OBJ_SETPROPERTY);
+	CHECK(log_request[3] == DRM_IOCTL_MODE_PAGE_FLIP &&
+	      log_object[3] == CRTC_ID(1));
+	CHECK(handle_flips(fd) == 1 && flipped_crtcs == 2);
+
+	/* A test-only commit can't be checked without applying it. */
+	log_count = 0;
+	CHECK(drmModeCommit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET |
+			    DRM_MODE_ATOMIC_TEST_ONLY, NULL) == -EOPNOTSUPP);
+	CHECK(log_count == 0);
+
+	drmModeCommitReqFree(req);
+	close_device(fd);
+	return errors;
+}
+
+int main(int argc, char **argv)
+{
+	int errors = 0;
+
+	errors += test_atomic();
+	errors += test_legacy();
+
+	return errors != 0;
+}
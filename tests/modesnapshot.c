@@ -0,0 +1,695 @@
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Runs drmModeGetSnapshot and the equivalent sequence of drmModeGet* calls
+ * against a mock KMS device, checks that both see the same objects and
+ * counts the ioctls and allocations each needs.  Also checks that property
+ * lookups through the property cache only reach the device once, and that
+ * the connector and crtc variants filling caller storage don't allocate.
+ * The mode code is built into the test so that drmIoctl, drmMalloc and
+ * drmFree can be replaced.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "xf86drmMode.c"
+
+#define NUM_FBS		3
+#define NUM_CRTCS	4
+#define NUM_CONNECTORS	6
+#define NUM_ENCODERS	6
+#define NUM_PLANES	12
+#define NUM_MODES	24	/* On each connected connector */
+#define NUM_FORMATS	20
+#define NUM_CONN_PROPS	8
+#define NUM_CRTC_PROPS	6
+#define NUM_PLANE_PROPS	10
+
+#define FB_ID(i)	(600 + (i))
+#define CRTC_ID(i)	(300 + (i))
+#define CONN_ID(i)	(100 + (i))
+#define ENC_ID(i)	(200 + (i))
+#define PLANE_ID(i)	(400 + (i))
+#define PROP_ID(i)	(500 + (i))
+
+static unsigned int ioctls, allocs;
+
+/* Mock device state */
+static unsigned int extra_modes;	/* Modes added to connector 0 */
+static unsigned int grow_modes;		/* Modes to add on the next fill */
+static int unplug_at;			/* GETCONNECTOR call that unplugs */
+static int unplugged;			/* Last connector is gone */
+static int vanishing;			/* Connector 1 is listed but never found */
+static int getconnector_calls;
+
+static unsigned int num_connectors(void)
+{
+	return unplugged ? NUM_CONNECTORS - 1 : NUM_CONNECTORS;
+}
+
+static unsigned int num_modes(unsigned int conn)
+{
+	if (conn % 2)
+		return 0;
+	return NUM_MODES + (conn == 0 ? extra_modes : 0);
+}
+
+/* The kernel only fills a list if it has room for all of it, and always
+ * reports the real length. */
+static void fill_ids(__u32 *count, __u64 ptr, unsigned int n, uint32_t base)
+{
+	uint32_t *ids = U642VOID(ptr);
+	unsigned int i;
+
+	if (n && *count >= n)
+		for (i = 0; i < n; i++)
+			ids[i] = base + i;
+	*count = n;
+}
+
+static void fill_props(__u32 *count, __u64 ids_ptr, __u64 values_ptr,
+		       unsigned int n, uint32_t object)
+{
+	uint64_t *values = U642VOID(values_ptr);
+	unsigned int i;
+
+	if (n && *count >= n)
+		for (i = 0; i < n; i++)
+			values[i] = (uint64_t)object << 32 | i;
+	fill_ids(count, ids_ptr, n, PROP_ID(0));
+}
+
+static int mock_getproperty(struct drm_mode_get_property *prop)
+{
+	struct drm_mode_property_enum *enums = U642VOID(prop->enum_blob_ptr);
+	uint64_t *values = U642VOID(prop->values_ptr);
+	unsigned int index = prop->prop_id - PROP_ID(0), i;
+
+	if (index >= NUM_PLANE_PROPS)
+		return -ENOENT;
+
+	prop->flags = DRM_MODE_PROP_ENUM;
+	snprintf(prop->name, sizeof(prop->name), "prop%u", index);
+	if (prop->count_values >= 3 && prop->count_enum_blobs >= 3) {
+		for (i = 0; i < 3; i++) {
+			values[i] = i;
+			enums[i].value = i;
+			snprintf(enums[i].name, sizeof(enums[i].name),
+				 "value%u", i);
+		}
+	}
+	prop->count_values = 3;
+	prop->count_enum_blobs = 3;
+	return 0;
+}
+
+static int mock_getconnector(struct drm_mode_get_connector *conn)
+{
+	struct drm_mode_modeinfo *modes = U642VOID(conn->modes_ptr);
+	unsigned int index = conn->connector_id - CONN_ID(0), n, i;
+
+	if (++getconnector_calls == unplug_at)
+		unplugged = 1;
+	if (index >= num_connectors() || (vanishing && index == 1))
+		return -ENOENT;
+
+	/* Another client probes the connector and finds more modes just
+	 * before the kernel fills in our list. */
+	if (index == 0 && grow_modes && conn->count_modes) {
+		extra_modes += grow_modes;
+		grow_modes = 0;
+	}
+
+	n = num_modes(index);
+	if (n && conn->count_modes >= n) {
+		for (i = 0; i < n; i++) {
+			memset(&modes[i], 0, sizeof(modes[i]));
+			modes[i].hdisplay = 640 + i;
+			modes[i].vdisplay = 480 + index;
+			snprintf(modes[i].name, sizeof(modes[i].name),
+				 "%ux%u", 640 + i, 480 + index);
+		}
+	}
+	conn->count_modes = n;
+
+	fill_props(&conn->count_props, conn->props_ptr, conn->prop_values_ptr,
+		   NUM_CONN_PROPS, conn->connector_id);
+	fill_ids(&conn->count_encoders, conn->encoders_ptr, 1, ENC_ID(index));
+
+	conn->encoder_id = ENC_ID(index);
+	conn->connector_type = DRM_MODE_CONNECTOR_HDMIA;
+	conn->connector_type_id = index + 1;
+	conn->connection = index % 2 ? 2 : 1;
+	conn->mm_width = 520;
+	conn->mm_height = 290;
+	conn->subpixel = 0;
+	return 0;
+}
+
+int drmIoctl(int fd, unsigned long request, void *arg)
+{
+	struct drm_mode_card_res *res = arg;
+	struct drm_mode_crtc *crtc = arg;
+	struct drm_mode_get_encoder *enc = arg;
+	struct drm_mode_get_plane_res *plane_res = arg;
+	struct drm_mode_get_plane *plane = arg;
+	struct drm_mode_obj_get_properties *props = arg;
+	unsigned int index;
+	int ret = 0;
+
+	ioctls++;
+
+	switch (request) {
+	case DRM_IOCTL_MODE_GETRESOURCES:
+		fill_ids(&res->count_fbs, res->fb_id_ptr, NUM_FBS, FB_ID(0));
+		fill_ids(&res->count_crtcs, res->crtc_id_ptr, NUM_CRTCS,
+			 CRTC_ID(0));
+		fill_ids(&res->count_connectors, res->connector_id_ptr,
+			 num_connectors(), CONN_ID(0));
+		fill_ids(&res->count_encoders, res->encoder_id_ptr,
+			 NUM_ENCODERS, ENC_ID(0));
+		res->min_width = res->min_height = 8;
+		res->max_width = res->max_height = 8192;
+		break;
+	case DRM_IOCTL_MODE_GETCRTC:
+		index = crtc->crtc_id - CRTC_ID(0);
+		if (index >= NUM_CRTCS) {
+			ret = -ENOENT;
+			break;
+		}
+		crtc->fb_id = index < NUM_FBS ? FB_ID(index) : 0;
+		crtc->x = index;
+		crtc->y = 2 * index;
+		crtc->gamma_size = 256;
+		crtc->mode_valid = index < NUM_FBS;
+		memset(&crtc->mode, 0, sizeof(crtc->mode));
+		crtc->mode.hdisplay = 1920;
+		crtc->mode.vdisplay = 1080;
+		break;
+	case DRM_IOCTL_MODE_GETCONNECTOR:
+		ret = mock_getconnector(arg);
+		break;
+	case DRM_IOCTL_MODE_GETENCODER:
+		index = enc->encoder_id - ENC_ID(0);
+		if (index >= NUM_ENCODERS) {
+			ret = -ENOENT;
+			break;
+		}
+		enc->encoder_type = DRM_MODE_ENCODER_TMDS;
+		enc->crtc_id = index < NUM_CRTCS ? CRTC_ID(index) : 0;
+		enc->possible_crtcs = (1 << NUM_CRTCS) - 1;
+		enc->possible_clones = 0;
+		break;
+	case DRM_IOCTL_MODE_GETPLANERESOURCES:
+		fill_ids(&plane_res->count_planes, plane_res->plane_id_ptr,
+			 NUM_PLANES, PLANE_ID(0));
+		break;
+	case DRM_IOCTL_MODE_GETPLANE:
+		index = plane->plane_id - PLANE_ID(0);
+		if (index >= NUM_PLANES) {
+			ret = -ENOENT;
+			break;
+		}
+		plane->crtc_id = CRTC_ID(index % NUM_CRTCS);
+		plane->fb_id = 0;
+		plane->possible_crtcs = 1 << (index % NUM_CRTCS);
+		plane->gamma_size = 0;
+		fill_ids(&plane->count_format_types, plane->format_type_ptr,
+			 NUM_FORMATS, 0x34325258);
+		break;
+	case DRM_IOCTL_MODE_GETPROPERTY:
+		ret = mock_getproperty(arg);
+		break;
+	case DRM_IOCTL_MODE_OBJ_GETPROPERTIES:
+		fill_props(&props->count_props, props->props_ptr,
+			   props->prop_values_ptr,
+			   props->obj_type == DRM_MODE_OBJECT_CRTC ?
+			   NUM_CRTC_PROPS : NUM_PLANE_PROPS, props->obj_id);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+void *drmMalloc(int size)
+{
+	allocs++;
+	return calloc(1, size);
+}
+
+void drmFree(void *pt)
+{
+	free(pt);
+}
+
+/* The drmModeGet* results a snapshot replaces. */
+struct legacy {
+	drmModeResPtr res;
+	drmModeCrtcPtr crtcs[NUM_CRTCS];
+	drmModeObjectPropertiesPtr crtc_props[NUM_CRTCS];
+	drmModeConnectorPtr connectors[NUM_CONNECTORS];
+	drmModeEncoderPtr encoders[NUM_ENCODERS];
+	drmModePlaneResPtr plane_res;
+	drmModePlanePtr planes[NUM_PLANES];
+	drmModeObjectPropertiesPtr plane_props[NUM_PLANES];
+};
+
+static int legacy_get(int fd, struct legacy *l)
+{
+	int i;
+
+	memset(l, 0, sizeof(*l));
+	if (!(l->res = drmModeGetResources(fd)))
+		return -1;
+	for (i = 0; i < l->res->count_crtcs; i++) {
+		l->crtcs[i] = drmModeGetCrtc(fd, l->res->crtcs[i]);
+		l->crtc_props[i] =
+			drmModeObjectGetProperties(fd, l->res->crtcs[i],
+						   DRM_MODE_OBJECT_CRTC);
+		if (!l->crtcs[i] || !l->crtc_props[i])
+			return -1;
+	}
+	for (i = 0; i < l->res->count_connectors; i++)
+		if (!(l->connectors[i] =
+		      drmModeGetConnector(fd, l->res->connectors[i])))
+			return -1;
+	for (i = 0; i < l->res->count_encoders; i++)
+		if (!(l->encoders[i] =
+		      drmModeGetEncoder(fd, l->res->encoders[i])))
+			return -1;
+	if (!(l->plane_res = drmModeGetPlaneResources(fd)))
+		return -1;
+	for (i = 0; i < (int)l->plane_res->count_planes; i++) {
+		l->planes[i] = drmModeGetPlane(fd, l->plane_res->planes[i]);
+		l->plane_props[i] =
+			drmModeObjectGetProperties(fd, l->plane_res->planes[i],
+						   DRM_MODE_OBJECT_PLANE);
+		if (!l->planes[i] || !l->plane_props[i])
+			return -1;
+	}
+	return 0;
+}
+
+static void legacy_free(struct legacy *l)
+{
+	int i;
+
+	for (i = 0; i < NUM_CRTCS; i++) {
+		drmModeFreeCrtc(l->crtcs[i]);
+		drmModeFreeObjectProperties(l->crtc_props[i]);
+	}
+	for (i = 0; i < NUM_CONNECTORS; i++)
+		drmModeFreeConnector(l->connectors[i]);
+	for (i = 0; i < NUM_ENCODERS; i++)
+		drmModeFreeEncoder(l->encoders[i]);
+	for (i = 0; i < NUM_PLANES; i++) {
+		drmModeFreePlane(l->planes[i]);
+		drmModeFreeObjectProperties(l->plane_props[i]);
+	}
+	drmModeFreePlaneResources(l->plane_res);
+	drmModeFreeResources(l->res);
+}
+
+static int same_list(const void *a, const void *b, int count, size_t size)
+{
+	if (!count)
+		return !a && !b;
+	return a && b && !memcmp(a, b, count * size);
+}
+
+static int same_props(drmModeObjectPropertiesPtr a,
+		      drmModeObjectPropertiesPtr b)
+{
+	return a->count_props == b->count_props &&
+		same_list(a->props, b->props, a->count_props,
+			  sizeof(uint32_t)) &&
+		same_list(a->prop_values, b->prop_values, a->count_props,
+			  sizeof(uint64_t));
+}
+
+static int compare(struct legacy *l, drmModeSnapshotPtr s)
+{
+	drmModeConnectorPtr c, sc;
+	drmModePlanePtr p, sp;
+	int i, errors = 0;
+
+	if (s->count_fbs != l->res->count_fbs ||
+	    s->count_crtcs != l->res->count_crtcs ||
+	    s->count_connectors != l->res->count_connectors ||
+	    s->count_encoders != l->res->count_encoders ||
+	    s->count_planes != (int)l->plane_res->count_planes ||
+	    s->min_width != l->res->min_width ||
+	    s->max_height != l->res->max_height ||
+	    !same_list(s->fbs, l->res->fbs, s->count_fbs, sizeof(uint32_t)))
+		return 1;
+
+	for (i = 0; i < s->count_crtcs; i++)
+		if (memcmp(&s->crtcs[i], l->crtcs[i], sizeof(drmModeCrtc)) ||
+		    !same_props(&s->crtc_props[i], l->crtc_props[i]))
+			errors++;
+
+	for (i = 0; i < s->count_connectors; i++) {
+		c = l->connectors[i];
+		sc = &s->connectors[i];
+		if (sc->connector_id != c->connector_id ||
+		    sc->encoder_id != c->encoder_id ||
+		    sc->connector_type != c->connector_type ||
+		    sc->connector_type_id != c->connector_type_id ||
+		    sc->connection != c->connection ||
+		    sc->mmWidth != c->mmWidth || sc->mmHeight != c->mmHeight ||
+		    sc->subpixel != c->subpixel ||
+		    sc->count_modes != c->count_modes ||
+		    !same_list(sc->modes, c->modes, c->count_modes,
+			       sizeof(drmModeModeInfo)) ||
+		    sc->count_props != c->count_props ||
+		    !same_list(sc->props, c->props, c->count_props,
+			       sizeof(uint32_t)) ||
+		    !same_list(sc->prop_values, c->prop_values,
+			       c->count_props, sizeof(uint64_t)) ||
+		    sc->count_encoders != c->count_encoders ||
+		    !same_list(sc->encoders, c->encoders, c->count_encoders,
+			       sizeof(uint32_t)))
+			errors++;
+	}
+
+	for (i = 0; i < s->count_encoders; i++)
+		if (memcmp(&s->encoders[i], l->encoders[i],
+			   sizeof(drmModeEncoder)))
+			errors++;
+
+	for (i = 0; i < s->count_planes; i++) {
+		p = l->planes[i];
+		sp = &s->planes[i];
+		if (sp->plane_id != p->plane_id || sp->crtc_id != p->crtc_id ||
+		    sp->fb_id != p->fb_id ||
+		    sp->possible_crtcs != p->possible_crtcs ||
+		    sp->gamma_size != p->gamma_size ||
+		    sp->count_formats != p->count_formats ||
+		    !same_list(sp->formats, p->formats, p->count_formats,
+			       sizeof(uint32_t)) ||
+		    !same_props(&s->plane_props[i], l->plane_props[i]))
+			errors++;
+	}
+
+	return errors;
+}
+
+/* Resolve every connector property by name, the way a compositor scans
+ * its outputs. */
+static int find_props(drmModeSnapshotPtr s)
+{
+	drmModeConnectorPtr c;
+	char name[DRM_PROP_NAME_LEN];
+	int i, j, errors = 0;
+
+	for (i = 0; i < s->count_connectors; i++) {
+		c = &s->connectors[i];
+		for (j = 0; j < c->count_props; j++) {
+			snprintf(name, sizeof(name), "prop%u",
+				 c->props[j] - PROP_ID(0));
+			if (drmModeFindPropertyIndex(-1, c->props,
+						     c->count_props,
+						     name) != j)
+				errors++;
+		}
+		if (drmModeFindPropertyIndex(-1, c->props, c->count_props,
+					     "missing") != -1)
+			errors++;
+	}
+	return errors;
+}
+
+static int check_property_cache(void)
+{
+	drmModeSnapshotPtr s;
+	drmModePropertyPtr prop;
+	unsigned int first;
+	int ret = 0;
+
+	if (!(s = drmModeGetSnapshot(-1)))
+		return 1;
+
+	ioctls = 0;
+	ret |= find_props(s);
+	first = ioctls;
+	ret |= find_props(s);
+	printf("property lookups: %u ioctls on the first scan, %u on the next\n",
+	       first, ioctls - first);
+	if (first != 2 * NUM_CONN_PROPS || ioctls != first)
+		ret = 1;
+
+	prop = drmModeGetPropertyCached(-1, PROP_ID(1));
+	if (!prop || prop != drmModeGetPropertyCached(-1, PROP_ID(1)) ||
+	    prop->count_enums != 3 || strcmp(prop->enums[2].name, "value2"))
+		ret = 1;
+
+	drmModeInvalidatePropertyCache(-1);
+	ioctls = 0;
+	ret |= find_props(s);
+	if (ioctls != 2 * NUM_CONN_PROPS)
+		ret = 1;
+	drmModeInvalidatePropertyCache(-1);
+
+	drmModeFreeSnapshot(s);
+	if (ret)
+		fprintf(stderr, "property cache failed\n");
+	return ret;
+}
+
+/* Poll every connector and crtc through the caller-storage variants, as a
+ * compositor does each frame, and compare with the allocating calls. */
+static int check_into(void)
+{
+	drmModeModeInfo modes[NUM_MODES + 8];
+	uint32_t props[NUM_CONN_PROPS], encoders[4];
+	uint64_t values[NUM_CONN_PROPS];
+	drmModeConnector c;
+	drmModeConnectorPtr l;
+	drmModeCrtc crtc;
+	drmModeCrtcPtr lc;
+	unsigned int get_ioctls, get_allocs, into_ioctls = 0, before;
+	int i, errors = 0;
+
+	unplugged = 0;
+	ioctls = allocs = 0;
+	for (i = 0; i < NUM_CONNECTORS; i++)
+		drmModeFreeConnector(drmModeGetConnector(-1, CONN_ID(i)));
+	get_ioctls = ioctls;
+	get_allocs = allocs;
+
+	ioctls = allocs = 0;
+	for (i = 0; i < NUM_CONNECTORS; i++) {
+		memset(&c, 0, sizeof(c));
+		if (drmModeGetConnectorInto(-1, CONN_ID(i), &c) ||
+		    c.connection != (i % 2 ? 2 : 1) ||
+		    c.count_modes != (int)num_modes(i) ||
+		    c.count_props != NUM_CONN_PROPS || c.count_encoders != 1)
+			errors++;
+	}
+	printf("%-24s %8u %8u\n", "drmModeGetConnector",
+	       get_ioctls / NUM_CONNECTORS, get_allocs / NUM_CONNECTORS);
+	printf("%-24s %8u %8u\n", "  ...Into, status only",
+	       ioctls / NUM_CONNECTORS, allocs);
+	if (ioctls != NUM_CONNECTORS || allocs)
+		errors++;
+
+	ioctls = allocs = 0;
+	for (i = 0; i < NUM_CONNECTORS; i++) {
+		memset(&c, 0, sizeof(c));
+		c.modes = modes;
+		c.count_modes = NUM_MODES;
+		c.props = props;
+		c.prop_values = values;
+		c.count_props = NUM_CONN_PROPS;
+		c.encoders = encoders;
+		c.count_encoders = 4;
+		before = ioctls;
+		if (drmModeGetConnectorInto(-1, CONN_ID(i), &c)) {
+			errors++;
+			continue;
+		}
+		into_ioctls += ioctls - before;
+		l = drmModeGetConnector(-1, CONN_ID(i));
+		if (!l || c.count_modes != l->count_modes ||
+		    c.encoder_id != l->encoder_id ||
+		    c.subpixel != l->subpixel ||
+		    (c.count_modes && !same_list(c.modes, l->modes,
+						 c.count_modes,
+						 sizeof(*modes))) ||
+		    !same_list(c.props, l->props, c.count_props,
+			       sizeof(*props)) ||
+		    !same_list(c.prop_values, l->prop_values, c.count_props,
+			       sizeof(*values)) ||
+		    !same_list(c.encoders, l->encoders, c.count_encoders,
+			       sizeof(*encoders)))
+			errors++;
+		drmModeFreeConnector(l);
+	}
+	printf("%-24s %8.1f %8u\n", "  ...Into, all lists",
+	       (double)into_ioctls / NUM_CONNECTORS, allocs - get_allocs);
+	if (allocs != get_allocs || into_ioctls >= get_ioctls)
+		errors++;
+
+	/* Too little room: the counts come back as the sizes needed. */
+	memset(&c, 0, sizeof(c));
+	c.modes = modes;
+	c.count_modes = NUM_MODES / 2;
+	if (drmModeGetConnectorInto(-1, CONN_ID(0), &c) != -ENOSPC ||
+	    c.count_modes != NUM_MODES ||
+	    drmModeGetConnectorInto(-1, CONN_ID(0), &c) ||
+	    modes[NUM_MODES - 1].hdisplay != 640 + NUM_MODES - 1)
+		errors++;
+
+	/* Modes appear between the probe and the copy. */
+	grow_modes = 4;
+	c.count_modes = NUM_MODES;
+	if (drmModeGetConnectorInto(-1, CONN_ID(0), &c) != -ENOSPC ||
+	    c.count_modes != NUM_MODES + 4 ||
+	    drmModeGetConnectorInto(-1, CONN_ID(0), &c) ||
+	    modes[NUM_MODES + 3].hdisplay != 640 + NUM_MODES + 3)
+		errors++;
+	extra_modes = 0;
+
+	if (drmModeGetConnectorInto(-1, CONN_ID(NUM_CONNECTORS), &c) !=
+	    -ENOENT)
+		errors++;
+
+	ioctls = allocs = 0;
+	for (i = 0; i < NUM_CRTCS; i++) {
+		memset(&crtc, 0xff, sizeof(crtc));
+		lc = drmModeGetCrtc(-1, CRTC_ID(i));
+		if (drmModeGetCrtcInto(-1, CRTC_ID(i), &crtc) || !lc ||
+		    memcmp(&crtc, lc, sizeof(crtc)))
+			errors++;
+		drmModeFreeCrtc(lc);
+	}
+	if (allocs != NUM_CRTCS || drmModeGetCrtcInto(-1, CRTC_ID(NUM_CRTCS),
+						      &crtc) != -ENOENT)
+		errors++;
+
+	if (errors)
+		fprintf(stderr, "caller storage variants: %d errors\n", errors);
+	return errors != 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct legacy l;
+	drmModeSnapshotPtr s;
+	unsigned int legacy_ioctls, legacy_allocs;
+	int ret = 0;
+
+	ioctls = allocs = 0;
+	if (legacy_get(-1, &l)) {
+		fprintf(stderr, "drmModeGet* sequence failed\n");
+		return 1;
+	}
+	legacy_ioctls = ioctls;
+	legacy_allocs = allocs;
+
+	ioctls = allocs = 0;
+	if (!(s = drmModeGetSnapshot(-1))) {
+		fprintf(stderr, "drmModeGetSnapshot failed\n");
+		return 1;
+	}
+	printf("%-24s %8s %8s\n", "", "ioctls", "allocs");
+	printf("%-24s %8u %8u\n", "drmModeGet* sequence",
+	       legacy_ioctls, legacy_allocs);
+	printf("%-24s %8u %8u  (%u bytes)\n", "drmModeGetSnapshot",
+	       ioctls, allocs, s->size);
+	if (compare(&l, s)) {
+		fprintf(stderr, "snapshot differs from drmModeGet* results\n");
+		ret = 1;
+	}
+	if (ioctls >= legacy_ioctls || allocs >= legacy_allocs) {
+		fprintf(stderr, "snapshot is not cheaper\n");
+		ret = 1;
+	}
+	drmModeFreeSnapshot(s);
+
+	/* The arena is sized from the previous snapshot. */
+	ioctls = allocs = 0;
+	s = drmModeGetSnapshot(-1);
+	printf("%-24s %8u %8u\n", "drmModeGetSnapshot again", ioctls, allocs);
+	if (!s || compare(&l, s) || allocs != 1) {
+		fprintf(stderr, "repeated snapshot failed\n");
+		ret = 1;
+	}
+	drmModeFreeSnapshot(s);
+	legacy_free(&l);
+
+	/* The first connector gains modes between the two GETCONNECTOR
+	 * calls, and the last connector is unplugged halfway through. */
+	grow_modes = 4;
+	unplug_at = getconnector_calls + NUM_CONNECTORS - 1;
+	ioctls = allocs = 0;
+	s = drmModeGetSnapshot(-1);
+	printf("%-24s %8u %8u\n", "drmModeGetSnapshot hotplug", ioctls, allocs);
+	if (!s || s->count_connectors != NUM_CONNECTORS - 1 ||
+	    s->connectors[0].count_modes != NUM_MODES + (int)extra_modes ||
+	    s->connectors[0].modes[NUM_MODES].hdisplay != 640 + NUM_MODES) {
+		fprintf(stderr, "hotplug snapshot failed\n");
+		ret = 1;
+	}
+	drmModeFreeSnapshot(s);
+
+	extra_modes = 0;
+	ret |= legacy_get(-1, &l) != 0;
+	s = drmModeGetSnapshot(-1);
+	if (!s || compare(&l, s)) {
+		fprintf(stderr, "snapshot after hotplug differs\n");
+		ret = 1;
+	}
+	drmModeFreeSnapshot(s);
+	legacy_free(&l);
+
+	/* An object that is never found fails the snapshot after a few
+	 * attempts instead of retrying forever. */
+	vanishing = 1;
+	errno = 0;
+	s = drmModeGetSnapshot(-1);
+	if (s || errno != ENOENT) {
+		fprintf(stderr, "snapshot of a vanishing connector didn't fail\n");
+		drmModeFreeSnapshot(s);
+		ret = 1;
+	}
+	vanishing = 0;
+
+	ret |= check_property_cache();
+	ret |= check_into();
+
+	return ret;
+}
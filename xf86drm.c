@@ -50,6 +50,9 @@
 #include <sys/ioctl.h>
 #include <sys/time.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
 
 /* Not all systems have MAP_FAILED defined */
 #ifndef MAP_FAILED
@@ -57,6 +60,7 @@
 #endif
 
 #include "xf86drm.h"
+#include "xf86drmMode.h"
 #include "libdrm.h"
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__) || defined(__DragonFly__)
@@ -139,10 +143,40 @@ drmSetDebugMsgFunction(debug_msg_func_t debug_msg_ptr)
 }
 
 static void *drmHashTable = NULL; /* Context switch callbacks */
+static pthread_mutex_t drmHashTableLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * drmHashTable is read without drmHashTableLock, so it is only set once
+ * the table is built, behind a barrier, and read before one: a reader
+ * that sees the pointer also sees the table it points to.  Without
+ * atomic primitives the pointer is read under the lock.
+ */
+static void drmPublishHashTable(void *table)
+{
+#if HAVE_LIBDRM_ATOMIC_PRIMITIVES
+    __sync_synchronize();
+#endif
+    *(void * volatile *)&drmHashTable = table;
+}
+
+static void *drmLoadHashTable(void)
+{
+    void *table;
+
+#if HAVE_LIBDRM_ATOMIC_PRIMITIVES
+    table = *(void * volatile *)&drmHashTable;
+    __sync_synchronize();
+#else
+    pthread_mutex_lock(&drmHashTableLock);
+    table = drmHashTable;
+    pthread_mutex_unlock(&drmHashTableLock);
+#endif
+    return table;
+}
 
 void *drmGetHashTable(void)
 {
-    return drmHashTable;
+    return drmLoadHashTable();
 }
 
 void *drmMalloc(int size)
@@ -159,6 +193,191 @@ void drmFree(void *pt)
 	free(pt);
 }
 
+/*
+ * Ioctl statistics.
+ *
+ * Off unless LIBDRM_IOCTL_STATS is set in the environment or
+ * drmSetIoctlStats() turns them on.  While on, every drmIoctl() is timed
+ * and accounted to its request number.  When the variable enabled them the
+ * totals are also dumped when libdrm is unloaded or the process exits, to
+ * the file it names if the value contains a '/' and to stderr otherwise.
+ * While off, drmIoctl() costs one extra test of a flag.
+ */
+
+static int drm_ioctl_stats = -1;	/* Not looked at the environment yet */
+static pthread_once_t drm_ioctl_stats_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t drm_ioctl_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static drmIoctlStat drm_ioctl_table[256];
+static char *drm_ioctl_stats_dump;	/* Where to dump at exit, or NULL */
+static int drm_ioctl_stats_dump_stderr;
+
+static void drmInitIoctlStats(void)
+{
+    const char *env = getenv("LIBDRM_IOCTL_STATS");
+    int        enable = env && *env && strcmp(env, "0");
+
+    if (enable) {
+	if (strchr(env, '/'))
+	    drm_ioctl_stats_dump = strdup(env);
+	else
+	    drm_ioctl_stats_dump_stderr = 1;
+    }
+    /* drmSetIoctlStats() may have decided already */
+    if (drm_ioctl_stats < 0)
+	drm_ioctl_stats = enable;
+}
+
+#if defined(__GNUC__)
+static void __attribute__((destructor)) drmDumpIoctlStatsAtExit(void)
+{
+    int fd;
+
+    if (drm_ioctl_stats_dump_stderr) {
+	drmDumpIoctlStats(STDERR_FILENO);
+    } else if (drm_ioctl_stats_dump) {
+	fd = open(drm_ioctl_stats_dump, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd >= 0) {
+	    drmDumpIoctlStats(fd);
+	    close(fd);
+	}
+    }
+}
+#endif
+
+static int drmIoctlTimed(int fd, unsigned long request, void *arg)
+{
+    struct timespec start, end;
+    drmIoctlStatPtr stat;
+    uint64_t        ns;
+    unsigned int    retries = 0, bucket;
+    int             ret, err;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while ((ret = ioctl(fd, request, arg)) == -1 &&
+	   (errno == EINTR || errno == EAGAIN))
+	retries++;
+    err = errno;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000 +
+	end.tv_nsec - start.tv_nsec;
+    for (bucket = 0; bucket < DRM_IOCTL_STATS_BUCKETS - 1; bucket++)
+	if (ns < (uint64_t) 1000 << bucket)
+	    break;
+
+    stat = &drm_ioctl_table[DRM_IOCTL_NR(request) & 0xff];
+    pthread_mutex_lock(&drm_ioctl_stats_lock);
+    stat->request = request;
+    stat->count++;
+    stat->retries += retries;
+    if (ret)
+	stat->errors++;
+    stat->total_ns += ns;
+    if (ns > stat->max_ns)
+	stat->max_ns = ns;
+    stat->histogram[bucket]++;
+    pthread_mutex_unlock(&drm_ioctl_stats_lock);
+
+    errno = err;
+    return ret;
+}
+
+/**
+ * Turn ioctl statistics on or off.
+ *
+ * Overrides LIBDRM_IOCTL_STATS.  Turning them off keeps what was recorded.
+ */
+void drmSetIoctlStats(int enable)
+{
+    pthread_once(&drm_ioctl_stats_once, drmInitIoctlStats);
+    drm_ioctl_stats = !!enable;
+}
+
+/** Clear the recorded ioctl statistics. */
+void drmResetIoctlStats(void)
+{
+    pthread_mutex_lock(&drm_ioctl_stats_lock);
+    memset(drm_ioctl_table, 0, sizeof(drm_ioctl_table));
+    pthread_mutex_unlock(&drm_ioctl_stats_lock);
+}
+
+static int drmCompareIoctlStats(const void *a, const void *b)
+{
+    const drmIoctlStat *sa = a, *sb = b;
+
+    if (sa->total_ns != sb->total_ns)
+	return sa->total_ns < sb->total_ns ? 1 : -1;
+    return DRM_IOCTL_NR(sa->request) - DRM_IOCTL_NR(sb->request);
+}
+
+/**
+ * Get the ioctl statistics recorded so far.
+ *
+ * \param stats array to fill in, or NULL to only count the requests.
+ * \param max_stats number of entries in \p stats.
+ *
+ * \return the number of request numbers that were used, which may be more
+ * than \p max_stats.  Entries are sorted by total time, most first.
+ */
+int drmGetIoctlStats(drmIoctlStatPtr stats, int max_stats)
+{
+    drmIoctlStat sorted[256];
+    int          i, count = 0;
+
+    pthread_mutex_lock(&drm_ioctl_stats_lock);
+    for (i = 0; i < 256; i++)
+	if (drm_ioctl_table[i].count)
+	    sorted[count++] = drm_ioctl_table[i];
+    pthread_mutex_unlock(&drm_ioctl_stats_lock);
+
+    qsort(sorted, count, sizeof(*sorted), drmCompareIoctlStats);
+    if (stats)
+	memcpy(stats, sorted,
+	       (count < max_stats ? count : max_stats) * sizeof(*stats));
+    return count;
+}
+
+/**
+ * Write the ioctl statistics recorded so far to \p fd as text, one line
+ * per request number, most time first.
+ */
+void drmDumpIoctlStats(int fd)
+{
+    drmIoctlStat stats[256];
+    char         line[512];
+    int          i, j, len, last, count;
+    ssize_t      ret;
+
+    count = drmGetIoctlStats(stats, 256);
+    len = snprintf(line, sizeof(line),
+		   "libdrm ioctl stats for pid %d (histogram buckets: <1us, "
+		   "then doubling, last is >=%uus)\n"
+		   "  nr  request        calls   retries    errors   total us"
+		   "     max us  histogram\n", (int) getpid(),
+		   1u << (DRM_IOCTL_STATS_BUCKETS - 2));
+    ret = write(fd, line, len);
+
+    for (i = 0; i < count && ret >= 0; i++) {
+	len = snprintf(line, sizeof(line),
+		       "0x%02x  0x%08lx %9llu %9llu %9llu %10llu %10llu ",
+		       (unsigned int) DRM_IOCTL_NR(stats[i].request),
+		       stats[i].request,
+		       (unsigned long long) stats[i].count,
+		       (unsigned long long) stats[i].retries,
+		       (unsigned long long) stats[i].errors,
+		       (unsigned long long) stats[i].total_ns / 1000,
+		       (unsigned long long) stats[i].max_ns / 1000);
+	for (last = DRM_IOCTL_STATS_BUCKETS - 1; last > 0; last--)
+	    if (stats[i].histogram[last])
+		break;
+	for (j = 0; j <= last; j++)
+	    len += snprintf(line + len, sizeof(line) - len, " %llu",
+			    (unsigned long long) stats[i].histogram[j]);
+	len += snprintf(line + len, sizeof(line) - len, "\n");
+	ret = write(fd, line, len);
+    }
+}
+
 /**
  * Call ioctl, restarting if it is interupted
  */
@@ -167,6 +386,13 @@ drmIoctl(int fd, unsigned long request, void *arg)
 {
     int	ret;
 
+    if (drm_ioctl_stats) {
+	if (drm_ioctl_stats < 0)
+	    pthread_once(&drm_ioctl_stats_once, drmInitIoctlStats);
+	if (drm_ioctl_stats > 0)
+	    return drmIoctlTimed(fd, request, arg);
+    }
+
     do {
 	ret = ioctl(fd, request, arg);
     } while (ret == -1 && (errno == EINTR || errno == EAGAIN));
@@ -182,24 +408,38 @@ static unsigned long drmGetKeyFromFd(int fd)
     return st.st_rdev;
 }
 
+/**
+ * Look up, or create, the per-device entry for \p fd.
+ *
+ * \internal
+ * The common case of an existing entry is a lock-free lookup in a
+ * concurrent hash table.  Creating the table or a new entry is serialized
+ * by drmHashTableLock, so racing threads agree on a single entry.
+ */
 drmHashEntry *drmGetEntry(int fd)
 {
     unsigned long key = drmGetKeyFromFd(fd);
+    void          *table = drmLoadHashTable();
     void          *value;
     drmHashEntry  *entry;
 
+    if (table && !drmHashLookup(table, key, &value))
+	return value;
+
+    pthread_mutex_lock(&drmHashTableLock);
     if (!drmHashTable)
-	drmHashTable = drmHashCreate();
+	drmPublishHashTable(drmHashCreateConcurrent());
 
     if (drmHashLookup(drmHashTable, key, &value)) {
 	entry           = drmMalloc(sizeof(*entry));
 	entry->fd       = fd;
 	entry->f        = NULL;
-	entry->tagTable = drmHashCreate();
+	entry->tagTable = drmHashCreateConcurrent();
 	drmHashInsert(drmHashTable, key, entry);
     } else {
 	entry = value;
     }
+    pthread_mutex_unlock(&drmHashTableLock);
     return entry;
 }
 
@@ -463,6 +703,370 @@ int drmAvailable(void)
 }
 
 
+/*
+ * Device enumeration.
+ *
+ * Opening a device is the expensive part of drmOpen(): the driver may have
+ * to power up the GPU just to answer the version and bus ID queries, and
+ * drmOpenByBusid() and drmOpenByName() used to do that for every minor
+ * until one matched.  Instead, the primary nodes are enumerated once from
+ * sysfs, which gives the driver name, PCI bus ID and sibling nodes of each
+ * device without opening anything, and the result is cached.  The open
+ * paths use the cache to try the likely minor first and still verify the
+ * match against the kernel, so a stale or incomplete cache only costs the
+ * old scan.  Where sysfs isn't available the cache stays empty.
+ */
+
+#ifndef DRM_SYSFS_DIR
+#define DRM_SYSFS_DIR "/sys/class/drm"
+#endif
+
+typedef struct drmDeviceEntry {
+    drmDeviceInfo device;
+    dev_t     sysfs_dev;	/* Identity of the sysfs device directory, */
+    ino_t     sysfs_ino;	/* used to match up sibling nodes */
+} drmDeviceEntry;
+
+static pthread_mutex_t drmDeviceLock = PTHREAD_MUTEX_INITIALIZER;
+static drmDeviceEntry *drmDeviceCache;
+static int drmDeviceCount;
+static int drmDeviceScanned;
+
+static char *drmSysfsDriver(const char *dir)
+{
+    char    path[PATH_MAX], link[PATH_MAX];
+    char    *base;
+    ssize_t len;
+
+    snprintf(path, sizeof path, "%s/device/driver", dir);
+    len = readlink(path, link, sizeof link - 1);
+    if (len <= 0)
+	return NULL;
+    link[len] = '\0';
+    base = strrchr(link, '/');
+    return strdup(base ? base + 1 : link);
+}
+
+static char *drmSysfsBusid(const char *dir)
+{
+    char path[PATH_MAX], line[256], *busid = NULL;
+    FILE *f;
+    int  len;
+
+    snprintf(path, sizeof path, "%s/device/uevent", dir);
+    if (!(f = fopen(path, "r")))
+	return NULL;
+    while (fgets(line, sizeof line, f)) {
+	if (strncmp(line, "PCI_SLOT_NAME=", 14))
+	    continue;
+	len = strcspn(line + 14, "\n");
+	if ((busid = malloc(len + 5)))
+	    sprintf(busid, "pci:%.*s", len, line + 14);
+	break;
+    }
+    fclose(f);
+    return busid;
+}
+
+static int drmDeviceCompare(const void *a, const void *b)
+{
+    const drmDeviceEntry *da = a, *db = b;
+
+    return da->device.minor - db->device.minor;
+}
+
+static void drmFreeDeviceEntries(drmDeviceEntry *entries, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+	free(entries[i].device.node);
+	free(entries[i].device.control);
+	free(entries[i].device.render);
+	free(entries[i].device.busid);
+	free(entries[i].device.driver);
+    }
+    free(entries);
+}
+
+/*
+ * Builds the device list from the cardN, controlDN and renderDN entries in
+ * DRM_SYSFS_DIR.  Control and render nodes are attached to the primary
+ * node whose device directory they share.  Returns the number of devices
+ * or a negative errno.
+ */
+static int drmScanDevices(drmDeviceEntry **list)
+{
+    drmDeviceEntry *entries = NULL, *tmp, *entry;
+    DIR            *dir;
+    struct dirent  *ent;
+    struct stat    st;
+    char           path[PATH_MAX], node[PATH_MAX], **slot;
+    int            count = 0, size = 0, minor, n, i;
+
+    if (!(dir = opendir(DRM_SYSFS_DIR)))
+	return -errno;
+
+    while ((ent = readdir(dir))) {
+	if (sscanf(ent->d_name, "card%d%n", &minor, &n) != 1 ||
+	    ent->d_name[n] != '\0')
+	    continue;
+	if (count == size) {
+	    size = size ? size * 2 : 8;
+	    if (!(tmp = realloc(entries, size * sizeof *entries)))
+		goto err;
+	    entries = tmp;
+	}
+	entry = &entries[count++];
+	memset(entry, 0, sizeof *entry);
+	entry->device.minor = minor;
+
+	snprintf(path, sizeof path, "%s/%s", DRM_SYSFS_DIR, ent->d_name);
+	snprintf(node, sizeof node, DRM_DEV_NAME, DRM_DIR_NAME, minor);
+	entry->device.node = strdup(node);
+	entry->device.driver = drmSysfsDriver(path);
+	entry->device.busid = drmSysfsBusid(path);
+	if (!entry->device.node)
+	    goto err;
+
+	strncat(path, "/device", sizeof path - strlen(path) - 1);
+	if (stat(path, &st) == 0) {
+	    entry->sysfs_dev = st.st_dev;
+	    entry->sysfs_ino = st.st_ino;
+	}
+    }
+
+    rewinddir(dir);
+    while ((ent = readdir(dir))) {
+	if (sscanf(ent->d_name, "controlD%d%n", &minor, &n) == 1 &&
+	    ent->d_name[n] == '\0')
+	    snprintf(node, sizeof node, DRM_CONTROL_DEV_NAME,
+		     DRM_DIR_NAME, minor);
+	else if (sscanf(ent->d_name, "renderD%d%n", &minor, &n) == 1 &&
+		 ent->d_name[n] == '\0')
+	    snprintf(node, sizeof node, DRM_RENDER_DEV_NAME,
+		     DRM_DIR_NAME, minor);
+	else
+	    continue;
+
+	snprintf(path, sizeof path, "%s/%s/device", DRM_SYSFS_DIR,
+		 ent->d_name);
+	if (stat(path, &st))
+	    continue;
+	for (i = 0; i < count; i++) {
+	    entry = &entries[i];
+	    if (entry->sysfs_ino != st.st_ino || entry->sysfs_dev != st.st_dev)
+		continue;
+	    slot = ent->d_name[0] == 'c' ? &entry->device.control
+					 : &entry->device.render;
+	    if (!*slot && !(*slot = strdup(node)))
+		goto err;
+	    break;
+	}
+    }
+    closedir(dir);
+
+    qsort(entries, count, sizeof *entries, drmDeviceCompare);
+    *list = entries;
+    return count;
+
+err:
+    closedir(dir);
+    drmFreeDeviceEntries(entries, count);
+    return -ENOMEM;
+}
+
+/* Scans on first use.  Called with drmDeviceLock held. */
+static void drmUpdateDevices(void)
+{
+    drmDeviceEntry *entries;
+    int            count;
+
+    if (drmDeviceScanned)
+	return;
+    count = drmScanDevices(&entries);
+    drmMsg("drmUpdateDevices: found %d devices\n", count);
+    if (count > 0) {
+	drmDeviceCache = entries;
+	drmDeviceCount = count;
+    }
+    drmDeviceScanned = 1;
+}
+
+/**
+ * Forget the cached device list.
+ *
+ * The next drmListDevices() or drmOpen() scans again.  Call this after a
+ * device has been added or removed.
+ */
+void drmRescanDevices(void)
+{
+    pthread_mutex_lock(&drmDeviceLock);
+    drmFreeDeviceEntries(drmDeviceCache, drmDeviceCount);
+    drmDeviceCache = NULL;
+    drmDeviceCount = 0;
+    drmDeviceScanned = 0;
+    pthread_mutex_unlock(&drmDeviceLock);
+}
+
+static char *drmCopyString(char **dst, const char *src, char *p)
+{
+    if (!src) {
+	*dst = NULL;
+	return p;
+    }
+    *dst = strcpy(p, src);
+    return p + strlen(src) + 1;
+}
+
+/**
+ * Get the DRM devices present in the system.
+ *
+ * \param devices array to fill in, or NULL to only count the devices.
+ * \param max_devices number of entries in \p devices.
+ *
+ * \return the number of devices found, which may be more than
+ * \p max_devices, or a negative errno on failure.
+ *
+ * \internal
+ * The list is scanned from sysfs on first use and cached until
+ * drmRescanDevices().  Each returned device is a single allocation owned by
+ * the caller; release them with drmFreeDeviceList().
+ */
+int drmListDevices(drmDeviceInfoPtr devices[], int max_devices)
+{
+    drmDeviceInfo *src, *dst;
+    size_t    size;
+    char      *p;
+    int       i, count;
+
+    pthread_mutex_lock(&drmDeviceLock);
+    drmUpdateDevices();
+    count = drmDeviceCount;
+    for (i = 0; devices && i < count && i < max_devices; i++) {
+	src = &drmDeviceCache[i].device;
+	size = sizeof *dst + strlen(src->node) + 1;
+	if (src->control)
+	    size += strlen(src->control) + 1;
+	if (src->render)
+	    size += strlen(src->render) + 1;
+	if (src->busid)
+	    size += strlen(src->busid) + 1;
+	if (src->driver)
+	    size += strlen(src->driver) + 1;
+	if (!(dst = malloc(size))) {
+	    pthread_mutex_unlock(&drmDeviceLock);
+	    drmFreeDeviceList(devices, i);
+	    return -ENOMEM;
+	}
+	dst->minor = src->minor;
+	p = (char *) (dst + 1);
+	p = drmCopyString(&dst->node, src->node, p);
+	p = drmCopyString(&dst->control, src->control, p);
+	p = drmCopyString(&dst->render, src->render, p);
+	p = drmCopyString(&dst->busid, src->busid, p);
+	drmCopyString(&dst->driver, src->driver, p);
+	devices[i] = dst;
+    }
+    pthread_mutex_unlock(&drmDeviceLock);
+
+    return count;
+}
+
+/**
+ * Free devices returned by drmListDevices().
+ *
+ * \param devices array filled in by drmListDevices().
+ * \param count number of entries filled in.
+ */
+void drmFreeDeviceList(drmDeviceInfoPtr devices[], int count)
+{
+    int i;
+
+    if (!devices)
+	return;
+    for (i = 0; i < count; i++) {
+	free(devices[i]);
+	devices[i] = NULL;
+    }
+}
+
+/*
+ * Fills \p minors with the cached primary minors, below DRM_MAX_MINOR, that
+ * may match the bus ID or driver name, most likely first.  Devices whose
+ * sysfs bus ID or driver is unknown are kept at the end as candidates.
+ */
+static int drmCandidateMinors(const char *busid, const char *name,
+			      int minors[DRM_MAX_MINOR])
+{
+    drmDeviceInfo *dev;
+    int       i, n = 0, unknown = 0, other[DRM_MAX_MINOR];
+
+    pthread_mutex_lock(&drmDeviceLock);
+    drmUpdateDevices();
+    for (i = 0; i < drmDeviceCount; i++) {
+	dev = &drmDeviceCache[i].device;
+	if (dev->minor < 0 || dev->minor >= DRM_MAX_MINOR)
+	    continue;
+	if (busid ? !dev->busid : !dev->driver)
+	    other[unknown++] = dev->minor;
+	else if (busid ? drmMatchBusID(dev->busid, busid, 1)
+		       : !strcmp(dev->driver, name))
+	    minors[n++] = dev->minor;
+    }
+    pthread_mutex_unlock(&drmDeviceLock);
+
+    memcpy(&minors[n], other, unknown * sizeof *other);
+    return n + unknown;
+}
+
+
+/*
+ * Opens \p minor and returns it if its bus ID matches, otherwise closes it
+ * and returns a negative value.
+ */
+static int drmOpenMinorByBusid(int minor, const char *busid)
+{
+    int        pci_domain_ok = 1;
+    int        fd;
+    const char *buf;
+    drmSetVersion sv;
+
+    fd = drmOpenMinor(minor, 1, DRM_NODE_RENDER);
+    drmMsg("drmOpenByBusid: drmOpenMinor returns %d\n", fd);
+    if (fd < 0)
+	return fd;
+
+    /* We need to try for 1.4 first for proper PCI domain support
+     * and if that fails, we know the kernel is busted
+     */
+    sv.drm_di_major = 1;
+    sv.drm_di_minor = 4;
+    sv.drm_dd_major = -1;	/* Don't care */
+    sv.drm_dd_minor = -1;	/* Don't care */
+    if (drmSetInterfaceVersion(fd, &sv)) {
+#ifndef __alpha__
+	pci_domain_ok = 0;
+#endif
+	sv.drm_di_major = 1;
+	sv.drm_di_minor = 1;
+	sv.drm_dd_major = -1;       /* Don't care */
+	sv.drm_dd_minor = -1;       /* Don't care */
+	drmMsg("drmOpenByBusid: Interface 1.4 failed, trying 1.1\n");
+	drmSetInterfaceVersion(fd, &sv);
+    }
+    buf = drmGetBusid(fd);
+    drmMsg("drmOpenByBusid: drmGetBusid reports %s\n", buf);
+    if (buf && drmMatchBusID(buf, busid, pci_domain_ok)) {
+	drmFreeBusid(buf);
+	return fd;
+    }
+    if (buf)
+	drmFreeBusid(buf);
+    close(fd);
+    return -1;
+}
+
 /**
  * Open the device by bus ID.
  *
@@ -471,56 +1075,75 @@ int drmAvailable(void)
  * \return a file descriptor on success, or a negative value on error.
  *
  * \internal
- * This function attempts to open every possible minor (up to DRM_MAX_MINOR),
- * comparing the device bus ID with the one supplied.
+ * This function first tries the minors that the cached device list says
+ * have this bus ID, then every other possible minor (up to DRM_MAX_MINOR),
+ * comparing the device bus ID with the one supplied.  Needing the second
+ * pass means the cached list is out of date, so it is dropped.
  *
- * \sa drmOpenMinor() and drmGetBusid().
+ * \sa drmOpenMinor(), drmGetBusid() and drmListDevices().
  */
 static int drmOpenByBusid(const char *busid)
 {
-    int        i, pci_domain_ok = 1;
-    int        fd;
-    const char *buf;
-    drmSetVersion sv;
+    int  i, n, fd;
+    int  minors[DRM_MAX_MINOR];
+    char tried[DRM_MAX_MINOR];
 
     drmMsg("drmOpenByBusid: Searching for BusID %s\n", busid);
+    memset(tried, 0, sizeof tried);
+    n = drmCandidateMinors(busid, NULL, minors);
+    for (i = 0; i < n; i++) {
+	tried[minors[i]] = 1;
+	fd = drmOpenMinorByBusid(minors[i], busid);
+	if (fd >= 0)
+	    return fd;
+    }
+
     for (i = 0; i < DRM_MAX_MINOR; i++) {
-	fd = drmOpenMinor(i, 1, DRM_NODE_RENDER);
-	drmMsg("drmOpenByBusid: drmOpenMinor returns %d\n", fd);
+	if (tried[i])
+	    continue;
+	fd = drmOpenMinorByBusid(i, busid);
 	if (fd >= 0) {
-	    /* We need to try for 1.4 first for proper PCI domain support
-	     * and if that fails, we know the kernel is busted
-	     */
-	    sv.drm_di_major = 1;
-	    sv.drm_di_minor = 4;
-	    sv.drm_dd_major = -1;	/* Don't care */
-	    sv.drm_dd_minor = -1;	/* Don't care */
-	    if (drmSetInterfaceVersion(fd, &sv)) {
-#ifndef __alpha__
-		pci_domain_ok = 0;
-#endif
-		sv.drm_di_major = 1;
-		sv.drm_di_minor = 1;
-		sv.drm_dd_major = -1;       /* Don't care */
-		sv.drm_dd_minor = -1;       /* Don't care */
-		drmMsg("drmOpenByBusid: Interface 1.4 failed, trying 1.1\n");
-		drmSetInterfaceVersion(fd, &sv);
-	    }
-	    buf = drmGetBusid(fd);
-	    drmMsg("drmOpenByBusid: drmGetBusid reports %s\n", buf);
-	    if (buf && drmMatchBusID(buf, busid, pci_domain_ok)) {
-		drmFreeBusid(buf);
+	    drmRescanDevices();
+	    return fd;
+	}
+    }
+    return -1;
+}
+
+
+/*
+ * Opens \p minor and returns it if it is driven by \p name and has no bus
+ * ID assigned yet, otherwise closes it and returns a negative value.
+ */
+static int drmOpenMinorByName(int minor, const char *name)
+{
+    int           fd;
+    drmVersionPtr version;
+    char *        id;
+
+    if ((fd = drmOpenMinor(minor, 1, DRM_NODE_RENDER)) < 0)
+	return fd;
+
+    if ((version = drmGetVersion(fd))) {
+	if (!strcmp(version->name, name)) {
+	    drmFreeVersion(version);
+	    id = drmGetBusid(fd);
+	    drmMsg("drmGetBusid returned '%s'\n", id ? id : "NULL");
+	    if (!id || !*id) {
+		if (id)
+		    drmFreeBusid(id);
 		return fd;
+	    } else {
+		drmFreeBusid(id);
 	    }
-	    if (buf)
-		drmFreeBusid(buf);
-	    close(fd);
+	} else {
+	    drmFreeVersion(version);
 	}
     }
+    close(fd);
     return -1;
 }
 
-
 /**
  * Open the device by name.
  *
@@ -531,40 +1154,34 @@ static int drmOpenByBusid(const char *busid)
  * \internal
  * This function opens the first minor number that matches the driver name and
  * isn't already in use.  If it's in use it then it will already have a bus ID
- * assigned.
+ * assigned.  Minors the cached device list reports for the driver are tried
+ * before the others.
  * 
- * \sa drmOpenMinor(), drmGetVersion() and drmGetBusid().
+ * \sa drmOpenMinor(), drmGetVersion(), drmGetBusid() and drmListDevices().
  */
 static int drmOpenByName(const char *name)
 {
-    int           i;
+    int           i, n;
     int           fd;
-    drmVersionPtr version;
-    char *        id;
+    int           minors[DRM_MAX_MINOR];
+    char          tried[DRM_MAX_MINOR];
 
     /*
      * Open the first minor number that matches the driver name and isn't
      * already in use.  If it's in use it will have a busid assigned already.
      */
+    memset(tried, 0, sizeof tried);
+    n = drmCandidateMinors(NULL, name, minors);
+    for (i = 0; i < n; i++) {
+	tried[minors[i]] = 1;
+	if ((fd = drmOpenMinorByName(minors[i], name)) >= 0)
+	    return fd;
+    }
+
     for (i = 0; i < DRM_MAX_MINOR; i++) {
-	if ((fd = drmOpenMinor(i, 1, DRM_NODE_RENDER)) >= 0) {
-	    if ((version = drmGetVersion(fd))) {
-		if (!strcmp(version->name, name)) {
-		    drmFreeVersion(version);
-		    id = drmGetBusid(fd);
-		    drmMsg("drmGetBusid returned '%s'\n", id ? id : "NULL");
-		    if (!id || !*id) {
-			if (id)
-			    drmFreeBusid(id);
-			return fd;
-		    } else {
-			drmFreeBusid(id);
-		    }
-		} else {
-		    drmFreeVersion(version);
-		}
-	    }
-	    close(fd);
+	if (!tried[i] && (fd = drmOpenMinorByName(i, name)) >= 0) {
+	    drmRescanDevices();
+	    return fd;
 	}
     }
 
@@ -1099,12 +1716,15 @@ int drmClose(int fd)
     unsigned long key    = drmGetKeyFromFd(fd);
     drmHashEntry  *entry = drmGetEntry(fd);
 
+    pthread_mutex_lock(&drmHashTableLock);
+    drmHashDelete(drmHashTable, key);
+    pthread_mutex_unlock(&drmHashTableLock);
+
     drmHashDestroy(entry->tagTable);
+    drmModeInvalidatePropertyCache(fd);
     entry->fd       = 0;
     entry->f        = NULL;
     entry->tagTable = NULL;
-
-    drmHashDelete(drmHashTable, key);
     drmFree(entry);
 
     return close(fd);
@@ -2530,6 +3150,19 @@ char *drmGetDeviceNameFromFd(int fd)
 	fstat(fd, &sbuf);
 	d = sbuf.st_rdev;
 
+	/* Only the nodes known to exist need checking, including minors
+	 * past DRM_MAX_MINOR. */
+	pthread_mutex_lock(&drmDeviceLock);
+	drmUpdateDevices();
+	for (i = 0; i < drmDeviceCount; i++) {
+		if (stat(drmDeviceCache[i].device.node, &sbuf) == 0 &&
+		    sbuf.st_rdev == d) {
+			pthread_mutex_unlock(&drmDeviceLock);
+			return strdup(drmDeviceCache[i].device.node);
+		}
+	}
+	pthread_mutex_unlock(&drmDeviceLock);
+
 	for (i = 0; i < DRM_MAX_MINOR; i++) {
 		snprintf(name, sizeof name, DRM_DEV_NAME, DRM_DIR_NAME, i);
 		if (stat(name, &sbuf) == 0 && sbuf.st_rdev == d)
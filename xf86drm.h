@@ -79,6 +79,7 @@ extern "C" {
 #define DRM_DIR_NAME  "/dev/dri"
 #define DRM_DEV_NAME  "%s/card%d"
 #define DRM_CONTROL_DEV_NAME  "%s/controlD%d"
+#define DRM_RENDER_DEV_NAME  "%s/renderD%d"
 #define DRM_PROC_NAME "/proc/dri/" /* For backward Linux compatibility */
 
 #define DRM_ERR_NO_DEVICE  (-1001)
@@ -111,6 +112,31 @@ typedef struct drmHashEntry {
 } drmHashEntry;
 
 extern int drmIoctl(int fd, unsigned long request, void *arg);
+
+/**
+ * Statistics drmIoctl() keeps for one request number while enabled, either
+ * by setting LIBDRM_IOCTL_STATS in the environment or by
+ * drmSetIoctlStats().
+ *
+ * histogram[0] counts calls under 1us, histogram[i] calls from 2^(i-1) up
+ * to 2^i us, and the last bucket everything longer.
+ */
+#define DRM_IOCTL_STATS_BUCKETS 16
+
+typedef struct _drmIoctlStat {
+	unsigned long request;	/* Request code, last seen for this number */
+	uint64_t count;		/* Calls */
+	uint64_t retries;	/* Restarts after EINTR or EAGAIN */
+	uint64_t errors;	/* Calls that failed */
+	uint64_t total_ns;	/* Time spent, including restarts */
+	uint64_t max_ns;	/* Longest call */
+	uint64_t histogram[DRM_IOCTL_STATS_BUCKETS];
+} drmIoctlStat, *drmIoctlStatPtr;
+
+extern void drmSetIoctlStats(int enable);
+extern void drmResetIoctlStats(void);
+extern int drmGetIoctlStats(drmIoctlStatPtr stats, int max_stats);
+extern void drmDumpIoctlStats(int fd);
 extern void *drmGetHashTable(void);
 extern drmHashEntry *drmGetEntry(int fd);
 
@@ -675,6 +701,7 @@ extern void          drmFree(void *pt);
 
 /* Hash table routines */
 extern void *drmHashCreate(void);
+extern void *drmHashCreateConcurrent(void);
 extern int  drmHashDestroy(void *t);
 extern int  drmHashLookup(void *t, unsigned long key, void **value);
 extern int  drmHashInsert(void *t, unsigned long key, void *value);
@@ -701,6 +728,10 @@ extern void drmSLDump(void *l);
 extern int  drmSLLookupNeighbors(void *l, unsigned long key,
 				 unsigned long *prev_key, void **prev_value,
 				 unsigned long *next_key, void **next_value);
+extern int  drmSLInsertMany(void *l, int count,
+			    const unsigned long *keys, void **values);
+extern int  drmSLLookupMany(void *l, int count,
+			    const unsigned long *keys, void **values);
 
 extern int drmOpenOnce(void *unused, const char *BusID, int *newlyopened);
 extern void drmCloseOnce(int fd);
@@ -733,8 +764,48 @@ typedef struct _drmEventContext {
 
 extern int drmHandleEvent(int fd, drmEventContextPtr evctx);
 
+typedef struct _drmEventBatch {
+	/* Buffer to read events into, or NULL to let libdrm manage one
+	 * that grows while the fd keeps filling it. */
+	void *buffer;
+	unsigned int size;
+
+	/* Called for events the drmEventContext has no handler for,
+	 * including event types newer than this libdrm.  May be NULL. */
+	void (*unhandled)(int fd, const struct drm_event *event, void *data);
+	void *data;
+
+	/* Filled in by drmHandleEventBatch */
+	unsigned int events;	/* Events dispatched */
+	unsigned int reads;	/* read() calls that returned data */
+	unsigned int tv_sec;	/* Timestamp of the last vblank or flip */
+	unsigned int tv_usec;	/* event, or 0 if there was none */
+} drmEventBatch, *drmEventBatchPtr;
+
+extern int drmHandleEventBatch(int fd, drmEventContextPtr evctx,
+			       drmEventBatchPtr batch);
+
 extern char *drmGetDeviceNameFromFd(int fd);
 
+/**
+ * A DRM device as found by drmListDevices().
+ *
+ * Node paths are under DRM_DIR_NAME and may not exist if nothing created
+ * them yet; drmOpen() will.
+ */
+typedef struct _drmDeviceInfo {
+	int minor;		/* Minor number of the primary node */
+	char *node;		/* Primary node, e.g. /dev/dri/card0 */
+	char *control;		/* Control node, or NULL */
+	char *render;		/* Render node, or NULL */
+	char *busid;		/* Bus ID in drmGetBusid() form, or NULL */
+	char *driver;		/* Kernel driver name, or NULL if unknown */
+} drmDeviceInfo, *drmDeviceInfoPtr;
+
+extern int drmListDevices(drmDeviceInfoPtr devices[], int max_devices);
+extern void drmFreeDeviceList(drmDeviceInfoPtr devices[], int count);
+extern void drmRescanDevices(void);
+
 extern int drmPrimeHandleToFD(int fd, uint32_t handle, uint32_t flags, int *prime_fd);
 extern int drmPrimeFDToHandle(int fd, int prime_fd, uint32_t *handle);
 
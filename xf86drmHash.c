@@ -27,279 +27,492 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward implementation of a fixed-sized
- * hash table using self-organizing linked lists [Knuth73, pp. 398-399] for
- * collision resolution.  There are two potentially interesting things
- * about this implementation:
+ * This file contains a straightforward implementation of a dynamically
+ * sized hash table using open addressing with linear probing [Knuth73,
+ * pp. 518-526] for collision resolution.  There are a few potentially
+ * interesting things about this implementation:
  *
- * 1) The table is power-of-two sized.  Prime sized tables are more
- * traditional, but do not have a significant advantage over power-of-two
- * sized table, especially when double hashing is not used for collision
- * resolution.
+ * 1) The table is power-of-two sized and doubles when it becomes three
+ * quarters full, so the cost of growing is amortized over the insertions
+ * that caused it.  Tables start out small, since most tables in libdrm
+ * (e.g., the per-fd context tag tables) only ever hold a handful of keys.
  *
- * 2) The hash computation uses a table of random integers [Hanson97,
- * pp. 39-41].
+ * 2) The hash computation is multiplicative (Fibonacci hashing, [Knuth73,
+ * pp. 508-512]): the key is multiplied by 2^64/phi and the top bits of
+ * the product select the slot.  This spreads consecutive integers and
+ * page-aligned addresses evenly without needing a scatter table.
  *
- * FUTURE ENHANCEMENTS
+ * 3) Lookups never modify the table.  Deleted slots are marked with a
+ * tombstone rather than being backfilled, so deleting the current key
+ * while walking the table with drmHashFirst/drmHashNext is safe.
+ * Tombstones are reclaimed when the table is rebuilt.
  *
- * With a table size of 512, the current implementation is sufficient for a
- * few hundred keys.  Since this is well above the expected size of the
- * tables for which this implementation was designed, the implementation of
- * dynamic hash tables was postponed until the need arises.  A common (and
- * naive) approach to dynamic hash table implementation simply creates a
- * new hash table when necessary, rehashes all the data into the new table,
- * and destroys the old table.  The approach in [Larson88] is superior in
- * two ways: 1) only a portion of the table is expanded when needed,
- * distributing the expansion cost over several insertions, and 2) portions
- * of the table can be locked, enabling a scalable thread-safe
- * implementation.
+ * 4) Tables created with drmHashCreateConcurrent may be used from several
+ * threads at once.  Writers are serialized by a mutex and bump a sequence
+ * count before and after modifying the table; readers take no lock and
+ * simply retry if the count was odd or changed while they probed (a
+ * seqlock, [Lameter05]).  A reader may race with a rebuild, so slot
+ * arrays are never freed under it: arrays replaced by a larger one are
+ * kept until the table is destroyed (at most as much memory as the
+ * current array, since the table only grows), and same-sized rebuilds
+ * are copied back over the live array.  Readers bound their probe
+ * sequence by the table size, since a torn view of the table need not
+ * contain an empty slot.  On platforms without atomic primitives,
+ * readers take the mutex too.
  *
  * REFERENCES
  *
- * [Hanson97] David R. Hanson.  C Interfaces and Implementations:
- * Techniques for Creating Reusable Software.  Reading, Massachusetts:
- * Addison-Wesley, 1997.
- *
  * [Knuth73] Donald E. Knuth. The Art of Computer Programming.  Volume 3:
  * Sorting and Searching.  Reading, Massachusetts: Addison-Wesley, 1973.
  *
- * [Larson88] Per-Ake Larson. "Dynamic Hash Tables".  CACM 31(4), April
- * 1988, pp. 446-457.
+ * [Lameter05] Christoph Lameter. "Effective Synchronization on Linux/NUMA
+ * Systems". Gelato Conference, May 2005.
  *
  */
 
+#ifdef HAVE_CONFIG_H
+# include <config.h>
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #define HASH_MAIN 0
 
 #if !HASH_MAIN
 # include "xf86drm.h"
+#else
+# include <time.h>
+# include <unistd.h>
 #endif
 
-#define HASH_MAGIC 0xdeadbeef
-#define HASH_DEBUG 0
-#define HASH_SIZE  512		/* Good for about 100 entries */
-				/* If you change this value, you probably
-                                   have to change the HashHash hashing
-                                   function! */
+#define HASH_MAGIC    0xdeadbeef
+#define HASH_DEBUG    0
+#define HASH_MIN_BITS 4		/* Initial table has 16 slots */
+#define HASH_MAX_LOAD(size) ((size) - ((size) >> 2)) /* 3/4 full */
 
 #if HASH_MAIN
-#define HASH_ALLOC malloc
+#define HASH_ALLOC(size) calloc(1, size)
 #define HASH_FREE  free
-#define HASH_RANDOM_DECL
-#define HASH_RANDOM_INIT(seed)  srandom(seed)
-#define HASH_RANDOM             random()
-#define HASH_RANDOM_DESTROY
 #else
 #define HASH_ALLOC drmMalloc
 #define HASH_FREE  drmFree
-#define HASH_RANDOM_DECL        void *state
-#define HASH_RANDOM_INIT(seed)  state = drmRandomCreate(seed)
-#define HASH_RANDOM             drmRandom(state)
-#define HASH_RANDOM_DESTROY     drmRandomDestroy(state)
+#endif
 
+#if HAVE_LIBDRM_ATOMIC_PRIMITIVES || HASH_MAIN
+#define HASH_LOCKLESS_READS 1
+#define HASH_BARRIER()      __sync_synchronize()
+#else
+#define HASH_LOCKLESS_READS 0
 #endif
 
-typedef struct HashBucket {
+#define HASH_SLOT_EMPTY   0	/* Must be zero, HASH_ALLOC clears memory */
+#define HASH_SLOT_USED    1
+#define HASH_SLOT_DELETED 2
+
+typedef struct HashSlot {
     unsigned long     key;
     void              *value;
-    struct HashBucket *next;
-} HashBucket, *HashBucketPtr;
+    int               state;	/* HASH_SLOT_* */
+} HashSlot, *HashSlotPtr;
+
+typedef struct HashRetired {
+    struct HashRetired *next;
+    HashSlotPtr        slots;
+} HashRetired, *HashRetiredPtr;
 
 typedef struct HashTable {
     unsigned long    magic;
-    unsigned long    entries;
-    unsigned long    hits;	/* At top of linked list */
-    unsigned long    partials;	/* Not at top of linked list */
-    unsigned long    misses;	/* Not in table */
-    HashBucketPtr    buckets[HASH_SIZE];
-    int              p0;
-    HashBucketPtr    p1;
+    unsigned long    entries;	/* Slots in use */
+    unsigned long    deleted;	/* Tombstones */
+    unsigned long    size;	/* Always a power of two */
+    int              bits;	/* log2(size) */
+    HashSlotPtr      slots;
+    unsigned long    p0;	/* Position for iteration */
+
+				/* Only used by concurrent tables */
+    int              concurrent;
+    volatile unsigned long seq;	/* Odd while a writer is active */
+    pthread_mutex_t  lock;	/* Serializes writers */
+    HashRetiredPtr   retired;	/* Slot arrays readers may still see */
 } HashTable, *HashTablePtr;
 
 #if HASH_MAIN
 extern void *drmHashCreate(void);
+extern void *drmHashCreateConcurrent(void);
 extern int  drmHashDestroy(void *t);
-extern int  drmHashLookup(void *t, unsigned long key, unsigned long *value);
-extern int  drmHashInsert(void *t, unsigned long key, unsigned long value);
+extern int  drmHashLookup(void *t, unsigned long key, void **value);
+extern int  drmHashInsert(void *t, unsigned long key, void *value);
 extern int  drmHashDelete(void *t, unsigned long key);
+extern int  drmHashFirst(void *t, unsigned long *key, void **value);
+extern int  drmHashNext(void *t, unsigned long *key, void **value);
 #endif
 
-static unsigned long HashHash(unsigned long key)
+static unsigned long HashHash(int bits, unsigned long key)
 {
-    unsigned long        hash = 0;
-    unsigned long        tmp  = key;
-    static int           init = 0;
-    static unsigned long scatter[256];
-    int                  i;
-
-    if (!init) {
-	HASH_RANDOM_DECL;
-	HASH_RANDOM_INIT(37);
-	for (i = 0; i < 256; i++) scatter[i] = HASH_RANDOM;
-	HASH_RANDOM_DESTROY;
-	++init;
+    unsigned long hash;
+
+    hash = (unsigned long)(((uint64_t)key * 0x9e3779b97f4a7c15ULL)
+			   >> (64 - bits));
+#if HASH_DEBUG
+    printf( "Hash(%lu) = %lu\n", key, hash);
+#endif
+    return hash;
+}
+
+/* Find the slot holding key, or NULL.  Never modifies the table. */
+
+static HashSlotPtr HashFind(HashTablePtr table, unsigned long key)
+{
+    unsigned long mask = table->size - 1;
+    unsigned long i    = HashHash(table->bits, key);
+    HashSlotPtr   slot;
+
+    for (;; i = (i + 1) & mask) {
+	slot = &table->slots[i];
+	if (slot->state == HASH_SLOT_EMPTY)
+	    return NULL;
+	if (slot->state == HASH_SLOT_USED && slot->key == key)
+	    return slot;
     }
+}
+
+/* Store a key known not to be in slots, reusing the first tombstone on
+   its probe sequence.  Returns 1 if a tombstone was reused. */
 
-    while (tmp) {
-	hash = (hash << 1) + scatter[tmp & 0xff];
-	tmp >>= 8;
+static int HashStore(HashSlotPtr slots, int bits,
+		     unsigned long key, void *value)
+{
+    unsigned long mask = (1UL << bits) - 1;
+    unsigned long i    = HashHash(bits, key);
+    HashSlotPtr   slot;
+    int           reused;
+
+    for (;; i = (i + 1) & mask) {
+	slot = &slots[i];
+	if (slot->state != HASH_SLOT_USED)
+	    break;
     }
 
-    hash %= HASH_SIZE;
+    reused      = slot->state == HASH_SLOT_DELETED;
+    slot->key   = key;
+    slot->value = value;
+    slot->state = HASH_SLOT_USED;
 #if HASH_DEBUG
-    printf( "Hash(%d) = %d\n", key, hash);
+    printf("Inserted %lu at %lu/%p\n", key, i, slot);
 #endif
-    return hash;
+    return reused;
 }
 
+/* Rebuild the table with 2^bits slots, dropping all tombstones. */
+
+static int HashResize(HashTablePtr table, int bits)
+{
+    HashSlotPtr    old = table->slots;
+    HashSlotPtr    slots;
+    HashRetiredPtr retired = NULL;
+    unsigned long  i;
+
+    slots = HASH_ALLOC((1UL << bits) * sizeof(*slots));
+    if (!slots) return -1;
+
+    if (table->concurrent && bits != table->bits) {
+	retired = HASH_ALLOC(sizeof(*retired));
+	if (!retired) {
+	    HASH_FREE(slots);
+	    return -1;
+	}
+    }
+
+    for (i = 0; i < table->size; i++)
+	if (old[i].state == HASH_SLOT_USED)
+	    HashStore(slots, bits, old[i].key, old[i].value);
+    table->deleted = 0;
+
+    if (!table->concurrent) {
+	table->slots = slots;
+	table->bits  = bits;
+	table->size  = 1UL << bits;
+	HASH_FREE(old);
+    } else if (bits == table->bits) {
+				/* Readers may be probing old, so it must
+				   stay allocated */
+	memcpy(old, slots, table->size * sizeof(*slots));
+	HASH_FREE(slots);
+    } else {
+				/* Publish the slots before the size, so a
+				   reader never indexes past the end of
+				   the array it loaded */
+	table->slots = slots;
+#if HASH_LOCKLESS_READS
+	HASH_BARRIER();
+#endif
+	table->bits  = bits;
+	table->size  = 1UL << bits;
+
+	retired->slots = old;
+	retired->next  = table->retired;
+	table->retired = retired;
+    }
+    return 0;
+}
+
+static void HashWriteBegin(HashTablePtr table)
+{
+    if (!table->concurrent) return;
+
+    pthread_mutex_lock(&table->lock);
+#if HASH_LOCKLESS_READS
+    ++table->seq;
+    HASH_BARRIER();
+#endif
+}
+
+static void HashWriteEnd(HashTablePtr table)
+{
+    if (!table->concurrent) return;
+
+#if HASH_LOCKLESS_READS
+    HASH_BARRIER();
+    ++table->seq;
+#endif
+    pthread_mutex_unlock(&table->lock);
+}
+
+#if HASH_LOCKLESS_READS
+static int HashLookupConcurrent(HashTablePtr table,
+				unsigned long key, void **value)
+{
+    unsigned long seq;
+    unsigned long mask;
+    unsigned long i;
+    unsigned long n;
+    HashSlotPtr   slots;
+    void          *found;
+    int           bits;
+    int           retcode;
+
+    for (;;) {
+	seq = table->seq;
+	HASH_BARRIER();
+	if (seq & 1) continue;	/* Writer active */
+
+	bits  = table->bits;
+	HASH_BARRIER();
+	slots = table->slots;
+	mask  = (1UL << bits) - 1;
+
+	retcode = 1;
+	found   = NULL;
+	for (i = HashHash(bits, key), n = 0; n <= mask;
+	     i = (i + 1) & mask, n++) {
+	    if (slots[i].state == HASH_SLOT_EMPTY)
+		break;
+	    if (slots[i].state == HASH_SLOT_USED && slots[i].key == key) {
+		found   = slots[i].value;
+		retcode = 0;
+		break;
+	    }
+	}
+
+	HASH_BARRIER();
+	if (table->seq == seq) break;
+    }
+
+    if (!retcode) *value = found;
+    return retcode;
+}
+#endif
+
 void *drmHashCreate(void)
 {
     HashTablePtr table;
-    int          i;
 
-    table           = HASH_ALLOC(sizeof(*table));
+    table             = HASH_ALLOC(sizeof(*table));
     if (!table) return NULL;
-    table->magic    = HASH_MAGIC;
-    table->entries  = 0;
-    table->hits     = 0;
-    table->partials = 0;
-    table->misses   = 0;
+    table->slots      = HASH_ALLOC((1UL << HASH_MIN_BITS)
+				   * sizeof(*table->slots));
+    if (!table->slots) {
+	HASH_FREE(table);
+	return NULL;
+    }
+    table->magic      = HASH_MAGIC;
+    table->entries    = 0;
+    table->deleted    = 0;
+    table->bits       = HASH_MIN_BITS;
+    table->size       = 1UL << HASH_MIN_BITS;
+    table->p0         = 0;
+    table->concurrent = 0;
+    table->seq        = 0;
+    table->retired    = NULL;
+    return table;
+}
+
+/* Like drmHashCreate, but the table may be used by several threads at
+   once.  Lookups are lock-free; inserts and deletes are serialized.
+   Iterating with drmHashFirst/drmHashNext is still only safe from one
+   thread at a time. */
 
-    for (i = 0; i < HASH_SIZE; i++) table->buckets[i] = NULL;
+void *drmHashCreateConcurrent(void)
+{
+    HashTablePtr table;
+
+    table = drmHashCreate();
+    if (!table) return NULL;
+
+    if (pthread_mutex_init(&table->lock, NULL)) {
+	drmHashDestroy(table);
+	return NULL;
+    }
+    table->concurrent = 1;
     return table;
 }
 
 int drmHashDestroy(void *t)
 {
-    HashTablePtr  table = (HashTablePtr)t;
-    HashBucketPtr bucket;
-    HashBucketPtr next;
-    int           i;
+    HashTablePtr   table = (HashTablePtr)t;
+    HashRetiredPtr retired;
+    HashRetiredPtr next;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    for (i = 0; i < HASH_SIZE; i++) {
-	for (bucket = table->buckets[i]; bucket;) {
-	    next = bucket->next;
-	    HASH_FREE(bucket);
-	    bucket = next;
-	}
+    for (retired = table->retired; retired; retired = next) {
+	next = retired->next;
+	HASH_FREE(retired->slots);
+	HASH_FREE(retired);
     }
+    if (table->concurrent)
+	pthread_mutex_destroy(&table->lock);
+    HASH_FREE(table->slots);
     HASH_FREE(table);
     return 0;
 }
 
-/* Find the bucket and organize the list so that this bucket is at the
-   top. */
-
-static HashBucketPtr HashFind(HashTablePtr table,
-			      unsigned long key, unsigned long *h)
-{
-    unsigned long hash = HashHash(key);
-    HashBucketPtr prev = NULL;
-    HashBucketPtr bucket;
-
-    if (h) *h = hash;
-
-    for (bucket = table->buckets[hash]; bucket; bucket = bucket->next) {
-	if (bucket->key == key) {
-	    if (prev) {
-				/* Organize */
-		prev->next           = bucket->next;
-		bucket->next         = table->buckets[hash];
-		table->buckets[hash] = bucket;
-		++table->partials;
-	    } else {
-		++table->hits;
-	    }
-	    return bucket;
-	}
-	prev = bucket;
-    }
-    ++table->misses;
-    return NULL;
-}
-
 int drmHashLookup(void *t, unsigned long key, void **value)
 {
     HashTablePtr  table = (HashTablePtr)t;
-    HashBucketPtr bucket;
+    HashSlotPtr   slot;
+    int           retcode = 1;
 
     if (!table || table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, NULL);
-    if (!bucket) return 1;	/* Not found */
-    *value = bucket->value;
-    return 0;			/* Found */
+    if (table->concurrent) {
+#if HASH_LOCKLESS_READS
+	return HashLookupConcurrent(table, key, value);
+#else
+	pthread_mutex_lock(&table->lock);
+#endif
+    }
+
+    slot = HashFind(table, key);
+    if (slot) {
+	*value  = slot->value;
+	retcode = 0;		/* Found */
+    }
+
+    if (table->concurrent)
+	pthread_mutex_unlock(&table->lock);
+    return retcode;		/* 1 if not found */
 }
 
 int drmHashInsert(void *t, unsigned long key, void *value)
 {
     HashTablePtr  table = (HashTablePtr)t;
-    HashBucketPtr bucket;
-    unsigned long hash;
+    int           bits;
+    int           retcode = 0;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    if (HashFind(table, key, &hash)) return 1; /* Already in table */
+    HashWriteBegin(table);
 
-    bucket               = HASH_ALLOC(sizeof(*bucket));
-    if (!bucket) return -1;	/* Error */
-    bucket->key          = key;
-    bucket->value        = value;
-    bucket->next         = table->buckets[hash];
-    table->buckets[hash] = bucket;
-#if HASH_DEBUG
-    printf("Inserted %d at %d/%p\n", key, hash, bucket);
-#endif
-    return 0;			/* Added to table */
+    if (HashFind(table, key)) {
+	retcode = 1;		/* Already in table */
+	goto out;
+    }
+
+    if (table->entries + table->deleted + 1 > HASH_MAX_LOAD(table->size)) {
+				/* Grow only if live entries, rather than
+				   tombstones, are what filled the table */
+	bits = table->bits;
+	if (table->entries + 1 > table->size >> 1)
+	    ++bits;
+	if (HashResize(table, bits)) {
+	    retcode = -1;	/* Error */
+	    goto out;
+	}
+    }
+
+    if (HashStore(table->slots, table->bits, key, value))
+	--table->deleted;
+    ++table->entries;		/* Added to table */
+
+out:
+    HashWriteEnd(table);
+    return retcode;
 }
 
 int drmHashDelete(void *t, unsigned long key)
 {
     HashTablePtr  table = (HashTablePtr)t;
-    unsigned long hash;
-    HashBucketPtr bucket;
+    HashSlotPtr   slot;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
-    bucket = HashFind(table, key, &hash);
+    HashWriteBegin(table);
 
-    if (!bucket) return 1;	/* Not found */
+    slot = HashFind(table, key);
+    if (slot) {
+	slot->state = HASH_SLOT_DELETED;
+	slot->value = NULL;
+	--table->entries;
+	++table->deleted;
+    }
 
-    table->buckets[hash] = bucket->next;
-    HASH_FREE(bucket);
-    return 0;
+    HashWriteEnd(table);
+    return slot ? 0 : 1;	/* 1 if not found */
 }
 
-int drmHashNext(void *t, unsigned long *key, void **value)
+static int HashNext(HashTablePtr table, unsigned long *key, void **value)
 {
-    HashTablePtr  table = (HashTablePtr)t;
+    HashSlotPtr   slot;
 
-    while (table->p0 < HASH_SIZE) {
-	if (table->p1) {
-	    *key       = table->p1->key;
-	    *value     = table->p1->value;
-	    table->p1  = table->p1->next;
+    while (table->p0 < table->size) {
+	slot = &table->slots[table->p0++];
+	if (slot->state == HASH_SLOT_USED) {
+	    *key   = slot->key;
+	    *value = slot->value;
 	    return 1;
 	}
-	table->p1 = table->buckets[table->p0];
-	++table->p0;
     }
     return 0;
 }
 
+int drmHashNext(void *t, unsigned long *key, void **value)
+{
+    HashTablePtr  table = (HashTablePtr)t;
+    int           retcode;
+
+    if (table->concurrent) pthread_mutex_lock(&table->lock);
+    retcode = HashNext(table, key, value);
+    if (table->concurrent) pthread_mutex_unlock(&table->lock);
+    return retcode;
+}
+
 int drmHashFirst(void *t, unsigned long *key, void **value)
 {
     HashTablePtr  table = (HashTablePtr)t;
+    int           retcode;
 
     if (table->magic != HASH_MAGIC) return -1; /* Bad magic */
 
+    if (table->concurrent) pthread_mutex_lock(&table->lock);
     table->p0 = 0;
-    table->p1 = table->buckets[0];
-    return drmHashNext(table, key, value);
+    retcode = HashNext(table, key, value);
+    if (table->concurrent) pthread_mutex_unlock(&table->lock);
+    return retcode;
 }
 
 #if HASH_MAIN
@@ -312,12 +525,11 @@ static void clear_dist(void) {
     for (i = 0; i < DIST_LIMIT; i++) dist[i] = 0;
 }
 
-static int count_entries(HashBucketPtr bucket)
+static int count_probes(HashTablePtr table, unsigned long i)
 {
-    int count = 0;
+    unsigned long home  = HashHash(table->bits, table->slots[i].key);
 
-    for (; bucket; bucket = bucket->next) ++count;
-    return count;
+    return (int)((i - home) & (table->size - 1));
 }
 
 static void update_dist(int count)
@@ -328,18 +540,17 @@ static void update_dist(int count)
 
 static void compute_dist(HashTablePtr table)
 {
-    int           i;
-    HashBucketPtr bucket;
+    unsigned long i;
 
-    printf("Entries = %ld, hits = %ld, partials = %ld, misses = %ld\n",
-	   table->entries, table->hits, table->partials, table->misses);
+    printf("Entries = %lu, deleted = %lu, size = %lu\n",
+	   table->entries, table->deleted, table->size);
     clear_dist();
-    for (i = 0; i < HASH_SIZE; i++) {
-	bucket = table->buckets[i];
-	update_dist(count_entries(bucket));
+    for (i = 0; i < table->size; i++) {
+	if (table->slots[i].state == HASH_SLOT_USED)
+	    update_dist(count_probes(table, i));
     }
     for (i = 0; i < DIST_LIMIT; i++) {
-	if (i != DIST_LIMIT-1) printf("%5d %10d\n", i, dist[i]);
+	if (i != DIST_LIMIT-1) printf("%5lu %10d\n", i, dist[i]);
 	else                   printf("other %10d\n", dist[i]);
     }
 }
@@ -347,39 +558,175 @@ static void compute_dist(HashTablePtr table)
 static void check_table(HashTablePtr table,
 			unsigned long key, unsigned long value)
 {
-    unsigned long retval  = 0;
+    void          *retval  = NULL;
     int           retcode = drmHashLookup(table, key, &retval);
 
     switch (retcode) {
     case -1:
 	printf("Bad magic = 0x%08lx:"
 	       " key = %lu, expected = %lu, returned = %lu\n",
-	       table->magic, key, value, retval);
+	       table->magic, key, value, (unsigned long)retval);
 	break;
     case 1:
 	printf("Not found: key = %lu, expected = %lu returned = %lu\n",
-	       key, value, retval);
+	       key, value, (unsigned long)retval);
 	break;
     case 0:
-	if (value != retval)
+	if (value != (unsigned long)retval)
 	    printf("Bad value: key = %lu, expected = %lu, returned = %lu\n",
-		   key, value, retval);
+		   key, value, (unsigned long)retval);
 	break;
     default:
 	printf("Bad retcode = %d: key = %lu, expected = %lu, returned = %lu\n",
-	       retcode, key, value, retval);
+	       retcode, key, value, (unsigned long)retval);
 	break;
     }
 }
 
+static double ns_since(struct timespec *start)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+static void do_time(unsigned long count, int random_keys)
+{
+    HashTablePtr    table;
+    unsigned long   *keys;
+    unsigned long   i;
+    void            *value;
+    struct timespec start;
+    double          insert, lookup, miss, delete;
+
+    keys = malloc(count * sizeof(*keys));
+    srandom(0xbeefbeef);
+    for (i = 0; i < count; i++)
+	keys[i] = random_keys ? ((unsigned long)random() << 16) ^ random()
+			      : i * 4096;
+
+    table = drmHashCreate();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) drmHashInsert(table, keys[i], (void *)i);
+    insert = ns_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) drmHashLookup(table, keys[i], &value);
+    lookup = ns_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) drmHashLookup(table, keys[i] + 1, &value);
+    miss = ns_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; i++) drmHashDelete(table, keys[i]);
+    delete = ns_since(&start);
+
+    printf("%8lu %-6s %8.1f %8.1f %8.1f %8.1f\n",
+	   count, random_keys ? "random" : "pages",
+	   insert / count, lookup / count, miss / count, delete / count);
+
+    drmHashDestroy(table);
+    free(keys);
+}
+
+#define STRESS_KEYS    4096
+#define STRESS_THREADS 16
+
+typedef struct StressArg {
+    HashTablePtr  table;
+    volatile int  *stop;
+    unsigned int  seed;
+    unsigned long ops;
+    unsigned long errors;
+} StressArg;
+
+/* Keys below STRESS_KEYS are always present; keys above are inserted and
+   deleted by the writer.  Every value must equal its key. */
+
+static void *stress_reader(void *p)
+{
+    StressArg     *arg = p;
+    unsigned long key;
+    void          *value;
+
+    while (!*arg->stop) {
+	key = rand_r(&arg->seed) % (2 * STRESS_KEYS);
+	if (!drmHashLookup(arg->table, key, &value)) {
+	    if ((unsigned long)value != key) ++arg->errors;
+	} else if (key < STRESS_KEYS) {
+	    ++arg->errors;
+	}
+	++arg->ops;
+    }
+    return NULL;
+}
+
+static void *stress_writer(void *p)
+{
+    StressArg     *arg = p;
+    unsigned long key;
+
+    while (!*arg->stop) {
+	key = STRESS_KEYS + rand_r(&arg->seed) % STRESS_KEYS;
+	if (drmHashInsert(arg->table, key, (void *)key))
+	    drmHashDelete(arg->table, key);
+	++arg->ops;
+    }
+    return NULL;
+}
+
+static void do_concurrent(int readers, int writer)
+{
+    HashTablePtr  table;
+    pthread_t     threads[STRESS_THREADS + 1];
+    StressArg     args[STRESS_THREADS + 1];
+    volatile int  stop = 0;
+    unsigned long lookups = 0;
+    unsigned long errors = 0;
+    unsigned long i;
+    int           n;
+
+    table = drmHashCreateConcurrent();
+    for (i = 0; i < STRESS_KEYS; i++) drmHashInsert(table, i, (void *)i);
+
+    for (n = 0; n < readers + writer; n++) {
+	args[n].table  = table;
+	args[n].stop   = &stop;
+	args[n].seed   = n + 1;
+	args[n].ops    = 0;
+	args[n].errors = 0;
+	pthread_create(&threads[n], NULL,
+		       n < readers ? stress_reader : stress_writer, &args[n]);
+    }
+    usleep(250000);
+    stop = 1;
+    for (n = 0; n < readers + writer; n++) {
+	pthread_join(threads[n], NULL);
+	if (n < readers) lookups += args[n].ops;
+	errors += args[n].errors;
+    }
+
+    printf("%7d %6s %12.1f %12.1f %6lu\n",
+	   readers, writer ? "yes" : "no",
+	   lookups / 0.25 / 1e6, lookups / 0.25 / 1e6 / readers, errors);
+
+    drmHashDestroy(table);
+}
+
 int main(void)
 {
-    HashTablePtr table;
-    int          i;
+    HashTablePtr  table;
+    unsigned long key;
+    void          *value;
+    unsigned long count;
+    int           i;
 
     printf("\n***** 256 consecutive integers ****\n");
     table = drmHashCreate();
-    for (i = 0; i < 256; i++) drmHashInsert(table, i, i);
+    for (i = 0; i < 256; i++) drmHashInsert(table, i, (void *)(long)i);
     for (i = 0; i < 256; i++) check_table(table, i, i);
     for (i = 256; i >= 0; i--) check_table(table, i, i);
     compute_dist(table);
@@ -387,7 +734,7 @@ int main(void)
 
     printf("\n***** 1024 consecutive integers ****\n");
     table = drmHashCreate();
-    for (i = 0; i < 1024; i++) drmHashInsert(table, i, i);
+    for (i = 0; i < 1024; i++) drmHashInsert(table, i, (void *)(long)i);
     for (i = 0; i < 1024; i++) check_table(table, i, i);
     for (i = 1024; i >= 0; i--) check_table(table, i, i);
     compute_dist(table);
@@ -395,7 +742,7 @@ int main(void)
 
     printf("\n***** 1024 consecutive page addresses (4k pages) ****\n");
     table = drmHashCreate();
-    for (i = 0; i < 1024; i++) drmHashInsert(table, i*4096, i);
+    for (i = 0; i < 1024; i++) drmHashInsert(table, i*4096, (void *)(long)i);
     for (i = 0; i < 1024; i++) check_table(table, i*4096, i);
     for (i = 1024; i >= 0; i--) check_table(table, i*4096, i);
     compute_dist(table);
@@ -404,7 +751,7 @@ int main(void)
     printf("\n***** 1024 random integers ****\n");
     table = drmHashCreate();
     srandom(0xbeefbeef);
-    for (i = 0; i < 1024; i++) drmHashInsert(table, random(), i);
+    for (i = 0; i < 1024; i++) drmHashInsert(table, random(), (void *)(long)i);
     srandom(0xbeefbeef);
     for (i = 0; i < 1024; i++) check_table(table, random(), i);
     srandom(0xbeefbeef);
@@ -415,7 +762,7 @@ int main(void)
     printf("\n***** 5000 random integers ****\n");
     table = drmHashCreate();
     srandom(0xbeefbeef);
-    for (i = 0; i < 5000; i++) drmHashInsert(table, random(), i);
+    for (i = 0; i < 5000; i++) drmHashInsert(table, random(), (void *)(long)i);
     srandom(0xbeefbeef);
     for (i = 0; i < 5000; i++) check_table(table, random(), i);
     srandom(0xbeefbeef);
@@ -423,6 +770,41 @@ int main(void)
     compute_dist(table);
     drmHashDestroy(table);
 
+    printf("\n***** delete odd keys while iterating ****\n");
+    table = drmHashCreate();
+    for (i = 0; i < 1024; i++) drmHashInsert(table, i, (void *)(long)i);
+    count = 0;
+    if (drmHashFirst(table, &key, &value)) {
+	do {
+	    ++count;
+	    if (key & 1) drmHashDelete(table, key);
+	} while (drmHashNext(table, &key, &value));
+    }
+    if (count != 1024) printf("Iterated over %lu keys, expected 1024\n", count);
+    for (i = 0; i < 1024; i += 2) check_table(table, i, i);
+    for (i = 1; i < 1024; i += 2)
+	if (!drmHashLookup(table, i, &value)) printf("Key %d not deleted\n", i);
+    compute_dist(table);
+    drmHashDestroy(table);
+
+    printf("\n***** throughput (ns/op) ****\n");
+    printf("%8s %-6s %8s %8s %8s %8s\n",
+	   "keys", "type", "insert", "lookup", "miss", "delete");
+    for (count = 1000; count <= 1000000; count *= 10) {
+	do_time(count, 0);
+	do_time(count, 1);
+    }
+
+    printf("\n***** concurrent lookups (Mops/s) ****\n");
+    printf("%7s %6s %12s %12s %6s\n",
+	   "readers", "writer", "total", "per-thread", "errors");
+    /* Every thread count runs even with fewer CPUs, where the extra
+       threads oversubscribe them and mostly stress the seqlock retries. */
+    for (i = 1; i <= STRESS_THREADS; i *= 2) {
+	do_concurrent(i, 0);
+	do_concurrent(i, 1);
+    }
+
     return 0;
 }
 #endif
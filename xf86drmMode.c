@@ -52,6 +52,9 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 #ifdef HAVE_VALGRIND
 #include <valgrind.h>
@@ -347,13 +350,10 @@ int drmModeDirtyFB(int fd, uint32_t bufferId,
 
 drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
 {
-	struct drm_mode_crtc crtc;
+	drmModeCrtc crtc;
 	drmModeCrtcPtr r;
 
-	VG_CLEAR(crtc);
-	crtc.crtc_id = crtcId;
-
-	if (drmIoctl(fd, DRM_IOCTL_MODE_GETCRTC, &crtc))
+	if (drmModeGetCrtcInto(fd, crtcId, &crtc))
 		return 0;
 
 	/*
@@ -363,6 +363,22 @@ drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
 	if (!(r = drmMalloc(sizeof(*r))))
 		return 0;
 
+	memcpy(r, &crtc, sizeof(*r));
+	return r;
+}
+
+int drmModeGetCrtcInto(int fd, uint32_t crtcId, drmModeCrtcPtr r)
+{
+	struct drm_mode_crtc crtc;
+	int ret;
+
+	VG_CLEAR(crtc);
+	crtc.crtc_id = crtcId;
+
+	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCRTC, &crtc)))
+		return ret;
+
+	memset(r, 0, sizeof(*r));
 	r->crtc_id         = crtc.crtc_id;
 	r->x               = crtc.x;
 	r->y               = crtc.y;
@@ -374,7 +390,7 @@ drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId)
 	}
 	r->buffer_id       = crtc.fb_id;
 	r->gamma_size      = crtc.gamma_size;
-	return r;
+	return 0;
 }
 
 
@@ -572,6 +588,66 @@ err_allocs:
 	return r;
 }
 
+int drmModeGetConnectorInto(int fd, uint32_t connector_id,
+			    drmModeConnectorPtr r)
+{
+	struct drm_mode_get_connector conn;
+	uint32_t max_modes, max_props, max_encoders;
+	int ret;
+
+	/* A list is only wanted if the caller gave storage for it, and the
+	 * kernel only fills a list if all of it fits. */
+	max_modes = r->modes && r->count_modes > 0 ? r->count_modes : 0;
+	max_props = r->props && r->prop_values && r->count_props > 0 ?
+		r->count_props : 0;
+	max_encoders = r->encoders && r->count_encoders > 0 ?
+		r->count_encoders : 0;
+
+	memset(&conn, 0, sizeof(struct drm_mode_get_connector));
+	conn.connector_id = connector_id;
+	conn.count_props = max_props;
+	conn.props_ptr = VOID2U64(r->props);
+	conn.prop_values_ptr = VOID2U64(r->prop_values);
+	conn.count_encoders = max_encoders;
+	conn.encoders_ptr = VOID2U64(r->encoders);
+
+	/* Asking for no modes makes the kernel probe the connector, just like
+	 * the first call in drmModeGetConnector(). */
+	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn)))
+		return ret;
+
+	if (conn.count_modes && conn.count_modes <= max_modes) {
+		conn.count_modes = max_modes;
+		conn.modes_ptr = VOID2U64(r->modes);
+		conn.count_props = max_props;
+		conn.count_encoders = max_encoders;
+		if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn)))
+			return ret;
+	}
+
+	r->connector_id = conn.connector_id;
+	r->encoder_id = conn.encoder_id;
+	r->connection   = conn.connection;
+	r->mmWidth      = conn.mm_width;
+	r->mmHeight     = conn.mm_height;
+	/* convert subpixel from kernel to userspace */
+	r->subpixel     = conn.subpixel + 1;
+	r->count_modes  = conn.count_modes;
+	r->count_props  = conn.count_props;
+	r->count_encoders = conn.count_encoders;
+	r->connector_type  = conn.connector_type;
+	r->connector_type_id = conn.connector_type_id;
+
+	/* Either too small to begin with or the lists grew with a hotplug
+	 * between the ioctls; the counts now say how much room is needed. */
+	if ((r->modes && conn.count_modes > max_modes) ||
+	    (max_props < conn.count_props && r->props && r->prop_values) ||
+	    (r->encoders && conn.count_encoders > max_encoders))
+		return -ENOSPC;
+
+	return 0;
+}
+
 int drmModeAttachMode(int fd, uint32_t connector_id, drmModeModeInfoPtr mode_info)
 {
 	struct drm_mode_mode_cmd res;
@@ -659,9 +735,120 @@ void drmModeFreeProperty(drmModePropertyPtr ptr)
 
 	drmFree(ptr->values);
 	drmFree(ptr->enums);
+	drmFree(ptr->blob_ids);
 	drmFree(ptr);
 }
 
+/*
+ * Property definitions don't change while a device is open, so they are
+ * kept per fd in a table of property id -> drmModePropertyPtr, alongside
+ * other facts about the device learnt on the way.  Lookups don't lock;
+ * filling in a missing entry takes fd_cache_lock.
+ */
+
+struct drm_mode_fd_cache {
+	void *props;		/* property id -> drmModePropertyPtr */
+	int atomic;		/* 1 atomic commits work, -1 not, 0 unknown */
+};
+
+static pthread_mutex_t fd_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static void *fd_caches;		/* fd -> struct drm_mode_fd_cache */
+
+static struct drm_mode_fd_cache *drmModeGetFdCache(int fd)
+{
+	struct drm_mode_fd_cache *cache;
+	void *value;
+
+	if (fd_caches && !drmHashLookup(fd_caches, fd, &value))
+		return value;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	if (!fd_caches)
+		fd_caches = drmHashCreateConcurrent();
+
+	cache = NULL;
+	if (fd_caches && !drmHashLookup(fd_caches, fd, &value)) {
+		cache = value;
+	} else if (fd_caches && (cache = drmMalloc(sizeof(*cache)))) {
+		if ((cache->props = drmHashCreateConcurrent())) {
+			drmHashInsert(fd_caches, fd, cache);
+		} else {
+			drmFree(cache);
+			cache = NULL;
+		}
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
+	return cache;
+}
+
+drmModePropertyPtr drmModeGetPropertyCached(int fd, uint32_t property_id)
+{
+	struct drm_mode_fd_cache *cache;
+	drmModePropertyPtr prop;
+	void *value;
+
+	if (!(cache = drmModeGetFdCache(fd)))
+		return NULL;
+
+	if (!drmHashLookup(cache->props, property_id, &value))
+		return value;
+
+	if (!(prop = drmModeGetProperty(fd, property_id)))
+		return NULL;
+
+	/* Another thread may have fetched the same property meanwhile;
+	 * everybody gets whichever copy made it into the table. */
+	pthread_mutex_lock(&fd_cache_lock);
+	if (drmHashLookup(cache->props, property_id, &value)) {
+		drmHashInsert(cache->props, property_id, prop);
+		value = prop;
+		prop = NULL;
+	}
+	pthread_mutex_unlock(&fd_cache_lock);
+
+	drmModeFreeProperty(prop);
+	return value;
+}
+
+int drmModeFindPropertyIndex(int fd, const uint32_t *props, int count,
+			     const char *name)
+{
+	drmModePropertyPtr prop;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		prop = drmModeGetPropertyCached(fd, props[i]);
+		if (prop && !strcmp(prop->name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+void drmModeInvalidatePropertyCache(int fd)
+{
+	struct drm_mode_fd_cache *cache;
+	unsigned long id;
+	void *value, *prop;
+
+	pthread_mutex_lock(&fd_cache_lock);
+	if (!fd_caches || drmHashLookup(fd_caches, fd, &value)) {
+		pthread_mutex_unlock(&fd_cache_lock);
+		return;
+	}
+	drmHashDelete(fd_caches, fd);
+	pthread_mutex_unlock(&fd_cache_lock);
+
+	cache = value;
+	if (drmHashFirst(cache->props, &id, &prop)) {
+		do {
+			drmModeFreeProperty(prop);
+		} while (drmHashNext(cache->props, &id, &prop));
+	}
+	drmHashDestroy(cache->props);
+	drmFree(cache);
+}
+
 drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id)
 {
 	struct drm_mode_get_blob blob;
@@ -841,12 +1028,44 @@ int drmModeCrtcSetGamma(int fd, uint32_t crtc_id, uint32_t size,
 	return DRM_IOCTL(fd, DRM_IOCTL_MODE_SETGAMMA, &l);
 }
 
+static int drmDispatchEvent(int fd, drmEventContextPtr evctx,
+			    struct drm_event *e)
+{
+	struct drm_event_vblank *vblank;
+
+	switch (e->type) {
+	case DRM_EVENT_VBLANK:
+		if (evctx->version < 1 ||
+		    evctx->vblank_handler == NULL)
+			return 0;
+		vblank = (struct drm_event_vblank *) e;
+		evctx->vblank_handler(fd,
+				      vblank->sequence, 
+				      vblank->tv_sec,
+				      vblank->tv_usec,
+				      U642VOID (vblank->user_data));
+		return 1;
+	case DRM_EVENT_FLIP_COMPLETE:
+		if (evctx->version < 2 ||
+		    evctx->page_flip_handler == NULL)
+			return 0;
+		vblank = (struct drm_event_vblank *) e;
+		evctx->page_flip_handler(fd,
+					 vblank->sequence,
+					 vblank->tv_sec,
+					 vblank->tv_usec,
+					 U642VOID (vblank->user_data));
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 int drmHandleEvent(int fd, drmEventContextPtr evctx)
 {
 	char buffer[1024];
 	int len, i;
 	struct drm_event *e;
-	struct drm_event_vblank *vblank;
 	
 	/* The DRM read semantics guarantees that we always get only
 	 * complete events. */
@@ -860,36 +1079,124 @@ int drmHandleEvent(int fd, drmEventContextPtr evctx)
 	i = 0;
 	while (i < len) {
 		e = (struct drm_event *) &buffer[i];
-		switch (e->type) {
-		case DRM_EVENT_VBLANK:
-			if (evctx->version < 1 ||
-			    evctx->vblank_handler == NULL)
+		drmDispatchEvent(fd, evctx, e);
+		i += e->length;
+	}
+
+	return 0;
+}
+
+/* A read that leaves less room than this in the buffer may have stopped
+ * short of the end of the event queue, so poll for more.  This is the
+ * buffer size drmHandleEvent has always assumed events fit in. */
+#define DRM_EVENT_BATCH_SLACK	1024
+#define DRM_EVENT_BATCH_DEFAULT	4096
+#define DRM_EVENT_BATCH_MAX	65536
+
+/**
+ * Read and dispatch all pending events on \p fd.
+ *
+ * Like drmHandleEvent, this blocks until the first event arrives unless
+ * \p fd is non-blocking.  It then keeps reading while the queue may hold
+ * more events, so a burst of vblank and flip events costs a few large
+ * reads instead of one read per kilobyte.
+ *
+ * \param batch supplies the read buffer and receives statistics.  If
+ * batch->buffer is NULL, a buffer is allocated that grows up to 64KB while
+ * reads keep filling it.  Caller buffers should be at least 1KB.
+ * Events the context has no handler for are passed to batch->unhandled.
+ *
+ * \return the number of events read, or -1 if the first read fails or
+ * returns no complete event.  A later read that fails ends the batch.
+ */
+int drmHandleEventBatch(int fd, drmEventContextPtr evctx,
+			drmEventBatchPtr batch)
+{
+	char stack[DRM_EVENT_BATCH_DEFAULT];
+	char *buffer, *grown;
+	unsigned int size;
+	struct pollfd pfd;
+	struct drm_event *e;
+	struct drm_event_vblank *vblank;
+	int len, i, ret = -1;
+
+	if (batch->buffer) {
+		buffer = batch->buffer;
+		size = batch->size;
+	} else {
+		buffer = stack;
+		size = sizeof stack;
+	}
+
+	batch->events = 0;
+	batch->reads = 0;
+	batch->tv_sec = 0;
+	batch->tv_usec = 0;
+
+	for (;;) {
+		len = read(fd, buffer, size);
+		if (len < 0) {
+			if (batch->reads)
 				break;
-			vblank = (struct drm_event_vblank *) e;
-			evctx->vblank_handler(fd,
-					      vblank->sequence, 
-					      vblank->tv_sec,
-					      vblank->tv_usec,
-					      U642VOID (vblank->user_data));
+			goto out;
+		}
+		if (len == 0)
 			break;
-		case DRM_EVENT_FLIP_COMPLETE:
-			if (evctx->version < 2 ||
-			    evctx->page_flip_handler == NULL)
+		batch->reads++;
+
+		/* The DRM read semantics guarantees that we always get only
+		 * complete events; stop at anything else, as drmHandleEvent
+		 * would. */
+		i = 0;
+		while (len - i >= sizeof *e) {
+			e = (struct drm_event *) &buffer[i];
+			if (e->length < sizeof *e || len - i < e->length)
 				break;
-			vblank = (struct drm_event_vblank *) e;
-			evctx->page_flip_handler(fd,
-						 vblank->sequence,
-						 vblank->tv_sec,
-						 vblank->tv_usec,
-						 U642VOID (vblank->user_data));
+
+			if (e->type == DRM_EVENT_VBLANK ||
+			    e->type == DRM_EVENT_FLIP_COMPLETE) {
+				vblank = (struct drm_event_vblank *) e;
+				batch->tv_sec = vblank->tv_sec;
+				batch->tv_usec = vblank->tv_usec;
+			}
+			if (!drmDispatchEvent(fd, evctx, e) &&
+			    batch->unhandled)
+				batch->unhandled(fd, e, batch->data);
+			batch->events++;
+			i += e->length;
+		}
+		if (i < len) {
+			if (!batch->events)
+				goto out;
 			break;
-		default:
+		}
+
+		if (size - len >= DRM_EVENT_BATCH_SLACK)
 			break;
+
+		if (!batch->buffer && size < DRM_EVENT_BATCH_MAX) {
+			grown = malloc(size * 2);
+			if (grown) {
+				if (buffer != stack)
+					free(buffer);
+				buffer = grown;
+				size *= 2;
+			}
 		}
-		i += e->length;
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN))
+			break;
 	}
 
-	return 0;
+	ret = batch->events;
+
+out:
+	if (buffer != stack && buffer != batch->buffer)
+		free(buffer);
+	return ret;
 }
 
 int drmModePageFlip(int fd, uint32_t crtc_id, uint32_t fb_id,
@@ -1129,3 +1436,866 @@ int drmModeObjectSetProperty(int fd, uint32_t object_id, uint32_t object_type,
 
 	return DRM_IOCTL(fd, DRM_IOCTL_MODE_OBJ_SETPROPERTY, &prop);
 }
+
+/*
+ * Mode object graph snapshots
+ *
+ * The snapshot is built in a single arena.  Query ioctls write their id,
+ * mode and property lists straight into the arena tail, and the lists are
+ * packed down to their real lengths afterwards.  Growing the arena moves
+ * it, so while building, the pointer members hold arena offsets (0 is the
+ * header and never a list, so it stands for NULL) and are converted once
+ * the snapshot is complete.
+ */
+
+#define SNAP_GUESS 32	/* Initial capacity offered for each list */
+#define SNAP_RETRIES 8	/* Attempts before giving up on a changing graph */
+
+struct snap_arena {
+	char *base;
+	uint32_t size;
+	uint32_t used;
+};
+
+struct snap_list {
+	__u32 *count;		/* ioctl count member */
+	__u64 *ptr;		/* ioctl pointer member */
+	uint32_t entry_size;
+	uint32_t capacity;
+	uint32_t offset;
+};
+
+/* Start size for the next arena, so a repeated snapshot of an unchanged
+ * device needs a single allocation.  Only ever a hint. */
+static uint32_t snap_size_hint = 16384;
+
+#define SNAP_OFF(offset) ((void *)(unsigned long)(offset))
+#define SNAP_FIXUP(a, p) ((p) = (p) ? (void *)((a)->base + (unsigned long)(p)) : NULL)
+
+static int snap_reserve(struct snap_arena *a, uint32_t count, uint32_t size,
+			uint32_t *offset)
+{
+	uint32_t start = (a->used + 7) & ~7;
+	uint64_t end = start + (uint64_t)count * size;
+	uint32_t new_size;
+	char *base;
+
+	if (end > INT32_MAX)
+		return -ENOMEM;
+
+	if (end > a->size) {
+		for (new_size = a->size; new_size < end; new_size *= 2)
+			;
+		if (!(base = drmMalloc(new_size)))
+			return -ENOMEM;
+		memcpy(base, a->base, a->used);
+		drmFree(a->base);
+		a->base = base;
+		a->size = new_size;
+	}
+
+	*offset = start;
+	a->used = end;
+	return 0;
+}
+
+/*
+ * Issue a query ioctl with its lists placed in the arena.  Lists whose
+ * count comes back larger than offered are resized and the ioctl repeated,
+ * as the kernel only fills lists that are large enough.
+ */
+static int snap_query(int fd, struct snap_arena *a, unsigned long request,
+		      void *arg, struct snap_list *lists, int count)
+{
+	uint32_t mark = a->used, from;
+	int i, ret, retry;
+
+	do {
+		a->used = mark;
+		for (i = 0; i < count; i++) {
+			ret = snap_reserve(a, lists[i].capacity,
+					   lists[i].entry_size, &lists[i].offset);
+			if (ret)
+				goto err;
+		}
+		for (i = 0; i < count; i++) {
+			*lists[i].count = lists[i].capacity;
+			*lists[i].ptr = lists[i].capacity ?
+				VOID2U64(a->base + lists[i].offset) : 0;
+		}
+
+		if ((ret = DRM_IOCTL(fd, request, arg)))
+			goto err;
+
+		retry = 0;
+		for (i = 0; i < count; i++) {
+			if (*lists[i].count > lists[i].capacity) {
+				lists[i].capacity = *lists[i].count;
+				retry = 1;
+			}
+		}
+	} while (retry);
+
+	/* Packing only ever moves lists towards the start of the arena. */
+	a->used = mark;
+	for (i = 0; i < count; i++) {
+		from = lists[i].offset;
+		snap_reserve(a, *lists[i].count, lists[i].entry_size,
+			     &lists[i].offset);
+		memmove(a->base + lists[i].offset, a->base + from,
+			*lists[i].count * lists[i].entry_size);
+		if (!*lists[i].count)
+			lists[i].offset = 0;
+	}
+
+	return 0;
+
+err:
+	a->used = mark;
+	return ret;
+}
+
+static void snap_list_init(struct snap_list *list, __u32 *count, __u64 *ptr,
+			   uint32_t entry_size, uint32_t capacity)
+{
+	list->count = count;
+	list->ptr = ptr;
+	list->entry_size = entry_size;
+	list->capacity = capacity;
+	list->offset = 0;
+}
+
+static int snap_object_props(int fd, struct snap_arena *a, uint32_t id,
+			     uint32_t type, uint32_t props_offset)
+{
+	struct drm_mode_obj_get_properties properties;
+	struct snap_list lists[2];
+	drmModeObjectPropertiesPtr r;
+	int ret;
+
+	memset(&properties, 0, sizeof(properties));
+	properties.obj_id = id;
+	properties.obj_type = type;
+	snap_list_init(&lists[0], &properties.count_props,
+		       &properties.props_ptr, sizeof(uint32_t), SNAP_GUESS);
+	snap_list_init(&lists[1], &properties.count_props,
+		       &properties.prop_values_ptr, sizeof(uint64_t), SNAP_GUESS);
+
+	if ((ret = snap_query(fd, a, DRM_IOCTL_MODE_OBJ_GETPROPERTIES,
+			      &properties, lists, 2)))
+		return ret;
+
+	r = (drmModeObjectPropertiesPtr)(a->base + props_offset);
+	r->count_props = properties.count_props;
+	r->props = SNAP_OFF(lists[0].offset);
+	r->prop_values = SNAP_OFF(lists[1].offset);
+	return 0;
+}
+
+static int snap_crtc(int fd, struct snap_arena *a, uint32_t id,
+		     uint32_t crtc_offset)
+{
+	struct drm_mode_crtc crtc;
+	drmModeCrtcPtr r;
+	int ret;
+
+	memset(&crtc, 0, sizeof(crtc));
+	crtc.crtc_id = id;
+
+	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETCRTC, &crtc)))
+		return ret;
+
+	r = (drmModeCrtcPtr)(a->base + crtc_offset);
+	r->crtc_id         = crtc.crtc_id;
+	r->x               = crtc.x;
+	r->y               = crtc.y;
+	r->mode_valid      = crtc.mode_valid;
+	if (r->mode_valid) {
+		memcpy(&r->mode, &crtc.mode, sizeof(struct drm_mode_modeinfo));
+		r->width = crtc.mode.hdisplay;
+		r->height = crtc.mode.vdisplay;
+	}
+	r->buffer_id       = crtc.fb_id;
+	r->gamma_size      = crtc.gamma_size;
+	return 0;
+}
+
+static int snap_connector(int fd, struct snap_arena *a, uint32_t id,
+			  uint32_t conn_offset)
+{
+	struct drm_mode_get_connector conn;
+	struct snap_list lists[4];
+	drmModeConnectorPtr r;
+	int ret;
+
+	memset(&conn, 0, sizeof(conn));
+	conn.connector_id = id;
+	/* No room for modes on the first call, so the kernel probes the
+	 * connector just like drmModeGetConnector() does. */
+	snap_list_init(&lists[0], &conn.count_modes, &conn.modes_ptr,
+		       sizeof(struct drm_mode_modeinfo), 0);
+	snap_list_init(&lists[1], &conn.count_props, &conn.props_ptr,
+		       sizeof(uint32_t), SNAP_GUESS);
+	snap_list_init(&lists[2], &conn.count_props, &conn.prop_values_ptr,
+		       sizeof(uint64_t), SNAP_GUESS);
+	snap_list_init(&lists[3], &conn.count_encoders, &conn.encoders_ptr,
+		       sizeof(uint32_t), SNAP_GUESS);
+
+	if ((ret = snap_query(fd, a, DRM_IOCTL_MODE_GETCONNECTOR, &conn,
+			      lists, 4)))
+		return ret;
+
+	r = (drmModeConnectorPtr)(a->base + conn_offset);
+	r->connector_id = conn.connector_id;
+	r->encoder_id   = conn.encoder_id;
+	r->connection   = conn.connection;
+	r->mmWidth      = conn.mm_width;
+	r->mmHeight     = conn.mm_height;
+	/* convert subpixel from kernel to userspace */
+	r->subpixel     = conn.subpixel + 1;
+	r->count_modes  = conn.count_modes;
+	r->modes        = SNAP_OFF(lists[0].offset);
+	r->count_props  = conn.count_props;
+	r->props        = SNAP_OFF(lists[1].offset);
+	r->prop_values  = SNAP_OFF(lists[2].offset);
+	r->count_encoders = conn.count_encoders;
+	r->encoders     = SNAP_OFF(lists[3].offset);
+	r->connector_type  = conn.connector_type;
+	r->connector_type_id = conn.connector_type_id;
+	return 0;
+}
+
+static int snap_encoder(int fd, struct snap_arena *a, uint32_t id,
+			uint32_t enc_offset)
+{
+	struct drm_mode_get_encoder enc;
+	drmModeEncoderPtr r;
+	int ret;
+
+	memset(&enc, 0, sizeof(enc));
+	enc.encoder_id = id;
+
+	if ((ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_GETENCODER, &enc)))
+		return ret;
+
+	r = (drmModeEncoderPtr)(a->base + enc_offset);
+	r->encoder_id = enc.encoder_id;
+	r->crtc_id = enc.crtc_id;
+	r->encoder_type = enc.encoder_type;
+	r->possible_crtcs = enc.possible_crtcs;
+	r->possible_clones = enc.possible_clones;
+	return 0;
+}
+
+static int snap_plane(int fd, struct snap_arena *a, uint32_t id,
+		      uint32_t plane_offset)
+{
+	struct drm_mode_get_plane ovr;
+	struct snap_list list;
+	drmModePlanePtr r;
+	int ret;
+
+	memset(&ovr, 0, sizeof(ovr));
+	ovr.plane_id = id;
+	snap_list_init(&list, &ovr.count_format_types, &ovr.format_type_ptr,
+		       sizeof(uint32_t), SNAP_GUESS);
+
+	if ((ret = snap_query(fd, a, DRM_IOCTL_MODE_GETPLANE, &ovr, &list, 1)))
+		return ret;
+
+	r = (drmModePlanePtr)(a->base + plane_offset);
+	r->count_formats = ovr.count_format_types;
+	r->formats = SNAP_OFF(list.offset);
+	r->plane_id = ovr.plane_id;
+	r->crtc_id = ovr.crtc_id;
+	r->fb_id = ovr.fb_id;
+	r->possible_crtcs = ovr.possible_crtcs;
+	r->gamma_size = ovr.gamma_size;
+	return 0;
+}
+
+/* Reserve a zeroed array of objects. */
+static int snap_objects(struct snap_arena *a, uint32_t count, uint32_t size,
+			uint32_t *offset)
+{
+	int ret;
+
+	if ((ret = snap_reserve(a, count, size, offset)))
+		return ret;
+	memset(a->base + *offset, 0, count * size);
+	return 0;
+}
+
+static int snap_build(int fd, struct snap_arena *a)
+{
+	struct drm_mode_card_res res;
+	struct drm_mode_get_plane_res plane_res;
+	struct snap_list res_lists[4], plane_list;
+	uint32_t offset, crtcs, crtc_props, connectors, encoders;
+	uint32_t planes, plane_props;
+	drmModeSnapshotPtr s;
+	uint32_t i;
+	int ret;
+
+	a->used = 0;
+	if ((ret = snap_objects(a, 1, sizeof(*s), &offset)))
+		return ret;
+
+	memset(&res, 0, sizeof(res));
+	snap_list_init(&res_lists[0], &res.count_fbs, &res.fb_id_ptr,
+		       sizeof(uint32_t), SNAP_GUESS);
+	snap_list_init(&res_lists[1], &res.count_crtcs, &res.crtc_id_ptr,
+		       sizeof(uint32_t), SNAP_GUESS);
+	snap_list_init(&res_lists[2], &res.count_connectors,
+		       &res.connector_id_ptr, sizeof(uint32_t), SNAP_GUESS);
+	snap_list_init(&res_lists[3], &res.count_encoders,
+		       &res.encoder_id_ptr, sizeof(uint32_t), SNAP_GUESS);
+	if ((ret = snap_query(fd, a, DRM_IOCTL_MODE_GETRESOURCES, &res,
+			      res_lists, 4)))
+		return ret;
+
+	/* Drivers without planes reject the ioctl, which means no planes. */
+	memset(&plane_res, 0, sizeof(plane_res));
+	snap_list_init(&plane_list, &plane_res.count_planes,
+		       &plane_res.plane_id_ptr, sizeof(uint32_t), SNAP_GUESS);
+	if (snap_query(fd, a, DRM_IOCTL_MODE_GETPLANERESOURCES, &plane_res,
+		       &plane_list, 1))
+		plane_res.count_planes = 0;
+
+	if ((ret = snap_objects(a, res.count_crtcs, sizeof(drmModeCrtc),
+				&crtcs)) ||
+	    (ret = snap_objects(a, res.count_crtcs,
+				sizeof(drmModeObjectProperties),
+				&crtc_props)) ||
+	    (ret = snap_objects(a, res.count_connectors,
+				sizeof(drmModeConnector), &connectors)) ||
+	    (ret = snap_objects(a, res.count_encoders,
+				sizeof(drmModeEncoder), &encoders)) ||
+	    (ret = snap_objects(a, plane_res.count_planes,
+				sizeof(drmModePlane), &planes)) ||
+	    (ret = snap_objects(a, plane_res.count_planes,
+				sizeof(drmModeObjectProperties),
+				&plane_props)))
+		return ret;
+
+	/* The id lists live in the arena too, which may move with every
+	 * query, so always index them through the current base. */
+#define SNAP_ID(list, i) (((uint32_t *)(a->base + (list).offset))[i])
+
+	for (i = 0; i < res.count_crtcs; i++) {
+		if ((ret = snap_crtc(fd, a, SNAP_ID(res_lists[1], i),
+				     crtcs + i * sizeof(drmModeCrtc))))
+			return ret;
+		if ((ret = snap_object_props(fd, a, SNAP_ID(res_lists[1], i),
+					     DRM_MODE_OBJECT_CRTC,
+					     crtc_props + i *
+					     sizeof(drmModeObjectProperties))))
+			return ret;
+	}
+	for (i = 0; i < res.count_connectors; i++) {
+		if ((ret = snap_connector(fd, a, SNAP_ID(res_lists[2], i),
+					  connectors + i *
+					  sizeof(drmModeConnector))))
+			return ret;
+	}
+	for (i = 0; i < res.count_encoders; i++) {
+		if ((ret = snap_encoder(fd, a, SNAP_ID(res_lists[3], i),
+					encoders + i * sizeof(drmModeEncoder))))
+			return ret;
+	}
+	for (i = 0; i < plane_res.count_planes; i++) {
+		if ((ret = snap_plane(fd, a, SNAP_ID(plane_list, i),
+				      planes + i * sizeof(drmModePlane))))
+			return ret;
+		if ((ret = snap_object_props(fd, a, SNAP_ID(plane_list, i),
+					     DRM_MODE_OBJECT_PLANE,
+					     plane_props + i *
+					     sizeof(drmModeObjectProperties))))
+			return ret;
+	}
+#undef SNAP_ID
+
+	s = (drmModeSnapshotPtr)a->base;
+	s->size = a->used;
+	s->min_width = res.min_width;
+	s->max_width = res.max_width;
+	s->min_height = res.min_height;
+	s->max_height = res.max_height;
+	s->count_fbs = res.count_fbs;
+	s->fbs = SNAP_OFF(res_lists[0].offset);
+	s->count_crtcs = res.count_crtcs;
+	s->crtcs = SNAP_OFF(res.count_crtcs ? crtcs : 0);
+	s->crtc_props = SNAP_OFF(res.count_crtcs ? crtc_props : 0);
+	s->count_connectors = res.count_connectors;
+	s->connectors = SNAP_OFF(res.count_connectors ? connectors : 0);
+	s->count_encoders = res.count_encoders;
+	s->encoders = SNAP_OFF(res.count_encoders ? encoders : 0);
+	s->count_planes = plane_res.count_planes;
+	s->planes = SNAP_OFF(plane_res.count_planes ? planes : 0);
+	s->plane_props = SNAP_OFF(plane_res.count_planes ? plane_props : 0);
+	return 0;
+}
+
+static void snap_fixup(struct snap_arena *a)
+{
+	drmModeSnapshotPtr s = (drmModeSnapshotPtr)a->base;
+	int i;
+
+	SNAP_FIXUP(a, s->fbs);
+	SNAP_FIXUP(a, s->crtcs);
+	SNAP_FIXUP(a, s->crtc_props);
+	SNAP_FIXUP(a, s->connectors);
+	SNAP_FIXUP(a, s->encoders);
+	SNAP_FIXUP(a, s->planes);
+	SNAP_FIXUP(a, s->plane_props);
+
+	for (i = 0; i < s->count_crtcs; i++) {
+		SNAP_FIXUP(a, s->crtc_props[i].props);
+		SNAP_FIXUP(a, s->crtc_props[i].prop_values);
+	}
+	for (i = 0; i < s->count_connectors; i++) {
+		SNAP_FIXUP(a, s->connectors[i].modes);
+		SNAP_FIXUP(a, s->connectors[i].props);
+		SNAP_FIXUP(a, s->connectors[i].prop_values);
+		SNAP_FIXUP(a, s->connectors[i].encoders);
+	}
+	for (i = 0; i < s->count_planes; i++) {
+		SNAP_FIXUP(a, s->planes[i].formats);
+		SNAP_FIXUP(a, s->plane_props[i].props);
+		SNAP_FIXUP(a, s->plane_props[i].prop_values);
+	}
+}
+
+drmModeSnapshotPtr drmModeGetSnapshot(int fd)
+{
+	struct snap_arena a;
+	int ret, tries = 0;
+
+	a.size = snap_size_hint;
+	a.used = 0;
+	if (!(a.base = drmMalloc(a.size)))
+		return NULL;
+
+	/* An object that vanished between listing the resources and
+	 * querying it was unplugged; start over with the new lists, unless
+	 * that keeps happening. */
+	while ((ret = snap_build(fd, &a)) == -ENOENT &&
+	       ++tries < SNAP_RETRIES)
+		;
+
+	if (ret) {
+		drmFree(a.base);
+		errno = -ret;
+		return NULL;
+	}
+
+	snap_fixup(&a);
+	snap_size_hint = a.size;
+	return (drmModeSnapshotPtr)a.base;
+}
+
+void drmModeFreeSnapshot(drmModeSnapshotPtr ptr)
+{
+	drmFree(ptr);
+}
+
+/*
+ * Batched mode setting
+ *
+ * A request is a list of items in the order they were added.  Property
+ * items carry an object/property/value tuple.  Crtc, plane and page flip
+ * updates are kept in a separate list of legacy operations, and their
+ * items have property id 0 (never a valid property) and the index of the
+ * operation as value.
+ */
+
+enum {
+	ATOMIC_OP_CRTC,
+	ATOMIC_OP_PLANE,
+	ATOMIC_OP_FLIP
+};
+
+struct drm_mode_atomic_item {
+	uint32_t object_id;
+	uint32_t property_id;
+	uint64_t value;
+	uint32_t index;		/* Position in the request, for sorting */
+};
+
+struct drm_mode_atomic_op {
+	int type;
+	uint32_t object_id;
+	uint32_t crtc_id;
+	uint32_t fb_id;
+	int32_t x, y;		/* crtc: fb offset, plane: crtc position */
+	uint32_t w, h;		/* plane: crtc size */
+	uint32_t src_x, src_y, src_w, src_h;
+	uint32_t *connectors;
+	int count_connectors;
+	int mode_valid;
+	drmModeModeInfo mode;
+};
+
+struct _drmModeCommitReq {
+	uint32_t cursor;
+	uint32_t size_items;
+	struct drm_mode_atomic_item *items;
+	uint32_t count_ops;
+	uint32_t size_ops;
+	struct drm_mode_atomic_op *ops;
+};
+
+drmModeCommitReqPtr drmModeCommitReqAlloc(void)
+{
+	return drmMalloc(sizeof(drmModeCommitReq));
+}
+
+void drmModeCommitReqFree(drmModeCommitReqPtr req)
+{
+	if (!req)
+		return;
+
+	drmModeCommitReqSetCursor(req, 0);
+	free(req->items);
+	free(req->ops);
+	drmFree(req);
+}
+
+int drmModeCommitReqGetCursor(drmModeCommitReqPtr req)
+{
+	return req->cursor;
+}
+
+void drmModeCommitReqSetCursor(drmModeCommitReqPtr req, int cursor)
+{
+	struct drm_mode_atomic_item *item;
+
+	while (req->cursor > (uint32_t)cursor) {
+		item = &req->items[--req->cursor];
+		if (item->property_id == 0)
+			free(req->ops[--req->count_ops].connectors);
+	}
+}
+
+static int drmModeCommitReqAddItem(drmModeCommitReqPtr req, uint32_t object_id,
+				   uint32_t property_id, uint64_t value)
+{
+	struct drm_mode_atomic_item *items;
+	uint32_t size;
+
+	if (req->cursor == req->size_items) {
+		size = req->size_items ? req->size_items * 2 : 16;
+		items = realloc(req->items, size * sizeof(*items));
+		if (!items)
+			return -ENOMEM;
+		req->items = items;
+		req->size_items = size;
+	}
+
+	req->items[req->cursor].object_id = object_id;
+	req->items[req->cursor].property_id = property_id;
+	req->items[req->cursor].value = value;
+	req->items[req->cursor].index = req->cursor;
+	return ++req->cursor;
+}
+
+int drmModeCommitReqAddProperty(drmModeCommitReqPtr req, uint32_t object_id,
+				uint32_t property_id, uint64_t value)
+{
+	if (!req || !object_id || !property_id)
+		return -EINVAL;
+
+	return drmModeCommitReqAddItem(req, object_id, property_id, value);
+}
+
+static struct drm_mode_atomic_op *
+drmModeCommitReqAddOp(drmModeCommitReqPtr req, int type, uint32_t object_id)
+{
+	struct drm_mode_atomic_op *ops, *op;
+	uint32_t size;
+
+	if (req->count_ops == req->size_ops) {
+		size = req->size_ops ? req->size_ops * 2 : 4;
+		ops = realloc(req->ops, size * sizeof(*ops));
+		if (!ops)
+			return NULL;
+		req->ops = ops;
+		req->size_ops = size;
+	}
+
+	if (drmModeCommitReqAddItem(req, object_id, 0, req->count_ops) < 0)
+		return NULL;
+
+	op = &req->ops[req->count_ops++];
+	memset(op, 0, sizeof(*op));
+	op->type = type;
+	op->object_id = object_id;
+	return op;
+}
+
+int drmModeCommitReqAddCrtc(drmModeCommitReqPtr req, uint32_t crtc_id,
+			    uint32_t fb_id, uint32_t x, uint32_t y,
+			    uint32_t *connectors, int count,
+			    drmModeModeInfoPtr mode)
+{
+	struct drm_mode_atomic_op *op;
+	uint32_t *copy = NULL;
+
+	if (!req || !crtc_id || count < 0 || (count && !connectors))
+		return -EINVAL;
+
+	if (count && !(copy = malloc(count * sizeof(*copy))))
+		return -ENOMEM;
+
+	if (!(op = drmModeCommitReqAddOp(req, ATOMIC_OP_CRTC, crtc_id))) {
+		free(copy);
+		return -ENOMEM;
+	}
+
+	op->fb_id = fb_id;
+	op->x = x;
+	op->y = y;
+	if (count)
+		memcpy(copy, connectors, count * sizeof(*copy));
+	op->connectors = copy;
+	op->count_connectors = count;
+	if (mode) {
+		op->mode = *mode;
+		op->mode_valid = 1;
+	}
+	return req->cursor;
+}
+
+int drmModeCommitReqAddPlane(drmModeCommitReqPtr req, uint32_t plane_id,
+			     uint32_t crtc_id, uint32_t fb_id,
+			     int32_t crtc_x, int32_t crtc_y,
+			     uint32_t crtc_w, uint32_t crtc_h,
+			     uint32_t src_x, uint32_t src_y,
+			     uint32_t src_w, uint32_t src_h)
+{
+	struct drm_mode_atomic_op *op;
+
+	if (!req || !plane_id)
+		return -EINVAL;
+
+	if (!(op = drmModeCommitReqAddOp(req, ATOMIC_OP_PLANE, plane_id)))
+		return -ENOMEM;
+
+	op->crtc_id = crtc_id;
+	op->fb_id = fb_id;
+	op->x = crtc_x;
+	op->y = crtc_y;
+	op->w = crtc_w;
+	op->h = crtc_h;
+	op->src_x = src_x;
+	op->src_y = src_y;
+	op->src_w = src_w;
+	op->src_h = src_h;
+	return req->cursor;
+}
+
+int drmModeCommitReqAddPageFlip(drmModeCommitReqPtr req, uint32_t crtc_id,
+				uint32_t fb_id)
+{
+	struct drm_mode_atomic_op *op;
+
+	if (!req || !crtc_id || !fb_id)
+		return -EINVAL;
+
+	if (!(op = drmModeCommitReqAddOp(req, ATOMIC_OP_FLIP, crtc_id)))
+		return -ENOMEM;
+
+	op->fb_id = fb_id;
+	return req->cursor;
+}
+
+static int drmModeCommitItemCompare(const void *a, const void *b)
+{
+	const struct drm_mode_atomic_item *x = a, *y = b;
+
+	if (x->object_id != y->object_id)
+		return x->object_id < y->object_id ? -1 : 1;
+	if (x->property_id != y->property_id)
+		return x->property_id < y->property_id ? -1 : 1;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * Issue the whole request as one DRM_IOCTL_MODE_ATOMIC.  Items are grouped
+ * by object as the kernel wants them, and of several values for the same
+ * property only the last one added is kept.
+ */
+static int drmModeCommitAtomic(int fd, drmModeCommitReqPtr req,
+			       uint32_t flags, void *user_data)
+{
+	struct drm_mode_atomic atomic;
+	struct drm_mode_atomic_item *sorted, *item;
+	uint32_t *objs, *count_props, *props;
+	uint64_t *values;
+	uint32_t i, count = 0, count_objs = 0;
+	char *block;
+	int ret;
+
+	block = drmMalloc(req->cursor * (sizeof(*sorted) + 3 * sizeof(uint32_t) +
+					 sizeof(uint64_t)));
+	if (!block)
+		return -ENOMEM;
+	sorted = (struct drm_mode_atomic_item *)block;
+	values = (uint64_t *)(sorted + req->cursor);
+	objs = (uint32_t *)(values + req->cursor);
+	count_props = objs + req->cursor;
+	props = count_props + req->cursor;
+
+	memcpy(sorted, req->items, req->cursor * sizeof(*sorted));
+	qsort(sorted, req->cursor, sizeof(*sorted), drmModeCommitItemCompare);
+
+	for (i = 0; i < req->cursor; i++) {
+		item = &sorted[i];
+		if (i + 1 < req->cursor &&
+		    item[1].object_id == item->object_id &&
+		    item[1].property_id == item->property_id)
+			continue;
+
+		if (!count_objs || objs[count_objs - 1] != item->object_id) {
+			objs[count_objs] = item->object_id;
+			count_props[count_objs++] = 0;
+		}
+		count_props[count_objs - 1]++;
+		props[count] = item->property_id;
+		values[count++] = item->value;
+	}
+
+	memset(&atomic, 0, sizeof(atomic));
+	atomic.flags = flags;
+	atomic.count_objs = count_objs;
+	atomic.objs_ptr = VOID2U64(objs);
+	atomic.count_props_ptr = VOID2U64(count_props);
+	atomic.props_ptr = VOID2U64(props);
+	atomic.prop_values_ptr = VOID2U64(values);
+	atomic.user_data = VOID2U64(user_data);
+
+	ret = DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &atomic);
+	drmFree(block);
+	return ret;
+}
+
+/* Object types that can carry properties, in the order they are tried
+ * when all we have is an id. */
+static const uint32_t drm_mode_property_objects[] = {
+	DRM_MODE_OBJECT_CONNECTOR,
+	DRM_MODE_OBJECT_CRTC,
+	DRM_MODE_OBJECT_PLANE,
+};
+
+static int drmModeCommitSetProperty(int fd, struct drm_mode_atomic_item *item)
+{
+	unsigned int i;
+	int ret = -ENOENT;
+
+	for (i = 0; i < sizeof(drm_mode_property_objects) /
+		     sizeof(drm_mode_property_objects[0]) && ret == -ENOENT; i++)
+		ret = drmModeObjectSetProperty(fd, item->object_id,
+					       drm_mode_property_objects[i],
+					       item->property_id, item->value);
+	return ret;
+}
+
+/*
+ * Apply a request with the legacy calls: crtc, plane and property updates
+ * in the order they were added, then all page flips back to back so the
+ * heads flip as close together as the legacy interface allows.
+ */
+static int drmModeCommitLegacy(int fd, drmModeCommitReqPtr req,
+			       uint32_t flags, void *user_data)
+{
+	struct drm_mode_atomic_op *op;
+	uint32_t i, flip_flags;
+	int ret;
+
+	for (i = 0; i < req->count_ops; i++)
+		if (req->ops[i].type == ATOMIC_OP_CRTC &&
+		    !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+			return -EINVAL;
+
+	/* The legacy calls have no way to check without applying */
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return -EOPNOTSUPP;
+
+	for (i = 0; i < req->cursor; i++) {
+		if (req->items[i].property_id) {
+			if ((ret = drmModeCommitSetProperty(fd, &req->items[i])))
+				return ret;
+			continue;
+		}
+
+		op = &req->ops[req->items[i].value];
+		switch (op->type) {
+		case ATOMIC_OP_CRTC:
+			ret = drmModeSetCrtc(fd, op->object_id, op->fb_id,
+					     op->x, op->y, op->connectors,
+					     op->count_connectors,
+					     op->mode_valid ? &op->mode : NULL);
+			break;
+		case ATOMIC_OP_PLANE:
+			ret = drmModeSetPlane(fd, op->object_id, op->crtc_id,
+					      op->fb_id, 0, op->x, op->y,
+					      op->w, op->h, op->src_x,
+					      op->src_y, op->src_w, op->src_h);
+			break;
+		default:
+			ret = 0;
+			break;
+		}
+		if (ret)
+			return ret;
+	}
+
+	flip_flags = flags & DRM_MODE_PAGE_FLIP_FLAGS;
+	for (i = 0; i < req->count_ops; i++) {
+		op = &req->ops[i];
+		if (op->type != ATOMIC_OP_FLIP)
+			continue;
+		if ((ret = drmModePageFlip(fd, op->object_id, op->fb_id,
+					   flip_flags, user_data)))
+			return ret;
+	}
+
+	return 0;
+}
+
+int drmModeCommit(int fd, drmModeCommitReqPtr req, uint32_t flags,
+		  void *user_data)
+{
+	struct drm_mode_fd_cache *cache;
+	struct drm_mode_atomic probe;
+	int ret;
+
+	if (!req || (flags & ~DRM_MODE_ATOMIC_FLAGS))
+		return -EINVAL;
+	if (!req->cursor)
+		return 0;
+
+	/* Legacy operations are always applied with the legacy calls. */
+	if (req->count_ops || !(cache = drmModeGetFdCache(fd)) ||
+	    cache->atomic < 0)
+		return drmModeCommitLegacy(fd, req, flags, user_data);
+
+	ret = drmModeCommitAtomic(fd, req, flags, user_data);
+	if (ret == 0)
+		cache->atomic = 1;
+	if (ret != -EINVAL || cache->atomic > 0)
+		return ret;
+
+	/* Kernels without the ioctl, and clients that haven't enabled
+	 * DRM_CLIENT_CAP_ATOMIC, get EINVAL even for an empty test commit;
+	 * anything else means the request itself was refused. */
+	memset(&probe, 0, sizeof(probe));
+	probe.flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	if (DRM_IOCTL(fd, DRM_IOCTL_MODE_ATOMIC, &probe)) {
+		cache->atomic = -1;
+		return drmModeCommitLegacy(fd, req, flags, user_data);
+	}
+
+	cache->atomic = 1;
+	return ret;
+}
@@ -326,6 +326,35 @@ typedef struct _drmModePlaneRes {
 	uint32_t *planes;
 } drmModePlaneRes, *drmModePlaneResPtr;
 
+/*
+ * A copy of the whole mode object graph, held in a single allocation.
+ * Objects appear in the order the kernel lists them, and every list and
+ * property array points into the same block.
+ */
+typedef struct _drmModeSnapshot {
+	uint32_t size; /**< Bytes used by the snapshot */
+
+	uint32_t min_width, max_width;
+	uint32_t min_height, max_height;
+
+	int count_fbs;
+	uint32_t *fbs;
+
+	int count_crtcs;
+	drmModeCrtcPtr crtcs;
+	drmModeObjectPropertiesPtr crtc_props; /**< One per crtc */
+
+	int count_connectors;
+	drmModeConnectorPtr connectors;
+
+	int count_encoders;
+	drmModeEncoderPtr encoders;
+
+	int count_planes;
+	drmModePlanePtr planes;
+	drmModeObjectPropertiesPtr plane_props; /**< One per plane */
+} drmModeSnapshot, *drmModeSnapshotPtr;
+
 extern void drmModeFreeModeInfo( drmModeModeInfoPtr ptr );
 extern void drmModeFreeResources( drmModeResPtr ptr );
 extern void drmModeFreeFB( drmModeFBPtr ptr );
@@ -381,6 +410,12 @@ extern int drmModeDirtyFB(int fd, uint32_t bufferId,
  */
 extern drmModeCrtcPtr drmModeGetCrtc(int fd, uint32_t crtcId);
 
+/**
+ * Like drmModeGetCrtc(), but fills in caller storage instead of allocating.
+ * Returns 0 on success or a negative errno.
+ */
+extern int drmModeGetCrtcInto(int fd, uint32_t crtcId, drmModeCrtcPtr crtc);
+
 /**
  * Set the mode on a crtc crtcId with the given mode modeId.
  */
@@ -418,6 +453,23 @@ drmModeEncoderPtr drmModeGetEncoder(int fd, uint32_t encoder_id);
 extern drmModeConnectorPtr drmModeGetConnector(int fd,
 		uint32_t connectorId);
 
+/**
+ * Like drmModeGetConnector(), but fills in caller storage instead of
+ * allocating.
+ *
+ * On entry, modes, props with prop_values, and encoders point to arrays
+ * holding count_modes, count_props and count_encoders entries, or are NULL
+ * if that list isn't needed.  On return the counts are the connector's real
+ * list lengths.  If a list didn't fit, -ENOSPC is returned with the counts
+ * giving the sizes needed, so the caller can grow its arrays and retry.
+ * Otherwise returns 0 or a negative errno.
+ *
+ * The connector is probed like drmModeGetConnector() does, and with no
+ * modes array that takes a single ioctl.
+ */
+extern int drmModeGetConnectorInto(int fd, uint32_t connectorId,
+				   drmModeConnectorPtr connector);
+
 /**
  * Attaches the given mode to an connector.
  */
@@ -432,6 +484,28 @@ extern int drmModeDetachMode(int fd, uint32_t connectorId, drmModeModeInfoPtr mo
 extern drmModePropertyPtr drmModeGetProperty(int fd, uint32_t propertyId);
 extern void drmModeFreeProperty(drmModePropertyPtr ptr);
 
+/**
+ * Returns the definition of a property from a per-fd cache, fetching it
+ * on first use.  The result belongs to the cache: don't free it, and don't
+ * use it after drmModeInvalidatePropertyCache() or drmClose() on the fd.
+ */
+extern drmModePropertyPtr drmModeGetPropertyCached(int fd, uint32_t propertyId);
+
+/**
+ * Returns the index of the property called name in a list of count property
+ * ids, such as drmModeConnector.props or drmModeObjectProperties.props, or
+ * -1 if there is none.  Property definitions come from the cache.
+ */
+extern int drmModeFindPropertyIndex(int fd, const uint32_t *props, int count,
+				    const char *name);
+
+/**
+ * Drops the cached property definitions of a device, e.g. before closing
+ * an fd that isn't closed with drmClose(), so a later fd with the same
+ * number starts afresh.  Must not race with users of cached definitions.
+ */
+extern void drmModeInvalidatePropertyCache(int fd);
+
 extern drmModePropertyBlobPtr drmModeGetPropertyBlob(int fd, uint32_t blob_id);
 extern void drmModeFreePropertyBlob(drmModePropertyBlobPtr ptr);
 extern int drmModeConnectorSetProperty(int fd, uint32_t connector_id, uint32_t property_id,
@@ -462,6 +536,73 @@ extern int drmModeObjectSetProperty(int fd, uint32_t object_id,
 				    uint32_t object_type, uint32_t property_id,
 				    uint64_t value);
 
+/**
+ * Retrieves resources, crtcs, connectors, encoders, planes and the
+ * properties of crtcs and planes in one go, using one ioctl per object
+ * where the kernel allows it.  Connectors are probed as with
+ * drmModeGetConnector().  Release the result with drmModeFreeSnapshot().
+ * Fails with errno set to ENOENT if objects keep disappearing while the
+ * snapshot is taken.
+ */
+extern drmModeSnapshotPtr drmModeGetSnapshot(int fd);
+extern void drmModeFreeSnapshot(drmModeSnapshotPtr ptr);
+
+/*
+ * Batched mode setting
+ *
+ * A request collects object/property/value tuples and crtc, plane and page
+ * flip updates shaped like drmModeSetCrtc(), drmModeSetPlane() and
+ * drmModePageFlip(), and drmModeCommit() applies them together.
+ *
+ * A request made of property tuples only is committed with a single
+ * DRM_IOCTL_MODE_ATOMIC when the kernel supports it and the client has
+ * enabled DRM_CLIENT_CAP_ATOMIC.  Otherwise, or when the request holds
+ * crtc, plane or page flip updates, the legacy calls are used: updates in
+ * the order they were added, with all page flips issued last.  Legacy
+ * commits are not atomic, a failure leaves earlier updates applied, and
+ * DRM_MODE_ATOMIC_TEST_ONLY fails with -EOPNOTSUPP since nothing can be
+ * checked without applying it.
+ *
+ * flags take DRM_MODE_ATOMIC_TEST_ONLY, DRM_MODE_ATOMIC_NONBLOCK,
+ * DRM_MODE_ATOMIC_ALLOW_MODESET (needed for crtc updates) and the page
+ * flip flags.  With DRM_MODE_PAGE_FLIP_EVENT, every crtc that flips sends
+ * an event to the page_flip_handler of drmHandleEvent() with user_data.
+ *
+ * The add functions return the new cursor, or a negative errno.
+ */
+
+typedef struct _drmModeCommitReq drmModeCommitReq, *drmModeCommitReqPtr;
+
+extern drmModeCommitReqPtr drmModeCommitReqAlloc(void);
+extern void drmModeCommitReqFree(drmModeCommitReqPtr req);
+
+/**
+ * The cursor is the number of updates in the request; setting it back
+ * drops everything added since.
+ */
+extern int drmModeCommitReqGetCursor(drmModeCommitReqPtr req);
+extern void drmModeCommitReqSetCursor(drmModeCommitReqPtr req, int cursor);
+
+extern int drmModeCommitReqAddProperty(drmModeCommitReqPtr req,
+				       uint32_t object_id,
+				       uint32_t property_id,
+				       uint64_t value);
+extern int drmModeCommitReqAddCrtc(drmModeCommitReqPtr req, uint32_t crtc_id,
+				   uint32_t fb_id, uint32_t x, uint32_t y,
+				   uint32_t *connectors, int count,
+				   drmModeModeInfoPtr mode);
+extern int drmModeCommitReqAddPlane(drmModeCommitReqPtr req, uint32_t plane_id,
+				    uint32_t crtc_id, uint32_t fb_id,
+				    int32_t crtc_x, int32_t crtc_y,
+				    uint32_t crtc_w, uint32_t crtc_h,
+				    uint32_t src_x, uint32_t src_y,
+				    uint32_t src_w, uint32_t src_h);
+extern int drmModeCommitReqAddPageFlip(drmModeCommitReqPtr req,
+				       uint32_t crtc_id, uint32_t fb_id);
+
+extern int drmModeCommit(int fd, drmModeCommitReqPtr req,
+			 uint32_t flags, void *user_data);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
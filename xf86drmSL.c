@@ -27,7 +27,19 @@
  *
  * DESCRIPTION
  *
- * This file contains a straightforward skip list implementation.n
+ * This file contains a straightforward skip list implementation.
+ *
+ * Entries are carved out of large chunks owned by the list instead of
+ * being allocated one at a time, so entries inserted together tend to be
+ * adjacent in memory and destroying a list only frees a few chunks.
+ * Deleted entries are kept on per-level free lists for reuse.  Levels are
+ * drawn from a per-list xorshift generator [Marsaglia03], which needs a
+ * single call per insertion.
+ *
+ * drmSLInsertMany and drmSLLookupMany start each search from the path
+ * found for the previous key rather than from the head of the list, so
+ * a batch of ascending keys costs far less than the same number of
+ * individual calls.
  *
  * FUTURE ENHANCEMENTS
  *
@@ -36,17 +48,21 @@
  * [Pugh90] William Pugh.  Skip Lists: A Probabilistic Alternative to
  * Balanced Trees. CACM 33(6), June 1990, pp. 668-676.
  *
+ * [Marsaglia03] George Marsaglia.  Xorshift RNGs.  Journal of Statistical
+ * Software 8(14), July 2003.
+ *
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #define SL_MAIN 0
 
 #if !SL_MAIN
 # include "xf86drm.h"
 #else
-# include <sys/time.h>
+# include <time.h>
 #endif
 
 #define SL_LIST_MAGIC  0xfacade00LU
@@ -55,20 +71,14 @@
 #define SL_MAX_LEVEL   16
 #define SL_DEBUG       0
 #define SL_RANDOM_SEED 0xc01055a1LU
+#define SL_CHUNK_SIZE  65536	/* Bytes of entries per chunk */
 
 #if SL_MAIN
 #define SL_ALLOC malloc
 #define SL_FREE  free
-#define SL_RANDOM_DECL        static int state = 0;
-#define SL_RANDOM_INIT(seed)  if (!state) { srandom(seed); ++state; }
-#define SL_RANDOM             random()
 #else
 #define SL_ALLOC drmMalloc
 #define SL_FREE  drmFree
-#define SL_RANDOM_DECL        static void *state = NULL
-#define SL_RANDOM_INIT(seed)  if (!state) state = drmRandomCreate(seed)
-#define SL_RANDOM             drmRandom(state)
-
 #endif
 
 typedef struct SLEntry {
@@ -79,12 +89,22 @@ typedef struct SLEntry {
     struct SLEntry    *forward[1]; /* variable sized array */
 } SLEntry, *SLEntryPtr;
 
+typedef struct SLChunk {
+    struct SLChunk    *next;
+    SLEntry           entries[1];  /* variable sized array */
+} SLChunk, *SLChunkPtr;
+
 typedef struct SkipList {
     unsigned long    magic;	/* SL_LIST_MAGIC */
     int              level;
     int              count;
     SLEntryPtr       head;
     SLEntryPtr       p0;	/* Position for iteration */
+    unsigned long    seed;	/* xorshift state for SLRandomLevel */
+    SLChunkPtr       chunks;	/* Storage for entries */
+    char             *avail;	/* Unused space in chunks */
+    size_t           avail_size;
+    SLEntryPtr       free[SL_MAX_LEVEL + 1]; /* Freed entries, by level */
 } SkipList, *SkipListPtr;
 
 #if SL_MAIN
@@ -99,17 +119,38 @@ extern void drmSLDump(void *l);
 extern int  drmSLLookupNeighbors(void *l, unsigned long key,
 				 unsigned long *prev_key, void **prev_value,
 				 unsigned long *next_key, void **next_value);
+extern int  drmSLInsertMany(void *l, int count,
+			    const unsigned long *keys, void **values);
+extern int  drmSLLookupMany(void *l, int count,
+			    const unsigned long *keys, void **values);
 #endif
 
-static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
+static SLEntryPtr SLCreateEntry(SkipListPtr list, int max_level,
+				unsigned long key, void *value)
 {
     SLEntryPtr entry;
+    SLChunkPtr chunk;
+    size_t     size;
     
     if (max_level < 0 || max_level > SL_MAX_LEVEL) max_level = SL_MAX_LEVEL;
 
-    entry         = SL_ALLOC(sizeof(*entry)
-			     + (max_level + 1) * sizeof(entry->forward[0]));
-    if (!entry) return NULL;
+    if ((entry = list->free[max_level])) {
+	list->free[max_level] = entry->forward[0];
+    } else {
+	size = offsetof(SLEntry, forward)
+	    + (max_level + 1) * sizeof(entry->forward[0]);
+	if (list->avail_size < size) {
+	    chunk = SL_ALLOC(offsetof(SLChunk, entries) + SL_CHUNK_SIZE);
+	    if (!chunk) return NULL;
+	    chunk->next      = list->chunks;
+	    list->chunks     = chunk;
+	    list->avail      = (char *)chunk->entries;
+	    list->avail_size = SL_CHUNK_SIZE;
+	}
+	entry             = (SLEntryPtr)list->avail;
+	list->avail      += size;
+	list->avail_size -= size;
+    }
     entry->magic  = SL_ENTRY_MAGIC;
     entry->key    = key;
     entry->value  = value;
@@ -118,14 +159,30 @@ static SLEntryPtr SLCreateEntry(int max_level, unsigned long key, void *value)
     return entry;
 }
 
-static int SLRandomLevel(void)
+static void SLFreeEntry(SkipListPtr list, SLEntryPtr entry)
 {
-    int level = 1;
-    SL_RANDOM_DECL;
+    int max_level = entry->levels - 1;
 
-    SL_RANDOM_INIT(SL_RANDOM_SEED);
-    
-    while ((SL_RANDOM & 0x01) && level < SL_MAX_LEVEL) ++level;
+    entry->magic          = SL_FREED_MAGIC;
+    entry->forward[0]     = list->free[max_level];
+    list->free[max_level] = entry;
+}
+
+static int SLRandomLevel(SkipListPtr list)
+{
+    unsigned long bits = list->seed;
+    int           level = 1;
+
+    bits ^= bits << 13;		/* xorshift32 */
+    bits ^= (bits & 0xffffffff) >> 17;
+    bits ^= bits << 5;
+    bits &= 0xffffffff;
+    list->seed = bits;
+
+    while ((bits & 0x01) && level < SL_MAX_LEVEL) {
+	++level;
+	bits >>= 1;
+    }
     return level;
 }
 
@@ -134,12 +191,23 @@ void *drmSLCreate(void)
     SkipListPtr  list;
     int          i;
 
-    list           = SL_ALLOC(sizeof(*list));
+    list             = SL_ALLOC(sizeof(*list));
     if (!list) return NULL;
-    list->magic    = SL_LIST_MAGIC;
-    list->level    = 0;
-    list->head     = SLCreateEntry(SL_MAX_LEVEL, 0, NULL);
-    list->count    = 0;
+    list->magic      = SL_LIST_MAGIC;
+    list->level      = 0;
+    list->count      = 0;
+    list->p0         = NULL;
+    list->seed       = SL_RANDOM_SEED;
+    list->chunks     = NULL;
+    list->avail      = NULL;
+    list->avail_size = 0;
+    for (i = 0; i <= SL_MAX_LEVEL; i++) list->free[i] = NULL;
+
+    list->head       = SLCreateEntry(list, SL_MAX_LEVEL, 0, NULL);
+    if (!list->head) {
+	SL_FREE(list);
+	return NULL;
+    }
 
     for (i = 0; i <= SL_MAX_LEVEL; i++) list->head->forward[i] = NULL;
     
@@ -149,16 +217,14 @@ void *drmSLCreate(void)
 int drmSLDestroy(void *l)
 {
     SkipListPtr   list  = (SkipListPtr)l;
-    SLEntryPtr    entry;
-    SLEntryPtr    next;
+    SLChunkPtr    chunk;
+    SLChunkPtr    next;
 
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
-    for (entry = list->head; entry; entry = next) {
-	if (entry->magic != SL_ENTRY_MAGIC) return -1; /* Bad magic */
-	next         = entry->forward[0];
-	entry->magic = SL_FREED_MAGIC;
-	SL_FREE(entry);
+    for (chunk = list->chunks; chunk; chunk = next) {
+	next = chunk->next;
+	SL_FREE(chunk);
     }
 
     list->magic = SL_FREED_MAGIC;
@@ -166,15 +232,20 @@ int drmSLDestroy(void *l)
     return 0;
 }
 
-static SLEntryPtr SLLocate(void *l, unsigned long key, SLEntryPtr *update)
+/* Fill update with the last entry before key on each level.  If finger
+   is set, update already holds such a path for a key no greater than
+   this one, and the search resumes from it instead of from the head. */
+
+static SLEntryPtr SLLocate(SkipListPtr list, unsigned long key,
+			   SLEntryPtr *update, int finger)
 {
-    SkipListPtr   list  = (SkipListPtr)l;
     SLEntryPtr    entry;
     int           i;
 
-    if (list->magic != SL_LIST_MAGIC) return NULL;
-
     for (i = list->level, entry = list->head; i >= 0; i--) {
+	if (finger && update[i] != list->head
+	    && (entry == list->head || update[i]->key > entry->key))
+	    entry = update[i];
 	while (entry->forward[i] && entry->forward[i]->key < key)
 	    entry = entry->forward[i];
 	update[i] = entry;
@@ -183,39 +254,79 @@ static SLEntryPtr SLLocate(void *l, unsigned long key, SLEntryPtr *update)
     return entry->forward[0];
 }
 
-int drmSLInsert(void *l, unsigned long key, void *value)
+/* Insert key after the path in update.  On return, update holds the path
+   for key itself, so it can be reused as a finger for a larger key. */
+
+static int SLInsertAt(SkipListPtr list, SLEntryPtr *update,
+		      unsigned long key, void *value)
 {
-    SkipListPtr   list  = (SkipListPtr)l;
     SLEntryPtr    entry;
-    SLEntryPtr    update[SL_MAX_LEVEL + 1];
     int           level;
     int           i;
 
-    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
-
-    entry = SLLocate(list, key, update);
-
-    if (entry && entry->key == key) return 1; /* Already in list */
-
-
-    level = SLRandomLevel();
+    level = SLRandomLevel(list);
     if (level > list->level) {
 	level = ++list->level;
 	update[level] = list->head;
     }
 
-    entry = SLCreateEntry(level, key, value);
+    entry = SLCreateEntry(list, level, key, value);
+    if (!entry) return -1;
 
 				/* Fix up forward pointers */
     for (i = 0; i <= level; i++) {
 	entry->forward[i]     = update[i]->forward[i];
 	update[i]->forward[i] = entry;
+	update[i]             = entry;
     }
 
     ++list->count;
     return 0;			/* Added to table */
 }
 
+int drmSLInsert(void *l, unsigned long key, void *value)
+{
+    SkipListPtr   list  = (SkipListPtr)l;
+    SLEntryPtr    entry;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    entry = SLLocate(list, key, update, 0);
+
+    if (entry && entry->key == key) return 1; /* Already in list */
+
+    return SLInsertAt(list, update, key, value);
+}
+
+/* Insert count keys, with values[i] for keys[i] (or NULL if values is
+   NULL).  Keys already in the list are skipped.  Runs of ascending keys
+   are inserted without restarting the search from the head.  Returns the
+   number of keys added, or -1 on error. */
+
+int drmSLInsertMany(void *l, int count,
+		    const unsigned long *keys, void **values)
+{
+    SkipListPtr   list  = (SkipListPtr)l;
+    SLEntryPtr    entry;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+    int           added = 0;
+    int           i;
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    for (i = 0; i < count; i++) {
+	entry = SLLocate(list, keys[i], update, i && keys[i] > keys[i-1]);
+
+	if (entry && entry->key == keys[i]) continue; /* Already in list */
+
+	if (SLInsertAt(list, update, keys[i], values ? values[i] : NULL))
+	    return -1;
+	++added;
+    }
+    return added;
+}
+
 int drmSLDelete(void *l, unsigned long key)
 {
     SkipListPtr   list = (SkipListPtr)l;
@@ -225,7 +336,7 @@ int drmSLDelete(void *l, unsigned long key)
 
     if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
 
-    entry = SLLocate(list, key, update);
+    entry = SLLocate(list, key, update, 0);
 
     if (!entry || entry->key != key) return 1; /* Not found */
 
@@ -235,8 +346,7 @@ int drmSLDelete(void *l, unsigned long key)
 	    update[i]->forward[i] = entry->forward[i];
     }
 
-    entry->magic = SL_FREED_MAGIC;
-    SL_FREE(entry);
+    SLFreeEntry(list, entry);
 
     while (list->level && !list->head->forward[list->level]) --list->level;
     --list->count;
@@ -249,16 +359,47 @@ int drmSLLookup(void *l, unsigned long key, void **value)
     SLEntryPtr    update[SL_MAX_LEVEL + 1];
     SLEntryPtr    entry;
 
-    entry = SLLocate(list, key, update);
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    entry = SLLocate(list, key, update, 0);
 
     if (entry && entry->key == key) {
-	*value = entry;
+	*value = entry->value;
 	return 0;
     }
     *value = NULL;
     return -1;
 }
 
+/* Look up count keys, storing the value for keys[i] in values[i] (NULL
+   if it is not in the list).  Runs of ascending keys are found without
+   restarting the search from the head.  Returns the number of keys
+   found, or -1 on error. */
+
+int drmSLLookupMany(void *l, int count,
+		    const unsigned long *keys, void **values)
+{
+    SkipListPtr   list = (SkipListPtr)l;
+    SLEntryPtr    update[SL_MAX_LEVEL + 1];
+    SLEntryPtr    entry;
+    int           found = 0;
+    int           i;
+
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    for (i = 0; i < count; i++) {
+	entry = SLLocate(list, keys[i], update, i && keys[i] >= keys[i-1]);
+
+	if (entry && entry->key == keys[i]) {
+	    values[i] = entry->value;
+	    ++found;
+	} else {
+	    values[i] = NULL;
+	}
+    }
+    return found;
+}
+
 int drmSLLookupNeighbors(void *l, unsigned long key,
 			 unsigned long *prev_key, void **prev_value,
 			 unsigned long *next_key, void **next_value)
@@ -267,6 +408,10 @@ int drmSLLookupNeighbors(void *l, unsigned long key,
     SLEntryPtr    update[SL_MAX_LEVEL + 1];
     int           retcode = 0;
 
+    if (list->magic != SL_LIST_MAGIC) return -1; /* Bad magic */
+
+    SLLocate(list, key, update, 0);
+
     *prev_key   = *next_key   = key;
     *prev_value = *next_value = NULL;
 	
@@ -360,26 +505,47 @@ static void print(SkipListPtr list)
     }
 }
 
-static double do_time(int size, int iter)
+static double ns_since(struct timespec *start, unsigned long ops)
 {
-    SkipListPtr    list;
-    int            i, j;
-    unsigned long  keys[1000000];
-    unsigned long  previous;
-    unsigned long  key;
-    void           *value;
-    struct timeval start, stop;
-    double         usec;
-    SL_RANDOM_DECL;
-
-    SL_RANDOM_INIT(12345);
-    
+    struct timespec stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    return ((stop.tv_sec - start->tv_sec) * 1e9
+	    + (stop.tv_nsec - start->tv_nsec)) / ops;
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void do_time(int size)
+{
+    SkipListPtr     list;
+    int             i;
+    unsigned long   *keys;
+    void            **values;
+    unsigned long   previous;
+    unsigned long   key;
+    void            *value;
+    struct timespec start;
+    double          insert, lookup, delete, insert_many, lookup_many;
+
+    keys   = malloc(size * sizeof(*keys));
+    values = malloc(size * sizeof(*values));
+    srandom(12345);
+    for (i = 0; i < size; i++)
+	keys[i] = ((unsigned long)random() << 16) ^ random();
+
     list = drmSLCreate();
 
-    for (i = 0; i < size; i++) {
-	keys[i] = SL_RANDOM;
-	drmSLInsert(list, keys[i], NULL);
-    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < size; i++)
+	drmSLInsert(list, keys[i], (void *)keys[i]);
+    insert = ns_since(&start, size);
 
     previous = 0;
     if (drmSLFirst(list, &key, &value)) {
@@ -390,24 +556,47 @@ static double do_time(int size, int iter)
 	    previous = key;
 	} while (drmSLNext(list, &key, &value));
     }
-    
-    gettimeofday(&start, NULL);
-    for (j = 0; j < iter; j++) {
-	for (i = 0; i < size; i++) {
-	    if (drmSLLookup(list, keys[i], &value))
-		printf("Error %lu %d\n", keys[i], i);
-	}
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < size; i++) {
+	if (drmSLLookup(list, keys[i], &value) || value != (void *)keys[i])
+	    printf("Error %lu %d\n", keys[i], i);
     }
-    gettimeofday(&stop, NULL);
-    
-    usec = (double)(stop.tv_sec * 1000000 + stop.tv_usec
-		    - start.tv_sec * 1000000 - start.tv_usec) / (size * iter);
-    
-    printf("%0.2f microseconds for list length %d\n", usec, size);
+    lookup = ns_since(&start, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < size; i++)
+	drmSLDelete(list, keys[i]);
+    delete = ns_since(&start, size);
+
+    if (list->count)
+	printf("%d entries left after deleting all keys\n", list->count);
+
+				/* Batched calls, on sorted keys */
+    qsort(keys, size, sizeof(*keys), compare_keys);
+    for (i = 0; i < size; i++)
+	values[i] = (void *)keys[i];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    drmSLInsertMany(list, size, keys, values);
+    insert_many = ns_since(&start, size);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (drmSLLookupMany(list, size, keys, values) != size)
+	printf("drmSLLookupMany missed keys\n");
+    lookup_many = ns_since(&start, size);
+
+    for (i = 0; i < size; i++) {
+	if (values[i] != (void *)keys[i])
+	    printf("Error %lu %d\n", keys[i], i);
+    }
+
+    printf("%9d %8.1f %8.1f %8.1f %12.1f %12.1f\n",
+	   size, insert, lookup, delete, insert_many, lookup_many);
 
     drmSLDestroy(list);
-    
-    return usec;
+    free(values);
+    free(keys);
 }
 
 static void print_neighbors(void *list, unsigned long key)
@@ -428,7 +617,7 @@ static void print_neighbors(void *list, unsigned long key)
 int main(void)
 {
     SkipListPtr    list;
-    double         usec, usec2, usec3, usec4;
+    int            size;
 
     list = drmSLCreate();
     printf( "list at %p\n", list);
@@ -459,18 +648,11 @@ int main(void)
     drmSLDestroy(list);
     printf("\n==============================\n\n");
 
-    usec  = do_time(100, 10000);
-    usec2 = do_time(1000, 500);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   1000.0/100.0, usec2 / usec);
-    
-    usec3 = do_time(10000, 50);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   10000.0/100.0, usec3 / usec);
-    
-    usec4 = do_time(100000, 4);
-    printf("Table size increased by %0.2f, search time increased by %0.2f\n",
-	   100000.0/100.0, usec4 / usec);
+    printf("ns/op for random keys; batched calls use the keys sorted\n");
+    printf("%9s %8s %8s %8s %12s %12s\n",
+	   "size", "insert", "lookup", "delete", "insert-many", "lookup-many");
+    for (size = 10000; size <= 10000000; size *= 10)
+	do_time(size);
 
     return 0;
 }